@@ -67,16 +67,28 @@ public:
 
   bool CheckBounds();
 
+  // Crop region is the padded bounding box of the nonzero probabilities
   void UseProbabilities(ProbabilityImageList probs);
 
   // Create new images (either cropped or padded)
   InputImagePointer Restore(InputImagePointer img);
   InputImagePointer Crop(InputImagePointer img);
 
+  // Same for any image type with the same geometry, voxels outside the crop
+  // region are zero or taken from the original image if given
+  template <class TImage>
+  typename TImage::Pointer CropImage(const TImage* img);
+  template <class TImage>
+  typename TImage::Pointer RestoreImage(const TImage* img,
+    const TImage* original = 0);
+
   // Crop region information
-  void SetCropInfo(const CropInfoType& info) { m_CropInfo = info; }
+  void SetCropInfo(const CropInfoType& info);
   const CropInfoType& GetCropInfo() { return m_CropInfo; }
 
+  // Fraction of the original voxels inside the crop region
+  double GetCroppedFraction() const;
+
   // For debugging, generate slabs in last dim with top and bottom parts removed
   itkSetMacro(SlabMode, bool);
   itkGetConstMacro(SlabMode, bool);
@@ -92,9 +104,6 @@ protected:
   InputImageIndexType m_LowerBound;
   InputImageIndexType m_UpperBound;
 
-  InputImagePointType m_InputOrigin;
-  InputImagePointType m_CropOrigin;
-
   InputImageSizeType m_OriginalSize;
 
   CropInfoType m_CropInfo;
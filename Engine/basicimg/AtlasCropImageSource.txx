@@ -2,10 +2,13 @@
 #ifndef _AtlasCropImageSource_txx
 #define _AtlasCropImageSource_txx
 
-#include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
 
 #include "AtlasCropImageSource.h"
 
+#include <cstring>
+
 template <class TInputImage, class TProbabilityImage>
 AtlasCropImageSource<TInputImage, TProbabilityImage>
 ::AtlasCropImageSource()
@@ -92,35 +95,71 @@ AtlasCropImageSource<TInputImage, TProbabilityImage>
     m_UpperBound[i] = 0;
   }
 
-  // Go through image and update bounds
-  typedef itk::ImageRegionIteratorWithIndex<ProbabilityImageType>
-    IteratorType;
+  // Go through image and update bounds, a row at a time on the raw buffers
+  unsigned long rowLength = size[0];
+  unsigned long numRows = 1;
+  for (unsigned int i = 1; i < ImageDimension; i++)
+    numRows *= size[i];
 
-  IteratorType it(probs[0], probs[0]->GetLargestPossibleRegion());
+  DynArray<const ProbabilityImagePixelType*> probBuffers;
+  for (unsigned int i = 0; i < probs.GetSize(); i++)
+    probBuffers.Append(probs[i]->GetBufferPointer());
 
-  it.GoToBegin();
-  while (!it.IsAtEnd())
+  for (unsigned long r = 0; r < numRows; r++)
   {
-    ProbabilityImageIndexType ind = it.GetIndex();
-
-    double sumProb = 0;
-    for (unsigned int i = 0; i < probs.GetSize(); i++)
-      sumProb += probs[i]->GetPixel(ind);
+    unsigned long offset = r * rowLength;
 
-    if (sumProb > 0)
+    // First and last nonzero voxel in the row
+    long first = -1;
+    long last = -1;
+    for (unsigned long x = 0; x < rowLength; x++)
     {
-      for (unsigned int i = 0; i < ImageDimension; i++)
+      double sumProb = 0;
+      for (unsigned int i = 0; i < probBuffers.GetSize(); i++)
+        sumProb += probBuffers[i][offset+x];
+      if (sumProb > 0)
       {
-        if (ind[i] < m_LowerBound[i])
-          m_LowerBound[i] = ind[i];
-        if (ind[i] > m_UpperBound[i])
-          m_UpperBound[i] = ind[i];
+        if (first < 0)
+          first = x;
+        last = x;
       }
     }
 
-    ++it;
+    if (first < 0)
+      continue;
+
+    ProbabilityImageIndexType ind;
+    ind[0] = first;
+    unsigned long q = r;
+    for (unsigned int i = 1; i < ImageDimension; i++)
+    {
+      ind[i] = q % size[i];
+      q /= size[i];
+    }
+
+    if (first < m_LowerBound[0])
+      m_LowerBound[0] = first;
+    if (last > m_UpperBound[0])
+      m_UpperBound[0] = last;
+    for (unsigned int i = 1; i < ImageDimension; i++)
+    {
+      if (ind[i] < m_LowerBound[i])
+        m_LowerBound[i] = ind[i];
+      if (ind[i] > m_UpperBound[i])
+        m_UpperBound[i] = ind[i];
+    }
   }
 
+  // No nonzero probabilities, keep the whole image
+  for (unsigned int i = 0; i < ImageDimension; i++)
+    if (m_LowerBound[i] > m_UpperBound[i])
+    {
+      m_LowerBound.Fill(0);
+      for (unsigned int j = 0; j < ImageDimension; j++)
+        m_UpperBound[j] = size[j]-1;
+      break;
+    }
+
   // Only generate a slab?
   if (m_SlabMode)
   {
@@ -145,13 +184,40 @@ AtlasCropImageSource<TInputImage, TProbabilityImage>
       m_UpperBound[i] = size[i]-1;
   }
 
-  // Store origin information
-  m_InputOrigin = probs[0]->GetOrigin();
-  probs[0]->TransformIndexToPhysicalPoint(m_LowerBound, m_CropOrigin);
+  m_CropInfo.offset = m_LowerBound;
+  for (unsigned int i = 0; i < ImageDimension; i++)
+    m_CropInfo.cropped_size[i] = m_UpperBound[i] - m_LowerBound[i] + 1;
+  m_CropInfo.original_size = m_OriginalSize;
+
+}
+
+template <class TInputImage, class TProbabilityImage>
+void
+AtlasCropImageSource<TInputImage, TProbabilityImage>
+::SetCropInfo(const CropInfoType& info)
+{
+  m_CropInfo = info;
 
-  //m_CropInfo.offset =
-  //m_CropInfo.size =
+  m_OriginalSize = info.original_size;
+  m_LowerBound = info.offset;
+  for (unsigned int i = 0; i < ImageDimension; i++)
+    m_UpperBound[i] = info.offset[i] + info.cropped_size[i] - 1;
+}
 
+template <class TInputImage, class TProbabilityImage>
+double
+AtlasCropImageSource<TInputImage, TProbabilityImage>
+::GetCroppedFraction() const
+{
+  double f = 1.0;
+  for (unsigned int i = 0; i < ImageDimension; i++)
+  {
+    if (m_OriginalSize[i] == 0)
+      return 1.0;
+    f *= (double)(m_UpperBound[i] - m_LowerBound[i] + 1) / m_OriginalSize[i];
+  }
+
+  return f;
 }
 
 template <class TInputImage, class TProbabilityImage>
@@ -159,6 +225,24 @@ typename AtlasCropImageSource<TInputImage, TProbabilityImage>
   ::InputImagePointer
 AtlasCropImageSource<TInputImage, TProbabilityImage>
 ::Restore(InputImagePointer img)
+{
+  return this->template RestoreImage<InputImageType>(img);
+}
+
+template <class TInputImage, class TProbabilityImage>
+typename AtlasCropImageSource<TInputImage, TProbabilityImage>
+  ::InputImagePointer
+AtlasCropImageSource<TInputImage, TProbabilityImage>
+::Crop(InputImagePointer img)
+{
+  return this->template CropImage<InputImageType>(img);
+}
+
+template <class TInputImage, class TProbabilityImage>
+template <class TImage>
+typename TImage::Pointer
+AtlasCropImageSource<TInputImage, TProbabilityImage>
+::RestoreImage(const TImage* img, const TImage* original)
 {
 
   if (!this->CheckBounds())
@@ -166,54 +250,75 @@ AtlasCropImageSource<TInputImage, TProbabilityImage>
     itkExceptionMacro(<< "Invalid bounds");
   }
 
-  InputImageSizeType size = img->GetLargestPossibleRegion().GetSize();
+  typename TImage::SizeType size = img->GetLargestPossibleRegion().GetSize();
 
-  InputImageSizeType croppedSize;
+  typename TImage::SizeType croppedSize;
   for (unsigned int i = 0; i < ImageDimension; i++)
     croppedSize[i] = m_UpperBound[i] - m_LowerBound[i] + 1;
 
   if (size != croppedSize)
     itkExceptionMacro(<< "Input size does not match size of cropped image");
 
-  InputImageRegionType region;
+  typename TImage::RegionType region;
   region.SetSize(m_OriginalSize);
 
-  InputImagePointer output = InputImageType::New();
+  // Origin is the position of the voxel at minus the crop offset
+  typename TImage::IndexType originIndex;
+  for (unsigned int i = 0; i < ImageDimension; i++)
+    originIndex[i] = -m_LowerBound[i];
+
+  typename TImage::PointType origin;
+  img->TransformIndexToPhysicalPoint(originIndex, origin);
+
+  typename TImage::Pointer output = TImage::New();
   output->CopyInformation(img);
-  // Adjust origin
-  output->SetOrigin(m_InputOrigin);
+  output->SetOrigin(origin);
   output->SetRegions(region);
   output->Allocate();
-  output->FillBuffer(0);
-
-  InputImageOffsetType offt;
-  for (unsigned int i = 0; i < ImageDimension; i++)
-    offt[i] = m_LowerBound[i];
 
-  typedef itk::ImageRegionIteratorWithIndex<InputImageType> IteratorType;
+  if (original != 0)
+  {
+    if (original->GetLargestPossibleRegion().GetSize() != m_OriginalSize)
+      itkExceptionMacro(<< "Original size does not match");
 
-  IteratorType inIt(img, img->GetLargestPossibleRegion());
+    typedef itk::ImageRegionConstIterator<TImage> ConstIteratorType;
+    typedef itk::ImageRegionIterator<TImage> IteratorType;
 
-  inIt.GoToBegin();
-  while (!inIt.IsAtEnd())
+    ConstIteratorType origIt(original, original->GetLargestPossibleRegion());
+    IteratorType outIt(output, region);
+    for (origIt.GoToBegin(), outIt.GoToBegin(); !outIt.IsAtEnd();
+         ++origIt, ++outIt)
+      outIt.Set(origIt.Get());
+  }
+  else
   {
-    InputImageIndexType ind = inIt.GetIndex();
+    // Zero for both scalar and vector pixels
+    memset(output->GetBufferPointer(), 0,
+      region.GetNumberOfPixels()*sizeof(typename TImage::PixelType));
+  }
 
-    output->SetPixel(ind + offt, inIt.Get());
+  typename TImage::RegionType pasteRegion;
+  pasteRegion.SetIndex(m_LowerBound);
+  pasteRegion.SetSize(croppedSize);
 
-    ++inIt;
-  }
+  typedef itk::ImageRegionConstIterator<TImage> ConstIteratorType;
+  typedef itk::ImageRegionIterator<TImage> IteratorType;
+
+  ConstIteratorType inIt(img, img->GetLargestPossibleRegion());
+  IteratorType outIt(output, pasteRegion);
+
+  for (inIt.GoToBegin(), outIt.GoToBegin(); !inIt.IsAtEnd(); ++inIt, ++outIt)
+    outIt.Set(inIt.Get());
 
   return output;
 
 }
 
-
 template <class TInputImage, class TProbabilityImage>
-typename AtlasCropImageSource<TInputImage, TProbabilityImage>
-  ::InputImagePointer
+template <class TImage>
+typename TImage::Pointer
 AtlasCropImageSource<TInputImage, TProbabilityImage>
-::Crop(InputImagePointer img)
+::CropImage(const TImage* img)
 {
 
   if (!this->CheckBounds())
@@ -221,42 +326,40 @@ AtlasCropImageSource<TInputImage, TProbabilityImage>
     itkExceptionMacro(<< "Invalid bounds");
   }
 
-  InputImageSizeType size = img->GetLargestPossibleRegion().GetSize();
+  typename TImage::SizeType size = img->GetLargestPossibleRegion().GetSize();
 
   if (size != m_OriginalSize)
     itkExceptionMacro(<< "Input size does not match size of probability images");
 
-  InputImageSizeType croppedSize;
+  typename TImage::SizeType croppedSize;
   for (unsigned int i = 0; i < ImageDimension; i++)
     croppedSize[i] = m_UpperBound[i] - m_LowerBound[i] + 1;
 
-  InputImageRegionType cropRegion;
+  typename TImage::RegionType cropRegion;
   cropRegion.SetSize(croppedSize);
 
-  InputImagePointer output = InputImageType::New();
+  typename TImage::PointType origin;
+  img->TransformIndexToPhysicalPoint(m_LowerBound, origin);
+
+  typename TImage::Pointer output = TImage::New();
   output->CopyInformation(img);
   // Adjust origin
-  output->SetOrigin(m_CropOrigin);
+  output->SetOrigin(origin);
   output->SetRegions(cropRegion);
   output->Allocate();
 
-  InputImageOffsetType offt;
-  for (unsigned int i = 0; i < ImageDimension; i++)
-    offt[i] = m_LowerBound[i];
+  typename TImage::RegionType inRegion;
+  inRegion.SetIndex(m_LowerBound);
+  inRegion.SetSize(croppedSize);
 
-  typedef itk::ImageRegionIteratorWithIndex<InputImageType> IteratorType;
+  typedef itk::ImageRegionConstIterator<TImage> ConstIteratorType;
+  typedef itk::ImageRegionIterator<TImage> IteratorType;
 
+  ConstIteratorType inIt(img, inRegion);
   IteratorType outIt(output, cropRegion);
 
-  outIt.GoToBegin();
-  while (!outIt.IsAtEnd())
-  {
-    InputImageIndexType ind = outIt.GetIndex();
-
-    outIt.Set(img->GetPixel(ind+offt));
-
-    ++outIt;
-  }
+  for (inIt.GoToBegin(), outIt.GoToBegin(); !outIt.IsAtEnd(); ++inIt, ++outIt)
+    outIt.Set(inIt.Get());
 
   return output;
 
@@ -145,16 +145,26 @@ ImageDirectionStandardizer<TImage>
 
   orient->UseImageDirectionOff();
 
+  ImageDirectionType givenDir;
   if (itksys::SystemTools::Strucmp(dirstring.c_str(), "file") == 0)
-  {
-    orient->SetGivenCoordinateDirection(img->GetDirection());
-  }
+    givenDir = img->GetDirection();
   else
+    givenDir = this->_GetDirectionFromString(dirstring);
+
+  // Already in the target orientation, share the voxels instead of copying
+  // them (e.g. for memory mapped images)
+  if (givenDir == m_TargetImageOrientation)
   {
-    ImageDirectionType dir = this->_GetDirectionFromString(dirstring);
-    orient->SetGivenCoordinateDirection(dir);
+    ImagePointer outimg = ImageType::New();
+    outimg->CopyInformation(img);
+    outimg->SetRegions(img->GetLargestPossibleRegion());
+    outimg->SetPixelContainer(img->GetPixelContainer());
+    outimg->SetDirection(m_TargetImageOrientation);
+    return outimg;
   }
 
+  orient->SetGivenCoordinateDirection(givenDir);
+
   orient->SetDesiredCoordinateDirection(m_TargetImageOrientation);
 
   orient->SetInput(img);
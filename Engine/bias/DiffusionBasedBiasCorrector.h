@@ -1,6 +1,17 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 //
+// Bias field estimation using anisotropic diffusion of the residual image
+// (difference between input intensities and the piecewise flat image
+// reconstructed from class means and probabilities).
+//
+// Suited for bias fields that are not well described by low degree
+// polynomials. Multi-threaded, each thread processes a slab of slices and
+// accesses neighbors in the raw image buffers using precomputed offsets.
+//
+// Has the same interface as LLSBiasCorrector (CorrectImages,
+// GetLogBiasFields) so it can be used in its place by EMSegmentationFilter.
+//
 ////////////////////////////////////////////////////////////////////////////////
 
 // prastawa@cs.unc.edu 3/2004
@@ -9,15 +20,13 @@
 #define _DiffusionBasedBiasCorrector_h
 
 #include "itkImage.h"
+#include "itkMultiThreader.h"
 #include "itkObject.h"
 
-#include "vnl/vnl_matrix.h"
-#include "vnl/vnl_vector.h"
-#include "vnl/algo/vnl_matrix_inverse.h"
-#include "vnl/algo/vnl_qr.h"
-
 #include "DynArray.h"
 
+#include <vector>
+
 template <class TInputImage, class TProbabilityImage>
 class DiffusionBasedBiasCorrector : public itk::Object
 {
@@ -45,6 +54,10 @@ public:
   typedef typename TInputImage::SizeType InputImageSizeType;
   typedef typename TInputImage::SpacingType InputImageSpacingType;
 
+  typedef itk::Image<unsigned char, 3> MaskImageType;
+  typedef MaskImageType::Pointer MaskImagePointer;
+  typedef MaskImageType::PixelType MaskImagePixelType;
+
   typedef TProbabilityImage ProbabilityImageType;
   typedef typename ProbabilityImageType::Pointer ProbabilityImagePointer;
   typedef typename ProbabilityImageType::IndexType ProbabilityImageIndexType;
@@ -62,32 +75,111 @@ public:
   void SetAdditive() { m_DoLog = false; }
   void SetMultiplicative() { m_DoLog = true; }
 
+  // Optional, restricts the voxels used for computing the residual
+  void SetMask(MaskImageType* mask);
+
   void SetProbabilities(DynArray<ProbabilityImagePointer> probs);
 
   void SetDiffusionTimeStep(double d) { m_DiffusionTimeStep = d; }
   void SetDiffusionIterations(unsigned int n) { m_DiffusionIterations = n; }
 
+  // Clamp magnitude of the estimated bias field (multiplicative mode only)
+  itkSetMacro(ClampBias, bool);
+  itkGetMacro(ClampBias, bool);
+
+  itkSetMacro(MaximumBiasMagnitude, float);
+  itkGetMacro(MaximumBiasMagnitude, float);
+
+  // Default is the global default number of threads
+  itkSetMacro(NumberOfThreads, unsigned int);
+  itkGetMacro(NumberOfThreads, unsigned int);
+
   void Correct(InputImagePointer input, InputImagePointer output);
 
+  // Correct each input image and write it to the designated output
+  void CorrectImages(
+    DynArray<InputImagePointer>& inputs,
+    DynArray<InputImagePointer>& outputs);
+
+  // Obtain the bias fields after correction, must call CorrectImages() first
+  DynArray<InternalImagePointer> GetLogBiasFields()
+  { return m_LogBiasFields; }
+
 protected:
 
   DiffusionBasedBiasCorrector();
   ~DiffusionBasedBiasCorrector();
 
   void CheckInput();
-  InternalImagePointer ComputeResidualImage();
+
+  void ComputeResidualImage();
+
+  float ComputeAverageGradientNorm();
+
+  void DiffuseResidualImage();
+
+  // Stages executed by the worker threads
+  typedef enum
+  {
+    MeansStage, ResidualStage, GradientStage, DiffusionStage, CorrectionStage
+  } ThreadStageType;
+
+  // Run a stage on all threads, each thread accumulates numAccumulators
+  // values that are summed into m_Accumulators afterwards
+  void ThreadedExecute(ThreadStageType stage, unsigned int numAccumulators);
+  static ITK_THREAD_RETURN_TYPE _threadExecute(void* arg);
+
+  void ThreadedComputeMeans(long zbegin, long zend, double* acc);
+  void ThreadedComputeResidual(long zbegin, long zend);
+  void ThreadedComputeGradientNorm(long zbegin, long zend, double* acc);
+  void ThreadedDiffuse(long zbegin, long zend);
+  void ThreadedCorrect(long zbegin, long zend);
 
 private:
 
   InputImagePointer m_InputData;
+  InputImagePointer m_OutputData;
+
+  MaskImagePointer m_Mask;
 
   DynArray<ProbabilityImagePointer> m_Probabilities;
 
+  DynArray<InternalImagePointer> m_LogBiasFields;
+
   bool m_DoLog;
 
   double m_DiffusionTimeStep;
   unsigned int m_DiffusionIterations;
 
+  bool m_ClampBias;
+  float m_MaximumBiasMagnitude;
+
+  unsigned int m_NumberOfThreads;
+
+  // Residual image and scratch image for the diffusion updates
+  InternalImagePointer m_ResidualImage;
+  InternalImagePointer m_UpdateImage;
+
+  // Raw buffer access, valid during Correct()
+  long m_Size[3];
+
+  std::vector<const ProbabilityImagePixelType*> m_ProbabilityBuffers;
+
+  std::vector<double> m_ClassMeans;
+
+  // Offsets to the 6-neighbors in the raw buffer (-x, +x, -y, +y, -z, +z)
+  // and the inverse squared spacing along each direction
+  long m_NeighborOffsets[6];
+  float m_NeighborWeights[6];
+
+  float m_ConductanceSquared;
+
+  ThreadStageType m_ThreadStage;
+
+  unsigned int m_NumberOfAccumulators;
+  std::vector<double> m_ThreadAccumulators;
+  std::vector<double> m_Accumulators;
+
 };
 
 #ifndef MU_MANUAL_INSTANTIATION
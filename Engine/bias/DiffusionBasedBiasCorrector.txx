@@ -2,22 +2,19 @@
 #ifndef _DiffusionBasedBiasCorrector_txx
 #define _DiffusionBasedBiasCorrector_txx
 
-#include "itkCurvatureFlowImageFilter.h"
-#include "itkGradientAnisotropicDiffusionImageFilter.h"
-#include "itkImageRegionIteratorWithIndex.h"
-
 #include "DiffusionBasedBiasCorrector.h"
 
 #include "vnl/vnl_math.h"
 
+#include <cfloat>
 #include <cmath>
 
 #include <iostream>
 
-#define EXPP(x) (exp((x)/100.0) - 1.0)
-#define LOGP(x) (100.0 * log((x)+1.0))
-//#define EXPP(x) (exp(x) - 1)
-//#define LOGP(x) (log((x)+1))
+// Same log mapping as LLSBiasCorrector, so the log bias fields from both
+// correctors are interchangeable
+#define EXPP(x) (expf(x) - 1)
+#define LOGP(x) (logf((x)+1))
 
 template <class TInputImage, class TProbabilityImage>
 DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
@@ -25,19 +22,46 @@ DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
 {
 
   m_InputData = 0;
+  m_OutputData = 0;
+
+  m_Mask = 0;
 
   m_DoLog = false;
 
   m_DiffusionIterations = 20;
   m_DiffusionTimeStep = 0.05;
 
+  m_ClampBias = false;
+  m_MaximumBiasMagnitude = 5.0;
+
+  m_NumberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  m_Size[0] = 0;
+  m_Size[1] = 0;
+  m_Size[2] = 0;
+
+  for (unsigned int k = 0; k < 6; k++)
+  {
+    m_NeighborOffsets[k] = 0;
+    m_NeighborWeights[k] = 1.0;
+  }
+
+  m_ConductanceSquared = 1.0;
+
+  m_ThreadStage = MeansStage;
+
+  m_NumberOfAccumulators = 0;
+
 }
 
 template <class TInputImage, class TProbabilityImage>
 DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
 ::~DiffusionBasedBiasCorrector()
 {
+  m_Mask = 0;
 
+  m_Probabilities.Clear();
+  m_LogBiasFields.Clear();
 }
 
 template <class TInputImage, class TProbabilityImage>
@@ -49,13 +73,16 @@ DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
   if (m_InputData.IsNull())
     itkExceptionMacro(<< "Input image not initialized");
 
+  if (m_InputData->GetImageDimension() != 3)
+    itkExceptionMacro(<< "Input image has invalid dimension: only supports 3D images");
+
   if (m_Probabilities.GetSize() < 1)
     itkExceptionMacro(<< "Must have one or more class probabilities");
 
   InputImageSizeType size =
     m_InputData->GetLargestPossibleRegion().GetSize();
 
-  for (int i = 0; i < m_Probabilities.GetSize(); i++)
+  for (unsigned int i = 0; i < m_Probabilities.GetSize(); i++)
   {
     if (m_Probabilities[i]->GetImageDimension() != 3)
       itkExceptionMacro(<< "Probability [" << i << "] has invalid dimension: only supports 3D images");
@@ -65,103 +92,430 @@ DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
       itkExceptionMacro(<< "Image data and probabilities 3D size mismatch");
   }
 
+  if (!m_Mask.IsNull())
+  {
+    MaskImageType::SizeType msize =
+      m_Mask->GetLargestPossibleRegion().GetSize();
+    if (size[0] != msize[0] || size[1] != msize[1] || size[2] != msize[2])
+      itkExceptionMacro(<< "Image data and mask 3D size mismatch");
+  }
+
 }
 
 template <class TInputImage, class TProbabilityImage>
-typename DiffusionBasedBiasCorrector<TInputImage, TProbabilityImage>::InternalImagePointer
+void
 DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
-::ComputeResidualImage()
+::SetMask(MaskImageType* mask)
 {
+  m_Mask = mask;
+}
 
-  itkDebugMacro(<< "DiffusionBasedBiasCorrector: Computing means...");
+template <class TInputImage, class TProbabilityImage>
+void
+DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
+::SetProbabilities(DynArray<ProbabilityImagePointer> probs)
+{
 
-  unsigned int numClasses = m_Probabilities.GetSize();
+  itkDebugMacro(<< "SetProbabilities");
 
-  DynArray<double> meanValues;
-  meanValues.Initialize(numClasses, 0);
+  if (probs.GetSize() < 1)
+    itkExceptionMacro(<<"Need one or more probabilities");
 
-  DynArray<double> sumProbs;
-  sumProbs.Initialize(numClasses, 0);
+  for (unsigned int i = 0; i < probs.GetSize(); i++)
+  {
+    if (probs[i].IsNull())
+      itkExceptionMacro(<<"One of input probabilities not initialized");
+  }
 
-  typedef itk::ImageRegionIteratorWithIndex<InputImageType> IteratorType;
+  m_Probabilities = probs;
+
+}
+
+template <class TInputImage, class TProbabilityImage>
+void
+DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
+::ThreadedExecute(ThreadStageType stage, unsigned int numAccumulators)
+{
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads(m_NumberOfThreads);
+
+  // Threader may clamp the number of threads
+  unsigned int numThreads = threader->GetNumberOfThreads();
+
+  m_ThreadStage = stage;
+
+  m_NumberOfAccumulators = numAccumulators;
+  m_ThreadAccumulators.assign(numThreads*numAccumulators, 0.0);
+
+  threader->SetSingleMethod(
+    &DiffusionBasedBiasCorrector::_threadExecute, (void*)this);
+  threader->SingleMethodExecute();
+
+  m_Accumulators.assign(numAccumulators, 0.0);
+  for (unsigned int t = 0; t < numThreads; t++)
+    for (unsigned int i = 0; i < numAccumulators; i++)
+      m_Accumulators[i] += m_ThreadAccumulators[t*numAccumulators + i];
+}
+
+template <class TInputImage, class TProbabilityImage>
+ITK_THREAD_RETURN_TYPE
+DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
+::_threadExecute(void* arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfoType;
+  ThreadInfoType * infoStruct = static_cast< ThreadInfoType * >( arg );
 
-  IteratorType it(m_InputData, m_InputData->GetLargestPossibleRegion());
-  for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+  const unsigned int threadId = infoStruct->ThreadID;
+  const unsigned int numThreads = infoStruct->NumberOfThreads;
+
+  DiffusionBasedBiasCorrector* obj =
+    static_cast< DiffusionBasedBiasCorrector* >( infoStruct->UserData );
+
+  // Split the volume into slabs along z
+  long numSlices = obj->m_Size[2];
+  long slabSize = (numSlices + numThreads - 1) / numThreads;
+
+  long zbegin = threadId * slabSize;
+  long zend = zbegin + slabSize;
+  if (zend > numSlices)
+    zend = numSlices;
+
+  if (zbegin >= zend)
+    return ITK_THREAD_RETURN_VALUE;
+
+  double* acc = 0;
+  if (obj->m_NumberOfAccumulators > 0)
+    acc = &(obj->m_ThreadAccumulators[threadId*obj->m_NumberOfAccumulators]);
+
+  switch (obj->m_ThreadStage)
   {
-    InputImageIndexType ind = it.GetIndex();
+    case MeansStage:
+      obj->ThreadedComputeMeans(zbegin, zend, acc);
+      break;
+    case ResidualStage:
+      obj->ThreadedComputeResidual(zbegin, zend);
+      break;
+    case GradientStage:
+      obj->ThreadedComputeGradientNorm(zbegin, zend, acc);
+      break;
+    case DiffusionStage:
+      obj->ThreadedDiffuse(zbegin, zend);
+      break;
+    case CorrectionStage:
+      obj->ThreadedCorrect(zbegin, zend);
+      break;
+  }
 
-    double v = it.Get();
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TInputImage, class TProbabilityImage>
+void
+DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
+::ThreadedComputeMeans(long zbegin, long zend, double* acc)
+{
+  unsigned int numClasses = m_ProbabilityBuffers.size();
+
+  const InputImagePixelType* inputBuffer = m_InputData->GetBufferPointer();
+
+  const MaskImagePixelType* maskBuffer = 0;
+  if (!m_Mask.IsNull())
+    maskBuffer = m_Mask->GetBufferPointer();
+
+  long sliceSize = m_Size[0]*m_Size[1];
+
+  // Accumulate locally, avoid writing to memory shared with other threads
+  std::vector<double> sums(2*numClasses, 0.0);
+
+  for (long i = zbegin*sliceSize; i < zend*sliceSize; i++)
+  {
+    if (maskBuffer != 0 && maskBuffer[i] == 0)
+      continue;
+
+    double v = inputBuffer[i];
     if (m_DoLog)
       v = LOGP(v);
 
-    for (unsigned int i = 0; i < numClasses; i++)
+    for (unsigned int c = 0; c < numClasses; c++)
     {
-      double p = m_Probabilities[i]->GetPixel(ind);
-      meanValues[i] += p*v;
-      sumProbs[i] += p;
+      double p = m_ProbabilityBuffers[c][i];
+      sums[2*c] += p*v;
+      sums[2*c+1] += p;
     }
   }
 
-  for (unsigned int i = 0; i < numClasses; i++)
-    if (sumProbs[i] > 0)
-      meanValues[i] /= sumProbs[i];
+  for (unsigned int j = 0; j < 2*numClasses; j++)
+    acc[j] = sums[j];
+}
 
-  itkDebugMacro(<< "DiffusionBasedBiasCorrector: Computing residual...");
+template <class TInputImage, class TProbabilityImage>
+void
+DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
+::ThreadedComputeResidual(long zbegin, long zend)
+{
+  unsigned int numClasses = m_ProbabilityBuffers.size();
+
+  const InputImagePixelType* inputBuffer = m_InputData->GetBufferPointer();
+
+  const MaskImagePixelType* maskBuffer = 0;
+  if (!m_Mask.IsNull())
+    maskBuffer = m_Mask->GetBufferPointer();
+
+  InternalImagePixelType* resBuffer = m_ResidualImage->GetBufferPointer();
 
-  InternalImagePointer resImg = InternalImageType::New();
-  resImg->SetRegions(m_InputData->GetLargestPossibleRegion());
-  resImg->Allocate();
-  resImg->SetOrigin(m_InputData->GetOrigin());
-  resImg->SetSpacing(m_InputData->GetSpacing());
-  resImg->FillBuffer(0);
+  long sliceSize = m_Size[0]*m_Size[1];
 
-  for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+  for (long i = zbegin*sliceSize; i < zend*sliceSize; i++)
   {
-    InputImageIndexType ind = it.GetIndex();
+    resBuffer[i] = 0;
 
-    double v = it.Get();
-    if (m_DoLog)
-      v = LOGP(v);
+    if (maskBuffer != 0 && maskBuffer[i] == 0)
+      continue;
 
     double ptot = 0;
-    for (unsigned int i = 0; i < numClasses; i++)
-      ptot += m_Probabilities[i]->GetPixel(ind);
+    double v_flat = 0;
+    for (unsigned int c = 0; c < numClasses; c++)
+    {
+      double p = m_ProbabilityBuffers[c][i];
+      ptot += p;
+      v_flat += p * m_ClassMeans[c];
+    }
 
     if (ptot < 1e-10)
       continue;
 
-    double v_flat = 0;
-    for (unsigned int i = 0; i < numClasses; i++)
+    double v = inputBuffer[i];
+    if (m_DoLog)
+      v = LOGP(v);
+
+    resBuffer[i] = (InternalImagePixelType)(v - v_flat / ptot);
+  }
+}
+
+template <class TInputImage, class TProbabilityImage>
+void
+DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
+::ThreadedComputeGradientNorm(long zbegin, long zend, double* acc)
+{
+  const InternalImagePixelType* resBuffer =
+    m_ResidualImage->GetBufferPointer();
+
+  long nx = m_Size[0];
+  long ny = m_Size[1];
+  long nz = m_Size[2];
+
+  double sumGradNorm = 0;
+  double countNonZero = 0;
+
+  // Interior voxels only, central differences
+  if (zbegin < 1)
+    zbegin = 1;
+  if (zend > nz-1)
+    zend = nz-1;
+
+  for (long z = zbegin; z < zend; z++)
+    for (long y = 1; y < ny-1; y++)
+    {
+      long i = (z*ny + y)*nx + 1;
+      for (long x = 1; x < nx-1; x++, i++)
+      {
+        double sumSquaredNorm = 0;
+        for (unsigned int k = 0; k < 6; k += 2)
+        {
+          double g = 0.5 *
+            (resBuffer[i+m_NeighborOffsets[k+1]] -
+             resBuffer[i+m_NeighborOffsets[k]]);
+          sumSquaredNorm += g*g * m_NeighborWeights[k];
+        }
+
+        if (sumSquaredNorm > 0)
+        {
+          sumGradNorm += sqrt(sumSquaredNorm);
+          countNonZero += 1.0;
+        }
+      }
+    }
+
+  acc[0] = sumGradNorm;
+  acc[1] = countNonZero;
+}
+
+template <class TInputImage, class TProbabilityImage>
+void
+DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
+::ThreadedDiffuse(long zbegin, long zend)
+{
+  const InternalImagePixelType* src = m_ResidualImage->GetBufferPointer();
+  InternalImagePixelType* dst = m_UpdateImage->GetBufferPointer();
+
+  long nx = m_Size[0];
+  long ny = m_Size[1];
+  long nz = m_Size[2];
+
+  float dt = m_DiffusionTimeStep;
+
+  for (long z = zbegin; z < zend; z++)
+    for (long y = 0; y < ny; y++)
+    {
+      // Valid neighbor directions along y and z are fixed for the row,
+      // zero flux across the image boundary
+      unsigned int rowValid = 0;
+      if (y > 0)
+        rowValid |= 1 << 2;
+      if (y < ny-1)
+        rowValid |= 1 << 3;
+      if (z > 0)
+        rowValid |= 1 << 4;
+      if (z < nz-1)
+        rowValid |= 1 << 5;
+
+      long i = (z*ny + y)*nx;
+      for (long x = 0; x < nx; x++, i++)
+      {
+        unsigned int valid = rowValid;
+        if (x > 0)
+          valid |= 1 << 0;
+        if (x < nx-1)
+          valid |= 1 << 1;
+
+        float center = src[i];
+
+        float flux = 0;
+        for (unsigned int k = 0; k < 6; k++)
+        {
+          if ((valid & (1 << k)) == 0)
+            continue;
+
+          float d = src[i+m_NeighborOffsets[k]] - center;
+          float gSquared = d*d * m_NeighborWeights[k];
+
+          // Perona-Malik conductance
+          float cond = expf(-gSquared / m_ConductanceSquared);
+
+          flux += cond * d * m_NeighborWeights[k];
+        }
+
+        dst[i] = center + dt*flux;
+      }
+    }
+}
+
+template <class TInputImage, class TProbabilityImage>
+void
+DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
+::ThreadedCorrect(long zbegin, long zend)
+{
+  const InputImagePixelType* inputBuffer = m_InputData->GetBufferPointer();
+  InputImagePixelType* outputBuffer = m_OutputData->GetBufferPointer();
+
+  InternalImagePixelType* biasBuffer = m_ResidualImage->GetBufferPointer();
+
+  bool doClamp = m_ClampBias && m_DoLog;
+
+  float logMax = LOGP(m_MaximumBiasMagnitude);
+  float logMin = -1.0 * logMax;
+
+  long sliceSize = m_Size[0]*m_Size[1];
+
+  for (long i = zbegin*sliceSize; i < zend*sliceSize; i++)
+  {
+    float b = biasBuffer[i];
+
+    if (doClamp)
     {
-      double p = m_Probabilities[i]->GetPixel(ind);
-      v_flat += p * meanValues[i];
+      if (b < logMin)
+        b = logMin;
+      if (b > logMax)
+        b = logMax;
+      biasBuffer[i] = b;
     }
 
-    resImg->SetPixel(ind, v - v_flat);
+    float v = inputBuffer[i];
+    if (m_DoLog)
+      v = LOGP(v);
+
+    float v_flat = v - b;
+    if (m_DoLog)
+      v_flat = EXPP(v_flat);
+
+    if (vnl_math_isnan(v_flat) || vnl_math_isinf(v_flat))
+      v_flat = 0.0;
+
+    outputBuffer[i] = (InputImagePixelType)v_flat;
   }
+}
 
-  return resImg;
+template <class TInputImage, class TProbabilityImage>
+void
+DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
+::ComputeResidualImage()
+{
+
+  itkDebugMacro(<< "DiffusionBasedBiasCorrector: Computing means...");
+
+  unsigned int numClasses = m_Probabilities.GetSize();
+
+  this->ThreadedExecute(MeansStage, 2*numClasses);
+
+  m_ClassMeans.assign(numClasses, 0.0);
+  for (unsigned int i = 0; i < numClasses; i++)
+    if (m_Accumulators[2*i+1] > 0)
+      m_ClassMeans[i] = m_Accumulators[2*i] / m_Accumulators[2*i+1];
+
+  itkDebugMacro(<< "DiffusionBasedBiasCorrector: Computing residual...");
+
+  m_ResidualImage = InternalImageType::New();
+  m_ResidualImage->CopyInformation(m_InputData);
+  m_ResidualImage->SetRegions(m_InputData->GetLargestPossibleRegion());
+  m_ResidualImage->Allocate();
+
+  this->ThreadedExecute(ResidualStage, 0);
 
 }
 
+template <class TInputImage, class TProbabilityImage>
+float
+DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
+::ComputeAverageGradientNorm()
+{
+  this->ThreadedExecute(GradientStage, 2);
+
+  if (m_Accumulators[1] <= 0)
+    return 0.0;
+
+  return m_Accumulators[0] / m_Accumulators[1];
+}
+
 template <class TInputImage, class TProbabilityImage>
 void
 DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
-::SetProbabilities(DynArray<ProbabilityImagePointer> probs)
+::DiffuseResidualImage()
 {
 
-  itkDebugMacro(<< "SetProbabilities");
+  itkDebugMacro(<< "DiffusionBasedBiasCorrector: Diffusing residual...");
 
-  if (probs.GetSize() < 1)
-    itkExceptionMacro(<<"Need one or more probabilities");
+  // Conductance from the average gradient norm of the residual
+  float K = this->ComputeAverageGradientNorm() + 1e-20;
+  m_ConductanceSquared = K*K;
+
+  itkDebugMacro(<< "Average gradient norm = " << K);
 
-  for (int i = 0; i < probs.GetSize(); i++)
+  m_UpdateImage = InternalImageType::New();
+  m_UpdateImage->CopyInformation(m_ResidualImage);
+  m_UpdateImage->SetRegions(m_ResidualImage->GetLargestPossibleRegion());
+  m_UpdateImage->Allocate();
+
+  for (unsigned int iter = 0; iter < m_DiffusionIterations; iter++)
   {
-    if (probs[i].IsNull())
-      itkExceptionMacro(<<"One of input probabilities not initialized");
+    this->ThreadedExecute(DiffusionStage, 0);
+
+    // Swap buffers, updated values become the residual
+    InternalImagePointer tmp = m_ResidualImage;
+    m_ResidualImage = m_UpdateImage;
+    m_UpdateImage = tmp;
   }
 
-  m_Probabilities = probs;
+  m_UpdateImage = 0;
 
 }
 
@@ -172,64 +526,86 @@ DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
 {
   // For convenience
   m_InputData = input;
+  m_OutputData = output;
 
   // Verify input
   this->CheckInput();
 
-  unsigned int numClasses = m_Probabilities.GetSize();
+  // Set up raw buffer access
+  InputImageSizeType size =
+    m_InputData->GetLargestPossibleRegion().GetSize();
+
+  m_Size[0] = size[0];
+  m_Size[1] = size[1];
+  m_Size[2] = size[2];
+
+  InputImageSpacingType spacing = m_InputData->GetSpacing();
+
+  double minSpacing = spacing[0];
+  for (unsigned int d = 1; d < 3; d++)
+    if (spacing[d] < minSpacing)
+      minSpacing = spacing[d];
+
+  long strides[3];
+  strides[0] = 1;
+  strides[1] = m_Size[0];
+  strides[2] = m_Size[0]*m_Size[1];
+
+  for (unsigned int d = 0; d < 3; d++)
+  {
+    // Spacing relative to the finest axis, keeps time step in voxel units
+    double h = spacing[d] / minSpacing;
+
+    m_NeighborOffsets[2*d] = -strides[d];
+    m_NeighborOffsets[2*d+1] = strides[d];
+
+    m_NeighborWeights[2*d] = 1.0 / (h*h);
+    m_NeighborWeights[2*d+1] = 1.0 / (h*h);
+  }
+
+  m_ProbabilityBuffers.clear();
+  for (unsigned int i = 0; i < m_Probabilities.GetSize(); i++)
+    m_ProbabilityBuffers.push_back(m_Probabilities[i]->GetBufferPointer());
 
   // Compute residual image
-  InternalImagePointer resImg = this->ComputeResidualImage();
+  this->ComputeResidualImage();
 
   // Do anisotropic blurring on the residual image
-#if 0
-  typedef itk::CurvatureFlowImageFilter<InternalImageType, InternalImageType>
-    CurvatureFilterType;
-  typename CurvatureFilterType::Pointer cfilt = CurvatureFilterType::New();
-
-  cfilt->SetNumberOfIterations(m_DiffusionIterations);
-  cfilt->SetTimeStep(m_DiffusionTimeStep);
-  cfilt->SetInput(resImg);
-  cfilt->Update();
-
-  resImg = cfilt->GetOutput();
-#else
-  typedef itk::GradientAnisotropicDiffusionImageFilter<InternalImageType, InternalImageType>
-    AnisoFilterType;
-  typename AnisoFilterType::Pointer afilt = AnisoFilterType::New();
-
-  afilt->SetNumberOfIterations(m_DiffusionIterations);
-  afilt->SetTimeStep(m_DiffusionTimeStep);
-  afilt->SetInput(resImg);
-  afilt->Update();
-
-  resImg = afilt->GetOutput();
-#endif
+  this->DiffuseResidualImage();
 
   // Apply correction
-  typedef itk::ImageRegionIteratorWithIndex<InputImageType> IteratorType;
+  m_OutputData->CopyInformation(m_InputData);
+  m_OutputData->SetRegions(m_InputData->GetLargestPossibleRegion());
+  m_OutputData->Allocate();
 
-  IteratorType it(m_InputData, m_InputData->GetLargestPossibleRegion());
-  for (it.GoToBegin(); !it.IsAtEnd(); ++it)
-  {
-    InputImageIndexType ind = it.GetIndex();
+  this->ThreadedExecute(CorrectionStage, 0);
 
-    double v = it.Get();
-    if (m_DoLog)
-      v = LOGP(v);
+  // Diffused residual is the bias field estimate
+  m_LogBiasFields.Append(m_ResidualImage);
 
-    double b = resImg->GetPixel(ind);
+  // Remove reference to data when done
+  m_ResidualImage = 0;
+  m_ProbabilityBuffers.clear();
 
-    double v_flat = v - b;
-    if (m_DoLog)
-      v_flat = EXPP(v_flat);
+  m_InputData = 0;
+  m_OutputData = 0;
 
-    output->SetPixel(ind, (InputImagePixelType)v_flat);
-  }
+}
 
-  // Remove reference to input data when done
-  m_InputData = 0;
+template <class TInputImage, class TProbabilityImage>
+void
+DiffusionBasedBiasCorrector <TInputImage, TProbabilityImage>
+::CorrectImages(
+  DynArray<InputImagePointer>& inputs,
+  DynArray<InputImagePointer>& outputs)
+{
+  if (inputs.GetSize() != outputs.GetSize())
+    itkExceptionMacro(<< "Number of output images != input images");
+
+  m_LogBiasFields.Clear();
 
+  for (unsigned int ichan = 0; ichan < inputs.GetSize(); ichan++)
+    this->Correct(inputs[ichan], outputs[ichan]);
 }
 
 #endif
@@ -18,6 +18,19 @@ EMSParameters
   m_OutputDirectory = "";
   m_OutputFormat = "Meta";
 
+  m_CompressLabels = true;
+  m_CompressPosteriors = true;
+  m_CompressCorrected = true;
+  m_CompressRegistered = true;
+  m_CompressWarpedTemplate = true;
+  m_CompressDisplacement = false;
+
+  m_PosteriorFormat = "separate";
+  m_PosteriorBits = 16;
+  m_EmbedLabels = false;
+
+  m_OutputWriterThreads = 0;
+
   m_Images.Clear();
   m_ImageOrientations.Clear();
 
@@ -27,21 +40,32 @@ EMSParameters
 
   m_MaxBiasDegree = 2;
 
+  m_BiasCorrectionMethod = "polynomial";
+
   m_AtlasWarpFluidIterations = 0;
 
   m_AtlasWarpFluidMaxStep = 0.5;
 
   m_AtlasWarpKernelWidth = 10.0;
 
+  m_DoAtlasCrop = true;
+  m_AtlasCropPadding = 8.0;
+
   //m_PriorWeights = std::vector<double>(4, 1.0);
 
   m_AtlasLinearMapType = "affine";
   m_ImageLinearMapType = "affine";
 
+  m_AffineInitialization = "centers";
+
+  m_AffineMetric = "mi";
+
   //m_InitialDistributionEstimator = "robust";
   m_InitialDistributionEstimator = "standard";
 
   m_NumberOfThreads = itk::MultiThreader::GetGlobalMaximumNumberOfThreads();
+
+  m_RegistrationCacheDirectory = "";
 }
 
 EMSParameters
@@ -97,9 +121,37 @@ EMSParameters
   if (m_Images.GetSize() == 0)
     return false;
 
+  if (m_PosteriorFormat.compare("separate") != 0 &&
+      m_PosteriorFormat.compare("combined") != 0)
+    return false;
+
+  if (m_PosteriorBits != 8 && m_PosteriorBits != 16)
+    return false;
+
+  // Analyze and GIPL can not store vector images
+  if (m_PosteriorFormat.compare("combined") == 0 &&
+      (itksys::SystemTools::Strucmp(m_OutputFormat.c_str(), "Analyze") == 0 ||
+       itksys::SystemTools::Strucmp(m_OutputFormat.c_str(), "GIPL") == 0))
+    return false;
+
+  if (m_BiasCorrectionMethod.compare("polynomial") != 0 &&
+      m_BiasCorrectionMethod.compare("diffusion") != 0)
+    return false;
+
+  if (m_AffineInitialization.compare("centers") != 0 &&
+      m_AffineInitialization.compare("moments") != 0)
+    return false;
+
+  if (m_AffineMetric.compare("mi") != 0 &&
+      m_AffineMetric.compare("hc") != 0)
+    return false;
+
   if (m_NumberOfThreads < 1)
     return false;
 
+  if (m_AtlasCropPadding < 0)
+    return false;
+
   return true;
 }
 
@@ -112,12 +164,36 @@ EMSParameters
   os << "Atlas orientation = " << m_AtlasOrientation << std::endl;
   os << "Output directory = " << m_OutputDirectory << std::endl;
   os << "Output format = " << m_OutputFormat << std::endl;
+  os << "Compressed outputs =";
+  if (m_CompressLabels)
+    os << " labels";
+  if (m_CompressPosteriors)
+    os << " posteriors";
+  if (m_CompressCorrected)
+    os << " corrected";
+  if (m_CompressRegistered)
+    os << " registered";
+  if (m_CompressWarpedTemplate)
+    os << " warped-template";
+  if (m_CompressDisplacement)
+    os << " displacement";
+  os << std::endl;
+  os << "Posterior format = " << m_PosteriorFormat;
+  if (m_PosteriorFormat.compare("combined") == 0)
+  {
+    os << ", " << m_PosteriorBits << " bits";
+    if (m_EmbedLabels)
+      os << ", with labels";
+  }
+  os << std::endl;
+  os << "Output writer threads = " << m_OutputWriterThreads << std::endl;
   os << "Images:" << std::endl;
   for (unsigned int k = 0; k < m_Images.GetSize(); k++)
     os << "  " << m_Images[k] << " --- " << m_ImageOrientations[k] << std::endl;
   os << "Filter iterations = " << m_FilterIterations << std::endl;
   os << "Filter time step = " << m_FilterTimeStep << std::endl;
   os << "Max bias degree = " << m_MaxBiasDegree << std::endl;
+  os << "Bias correction method = " << m_BiasCorrectionMethod << std::endl;
   for (unsigned int i = 0; i < m_PriorWeights.size(); i++)
     os << "Prior " << i+1 << " = " << m_PriorWeights[i] << std::endl;
   os << "Initial Distribution Estimator = " << m_InitialDistributionEstimator << std::endl;
@@ -132,5 +208,12 @@ EMSParameters
   {
     os << "No atlas warping..." << std::endl;
   }
+  if (m_DoAtlasCrop)
+    os << "Atlas crop padding = " << m_AtlasCropPadding << std::endl;
+  else
+    os << "No atlas cropping..." << std::endl;
+  os << "Affine initialization = " << m_AffineInitialization << std::endl;
+  os << "Affine metric = " << m_AffineMetric << std::endl;
   os << "Number of threads = " << m_NumberOfThreads << std::endl;
+  os << "Registration cache directory = " << m_RegistrationCacheDirectory << std::endl;
 }
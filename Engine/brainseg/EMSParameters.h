@@ -38,12 +38,56 @@ public:
   itkGetMacro(DoAtlasWarp, bool);
   itkSetMacro(DoAtlasWarp, bool);
 
+  // Segment only within the padded bounding box of the registered
+  // foreground priors, outputs are restored to the full image
+  itkGetMacro(DoAtlasCrop, bool);
+  itkSetMacro(DoAtlasCrop, bool);
+
+  // Padding of the bounding box in mm
+  itkGetMacro(AtlasCropPadding, float);
+  itkSetMacro(AtlasCropPadding, float);
+
   itkGetMacro(OutputDirectory, std::string);
   itkSetMacro(OutputDirectory, std::string);
 
   itkGetMacro(OutputFormat, std::string);
   itkSetMacro(OutputFormat, std::string);
 
+  // Compression of each kind of output
+  itkGetMacro(CompressLabels, bool);
+  itkSetMacro(CompressLabels, bool);
+  itkGetMacro(CompressPosteriors, bool);
+  itkSetMacro(CompressPosteriors, bool);
+  itkGetMacro(CompressCorrected, bool);
+  itkSetMacro(CompressCorrected, bool);
+
+  // Affine template and registered images
+  itkGetMacro(CompressRegistered, bool);
+  itkSetMacro(CompressRegistered, bool);
+
+  // Warped template and displacement field
+  itkGetMacro(CompressWarpedTemplate, bool);
+  itkSetMacro(CompressWarpedTemplate, bool);
+  itkGetMacro(CompressDisplacement, bool);
+  itkSetMacro(CompressDisplacement, bool);
+
+  // "separate" for one file per class, or "combined" for all classes as the
+  // components of one vector image
+  itkGetMacro(PosteriorFormat, std::string);
+  itkSetMacro(PosteriorFormat, std::string);
+
+  // Bits per component of the combined posteriors, 8 or 16
+  itkGetMacro(PosteriorBits, unsigned int);
+  itkSetMacro(PosteriorBits, unsigned int);
+
+  // Append the labels as the last component of the combined posteriors
+  itkGetMacro(EmbedLabels, bool);
+  itkSetMacro(EmbedLabels, bool);
+
+  // Threads writing the outputs, zero to use the segmentation threads
+  itkGetMacro(OutputWriterThreads, unsigned int);
+  itkSetMacro(OutputWriterThreads, unsigned int);
+
   void AddImage(std::string s, std::string orientation);
   void ClearImages();
 
@@ -62,6 +106,10 @@ public:
   itkGetMacro(MaxBiasDegree, unsigned int);
   itkSetMacro(MaxBiasDegree, unsigned int);
 
+  // "polynomial" or "diffusion"
+  itkGetMacro(BiasCorrectionMethod, std::string);
+  itkSetMacro(BiasCorrectionMethod, std::string);
+
   itkGetMacro(AtlasWarpFluidIterations, unsigned int);
   itkSetMacro(AtlasWarpFluidIterations, unsigned int);
 
@@ -85,12 +133,24 @@ public:
   itkGetMacro(ImageLinearMapType, std::string);
   itkSetMacro(ImageLinearMapType, std::string);
 
+  // "centers" or "moments"
+  itkGetMacro(AffineInitialization, std::string);
+  itkSetMacro(AffineInitialization, std::string);
+
+  // "mi" or "hc"
+  itkGetMacro(AffineMetric, std::string);
+  itkSetMacro(AffineMetric, std::string);
+
   itkGetMacro(InitialDistributionEstimator, std::string);
   itkSetMacro(InitialDistributionEstimator, std::string);
 
   itkGetMacro(NumberOfThreads, unsigned int);
   itkSetMacro(NumberOfThreads, unsigned int);
 
+  // Shared directory of registration results, empty to disable
+  itkGetMacro(RegistrationCacheDirectory, std::string);
+  itkSetMacro(RegistrationCacheDirectory, std::string);
+
 protected:
 
   EMSParameters();
@@ -109,9 +169,25 @@ protected:
 
   float m_AtlasWarpKernelWidth;
 
+  bool m_DoAtlasCrop;
+  float m_AtlasCropPadding;
+
   std::string m_OutputDirectory;
   std::string m_OutputFormat;
 
+  bool m_CompressLabels;
+  bool m_CompressPosteriors;
+  bool m_CompressCorrected;
+  bool m_CompressRegistered;
+  bool m_CompressWarpedTemplate;
+  bool m_CompressDisplacement;
+
+  std::string m_PosteriorFormat;
+  unsigned int m_PosteriorBits;
+  bool m_EmbedLabels;
+
+  unsigned int m_OutputWriterThreads;
+
   DynArray<std::string> m_Images;
   DynArray<std::string> m_ImageOrientations;
 
@@ -121,14 +197,22 @@ protected:
 
   unsigned int m_MaxBiasDegree;
 
+  std::string m_BiasCorrectionMethod;
+
   std::vector<double> m_PriorWeights;
 
   std::string m_AtlasLinearMapType;
   std::string m_ImageLinearMapType;
 
+  std::string m_AffineInitialization;
+
+  std::string m_AffineMetric;
+
   std::string m_InitialDistributionEstimator;
 
   unsigned int m_NumberOfThreads;
+
+  std::string m_RegistrationCacheDirectory;
 };
 
 #endif
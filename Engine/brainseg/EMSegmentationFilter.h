@@ -99,6 +99,11 @@ public:
   itkSetMacro(MaxBiasDegree, unsigned int);
   itkGetMacro(MaxBiasDegree, unsigned int);
 
+  // Bias correction method, "polynomial" (LLSBiasCorrector) or "diffusion"
+  // (DiffusionBasedBiasCorrector)
+  itkSetMacro(BiasCorrectionMethod, std::string);
+  itkGetConstMacro(BiasCorrectionMethod, std::string);
+
   itkSetMacro(BiasLikelihoodTolerance, float);
   itkGetMacro(BiasLikelihoodTolerance, float);
 
@@ -187,6 +192,11 @@ protected:
 
   void CorrectBias(unsigned int degree);
 
+  // The corrected images share the voxels of the input images until they are
+  // first written, gives each its own buffer before writing (a copy of the
+  // input voxels if asked)
+  void SeparateCorrectedImages(bool copyVoxels);
+
   void EMLoop();
 
   void ComputeLabels();
@@ -230,6 +240,7 @@ private:
   float m_SampleSpacing;
 
   unsigned int m_MaxBiasDegree;
+  std::string m_BiasCorrectionMethod;
   float m_BiasLikelihoodTolerance;
   float m_LikelihoodTolerance;
   unsigned m_MaximumIterations;
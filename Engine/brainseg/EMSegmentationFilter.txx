@@ -34,6 +34,7 @@
 #include "vnl/vnl_math.h"
 
 #include "ConnectedComponentsFilter.h"
+#include "DiffusionBasedBiasCorrector.h"
 #include "LLSBiasCorrector.h"
 #include "Log.h"
 #include "MersenneTwisterRNG.h"
@@ -65,6 +66,7 @@ EMSegmentationFilter <TInputImage, TProbabilityImage>
 
   // Bias
   m_MaxBiasDegree = 4;
+  m_BiasCorrectionMethod = "polynomial";
   //m_BiasLikelihoodTolerance = 1e-2;
 // PP
   m_BiasLikelihoodTolerance = 2e-4;
@@ -164,17 +166,10 @@ EMSegmentationFilter <TInputImage, TProbabilityImage>
   for (unsigned i = 0; i < data.GetSize(); i++)
     m_InputImages.Append(data[i]);
 
-  // Allocate space for bias corrected input images
+  // No bias correction yet, copied when first corrected
   m_CorrectedImages.Clear();
   for (unsigned i = 0; i < data.GetSize(); i++)
-  {
-    typedef itk::ImageDuplicator<InputImageType> DuperType;
-    typename DuperType::Pointer dup = DuperType::New();
-    dup->SetInputImage(m_InputImages[i]);
-    dup->Update();
-
-    m_CorrectedImages.Append(dup->GetOutput());
-  }
+    m_CorrectedImages.Append(m_InputImages[i]);
 
   m_InputModified = true;
 
@@ -522,14 +517,7 @@ EMSegmentationFilter <TInputImage, TProbabilityImage>
     m_InputImages[i] = this->DownsampleImage(m_OriginalInputImages[i], factor);
 
   for (unsigned int i = 0; i < m_OriginalInputImages.GetSize(); i++)
-  {
-    typedef itk::ImageDuplicator<InputImageType> DuperType;
-    typename DuperType::Pointer dup = DuperType::New();
-    dup->SetInputImage(m_InputImages[i]);
-    dup->Update();
-
-    m_CorrectedImages[i] = dup->GetOutput();
-  }
+    m_CorrectedImages[i] = m_InputImages[i];
 
   for (unsigned int i = 0; i < m_OriginalPriors.GetSize(); i++)
     m_Priors[i] = this->DownsampleImage(m_OriginalPriors[i], factor);
@@ -1616,11 +1604,16 @@ EMSegmentationFilter <TInputImage, TProbabilityImage>
 ::CorrectBias(unsigned int degree)
 {
 
-  muLogMacro(<< "Bias correction, polynomial degree = " << degree << "\n");
-
   if (degree == 0)
     return;
 
+  bool useDiffusion = (m_BiasCorrectionMethod.compare("diffusion") == 0);
+
+  if (useDiffusion)
+    muLogMacro(<< "Bias correction, diffusion\n");
+  else
+    muLogMacro(<< "Bias correction, polynomial degree = " << degree << "\n");
+
   unsigned int numPriors = m_Priors.GetSize();
 
   unsigned int numFGClasses = 0;
@@ -1629,6 +1622,9 @@ EMSegmentationFilter <TInputImage, TProbabilityImage>
 
   unsigned int numClasses = numFGClasses + m_NumberOfGaussians[numPriors-1];
 
+  // The correctors overwrite all of the output voxels
+  this->SeparateCorrectedImages(false);
+
   // Perform bias correction
   DynArray<ProbabilityImagePointer> biasPosteriors;
   for (unsigned j = 0; j < numClasses-1; j++)
@@ -1637,6 +1633,31 @@ EMSegmentationFilter <TInputImage, TProbabilityImage>
   //for (unsigned j = 0; j < numFGClasses; j++)
     biasPosteriors.Append(m_Posteriors[j]);
 
+  if (useDiffusion)
+  {
+    typedef DiffusionBasedBiasCorrector<InputImageType, ProbabilityImageType>
+      DiffusionCorrectorType;
+
+    typename DiffusionCorrectorType::Pointer diffcorr =
+      DiffusionCorrectorType::New();
+
+    diffcorr->SetMultiplicative();
+    diffcorr->SetClampBias(true);
+    diffcorr->SetMaximumBiasMagnitude(4.0);
+
+    diffcorr->SetMask(m_Mask);
+    diffcorr->SetProbabilities(biasPosteriors);
+
+    if (this->GetDebug())
+      diffcorr->DebugOn();
+
+    diffcorr->CorrectImages(m_InputImages, m_CorrectedImages);
+
+    m_LogBiasFields = diffcorr->GetLogBiasFields();
+
+    return;
+  }
+
   typedef LLSBiasCorrector<InputImageType, ProbabilityImageType>
     BiasCorrectorType;
   typedef typename BiasCorrectorType::Pointer BiasCorrectorPointer;
@@ -2053,6 +2074,47 @@ EMSegmentationFilter <TInputImage, TProbabilityImage>
 
 }
 
+template <class TInputImage, class TProbabilityImage>
+void
+EMSegmentationFilter <TInputImage, TProbabilityImage>
+::SeparateCorrectedImages(bool copyVoxels)
+{
+  for (unsigned int i = 0; i < m_CorrectedImages.GetSize(); i++)
+  {
+    const void* buffer = m_CorrectedImages[i]->GetBufferPointer();
+
+    bool shared = false;
+    for (unsigned int j = 0; j < m_InputImages.GetSize(); j++)
+      if (m_InputImages[j]->GetBufferPointer() == buffer)
+        shared = true;
+    for (unsigned int j = 0; j < m_OriginalInputImages.GetSize(); j++)
+      if (m_OriginalInputImages[j]->GetBufferPointer() == buffer)
+        shared = true;
+
+    if (!shared)
+      continue;
+
+    if (copyVoxels)
+    {
+      typedef itk::ImageDuplicator<InputImageType> DuperType;
+      typename DuperType::Pointer dup = DuperType::New();
+      dup->SetInputImage(m_CorrectedImages[i]);
+      dup->Update();
+
+      m_CorrectedImages[i] = dup->GetOutput();
+    }
+    else
+    {
+      InputImagePointer img = InputImageType::New();
+      img->CopyInformation(m_CorrectedImages[i]);
+      img->SetRegions(m_CorrectedImages[i]->GetLargestPossibleRegion());
+      img->Allocate();
+
+      m_CorrectedImages[i] = img;
+    }
+  }
+}
+
 template <class TInputImage, class TProbabilityImage>
 void
 EMSegmentationFilter <TInputImage, TProbabilityImage>
@@ -2076,6 +2138,8 @@ EMSegmentationFilter <TInputImage, TProbabilityImage>
   InputImageSizeType size =
     m_InputImages[0]->GetLargestPossibleRegion().GetSize();
 
+  this->SeparateCorrectedImages(true);
+
   // Make sure all output corrected image intensities are within a "nice" range
   // defined in the brain regions
   for (unsigned int ichan = 0; ichan < numChannels; ichan++)
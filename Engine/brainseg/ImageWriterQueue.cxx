@@ -0,0 +1,186 @@
+
+#include "ImageWriterQueue.h"
+
+#include "itkImageIOFactory.h"
+
+#include "Log.h"
+
+ImageWriterQueue
+::ImageWriterQueue()
+{
+  m_NumberOfThreads = 0;
+
+  m_NextJob = 0;
+  m_NumberOfRunningJobs = 0;
+
+  m_Stopping = false;
+  m_IOFactoriesRegistered = false;
+
+  m_LogOwner = 0;
+
+  m_Threader = itk::MultiThreader::New();
+
+  m_JobQueued = itk::ConditionVariable::New();
+  m_JobDone = itk::ConditionVariable::New();
+}
+
+ImageWriterQueue
+::~ImageWriterQueue()
+{
+  this->Stop();
+
+  for (unsigned int i = 0; i < m_Jobs.GetSize(); i++)
+    delete m_Jobs[i];
+}
+
+void
+ImageWriterQueue
+::Enqueue(Job* job)
+{
+  // Register the image IO factories before the threads look them up, and
+  // send messages from the threads to the log of the queueing thread
+  if (!m_IOFactoriesRegistered)
+  {
+    itk::ImageIOFactory::CreateImageIO(
+      job->FileName.c_str(), itk::ImageIOFactory::WriteMode);
+    m_IOFactoriesRegistered = true;
+
+    m_LogOwner = mu::Log::GetInstance()->GetThreadOwner();
+  }
+
+  unsigned int numThreads = m_NumberOfThreads;
+  if (numThreads == 0)
+    numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  if (numThreads < 1)
+    numThreads = 1;
+
+  m_Mutex.Lock();
+
+  m_Jobs.Append(job);
+
+  // Add a thread unless the idle ones can take the job
+  unsigned int numWaiting = m_Jobs.GetSize() - m_NextJob;
+  bool addThread =
+    m_ThreadIDs.GetSize() < numThreads
+    &&
+    m_ThreadIDs.GetSize() < m_NumberOfRunningJobs + numWaiting;
+
+  m_JobQueued->Signal();
+
+  m_Mutex.Unlock();
+
+  if (addThread)
+    m_ThreadIDs.Append(
+      m_Threader->SpawnThread(&ImageWriterQueue::_writeThread, (void*)this));
+}
+
+void
+ImageWriterQueue
+::RunJob(Job* job)
+{
+  std::string err = "";
+
+  try
+  {
+    job->Run();
+  }
+  catch (itk::ExceptionObject& e)
+  {
+    err = e.GetDescription();
+  }
+  catch (std::exception& e)
+  {
+    err = e.what();
+  }
+
+  m_Mutex.Lock();
+  if (err.length() != 0)
+    m_Errors.Append(job->FileName + ": " + err);
+  m_NumberOfRunningJobs--;
+  m_JobDone->Broadcast();
+  m_Mutex.Unlock();
+
+  // Release the image as soon as it is written
+  delete job;
+}
+
+ITK_THREAD_RETURN_TYPE
+ImageWriterQueue
+::_writeThread(void* arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfoType;
+  ThreadInfoType* infoStruct = static_cast<ThreadInfoType*>(arg);
+
+  ImageWriterQueue* obj = static_cast<ImageWriterQueue*>(infoStruct->UserData);
+
+  unsigned long prevOwner =
+    mu::Log::GetInstance()->SetThreadOwner(obj->m_LogOwner);
+
+  while (true)
+  {
+    obj->m_Mutex.Lock();
+
+    while (obj->m_NextJob >= obj->m_Jobs.GetSize() && !obj->m_Stopping)
+      obj->m_JobQueued->Wait(&obj->m_Mutex);
+
+    if (obj->m_NextJob >= obj->m_Jobs.GetSize())
+    {
+      obj->m_Mutex.Unlock();
+      break;
+    }
+
+    unsigned int i = obj->m_NextJob++;
+    Job* job = obj->m_Jobs[i];
+    obj->m_Jobs[i] = 0;
+    obj->m_NumberOfRunningJobs++;
+
+    obj->m_Mutex.Unlock();
+
+    obj->RunJob(job);
+  }
+
+  mu::Log::GetInstance()->SetThreadOwner(prevOwner);
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+void
+ImageWriterQueue
+::Wait()
+{
+  m_Mutex.Lock();
+
+  while (m_NextJob < m_Jobs.GetSize() || m_NumberOfRunningJobs > 0)
+    m_JobDone->Wait(&m_Mutex);
+
+  DynArray<std::string> errors = m_Errors;
+  m_Errors.Clear();
+
+  m_Mutex.Unlock();
+
+  if (errors.GetSize() != 0)
+  {
+    std::string msg = "Error writing ";
+    for (unsigned int i = 0; i < errors.GetSize(); i++)
+    {
+      if (i != 0)
+        msg += "; ";
+      msg += errors[i];
+    }
+    itkExceptionMacro(<< msg);
+  }
+}
+
+void
+ImageWriterQueue
+::Stop()
+{
+  m_Mutex.Lock();
+  m_Stopping = true;
+  m_JobQueued->Broadcast();
+  m_Mutex.Unlock();
+
+  for (unsigned int t = 0; t < m_ThreadIDs.GetSize(); t++)
+    m_Threader->TerminateThread(m_ThreadIDs[t]);
+  m_ThreadIDs.Clear();
+}
@@ -0,0 +1,140 @@
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Writes images on background threads, so that several outputs are
+// compressed at once and writing overlaps with the computations that follow
+//
+// The queue writes a shallow copy of each image detached from its pipeline,
+// the voxels must not be modified after the image is queued. Wait() blocks
+// until everything queued has been written.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _ImageWriterQueue_h
+#define _ImageWriterQueue_h
+
+#include "itkConditionVariable.h"
+#include "itkImageFileWriter.h"
+#include "itkMultiThreader.h"
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkSimpleMutexLock.h"
+
+#include "DynArray.h"
+
+#include <string>
+
+class ImageWriterQueue: public itk::Object
+{
+
+public:
+
+  /** Standard class typedefs. */
+  typedef ImageWriterQueue Self;
+  typedef itk::Object Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(ImageWriterQueue, itk::Object);
+
+  // Writer threads, zero means the ITK global default
+  itkSetMacro(NumberOfThreads, unsigned int);
+  itkGetConstMacro(NumberOfThreads, unsigned int);
+
+  // Queues an image to be written to a file
+  template <class TImage>
+  void Write(const TImage* img, const std::string& fn, bool compress);
+
+  // Waits until all queued images are written, throws if any of them failed
+  void Wait();
+
+protected:
+
+  ImageWriterQueue();
+  ~ImageWriterQueue();
+
+  class Job
+  {
+  public:
+    Job(const std::string& fn, bool compress):
+      FileName(fn), UseCompression(compress) { }
+    virtual ~Job() { }
+    virtual void Run() = 0;
+
+    std::string FileName;
+    bool UseCompression;
+  };
+
+  template <class TImage>
+  class ImageJob: public Job
+  {
+  public:
+    ImageJob(typename TImage::Pointer img, const std::string& fn, bool compress):
+      Job(fn, compress), Image(img) { }
+
+    void Run()
+    {
+      typedef itk::ImageFileWriter<TImage> WriterType;
+      typename WriterType::Pointer writer = WriterType::New();
+      writer->SetInput(this->Image);
+      writer->SetFileName(this->FileName.c_str());
+      writer->SetUseCompression(this->UseCompression);
+      writer->Update();
+    }
+
+    typename TImage::Pointer Image;
+  };
+
+  void Enqueue(Job* job);
+
+  // Runs a job claimed by a writer thread and records any error
+  void RunJob(Job* job);
+
+  // Stops the writer threads once the queue is empty
+  void Stop();
+
+  static ITK_THREAD_RETURN_TYPE _writeThread(void* arg);
+
+private:
+  ImageWriterQueue(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  unsigned int m_NumberOfThreads;
+
+  DynArray<Job*> m_Jobs;
+  unsigned int m_NextJob;
+  unsigned int m_NumberOfRunningJobs;
+
+  DynArray<std::string> m_Errors;
+
+  bool m_Stopping;
+  bool m_IOFactoriesRegistered;
+
+  itk::MultiThreader::Pointer m_Threader;
+  DynArray<int> m_ThreadIDs;
+  unsigned long m_LogOwner;
+
+  // Guards the jobs, signalled when a job is queued or finished
+  itk::SimpleMutexLock m_Mutex;
+  itk::ConditionVariable::Pointer m_JobQueued;
+  itk::ConditionVariable::Pointer m_JobDone;
+
+};
+
+template <class TImage>
+void
+ImageWriterQueue
+::Write(const TImage* img, const std::string& fn, bool compress)
+{
+  // Share the voxels, but not the pipeline of the caller
+  typename TImage::Pointer copy = TImage::New();
+  copy->Graft(img);
+
+  this->Enqueue(new ImageJob<TImage>(copy, fn, compress));
+}
+
+#endif
@@ -0,0 +1,814 @@
+
+#include "SegmentationDaemon.h"
+
+#include "itkImageIOBase.h"
+#include "itkImageIOFactory.h"
+
+#include "itksys/Directory.hxx"
+#include "itksys/SystemTools.hxx"
+
+#include "BinIndexImage.h"
+#include "EMSParametersXMLFile.h"
+#include "Log.h"
+#include "MersenneTwisterRNG.h"
+#include "muFile.h"
+#include "runEMS.h"
+
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#include <stdlib.h>
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#define MU_GETPID _getpid
+#define MU_RMDIR _rmdir
+#else
+#include <unistd.h>
+#define MU_GETPID getpid
+#define MU_RMDIR rmdir
+#endif
+
+static std::string
+_hostName()
+{
+  char name[256];
+#if defined(_MSC_VER)
+  DWORD size = 256;
+  if (!GetComputerNameA(name, &size))
+    return std::string("localhost");
+#else
+  if (gethostname(name, 256) != 0)
+    return std::string("localhost");
+  name[255] = 0;
+#endif
+  return std::string(name);
+}
+
+// Sorted names of the job files in a directory
+static std::set<std::string>
+_listJobFiles(const std::string& dir)
+{
+  std::set<std::string> names;
+
+  itksys::Directory d;
+  if (!d.Load(dir.c_str()))
+    return names;
+
+  for (unsigned long i = 0; i < d.GetNumberOfFiles(); i++)
+  {
+    std::string name = d.GetFile(i);
+    if (itksys::SystemTools::GetFilenameLastExtension(name).compare(".xml")
+        == 0)
+      names.insert(name);
+  }
+
+  return names;
+}
+
+// Priority from the <n>- prefix of a job name
+static int
+_jobPriority(const std::string& name)
+{
+  std::string::size_type dash = name.find('-');
+  if (dash != std::string::npos && dash > 0
+      &&
+      name.find_first_not_of("0123456789") == dash)
+    return atoi(name.substr(0, dash).c_str());
+  return 0;
+}
+
+// Removes a directory only if it is empty
+static bool
+_removeEmptyDirectory(const std::string& dir)
+{
+  return MU_RMDIR(dir.c_str()) == 0;
+}
+
+SegmentationDaemon
+::SegmentationDaemon()
+{
+  m_SpoolDirectory = "";
+
+  std::ostringstream oss;
+  oss << _hostName() << "." << MU_GETPID();
+  m_WorkerID = oss.str();
+
+  m_NumberOfConcurrentJobs = 1;
+  m_NumberOfThreads = 0;
+
+  m_MaximumMemory = 0;
+
+  m_PollInterval = 2.0;
+
+  m_HeartbeatTimeout = 120.0;
+
+  m_PerJobOutputs = false;
+
+  m_ExitWhenIdle = false;
+
+  m_WriteMoreOutputs = true;
+
+  m_NumberOfQueuedJobs = 0;
+
+  m_RunningMemory = 0;
+  m_NumberOfRunningJobs = 0;
+
+  m_StopRequested = false;
+
+  m_HeartbeatCounter = 0;
+}
+
+void
+SegmentationDaemon
+::SetSpoolDirectory(const std::string& dir)
+{
+  m_SpoolDirectory = dir;
+  if (m_SpoolDirectory.length() != 0
+      &&
+      m_SpoolDirectory[m_SpoolDirectory.length()-1] != MU_DIR_SEPARATOR)
+    m_SpoolDirectory += MU_DIR_SEPARATOR;
+
+  this->Modified();
+}
+
+std::string
+SegmentationDaemon
+::GetJobFileName(const std::string& subdir, const std::string& name) const
+{
+  return m_SpoolDirectory + subdir + MU_DIR_SEPARATOR + name;
+}
+
+std::string
+SegmentationDaemon
+::GetWorkerDirectory(const std::string& worker) const
+{
+  return this->GetJobFileName("running", worker);
+}
+
+void
+SegmentationDaemon
+::CreateSpoolDirectories()
+{
+  const char* subdirs[] =
+    {"incoming", "running", "done", "failed", "status"};
+
+  for (unsigned int i = 0; i < 5; i++)
+  {
+    std::string dir = m_SpoolDirectory + subdirs[i];
+    if (!itksys::SystemTools::MakeDirectory(dir.c_str()))
+      muExceptionMacro(<< "Failed creating " << dir);
+  }
+
+  if (m_PerJobOutputs)
+  {
+    std::string dir = m_SpoolDirectory + "results";
+    if (!itksys::SystemTools::MakeDirectory(dir.c_str()))
+      muExceptionMacro(<< "Failed creating " << dir);
+  }
+}
+
+void
+SegmentationDaemon
+::WriteStatus(const std::string& name, const std::string& s)
+{
+  std::string fn = this->GetJobFileName("status",
+    itksys::SystemTools::GetFilenameWithoutLastExtension(name) + ".status");
+
+  // Job threads write status at the same time, localtime is not reentrant
+  time_t t = time(0);
+  struct tm local;
+#if defined(_MSC_VER)
+  localtime_s(&local, &t);
+#else
+  localtime_r(&t, &local);
+#endif
+  char timestr[64];
+  strftime(timestr, 64, "%Y-%m-%d %H:%M:%S", &local);
+
+  std::ofstream outfile(fn.c_str(), std::ios::out | std::ios::app);
+  outfile << timestr << " " << s << std::endl;
+}
+
+void
+SegmentationDaemon
+::_jobProgress(const char* stage, void* data)
+{
+  JobProgressType* progress = static_cast<JobProgressType*>(data);
+  progress->Daemon->WriteStatus(progress->Name, stage);
+}
+
+double
+SegmentationDaemon
+::EstimateJobMemory(EMSParameters* emsp)
+{
+  DynArray<std::string> images = emsp->GetImages();
+  if (images.GetSize() == 0)
+    return 0;
+
+  itk::ImageIOBase::Pointer io = itk::ImageIOFactory::CreateImageIO(
+    images[0].c_str(), itk::ImageIOFactory::ReadMode);
+  if (io.IsNull())
+    return 0;
+
+  double numVoxels = 1.0;
+  try
+  {
+    io->SetFileName(images[0].c_str());
+    io->ReadImageInformation();
+    for (unsigned int i = 0; i < io->GetNumberOfDimensions(); i++)
+      numVoxels *= io->GetDimensions(i);
+  }
+  catch (...)
+  {
+    return 0;
+  }
+
+  // Float images kept during registration and segmentation: the inputs with
+  // their filtered and bias corrected versions, priors with posteriors and
+  // their resampled versions, plus masks and temporaries
+  double numImages = images.GetSize();
+  double numPriors = emsp->GetPriorWeights().size();
+
+  double numFloats = 8.0*numImages + 6.0*numPriors + 16.0;
+  if (emsp->GetDoAtlasWarp())
+    numFloats += 12.0;
+
+  return numVoxels * numFloats * sizeof(float) / (1024.0 * 1024.0);
+}
+
+unsigned int
+SegmentationDaemon
+::ScanIncoming()
+{
+  std::set<std::string> names = _listJobFiles(m_SpoolDirectory + "incoming");
+
+  // Only the names are looked at, the parameters are read by whichever
+  // worker claims the job
+  m_QueueMutex.Lock();
+
+  // Jobs claimed by other workers are gone from incoming
+  std::map<std::string, JobType>::iterator it = m_Queue.begin();
+  while (it != m_Queue.end())
+  {
+    if (names.find(it->first) == names.end())
+      m_Queue.erase(it++);
+    else
+      ++it;
+  }
+
+  std::set<std::string>::const_iterator nameIt;
+  for (nameIt = names.begin(); nameIt != names.end(); ++nameIt)
+  {
+    if (m_Queue.find(*nameIt) != m_Queue.end())
+      continue;
+
+    JobType job;
+    job.Name = *nameIt;
+    job.Priority = _jobPriority(*nameIt);
+    job.Order = m_NumberOfQueuedJobs++;
+    job.Memory = -1.0;
+
+    m_Queue[*nameIt] = job;
+  }
+
+  m_QueueMutex.Unlock();
+
+  return names.size();
+}
+
+bool
+SegmentationDaemon
+::ClaimNextJob(JobType& job)
+{
+  std::string workerdir = this->GetWorkerDirectory(m_WorkerID);
+
+  while (true)
+  {
+    m_QueueMutex.Lock();
+
+    // Jobs put back for lack of memory wait until enough is free
+    std::map<std::string, JobType>::iterator best = m_Queue.end();
+    std::map<std::string, JobType>::iterator it;
+    for (it = m_Queue.begin(); it != m_Queue.end(); ++it)
+    {
+      const JobType& q = it->second;
+
+      if (q.Memory >= 0 && m_MaximumMemory > 0 && m_NumberOfRunningJobs > 0
+          &&
+          m_RunningMemory + q.Memory > m_MaximumMemory)
+        continue;
+
+      if (best == m_Queue.end()
+          ||
+          q.Priority > best->second.Priority
+          ||
+          (q.Priority == best->second.Priority
+           &&
+           q.Order < best->second.Order))
+        best = it;
+    }
+
+    if (best == m_Queue.end())
+    {
+      m_QueueMutex.Unlock();
+      return false;
+    }
+
+    job = best->second;
+    m_Queue.erase(best);
+
+    // Counted as running from here on, so that the worker does not stop for
+    // being idle while the job is moved and read
+    m_NumberOfRunningJobs++;
+
+    m_QueueMutex.Unlock();
+
+    // Only one worker succeeds in moving the file, the others move on to
+    // the next job. The rename may be slow on a shared spool directory, the
+    // other job threads keep using the queue meanwhile.
+    std::string fn = this->GetJobFileName("incoming", job.Name);
+    std::string runningfn = workerdir + MU_DIR_SEPARATOR + job.Name;
+    if (itksys::SystemTools::RenameFile(fn.c_str(), runningfn.c_str()))
+      return true;
+
+    m_QueueMutex.Lock();
+    m_NumberOfRunningJobs--;
+    m_QueueMutex.Unlock();
+  }
+}
+
+bool
+SegmentationDaemon
+::TakeNextJob(JobType& job)
+{
+  std::string workerdir = this->GetWorkerDirectory(m_WorkerID);
+
+  while (this->ClaimNextJob(job))
+  {
+    std::string runningfn = workerdir + MU_DIR_SEPARATOR + job.Name;
+
+    try
+    {
+      job.Parameters = readEMSParametersXML(runningfn.c_str());
+      if (job.Parameters.IsNull() || !job.Parameters->CheckValues())
+        muExceptionMacro(<< "Invalid segmentation parameter values");
+    }
+    catch (std::exception& e)
+    {
+      if (itksys::SystemTools::RenameFile(runningfn.c_str(),
+            this->GetJobFileName("failed", job.Name).c_str()))
+      {
+        muLogMacro(<< "Job " << job.Name << " FAILED: " << e.what() << "\n");
+        this->WriteStatus(job.Name, std::string("failed ") + e.what());
+      }
+
+      m_QueueMutex.Lock();
+      m_NumberOfRunningJobs--;
+      m_QueueMutex.Unlock();
+
+      continue;
+    }
+
+    job.Memory = EstimateJobMemory(job.Parameters);
+
+    m_QueueMutex.Lock();
+
+    // A job larger than the limit still runs when nothing else is running
+    bool fits =
+      m_MaximumMemory <= 0 || m_NumberOfRunningJobs == 1
+      ||
+      m_RunningMemory + job.Memory <= m_MaximumMemory;
+
+    if (fits)
+    {
+      m_RunningMemory += job.Memory;
+      m_QueueMutex.Unlock();
+      return true;
+    }
+
+    m_NumberOfRunningJobs--;
+
+    // Back to incoming for any worker with the memory to spare, this worker
+    // takes it again once its running jobs leave enough room
+    std::string fn = this->GetJobFileName("incoming", job.Name);
+    if (itksys::SystemTools::RenameFile(runningfn.c_str(), fn.c_str()))
+    {
+      job.Parameters = 0;
+      m_Queue[job.Name] = job;
+    }
+
+    m_QueueMutex.Unlock();
+  }
+
+  return false;
+}
+
+CompiledAtlas::Pointer
+SegmentationDaemon
+::GetAtlas(const std::string& dir)
+{
+  std::string atlasdir = dir;
+  if (atlasdir.length() != 0 && atlasdir[atlasdir.length()-1] != MU_DIR_SEPARATOR)
+    atlasdir += MU_DIR_SEPARATOR;
+
+  // Changes to the compiled atlas, the template or any prior trigger a
+  // reload
+  DynArray<std::string> atlasfns = CompiledAtlas::GetSourceFileNames(atlasdir);
+  atlasfns.Append(atlasdir + std::string(MU_COMPILED_ATLAS_NAME));
+
+  long mtime = 0;
+  for (unsigned int i = 0; i < atlasfns.GetSize(); i++)
+  {
+    long t = itksys::SystemTools::ModifiedTime(atlasfns[i].c_str());
+    if (t > mtime)
+      mtime = t;
+  }
+
+  // Loading holds the lock, jobs waiting for the same atlas need it anyway
+  m_AtlasMutex.Lock();
+
+  std::map<std::string, AtlasEntryType>::iterator it =
+    m_Atlases.find(atlasdir);
+  if (it != m_Atlases.end() && it->second.ModifiedTime == mtime)
+  {
+    CompiledAtlas::Pointer atlas = it->second.Atlas;
+    m_AtlasMutex.Unlock();
+    return atlas;
+  }
+
+  AtlasEntryType entry;
+  try
+  {
+    muLogMacro(<< "Loading atlas " << atlasdir << "\n");
+    entry.Atlas = CompiledAtlas::LoadDirectory(atlasdir);
+    entry.ModifiedTime = mtime;
+  }
+  catch (...)
+  {
+    m_AtlasMutex.Unlock();
+    throw;
+  }
+
+  // Jobs still using the old atlas keep their reference
+  m_Atlases[atlasdir] = entry;
+
+  m_AtlasMutex.Unlock();
+
+  return entry.Atlas;
+}
+
+void
+SegmentationDaemon
+::RunJob(JobType& job)
+{
+  std::string runningfn =
+    this->GetWorkerDirectory(m_WorkerID) + MU_DIR_SEPARATOR + job.Name;
+
+  if (m_PerJobOutputs)
+    job.Parameters->SetOutputDirectory(
+      this->GetJobFileName("results",
+        itksys::SystemTools::GetFilenameWithoutLastExtension(job.Name)));
+
+  this->WriteStatus(job.Name, std::string("started on ") + m_WorkerID);
+  muLogMacro(<< "Job " << job.Name << " started\n");
+
+  JobProgressType progress;
+  progress.Daemon = this;
+  progress.Name = job.Name;
+
+  std::string err = "";
+  try
+  {
+    CompiledAtlas::Pointer atlas =
+      this->GetAtlas(job.Parameters->GetAtlasDirectory());
+
+    runEMSWithAtlas(job.Parameters, this->GetDebug(), m_WriteMoreOutputs,
+      atlas, _jobProgress, &progress);
+  }
+  catch (itk::ExceptionObject& e)
+  {
+    std::ostringstream oss;
+    oss << e;
+    err = oss.str();
+  }
+  catch (std::exception& e)
+  {
+    err = e.what();
+  }
+  catch (std::string& s)
+  {
+    err = s;
+  }
+  catch (...)
+  {
+    err = "Unknown exception";
+  }
+
+  std::string subdir = "done";
+  if (err.length() != 0)
+    subdir = "failed";
+
+  // The job is no longer ours if this worker missed enough heartbeats
+  if (!itksys::SystemTools::RenameFile(runningfn.c_str(),
+        this->GetJobFileName(subdir, job.Name).c_str()))
+  {
+    muLogMacro(<< "WARNING: job " << job.Name
+      << " was reclaimed by another worker\n");
+  }
+  else if (err.length() != 0)
+  {
+    muLogMacro(<< "Job " << job.Name << " FAILED: " << err << "\n");
+    this->WriteStatus(job.Name, std::string("failed ") + err);
+  }
+  else
+  {
+    muLogMacro(<< "Job " << job.Name << " finished\n");
+    this->WriteStatus(job.Name, "finished");
+  }
+
+  // Parameters are not needed anymore, job records are copied by value
+  job.Parameters = 0;
+
+  m_QueueMutex.Lock();
+  m_RunningMemory -= job.Memory;
+  m_NumberOfRunningJobs--;
+  m_QueueMutex.Unlock();
+}
+
+void
+SegmentationDaemon
+::WriteHeartbeat()
+{
+  // Recreated if another worker took this worker for dead
+  std::string workerdir = this->GetWorkerDirectory(m_WorkerID);
+  itksys::SystemTools::MakeDirectory(workerdir.c_str());
+
+  std::string fn = workerdir + MU_DIR_SEPARATOR + "heartbeat";
+
+  std::ofstream outfile(fn.c_str(), std::ios::out | std::ios::trunc);
+  outfile << ++m_HeartbeatCounter << std::endl;
+}
+
+void
+SegmentationDaemon
+::RemoveHeartbeat()
+{
+  std::string workerdir = this->GetWorkerDirectory(m_WorkerID);
+  std::string fn = workerdir + MU_DIR_SEPARATOR + "heartbeat";
+
+  itksys::SystemTools::RemoveFile(fn.c_str());
+  _removeEmptyDirectory(workerdir);
+}
+
+void
+SegmentationDaemon
+::ReclaimWorkerJobs(const std::string& worker)
+{
+  std::string workerdir = this->GetWorkerDirectory(worker);
+  std::string heartbeatfn = workerdir + MU_DIR_SEPARATOR + "heartbeat";
+
+  // A worker taken for dead may still claim a job after the listing, the
+  // directory is never removed with a job in it. Give up after a few tries,
+  // a worker that keeps claiming jobs is alive and will write a heartbeat.
+  for (unsigned int attempt = 0; attempt < 3; attempt++)
+  {
+    std::set<std::string> names = _listJobFiles(workerdir);
+
+    std::set<std::string>::const_iterator it;
+    for (it = names.begin(); it != names.end(); ++it)
+    {
+      std::string fn = workerdir + MU_DIR_SEPARATOR + *it;
+      if (itksys::SystemTools::RenameFile(fn.c_str(),
+            this->GetJobFileName("incoming", *it).c_str()))
+      {
+        muLogMacro(<< "Job " << *it << " reclaimed from " << worker << "\n");
+        this->WriteStatus(*it, std::string("reclaimed from ") + worker);
+      }
+    }
+
+    itksys::SystemTools::RemoveFile(heartbeatfn.c_str());
+
+    if (_removeEmptyDirectory(workerdir)
+        ||
+        !itksys::SystemTools::FileIsDirectory(workerdir.c_str()))
+      break;
+  }
+}
+
+unsigned int
+SegmentationDaemon
+::ReclaimJobs()
+{
+  std::string dir = m_SpoolDirectory + "running";
+
+  itksys::Directory d;
+  if (!d.Load(dir.c_str()))
+    return 0;
+
+  time_t now = time(0);
+
+  unsigned int numRunning = 0;
+
+  for (unsigned long i = 0; i < d.GetNumberOfFiles(); i++)
+  {
+    std::string worker = d.GetFile(i);
+    if (worker.compare(".") == 0 || worker.compare("..") == 0
+        ||
+        worker.compare(m_WorkerID) == 0)
+      continue;
+
+    std::string workerdir = this->GetWorkerDirectory(worker);
+    if (!itksys::SystemTools::FileIsDirectory(workerdir.c_str()))
+      continue;
+
+    std::string contents = "";
+    {
+      std::string fn = workerdir + MU_DIR_SEPARATOR + "heartbeat";
+      std::ifstream infile(fn.c_str());
+      std::getline(infile, contents);
+    }
+
+    std::map<std::string, HeartbeatType>::iterator it =
+      m_Heartbeats.find(worker);
+    if (it == m_Heartbeats.end() || it->second.Contents.compare(contents) != 0)
+    {
+      HeartbeatType hb;
+      hb.Contents = contents;
+      hb.LastChange = now;
+      m_Heartbeats[worker] = hb;
+    }
+    else if (difftime(now, it->second.LastChange) > m_HeartbeatTimeout)
+    {
+      muLogMacro(<< "No heartbeat from " << worker << " for "
+        << difftime(now, it->second.LastChange) << " seconds\n");
+      this->ReclaimWorkerJobs(worker);
+      m_Heartbeats.erase(it);
+      continue;
+    }
+
+    numRunning += _listJobFiles(workerdir).size();
+  }
+
+  return numRunning;
+}
+
+// Thread zero scans the spool directory and writes the heartbeats, the
+// others run jobs
+ITK_THREAD_RETURN_TYPE
+SegmentationDaemon
+::_daemonThread(void* arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfoType;
+
+  ThreadInfoType* threadInfo = static_cast<ThreadInfoType*>(arg);
+  SegmentationDaemon* daemon =
+    static_cast<SegmentationDaemon*>(threadInfo->UserData);
+
+  unsigned int pollms = (unsigned int)(daemon->m_PollInterval * 1000.0);
+  if (pollms == 0)
+    pollms = 1;
+
+  if (threadInfo->ThreadID == 0)
+  {
+    std::string stopfn = daemon->m_SpoolDirectory + "stop";
+
+    while (true)
+    {
+      if (itksys::SystemTools::FileExists(stopfn.c_str()))
+      {
+        muLogMacro(<< "Stop requested, waiting for running jobs\n");
+        break;
+      }
+
+      unsigned int numIncoming = 0;
+      unsigned int numRunningElsewhere = 0;
+      try
+      {
+        daemon->WriteHeartbeat();
+        numIncoming = daemon->ScanIncoming();
+        numRunningElsewhere = daemon->ReclaimJobs();
+      }
+      catch (...)
+      {
+        // Scan again at the next poll
+        numIncoming = 1;
+      }
+
+      // Jobs of other workers may still come back to incoming
+      if (daemon->m_ExitWhenIdle && numIncoming == 0
+          &&
+          numRunningElsewhere == 0)
+      {
+        daemon->m_QueueMutex.Lock();
+        bool idle = (daemon->m_NumberOfRunningJobs == 0);
+        daemon->m_QueueMutex.Unlock();
+
+        if (idle)
+        {
+          muLogMacro(<< "No jobs left\n");
+          break;
+        }
+      }
+
+      itksys::SystemTools::Delay(pollms);
+    }
+
+    daemon->m_QueueMutex.Lock();
+    daemon->m_StopRequested = true;
+    daemon->m_QueueMutex.Unlock();
+
+    // Keep the heartbeat going until the running jobs finish
+    while (true)
+    {
+      daemon->m_QueueMutex.Lock();
+      unsigned int numRunning = daemon->m_NumberOfRunningJobs;
+      daemon->m_QueueMutex.Unlock();
+
+      if (numRunning == 0)
+        break;
+
+      daemon->WriteHeartbeat();
+      itksys::SystemTools::Delay(pollms);
+    }
+
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  while (true)
+  {
+    daemon->m_QueueMutex.Lock();
+    bool stop = daemon->m_StopRequested;
+    daemon->m_QueueMutex.Unlock();
+
+    if (stop)
+      break;
+
+    JobType job;
+    if (daemon->TakeNextJob(job))
+      daemon->RunJob(job);
+    else
+      itksys::SystemTools::Delay(pollms < 500 ? pollms : 500);
+  }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+void
+SegmentationDaemon
+::Run()
+{
+  if (m_SpoolDirectory.length() == 0)
+    muExceptionMacro(<< "No spool directory");
+
+  this->CreateSpoolDirectories();
+
+  unsigned int numThreads = m_NumberOfThreads;
+  if (numThreads == 0)
+    numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  unsigned int numJobs = m_NumberOfConcurrentJobs;
+  if (numJobs == 0)
+    numJobs = 1;
+
+  unsigned int threadsPerJob = numThreads / numJobs;
+  if (threadsPerJob == 0)
+    threadsPerJob = 1;
+
+  muLogMacro(<< "Segmentation worker " << m_WorkerID << " on "
+    << m_SpoolDirectory << ", " << numJobs << " jobs at a time with "
+    << threadsPerJob << " threads each\n");
+
+  // Jobs left by an earlier run with the same worker ID start over
+  this->ReclaimWorkerJobs(m_WorkerID);
+
+  m_StopRequested = false;
+  this->WriteHeartbeat();
+
+  // Filters created by each job use its share of the threads
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threadsPerJob);
+
+  // Jobs share the random number generators, seeded once
+  srand(542948474);
+  MersenneTwisterRNG* rng = MersenneTwisterRNG::GetGlobalInstance();
+  rng->Initialize(87584359);
+
+  // Shared caches and the image IO factories are set up here, before the
+  // jobs look them up concurrently, any file name registers the factories
+  BinIndexImageCache::GetGlobalInstance();
+  itk::ImageIOFactory::CreateImageIO("", itk::ImageIOFactory::ReadMode);
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads(numJobs + 1);
+  threader->SetSingleMethod(_daemonThread, this);
+  threader->SingleMethodExecute();
+
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads(numThreads);
+
+  this->RemoveHeartbeat();
+
+  muLogMacro(<< "Segmentation worker " << m_WorkerID << " stopped\n");
+}
@@ -0,0 +1,230 @@
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Long running segmentation service, keeps atlases loaded and runs jobs
+// submitted to a spool directory
+//
+// Jobs are segmentation parameter files (the usual XML format) moved into
+// <spool>/incoming. Any number of workers, on any hosts sharing the spool
+// directory, claim jobs by renaming them to running/<worker>/ and move them
+// to done/ or failed/ when finished. Jobs are picked by file name only, the
+// parameters are read by the worker that claimed the job, and a job too large
+// for the memory left on that worker goes back to incoming. The progress of
+// each job (started, registered, segmented, written, then finished or
+// failed) is appended to status/<job>.status, the segmentation log is
+// written to the output directory of the job.
+//
+// Each worker rewrites running/<worker>/heartbeat while alive, jobs of a
+// worker whose heartbeat has not changed for the heartbeat timeout (measured
+// by the clock of the observer, so host clocks need not agree) are moved
+// back to incoming.
+//
+// A job named <n>-<name>.xml has priority n (zero otherwise), higher
+// priorities start first. The workers stop after their running jobs finish
+// when a file named stop is created in the spool directory, it has to be
+// removed before starting them again.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _SegmentationDaemon_h
+#define _SegmentationDaemon_h
+
+#include "itkMultiThreader.h"
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkSimpleFastMutexLock.h"
+
+#include "CompiledAtlas.h"
+#include "DynArray.h"
+#include "EMSParameters.h"
+
+#include <ctime>
+#include <map>
+#include <string>
+
+class SegmentationDaemon: public itk::Object
+{
+
+public:
+
+  /** Standard class typedefs. */
+  typedef SegmentationDaemon Self;
+  typedef itk::Object Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(SegmentationDaemon, itk::Object);
+
+  void SetSpoolDirectory(const std::string& dir);
+  itkGetConstMacro(SpoolDirectory, std::string);
+
+  // Unique among the workers sharing the spool directory, host name and
+  // process ID by default
+  itkSetMacro(WorkerID, std::string);
+  itkGetConstMacro(WorkerID, std::string);
+
+  // Jobs running at once and the total number of threads split between them
+  // (zero means the ITK global default)
+  itkSetMacro(NumberOfConcurrentJobs, unsigned int);
+  itkGetConstMacro(NumberOfConcurrentJobs, unsigned int);
+  itkSetMacro(NumberOfThreads, unsigned int);
+  itkGetConstMacro(NumberOfThreads, unsigned int);
+
+  // Limit on the estimated memory of the running jobs in megabytes, a job
+  // larger than the limit still runs when nothing else is running, zero
+  // means no limit
+  itkSetMacro(MaximumMemory, double);
+  itkGetConstMacro(MaximumMemory, double);
+
+  // Seconds between scans of the incoming directory and heartbeats
+  itkSetMacro(PollInterval, double);
+  itkGetConstMacro(PollInterval, double);
+
+  // Seconds without a heartbeat before the jobs of a worker are reclaimed
+  itkSetMacro(HeartbeatTimeout, double);
+  itkGetConstMacro(HeartbeatTimeout, double);
+
+  // Write the results of each job to <spool>/results/<job>/ instead of the
+  // output directory in its parameters
+  itkSetMacro(PerJobOutputs, bool);
+  itkGetConstMacro(PerJobOutputs, bool);
+  itkBooleanMacro(PerJobOutputs);
+
+  // Stop when there are no jobs left instead of waiting for more
+  itkSetMacro(ExitWhenIdle, bool);
+  itkGetConstMacro(ExitWhenIdle, bool);
+  itkBooleanMacro(ExitWhenIdle);
+
+  itkSetMacro(WriteMoreOutputs, bool);
+  itkGetConstMacro(WriteMoreOutputs, bool);
+  itkBooleanMacro(WriteMoreOutputs);
+
+  // Process jobs until stopped
+  void Run();
+
+  // Rough estimate of the memory needed to segment a subject, in megabytes
+  static double EstimateJobMemory(EMSParameters* emsp);
+
+protected:
+
+  SegmentationDaemon();
+  ~SegmentationDaemon() { }
+
+  // Parameters are read and the memory is estimated once the job is claimed,
+  // the memory is negative until then
+  struct JobType
+  {
+    std::string Name;
+    int Priority;
+    unsigned long Order;
+    double Memory;
+    EMSParameters::Pointer Parameters;
+  };
+
+  struct AtlasEntryType
+  {
+    CompiledAtlas::Pointer Atlas;
+    long ModifiedTime;
+  };
+
+  struct HeartbeatType
+  {
+    std::string Contents;
+    time_t LastChange;
+  };
+
+  void CreateSpoolDirectories();
+
+  // Updates the list of unclaimed jobs from the incoming directory, returns
+  // the number of jobs found
+  unsigned int ScanIncoming();
+
+  // Claims the highest priority job that fits in memory and reads its
+  // parameters, returns false if there is none
+  bool TakeNextJob(JobType& job);
+
+  // Claims the highest priority job not known to exceed the memory limit
+  bool ClaimNextJob(JobType& job);
+
+  void RunJob(JobType& job);
+
+  void WriteHeartbeat();
+  void RemoveHeartbeat();
+
+  // Moves the jobs of workers without heartbeats back to incoming, returns
+  // the number of jobs still running on other workers
+  unsigned int ReclaimJobs();
+
+  // The directory of the worker is only removed once empty, so a job the
+  // worker claims meanwhile is either moved back too or stays in place
+  void ReclaimWorkerJobs(const std::string& worker);
+
+  // Loaded atlas for a directory, reloaded when the atlas files change
+  CompiledAtlas::Pointer GetAtlas(const std::string& atlasdir);
+
+  void WriteStatus(const std::string& name, const std::string& s);
+
+  // Progress of a running job, appended to its status file
+  struct JobProgressType
+  {
+    SegmentationDaemon* Daemon;
+    std::string Name;
+  };
+
+  static void _jobProgress(const char* stage, void* data);
+
+  std::string GetJobFileName(const std::string& subdir,
+    const std::string& name) const;
+  std::string GetWorkerDirectory(const std::string& worker) const;
+
+  static ITK_THREAD_RETURN_TYPE _daemonThread(void* arg);
+
+private:
+  SegmentationDaemon(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  std::string m_SpoolDirectory;
+
+  std::string m_WorkerID;
+
+  unsigned int m_NumberOfConcurrentJobs;
+  unsigned int m_NumberOfThreads;
+
+  double m_MaximumMemory;
+
+  double m_PollInterval;
+
+  double m_HeartbeatTimeout;
+
+  bool m_PerJobOutputs;
+
+  bool m_ExitWhenIdle;
+
+  bool m_WriteMoreOutputs;
+
+  // Unclaimed jobs by name, updated by the scanning thread
+  std::map<std::string, JobType> m_Queue;
+  unsigned long m_NumberOfQueuedJobs;
+
+  double m_RunningMemory;
+  unsigned int m_NumberOfRunningJobs;
+
+  bool m_StopRequested;
+
+  itk::SimpleFastMutexLock m_QueueMutex;
+
+  unsigned long m_HeartbeatCounter;
+
+  // Last heartbeat seen from the other workers
+  std::map<std::string, HeartbeatType> m_Heartbeats;
+
+  std::map<std::string, AtlasEntryType> m_Atlases;
+  itk::SimpleFastMutexLock m_AtlasMutex;
+
+};
+
+#endif
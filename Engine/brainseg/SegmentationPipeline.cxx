@@ -0,0 +1,425 @@
+
+#include "itkRescaleIntensityImageFilter.h"
+
+#include "Log.h"
+#include "muFile.h"
+
+// Use manually instantiated classes for the big program chunks
+#define MU_MANUAL_INSTANTIATION
+#include "EMSegmentationFilter.h"
+#include "AtlasRegistrationMethod.h"
+#undef MU_MANUAL_INSTANTIATION
+
+#include "SegmentationPipeline.h"
+
+SegmentationPipeline
+::SegmentationPipeline()
+{
+  m_Parameters = 0;
+
+  m_Atlas = 0;
+
+  m_TransformDirectory = "";
+
+  m_NumberOfConcurrentRegistrations = 0;
+
+  m_RestoreCorrectedImages = true;
+
+  m_Registered = false;
+}
+
+SegmentationPipeline
+::~SegmentationPipeline()
+{
+
+}
+
+void
+SegmentationPipeline
+::SetParameters(EMSParameters* params)
+{
+  m_Parameters = params;
+  m_Registered = false;
+  this->Modified();
+}
+
+void
+SegmentationPipeline
+::SetInputImages(const DynArray<FloatImagePointer>& images)
+{
+  m_InputImages = images;
+  m_Registered = false;
+  this->Modified();
+}
+
+void
+SegmentationPipeline
+::SetAtlas(CompiledAtlas* atlas)
+{
+  m_Atlas = atlas;
+  m_Registered = false;
+  this->Modified();
+}
+
+void
+SegmentationPipeline
+::Register()
+{
+  if (m_Parameters.IsNull())
+    itkExceptionMacro(<< "No segmentation parameters");
+
+  if (m_InputImages.GetSize() == 0 && m_Parameters->GetImages().GetSize() == 0)
+    itkExceptionMacro(<< "No input images");
+
+  if (m_Atlas.IsNull() && m_Parameters->GetAtlasDirectory().length() == 0)
+    itkExceptionMacro(<< "No atlas");
+
+  typedef AtlasRegistrationMethod<float, float> AtlasRegType;
+  AtlasRegType::Pointer atlasreg = AtlasRegType::New();
+
+  if (this->GetDebug())
+    atlasreg->DebugOn();
+
+  atlasreg->SetPrefilteringMethod(m_Parameters->GetFilterMethod().c_str());
+  atlasreg->SetPrefilteringIterations(m_Parameters->GetFilterIterations());
+  atlasreg->SetPrefilteringTimeStep(m_Parameters->GetFilterTimeStep());
+
+  atlasreg->SetSuffix(m_Parameters->GetSuffix());
+
+  atlasreg->SetAtlasOrientation(m_Parameters->GetAtlasOrientation());
+
+  if (m_InputImages.GetSize() != 0)
+  {
+    DynArray<std::string> orients;
+    orients.Initialize(m_InputImages.GetSize(), std::string("file"));
+
+    atlasreg->SetInputImages(m_InputImages);
+    atlasreg->SetImageOrientations(orients);
+  }
+  else
+  {
+    atlasreg->SetImageFileNames(m_Parameters->GetImages());
+    atlasreg->SetImageOrientations(m_Parameters->GetImageOrientations());
+  }
+
+  std::string transformdir = m_TransformDirectory;
+  if (transformdir.length() != 0
+      &&
+      transformdir[transformdir.size()-1] != MU_DIR_SEPARATOR)
+    transformdir += MU_DIR_SEPARATOR;
+  atlasreg->SetOutputDirectory(transformdir);
+
+  atlasreg->SetRegistrationCacheDirectory(
+    m_Parameters->GetRegistrationCacheDirectory());
+
+  std::string atlasmapstr = m_Parameters->GetAtlasLinearMapType();
+  if (atlasmapstr.compare("id") == 0)
+    atlasreg->SetAtlasLinearTransformChoice(AtlasRegType::ID_TRANSFORM);
+  if (atlasmapstr.compare("rigid") == 0)
+    atlasreg->SetAtlasLinearTransformChoice(AtlasRegType::RIGID_TRANSFORM);
+
+  std::string imagemapstr = m_Parameters->GetImageLinearMapType();
+  if (imagemapstr.compare("id") == 0)
+    atlasreg->SetImageLinearTransformChoice(AtlasRegType::ID_TRANSFORM);
+  if (imagemapstr.compare("rigid") == 0)
+    atlasreg->SetImageLinearTransformChoice(AtlasRegType::RIGID_TRANSFORM);
+
+  if (m_Parameters->GetAffineInitialization().compare("moments") == 0)
+    atlasreg->MomentInitializationOn();
+  else
+    atlasreg->MomentInitializationOff();
+
+  if (m_Parameters->GetAffineMetric().compare("hc") == 0)
+    atlasreg->HCMetricOn();
+  else
+    atlasreg->HCMetricOff();
+
+  // Directory with the template and priors (template.mha, 1.mha, ... 99.mha),
+  // also names the template transform file when using a compiled atlas
+  std::string atlasdir = m_Parameters->GetAtlasDirectory();
+  if (atlasdir.length() != 0)
+  {
+    if (atlasdir[atlasdir.size()-1] != MU_DIR_SEPARATOR)
+      atlasdir += MU_DIR_SEPARATOR;
+    atlasreg->SetAtlasDirectory(atlasdir);
+  }
+
+  if (!m_Atlas.IsNull())
+    atlasreg->SetCompiledAtlas(m_Atlas);
+
+  atlasreg->SetNumberOfConcurrentRegistrations(
+    m_NumberOfConcurrentRegistrations);
+
+  if (transformdir.length() != 0)
+  {
+    muLogMacro(<< "Attempting to read previous registration results..."
+      << std::endl);
+    atlasreg->ReadParameters();
+  }
+
+  muLogMacro(<< "Registering and resampling images..." << std::endl);
+  atlasreg->Update();
+
+  if (transformdir.length() != 0)
+    atlasreg->WriteParameters();
+
+  m_FOVMask = atlasreg->GetFOVMask();
+
+  m_RegisteredImages = atlasreg->GetImages();
+  m_RegisteredPriors = atlasreg->GetProbabilities();
+
+  m_AffineTemplate = atlasreg->GetAffineTemplate();
+
+  m_TemplateAffineTransform = atlasreg->GetTemplateAffineTransform();
+  m_AffineTransforms = atlasreg->GetAffineTransforms();
+
+  m_SegmentationFilter = 0;
+  m_Cropper = 0;
+  m_UncroppedImages.Clear();
+
+  m_Registered = true;
+}
+
+void
+SegmentationPipeline
+::Segment()
+{
+  if (!m_Registered)
+    this->Register();
+
+  // The registration results are handed over to the segmentation
+  DynArray<FloatImagePointer> images = m_RegisteredImages;
+  DynArray<FloatImagePointer> priors = m_RegisteredPriors;
+  FloatImagePointer templateImg = m_AffineTemplate;
+  ByteImagePointer fovmask = m_FOVMask;
+
+  m_RegisteredImages.Clear();
+  m_RegisteredPriors.Clear();
+  m_FOVMask = 0;
+  m_Registered = false;
+
+  muLogMacro(<< "Rescale intensity of filtered images...\n");
+  {
+    typedef itk::RescaleIntensityImageFilter<FloatImageType, FloatImageType>
+      RescaleType;
+    RescaleType::Pointer rescaler = RescaleType::New();
+    rescaler->SetOutputMinimum(1);
+    rescaler->SetOutputMaximum(4096);
+
+    FloatImageType::SizeType size =
+      images[0]->GetLargestPossibleRegion().GetSize();
+    FloatImageType::IndexType ind;
+
+    for (unsigned int i = 0; i < images.GetSize(); i++)
+    {
+      FloatImagePointer tmp = images[i];
+
+      rescaler->SetInput(tmp);
+      rescaler->Update();
+
+      FloatImagePointer rImg = rescaler->GetOutput();
+      for (ind[2] = 0; ind[2] < (long)size[2]; ind[2]++)
+        for (ind[1] = 0; ind[1] < (long)size[1]; ind[1]++)
+          for (ind[0] = 0; ind[0] < (long)size[0]; ind[0]++)
+          {
+            tmp->SetPixel(ind, rImg->GetPixel(ind));
+          }
+    }
+  }
+
+  // Segment only the padded bounding box of the foreground priors, the
+  // background prior covers the whole image and is left out
+  m_Cropper = 0;
+  m_UncroppedImages.Clear();
+
+  if (m_Parameters->GetDoAtlasCrop() && priors.GetSize() > 1)
+  {
+    muLogMacro(<< "Cropping to atlas bounding box...\n");
+
+    DynArray<FloatImagePointer> fgPriors;
+    for (unsigned int i = 0; i < (priors.GetSize()-1); i++)
+      fgPriors.Append(priors[i]);
+
+    m_Cropper = CropperType::New();
+    m_Cropper->SetPadding(m_Parameters->GetAtlasCropPadding());
+    m_Cropper->UseProbabilities(fgPriors);
+
+    CropperType::CropInfoType info = m_Cropper->GetCropInfo();
+    muLogMacro(<< "Crop region " << info.cropped_size[0] << "x"
+      << info.cropped_size[1] << "x" << info.cropped_size[2] << " at "
+      << info.offset << ", "
+      << (int)(100.0*m_Cropper->GetCroppedFraction() + 0.5)
+      << "% of the image\n");
+
+    // The corrected images are filled in with the rescaled intensities
+    if (m_RestoreCorrectedImages)
+      m_UncroppedImages = images;
+
+    for (unsigned int i = 0; i < images.GetSize(); i++)
+      images[i] = m_Cropper->Crop(images[i]);
+    for (unsigned int i = 0; i < priors.GetSize(); i++)
+      priors[i] = m_Cropper->Crop(priors[i]);
+
+    templateImg = m_Cropper->Crop(templateImg);
+
+    if (!fovmask.IsNull())
+      fovmask = m_Cropper->CropImage<ByteImageType>(fovmask);
+  }
+
+  muLogMacro(<< "Start segmentation...\n");
+  m_SegmentationFilter = SegFilterType::New();
+
+  if (this->GetDebug())
+    m_SegmentationFilter->DebugOn();
+
+  m_SegmentationFilter->SetTemplateImage(templateImg);
+
+  m_SegmentationFilter->SetInputImages(images);
+  m_SegmentationFilter->SetPriors(priors);
+
+  m_SegmentationFilter->SetFOVMask(fovmask);
+
+  std::vector<double> prWeights = m_Parameters->GetPriorWeights();
+  SegFilterType::VectorType prWeightsVec(prWeights.size());
+  for (unsigned int i = 0; i < prWeights.size(); i++)
+    prWeightsVec[i] = prWeights[i];
+  m_SegmentationFilter->SetPriorWeights(prWeightsVec);
+
+  m_SegmentationFilter->SetMaxBiasDegree(m_Parameters->GetMaxBiasDegree());
+  m_SegmentationFilter->SetBiasCorrectionMethod(
+    m_Parameters->GetBiasCorrectionMethod());
+
+  m_SegmentationFilter->SetInitialDistributionEstimator(
+    m_Parameters->GetInitialDistributionEstimator());
+
+  if (m_Parameters->GetDoAtlasWarp())
+    m_SegmentationFilter->WarpingOn();
+  else
+    m_SegmentationFilter->WarpingOff();
+  m_SegmentationFilter->SetWarpFluidIterations(
+    m_Parameters->GetAtlasWarpFluidIterations());
+  m_SegmentationFilter->SetWarpFluidMaxStep(
+    m_Parameters->GetAtlasWarpFluidMaxStep());
+  m_SegmentationFilter->SetWarpFluidKernelWidth(
+    m_Parameters->GetAtlasWarpKernelWidth());
+  m_SegmentationFilter->Update();
+}
+
+void
+SegmentationPipeline
+::CheckSegmented()
+{
+  if (m_SegmentationFilter.IsNull())
+    itkExceptionMacro(<< "Segmentation has not been run");
+}
+
+SegmentationPipeline::ShortImagePointer
+SegmentationPipeline
+::GetLabels()
+{
+  this->CheckSegmented();
+
+  ShortImagePointer labels = m_SegmentationFilter->GetOutput();
+  if (!m_Cropper.IsNull())
+    labels = m_Cropper->RestoreImage<ShortImageType>(labels);
+
+  return labels;
+}
+
+unsigned int
+SegmentationPipeline
+::GetNumberOfPosteriors()
+{
+  this->CheckSegmented();
+
+  // The last three classes are the Gaussians of the background
+  return m_SegmentationFilter->GetPosteriors().GetSize() - 3;
+}
+
+SegmentationPipeline::FloatImagePointer
+SegmentationPipeline
+::GetPosterior(unsigned int i)
+{
+  if (i >= this->GetNumberOfPosteriors())
+    itkExceptionMacro(<< "Posterior index out of range");
+
+  FloatImagePointer post = m_SegmentationFilter->GetPosteriors()[i];
+  if (!m_Cropper.IsNull())
+    post = m_Cropper->Restore(post);
+
+  return post;
+}
+
+DynArray<SegmentationPipeline::ShortImagePointer>
+SegmentationPipeline
+::GetShortPosteriors()
+{
+  unsigned int numPosteriors = this->GetNumberOfPosteriors();
+
+  DynArray<ShortImagePointer> probset =
+    m_SegmentationFilter->GetShortPosteriors();
+
+  DynArray<ShortImagePointer> posts;
+  for (unsigned int i = 0; i < numPosteriors; i++)
+  {
+    if (!m_Cropper.IsNull())
+      posts.Append(m_Cropper->RestoreImage<ShortImageType>(probset[i]));
+    else
+      posts.Append(probset[i]);
+  }
+
+  return posts;
+}
+
+DynArray<SegmentationPipeline::FloatImagePointer>
+SegmentationPipeline
+::GetCorrectedImages()
+{
+  this->CheckSegmented();
+
+  DynArray<FloatImagePointer> imgset = m_SegmentationFilter->GetCorrected();
+  if (!m_Cropper.IsNull())
+    for (unsigned int i = 0; i < imgset.GetSize(); i++)
+    {
+      FloatImagePointer original = 0;
+      if (i < m_UncroppedImages.GetSize())
+        original = m_UncroppedImages[i];
+      imgset[i] = m_Cropper->RestoreImage<FloatImageType>(imgset[i], original);
+    }
+
+  return imgset;
+}
+
+SegmentationPipeline::FloatImagePointer
+SegmentationPipeline
+::GetWarpedTemplate()
+{
+  this->CheckSegmented();
+
+  if (!m_Parameters->GetDoAtlasWarp())
+    return 0;
+
+  FloatImagePointer warpedTemplate =
+    m_SegmentationFilter->GetWarpedTemplateImage();
+  if (!m_Cropper.IsNull())
+    warpedTemplate = m_Cropper->Restore(warpedTemplate);
+
+  return warpedTemplate;
+}
+
+SegmentationPipeline::VectorFieldPointer
+SegmentationPipeline
+::GetDisplacementField()
+{
+  this->CheckSegmented();
+
+  if (!m_Parameters->GetDoAtlasWarp())
+    return 0;
+
+  VectorFieldPointer velocity =
+    m_SegmentationFilter->GetTemplateFluidVelocity();
+  if (!m_Cropper.IsNull())
+    velocity = m_Cropper->RestoreImage<VectorFieldType>(velocity);
+
+  return velocity;
+}
@@ -0,0 +1,176 @@
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Registration and segmentation of one subject with the inputs and outputs
+// in memory, the part of runEMS that programs linking the ABC library use
+// directly
+//
+// The inputs are either images or the image files named in the parameters,
+// the atlas either a compiled atlas or the atlas directory of the
+// parameters. Nothing is written unless a transform directory is set or the
+// parameters name a registration cache directory. Outputs are in the space
+// of the first input image, restored to the full image if the segmentation
+// was cropped to the atlas.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _SegmentationPipeline_h
+#define _SegmentationPipeline_h
+
+#include "itkImage.h"
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkVector.h"
+
+#include "AtlasCropImageSource.h"
+#include "ChainedAffineTransform3D.h"
+#include "CompiledAtlas.h"
+#include "DynArray.h"
+#include "EMSParameters.h"
+
+#include <string>
+
+template <class TInputImage, class TProbabilityImage>
+class EMSegmentationFilter;
+
+class SegmentationPipeline: public itk::Object
+{
+
+public:
+
+  /** Standard class typedefs. */
+  typedef SegmentationPipeline Self;
+  typedef itk::Object Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(SegmentationPipeline, itk::Object);
+
+  typedef itk::Image<float, 3> FloatImageType;
+  typedef FloatImageType::Pointer FloatImagePointer;
+
+  typedef itk::Image<unsigned char, 3> ByteImageType;
+  typedef ByteImageType::Pointer ByteImagePointer;
+
+  typedef itk::Image<short, 3> ShortImageType;
+  typedef ShortImageType::Pointer ShortImagePointer;
+
+  typedef itk::Image<itk::Vector<float, 3>, 3> VectorFieldType;
+  typedef VectorFieldType::Pointer VectorFieldPointer;
+
+  typedef ChainedAffineTransform3D AffineTransformType;
+  typedef AffineTransformType::Pointer AffineTransformPointer;
+
+  typedef EMSegmentationFilter<FloatImageType, FloatImageType> SegFilterType;
+
+  typedef AtlasCropImageSource<FloatImageType, FloatImageType> CropperType;
+
+  // Registration and segmentation settings, the output directory, format
+  // and compression are not used
+  void SetParameters(EMSParameters* params);
+
+  // Input images used instead of the image files of the parameters, with
+  // the orientations of their image directions, they are not modified
+  void SetInputImages(const DynArray<FloatImagePointer>& images);
+
+  // Atlas used instead of the atlas directory of the parameters, may be
+  // shared with other pipelines running at the same time
+  void SetAtlas(CompiledAtlas* atlas);
+
+  // Directory where previous affine transforms are read from and new ones
+  // written, named after the image files, empty (the default) for neither
+  itkSetMacro(TransformDirectory, std::string);
+  itkGetConstMacro(TransformDirectory, std::string);
+
+  // Pairwise registrations run at once, zero runs all of them at once
+  itkSetMacro(NumberOfConcurrentRegistrations, unsigned int);
+  itkGetConstMacro(NumberOfConcurrentRegistrations, unsigned int);
+
+  // Fill the corrected images outside of the atlas crop region with the
+  // input intensities, keeps the full size images during the segmentation
+  itkSetMacro(RestoreCorrectedImages, bool);
+  itkGetConstMacro(RestoreCorrectedImages, bool);
+  itkBooleanMacro(RestoreCorrectedImages);
+
+  // Registers the atlas and the images to the first image
+  void Register();
+
+  // Segments the registered images, registers them first if needed
+  void Segment();
+
+  void Update() { this->Segment(); }
+
+  // Registration results, the registered images are handed over to
+  // Segment(), which rescales their intensities in place
+  FloatImagePointer GetAffineTemplate() const { return m_AffineTemplate; }
+  DynArray<FloatImagePointer> GetRegisteredImages() const
+  { return m_RegisteredImages; }
+
+  AffineTransformPointer GetTemplateAffineTransform() const
+  { return m_TemplateAffineTransform; }
+
+  // Transforms of the images to the first image, the first is the identity
+  DynArray<AffineTransformPointer> GetAffineTransforms() const
+  { return m_AffineTransforms; }
+
+  ShortImagePointer GetLabels();
+
+  // Posteriors of the atlas classes, the background classes are left out
+  unsigned int GetNumberOfPosteriors();
+  FloatImagePointer GetPosterior(unsigned int i);
+
+  // Posteriors scaled to the range of short
+  DynArray<ShortImagePointer> GetShortPosteriors();
+
+  // Bias corrected images, with the rescaled intensities
+  DynArray<FloatImagePointer> GetCorrectedImages();
+
+  // Outputs of the atlas warping, NULL without warping
+  FloatImagePointer GetWarpedTemplate();
+  VectorFieldPointer GetDisplacementField();
+
+protected:
+
+  SegmentationPipeline();
+  ~SegmentationPipeline();
+
+  void CheckSegmented();
+
+private:
+  SegmentationPipeline(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  EMSParameters::Pointer m_Parameters;
+
+  DynArray<FloatImagePointer> m_InputImages;
+
+  CompiledAtlas::Pointer m_Atlas;
+
+  std::string m_TransformDirectory;
+
+  unsigned int m_NumberOfConcurrentRegistrations;
+
+  bool m_RestoreCorrectedImages;
+
+  bool m_Registered;
+
+  FloatImagePointer m_AffineTemplate;
+  DynArray<FloatImagePointer> m_RegisteredImages;
+  DynArray<FloatImagePointer> m_RegisteredPriors;
+  ByteImagePointer m_FOVMask;
+
+  AffineTransformPointer m_TemplateAffineTransform;
+  DynArray<AffineTransformPointer> m_AffineTransforms;
+
+  itk::SmartPointer<SegFilterType> m_SegmentationFilter;
+
+  CropperType::Pointer m_Cropper;
+  DynArray<FloatImagePointer> m_UncroppedImages;
+
+};
+
+#endif
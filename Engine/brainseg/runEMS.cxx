@@ -1,18 +1,24 @@
 
 #include "itkCastImageFilter.h"
 #include "itkImage.h"
+#include "itkImageIOFactory.h"
 #include "itkImageFileWriter.h"
 #include "itkLinearInterpolateImageFunction.h"
 #include "itkMultiThreader.h"
 #include "itkNumericTraits.h"
 #include "itkRescaleIntensityImageFilter.h"
+#include "itkSimpleFastMutexLock.h"
+#include "itkVectorImage.h"
 #include "itkVersion.h"
 
 #include "itksys/SystemTools.hxx"
 
 #include "EMSParameters.h"
 #include "EMSParametersXMLFile.h"
+#include "ImageWriterQueue.h"
 
+#include "BinIndexImage.h"
+#include "CompiledAtlas.h"
 #include "DynArray.h"
 #include "Log.h"
 #include "MersenneTwisterRNG.h"
@@ -20,19 +26,16 @@
 
 #include "muFile.h"
 
-// Use manually instantiated classes for the big program chunks
-#define MU_MANUAL_INSTANTIATION
-#include "EMSegmentationFilter.h"
-#include "AtlasRegistrationMethod.h"
-#include "PairRegistrationMethod.h"
-#undef MU_MANUAL_INSTANTIATION
+#include "SegmentationPipeline.h"
 
 #include "runEMS.h"
 
 #include <iostream>
+#include <map>
 #include <string>
 #include <sstream>
 
+#include <math.h>
 #include <stdlib.h>
 
 typedef itk::Image<float, 3> FloatImageType;
@@ -43,22 +46,90 @@ typedef FloatImageType::Pointer FloatImagePointer;
 typedef ByteImageType::Pointer ByteImagePointer;
 typedef ShortImageType::Pointer ShortImagePointer;
 
-void
-runEMS(EMSParameters* emsp, bool debugflag, bool writemoreflag)
+// Posteriors of a segmentation as the components of one vector image,
+// quantized to the range of TComponent, the labels are appended as the last
+// component if given
+template <class TComponent>
+static typename itk::VectorImage<TComponent, 3>::Pointer
+_combinePosteriors(SegmentationPipeline* pipeline, const ShortImageType* labels)
+{
+  typedef itk::VectorImage<TComponent, 3> VectorImageType;
+
+  unsigned int numClasses = pipeline->GetNumberOfPosteriors();
+
+  unsigned int numComponents = numClasses;
+  if (labels != 0)
+    numComponents++;
+
+  float max = itk::NumericTraits<TComponent>::max();
+
+  typename VectorImageType::Pointer combined = VectorImageType::New();
+  unsigned long numVoxels = 0;
+
+  for (unsigned int c = 0; c < numClasses; c++)
+  {
+    FloatImagePointer post = pipeline->GetPosterior(c);
+
+    if (c == 0)
+    {
+      combined->CopyInformation(post);
+      combined->SetRegions(post->GetLargestPossibleRegion());
+      combined->SetVectorLength(numComponents);
+      combined->Allocate();
+
+      numVoxels = post->GetLargestPossibleRegion().GetNumberOfPixels();
+    }
+
+    const float* p = post->GetBufferPointer();
+    TComponent* v = combined->GetBufferPointer() + c;
+
+    for (unsigned long i = 0; i < numVoxels; i++)
+    {
+      float q = floor(max*p[i] + 0.5);
+      if (q < 0)
+        q = 0;
+      if (q > max)
+        q = max;
+      v[i*numComponents] = (TComponent)q;
+    }
+  }
+
+  if (labels != 0)
+  {
+    const short* l = labels->GetBufferPointer();
+    TComponent* v = combined->GetBufferPointer() + numClasses;
+
+    for (unsigned long i = 0; i < numVoxels; i++)
+      v[i*numComponents] = (TComponent)l[i];
+  }
+
+  return combined;
+}
+
+// Segment one subject, in batch mode the threads and random number
+// generators are set up by the caller and messages go to the subject log only
+static void
+_runEMSSubject(EMSParameters* emsp, bool debugflag, bool writemoreflag,
+  CompiledAtlas* atlas, bool batch,
+  EMSProgressMethodType progress, void* progressData)
 {
 
   if (!emsp->CheckValues())
     throw std::string("Invalid segmentation parameter values");
 
-  itk::MultiThreader::SetGlobalDefaultNumberOfThreads( emsp->GetNumberOfThreads() );
+  if (!batch)
+    itk::MultiThreader::SetGlobalDefaultNumberOfThreads( emsp->GetNumberOfThreads() );
   
   // Create and start a new timer (for the whole process)
   Timer* timer = new Timer();
 
   // Initialize random number generators
-  srand(542948474);
-  MersenneTwisterRNG* rng = MersenneTwisterRNG::GetGlobalInstance();
-  rng->Initialize(87584359);
+  if (!batch)
+  {
+    srand(542948474);
+    MersenneTwisterRNG* rng = MersenneTwisterRNG::GetGlobalInstance();
+    rng->Initialize(87584359);
+  }
 
   // Directory separator string
   std::string separator = std::string("/");
@@ -72,13 +143,42 @@ runEMS(EMSParameters* emsp, bool debugflag, bool writemoreflag)
 
   // Create the output directory, stop if it does not exist
   if(!mu::create_dir(outdir.c_str()))
+  {
+    delete timer;
+    if (batch)
+      throw std::string("Failed creating ") + outdir;
     return;
+  }
 
   // Set up the logger
   {
     std::string logfn = outdir + emsp->GetSuffix() + ".log";
-    (mu::Log::GetInstance())->EchoOn();
-    (mu::Log::GetInstance())->SetOutputFileName(logfn.c_str());
+    if (batch)
+    {
+      (mu::Log::GetInstance())->SetThreadOutputFileName(logfn);
+    }
+    else
+    {
+      (mu::Log::GetInstance())->EchoOn();
+      (mu::Log::GetInstance())->SetOutputFileName(logfn.c_str());
+    }
+  }
+
+  // Subjects segmented side by side split the threads evenly, a thread count
+  // given for this subject cannot be honoured
+  if (batch)
+  {
+    unsigned int numThreads =
+      itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    if (emsp->GetNumberOfThreads() != numThreads
+        &&
+        emsp->GetNumberOfThreads() !=
+          itk::MultiThreader::GetGlobalMaximumNumberOfThreads())
+    {
+      muLogMacro(<< "WARNING: ignoring NUMBER-OF-THREADS = "
+        << emsp->GetNumberOfThreads() << ", using " << numThreads
+        << " threads, the share of this subject\n");
+    }
   }
 
   // Write out the parameters in XML
@@ -149,6 +249,7 @@ runEMS(EMSParameters* emsp, bool debugflag, bool writemoreflag)
   muLogMacro(<< "\n");
   muLogMacro(
     << "Max bias polynomial degree: " << emsp->GetMaxBiasDegree() << "\n");
+  muLogMacro(<< "Bias correction method: " << emsp->GetBiasCorrectionMethod() << "\n");
   muLogMacro(<< "Initial Distribution Estimator: " << emsp->GetInitialDistributionEstimator() << "\n");
   muLogMacro(<< "Atlas warping: " << emsp->GetDoAtlasWarp() << "\n");
   muLogMacro(
@@ -156,216 +257,119 @@ runEMS(EMSParameters* emsp, bool debugflag, bool writemoreflag)
     << "\n");
   muLogMacro(<< "Atlas warp fluid max step: " << emsp->GetAtlasWarpFluidMaxStep() << "\n");
   muLogMacro(<< "Atlas warp kernel width: " << emsp->GetAtlasWarpKernelWidth() << "\n");
+  muLogMacro(<< "Atlas cropping: " << emsp->GetDoAtlasCrop() << "\n");
+  muLogMacro(<< "Atlas crop padding: " << emsp->GetAtlasCropPadding() << "\n");
+  muLogMacro(<< "Affine initialization: " << emsp->GetAffineInitialization() << "\n");
+  muLogMacro(<< "Affine metric: " << emsp->GetAffineMetric() << "\n");
+  muLogMacro(<< "Registration cache directory: " << emsp->GetRegistrationCacheDirectory() << "\n");
+  muLogMacro(<< "Posterior format: " << emsp->GetPosteriorFormat() << ", "
+    << emsp->GetPosteriorBits() << " bits, embedded labels: "
+    << emsp->GetEmbedLabels() << "\n");
+  muLogMacro(<< "Output writer threads: " << emsp->GetOutputWriterThreads() << "\n");
   muLogMacro(<< "\n");
 
   muLogMacro(<< "=== Start ===\n");
 
-  //Get atlas directory
-  std::string atlasdir = emsp->GetAtlasDirectory();
-  // Make sure last character is a separator
-  if (atlasdir[atlasdir.size()-1] != MU_DIR_SEPARATOR)
-    atlasdir += separator;
+  // Outputs are written in the background as they become available
+  ImageWriterQueue::Pointer outwriter = ImageWriterQueue::New();
+  outwriter->SetNumberOfThreads(emsp->GetOutputWriterThreads());
 
   muLogMacro(<< "Registering images using linear transform...\n");
 
-  ByteImagePointer fovmask;
+  SegmentationPipeline::Pointer pipeline = SegmentationPipeline::New();
 
-  FloatImagePointer templateImg;
-
-  DynArray<FloatImagePointer> images;
-  DynArray<FloatImagePointer> priors;
-  {
-    typedef AtlasRegistrationMethod<float, float> AtlasRegType;
-    AtlasRegType::Pointer atlasreg = AtlasRegType::New();
-
-    if (debugflag)
-      atlasreg->DebugOn();
-
-    atlasreg->SetPrefilteringMethod(emsp->GetFilterMethod().c_str());
-    atlasreg->SetPrefilteringIterations(emsp->GetFilterIterations());
-    atlasreg->SetPrefilteringTimeStep(emsp->GetFilterTimeStep());
-
-    atlasreg->SetSuffix(emsp->GetSuffix());
+  if (debugflag)
+    pipeline->DebugOn();
 
-    atlasreg->SetAtlasOrientation(emsp->GetAtlasOrientation());
+  pipeline->SetParameters(emsp);
 
-    atlasreg->SetImageFileNames(emsp->GetImages());
-    atlasreg->SetImageOrientations(emsp->GetImageOrientations());
-    atlasreg->SetOutputDirectory(outdir);
+  // Atlas shared between the subjects of a batch, threads are already
+  // split between subjects
+  if (atlas != 0)
+    pipeline->SetAtlas(atlas);
+  if (batch)
+    pipeline->SetNumberOfConcurrentRegistrations(1);
 
-    std::string atlasmapstr = emsp->GetAtlasLinearMapType();
-    if (atlasmapstr.compare("id") == 0)
-      atlasreg->SetAtlasLinearTransformChoice(AtlasRegType::ID_TRANSFORM);
-    if (atlasmapstr.compare("rigid") == 0)
-      atlasreg->SetAtlasLinearTransformChoice(AtlasRegType::RIGID_TRANSFORM);
+  // Previous registration results are reused from the output directory
+  pipeline->SetTransformDirectory(outdir);
 
-    std::string imagemapstr = emsp->GetImageLinearMapType();
-    if (imagemapstr.compare("id") == 0)
-      atlasreg->SetImageLinearTransformChoice(AtlasRegType::ID_TRANSFORM);
-    if (imagemapstr.compare("rigid") == 0)
-      atlasreg->SetImageLinearTransformChoice(AtlasRegType::RIGID_TRANSFORM);
+  // The corrected images are only written with the secondary outputs
+  pipeline->SetRestoreCorrectedImages(writemoreflag);
 
-    // Directory with the template and priors (template.mha, 1.mha, ... 99.mha)
-    atlasreg->SetAtlasDirectory(atlasdir);
+  Timer* regtimer = new Timer();
+  pipeline->Register();
+  regtimer->Stop();
 
-    muLogMacro(<< "Attempting to read previous registration results..."
-      << std::endl);
-    atlasreg->ReadParameters();
+  muLogMacro(<< "Registration took " << regtimer->GetElapsedHours() << " hours, ");
+  muLogMacro(<< regtimer->GetElapsedMinutes() << " minutes, ");
+  muLogMacro(<< regtimer->GetElapsedSeconds() << " seconds\n");
+  delete regtimer;
 
-    muLogMacro(<< "Registering and resampling images..." << std::endl);
-    Timer* regtimer = new Timer();
-    atlasreg->Update();
+  if (progress != 0)
+    progress("registered", progressData);
 
-    atlasreg->WriteParameters();
-    regtimer->Stop();
+  // Write the registered template and images
+  if (writemoreflag)
+  {
+    muLogMacro(<< "Writing linearly-registered template...\n");
 
-    muLogMacro(<< "Registration took " << regtimer->GetElapsedHours() << " hours, ");
-    muLogMacro(<< regtimer->GetElapsedMinutes() << " minutes, ");
-    muLogMacro(<< regtimer->GetElapsedSeconds() << " seconds\n");
-    delete regtimer;
+    typedef itk::RescaleIntensityImageFilter<FloatImageType, ByteImageType>
+      ByteRescaleType;
 
-    fovmask = atlasreg->GetFOVMask();
+    ByteRescaleType::Pointer rescaler = ByteRescaleType::New();
+    rescaler->SetOutputMinimum(0);
+    rescaler->SetOutputMaximum(255);
+    rescaler->SetInput(pipeline->GetAffineTemplate());
+    rescaler->Update();
 
-    images = atlasreg->GetImages();
-    priors = atlasreg->GetProbabilities();
+    std::string fn =
+      outdir + mu::get_name((emsp->GetImages()[0]).c_str()) +
+      std::string("_template_affine") + suffstr;
 
-    templateImg = atlasreg->GetAffineTemplate();
+    outwriter->Write<ByteImageType>(
+      rescaler->GetOutput(), fn, emsp->GetCompressRegistered());
 
-    // Write the registered template and images
-    if (writemoreflag)
+    DynArray<FloatImagePointer> images = pipeline->GetRegisteredImages();
+    for (unsigned int i = 0; i < images.GetSize(); i++)
     {
-      muLogMacro(<< "Writing linearly-registered template...\n");
+      typedef itk::RescaleIntensityImageFilter<FloatImageType, ShortImageType>
+        ShortRescaleType;
 
-      typedef itk::RescaleIntensityImageFilter<FloatImageType, ByteImageType>
-        ByteRescaleType;
-
-      ByteRescaleType::Pointer rescaler = ByteRescaleType::New();
+      ShortRescaleType::Pointer rescaler = ShortRescaleType::New();
       rescaler->SetOutputMinimum(0);
-      rescaler->SetOutputMaximum(255);
-      rescaler->SetInput(atlasreg->GetAffineTemplate());
+      rescaler->SetOutputMaximum(itk::NumericTraits<short>::max());
+      rescaler->SetInput(images[i]);
       rescaler->Update();
 
-      typedef itk::ImageFileWriter<ByteImageType> ByteWriterType;
-      ByteWriterType::Pointer writer = ByteWriterType::New();
-
       std::string fn =
-        outdir + mu::get_name((emsp->GetImages()[0]).c_str()) +
-        std::string("_template_affine") + suffstr;
-
-      writer->SetInput(rescaler->GetOutput());
-      writer->SetFileName(fn.c_str());
-      writer->UseCompressionOn();
-      writer->Update();
+        outdir + mu::get_name((emsp->GetImages()[i]).c_str()) +
+        std::string("_registered") + suffstr;
 
-      for (unsigned int i = 0; i < images.GetSize(); i++)
-      {
-        typedef itk::RescaleIntensityImageFilter<FloatImageType, ShortImageType>
-          ShortRescaleType;
-
-        ShortRescaleType::Pointer rescaler = ShortRescaleType::New();
-        rescaler->SetOutputMinimum(0);
-        rescaler->SetOutputMaximum(itk::NumericTraits<short>::max());
-        rescaler->SetInput(images[i]);
-        rescaler->Update();
-
-        std::string fn =
-          outdir + mu::get_name((emsp->GetImages()[i]).c_str()) +
-          std::string("_registered") + suffstr;
-
-        typedef itk::ImageFileWriter<ShortImageType> ShortWriterType;
-        ShortWriterType::Pointer writer = ShortWriterType::New();
-
-        writer->SetInput(rescaler->GetOutput());
-        writer->SetFileName(fn.c_str());
-        writer->UseCompressionOn();
-        writer->Update();
-      }
-    }
-  } // end atlas reg block
-
-
-  muLogMacro(<< "Rescale intensity of filtered images...\n");
-  {
-    typedef itk::RescaleIntensityImageFilter<FloatImageType, FloatImageType>
-      RescaleType;
-    RescaleType::Pointer rescaler = RescaleType::New();
-    rescaler->SetOutputMinimum(1);
-    rescaler->SetOutputMaximum(4096);
-
-    FloatImageType::SizeType size =
-      images[0]->GetLargestPossibleRegion().GetSize();
-    FloatImageType::IndexType ind;
-
-    for (unsigned int i = 0; i < images.GetSize(); i++)
-    {
-      FloatImagePointer tmp = images[i];
-
-      rescaler->SetInput(tmp);
-      rescaler->Update();
-
-      FloatImagePointer rImg = rescaler->GetOutput();
-      for (ind[2] = 0; ind[2] < (long)size[2]; ind[2]++)
-        for (ind[1] = 0; ind[1] < (long)size[1]; ind[1]++)
-          for (ind[0] = 0; ind[0] < (long)size[0]; ind[0]++)
-          {
-            tmp->SetPixel(ind, rImg->GetPixel(ind));
-          }
+      outwriter->Write<ShortImageType>(
+        rescaler->GetOutput(), fn, emsp->GetCompressRegistered());
     }
   }
 
-  muLogMacro(<< "Start segmentation...\n");
-  typedef EMSegmentationFilter<FloatImageType, FloatImageType> SegFilterType;
-  SegFilterType::Pointer segfilter = SegFilterType::New();
-
-  if (debugflag)
-    segfilter->DebugOn();
-
-  segfilter->SetTemplateImage(templateImg);
+  pipeline->Segment();
 
-  segfilter->SetInputImages(images);
-  segfilter->SetPriors(priors);
-
-  segfilter->SetFOVMask(fovmask);
-
-  SegFilterType::VectorType prWeightsVec(prWeights.size());
-  for (unsigned int i = 0; i < prWeights.size(); i++)
-    prWeightsVec[i] = prWeights[i];
-  segfilter->SetPriorWeights(prWeightsVec);
-
-  segfilter->SetMaxBiasDegree(emsp->GetMaxBiasDegree());
-
-  segfilter->SetInitialDistributionEstimator(emsp->GetInitialDistributionEstimator());
-
-  if(emsp->GetDoAtlasWarp())
-    segfilter->WarpingOn();
-  else
-    segfilter->WarpingOff();
-  segfilter->SetWarpFluidIterations(emsp->GetAtlasWarpFluidIterations());
-  segfilter->SetWarpFluidMaxStep(emsp->GetAtlasWarpFluidMaxStep());
-  segfilter->SetWarpFluidKernelWidth(emsp->GetAtlasWarpKernelWidth());
-  segfilter->Update();
+  if (progress != 0)
+    progress("segmented", progressData);
 
   DynArray<std::string> names = emsp->GetImages();
 
   // Write the labels
   muLogMacro(<< "Writing labels...\n");
+  ShortImagePointer labels = pipeline->GetLabels();
   {
-    typedef itk::ImageFileWriter<ByteImageType> ByteWriterType;
-    ByteWriterType::Pointer writer = ByteWriterType::New();
-
-    writer->SetInput(segfilter->GetOutput());
-
     std::string fn = outdir + mu::get_name(names[0].c_str()) + std::string("_labels") + suffstr;
-    writer->SetFileName(fn.c_str());
-    writer->UseCompressionOn();
-    writer->Update();
+    outwriter->Write<ShortImageType>(labels, fn, emsp->GetCompressLabels());
   }
 
   // Write the secondary outputs
   if (writemoreflag)
   {
     muLogMacro(<< "Writing filtered and bias corrected images...\n");
-    DynArray<FloatImagePointer> imgset = segfilter->GetCorrected();
+    DynArray<FloatImagePointer> imgset = pipeline->GetCorrectedImages();
     for (unsigned i = 0; i < imgset.GetSize(); i++)
     {
       typedef itk::CastImageFilter<FloatImageType, ShortImageType> CasterType;
@@ -377,32 +381,55 @@ runEMS(EMSParameters* emsp, bool debugflag, bool writemoreflag)
         outdir + mu::get_name(names[i].c_str()) + std::string("_corrected")
         + suffstr;
 
-      typedef itk::ImageFileWriter<ShortImageType> ShortWriterType;
-      ShortWriterType::Pointer writer = ShortWriterType::New();
-
-      writer->SetInput(caster->GetOutput());
-      writer->SetFileName(fn.c_str());
-      writer->UseCompressionOn();
-      writer->Update();
+      outwriter->Write<ShortImageType>(
+        caster->GetOutput(), fn, emsp->GetCompressCorrected());
     }
 
-    // Short posteriors
-    muLogMacro(<< "Writing posterior images...\n");
-    DynArray<ShortImagePointer> probset = segfilter->GetShortPosteriors();
-    for (unsigned int i = 0; i < (probset.GetSize()-3); i++)
+    if (emsp->GetPosteriorFormat().compare("combined") == 0)
     {
-      typedef itk::ImageFileWriter<ShortImageType> ShortWriterType;
-      ShortWriterType::Pointer writer = ShortWriterType::New();
+      muLogMacro(<< "Writing combined posterior image...\n");
 
-      std::string first = outdir + mu::get_name(names[0].c_str());
+      const ShortImageType* embedded = 0;
+      if (emsp->GetEmbedLabels())
+        embedded = labels;
 
-      std::ostringstream oss;
-      oss << first << "_posterior" << i << suffstr << std::ends;
+      std::string fn =
+        outdir + mu::get_name(names[0].c_str()) + std::string("_posteriors")
+        + suffstr;
 
-      writer->SetInput(probset[i]);
-      writer->SetFileName(oss.str().c_str());
-      writer->UseCompressionOn();
-      writer->Update();
+      if (emsp->GetPosteriorBits() == 8)
+      {
+        typedef itk::VectorImage<unsigned char, 3> ByteVectorImageType;
+        ByteVectorImageType::Pointer combined =
+          _combinePosteriors<unsigned char>(pipeline, embedded);
+        outwriter->Write<ByteVectorImageType>(
+          combined, fn, emsp->GetCompressPosteriors());
+      }
+      else
+      {
+        // Same scale as the separate short posteriors
+        typedef itk::VectorImage<short, 3> ShortVectorImageType;
+        ShortVectorImageType::Pointer combined =
+          _combinePosteriors<short>(pipeline, embedded);
+        outwriter->Write<ShortVectorImageType>(
+          combined, fn, emsp->GetCompressPosteriors());
+      }
+    }
+    else
+    {
+      // Short posteriors
+      muLogMacro(<< "Writing posterior images...\n");
+      DynArray<ShortImagePointer> probset = pipeline->GetShortPosteriors();
+      for (unsigned int i = 0; i < probset.GetSize(); i++)
+      {
+        std::string first = outdir + mu::get_name(names[0].c_str());
+
+        std::ostringstream oss;
+        oss << first << "_posterior" << i << suffstr;
+
+        outwriter->Write<ShortImageType>(
+          probset[i], oss.str(), emsp->GetCompressPosteriors());
+      }
     }
 
 /*
@@ -456,20 +483,15 @@ runEMS(EMSParameters* emsp, bool debugflag, bool writemoreflag)
     ByteRescaleType::Pointer rescaler = ByteRescaleType::New();
     rescaler->SetOutputMinimum(0);
     rescaler->SetOutputMaximum(255);
-    rescaler->SetInput(segfilter->GetWarpedTemplateImage());
+    rescaler->SetInput(pipeline->GetWarpedTemplate());
     rescaler->Update();
 
-    typedef itk::ImageFileWriter<ByteImageType> ByteWriterType;
-    ByteWriterType::Pointer writer = ByteWriterType::New();
-
     std::string fn =
       outdir + mu::get_name((emsp->GetImages()[0]).c_str()) +
       std::string("_template_warped") + suffstr;
 
-    writer->SetInput(rescaler->GetOutput());
-    writer->SetFileName(fn.c_str());
-    writer->UseCompressionOn();
-    writer->Update();
+    outwriter->Write<ByteImageType>(
+      rescaler->GetOutput(), fn, emsp->GetCompressWarpedTemplate());
 
 /*
 // Deprecated
@@ -487,14 +509,16 @@ runEMS(EMSParameters* emsp, bool debugflag, bool writemoreflag)
       std::string("_to_template") + 
       std::string("_dispF_") + std::string(emsp->GetSuffix()) + ".mha";
 
-    typedef itk::ImageFileWriter<SegFilterType::VectorFieldType>
-      VectorWriterType;
-    VectorWriterType::Pointer defwriter = VectorWriterType::New();
-    defwriter->SetInput(segfilter->GetTemplateFluidVelocity());
-    defwriter->SetFileName(fn.c_str());
-    defwriter->Update();
+    outwriter->Write<SegmentationPipeline::VectorFieldType>(
+      pipeline->GetDisplacementField(), fn, emsp->GetCompressDisplacement());
   }
 
+  muLogMacro(<< "Waiting for outputs to be written...\n");
+  outwriter->Wait();
+
+  if (progress != 0)
+    progress("written", progressData);
+
   timer->Stop();
 
   muLogMacro(<< "All segmentation processes took " << timer->GetElapsedHours() << " hours, ");
@@ -504,3 +528,247 @@ runEMS(EMSParameters* emsp, bool debugflag, bool writemoreflag)
   delete timer;
 
 }
+
+void
+runEMS(EMSParameters* emsp, bool debugflag, bool writemoreflag)
+{
+  _runEMSSubject(emsp, debugflag, writemoreflag, 0, false, 0, 0);
+}
+
+void
+runEMSWithAtlas(EMSParameters* emsp, bool debugflag, bool writemoreflag,
+  CompiledAtlas* atlas, EMSProgressMethodType progress, void* progressData)
+{
+  try
+  {
+    _runEMSSubject(emsp, debugflag, writemoreflag, atlas, true,
+      progress, progressData);
+  }
+  catch (...)
+  {
+    (mu::Log::GetInstance())->CloseThreadFile();
+    throw;
+  }
+
+  (mu::Log::GetInstance())->CloseThreadFile();
+}
+
+struct EMSBatchData
+{
+  DynArray<std::string> ParameterFiles;
+  DynArray<EMSParameters::Pointer> Parameters;
+  DynArray<CompiledAtlas::Pointer> Atlases;
+
+  bool DebugFlag;
+  bool WriteMoreFlag;
+
+  unsigned int NextSubject;
+  unsigned int NumberOfFailures;
+  itk::SimpleFastMutexLock Mutex;
+};
+
+// Subjects are taken in order by whichever thread is free
+static ITK_THREAD_RETURN_TYPE
+_runEMSBatchThread(void* arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfoType;
+
+  ThreadInfoType* threadInfo = static_cast<ThreadInfoType*>(arg);
+  EMSBatchData* data = static_cast<EMSBatchData*>(threadInfo->UserData);
+
+  unsigned int numSubjects = data->ParameterFiles.GetSize();
+
+  while (true)
+  {
+    data->Mutex.Lock();
+    unsigned int i = data->NextSubject++;
+    data->Mutex.Unlock();
+
+    if (i >= numSubjects)
+      break;
+
+    const std::string& fn = data->ParameterFiles[i];
+
+    if (data->Parameters[i].IsNull() || data->Atlases[i].IsNull())
+    {
+      // Already reported when reading the parameters and atlases
+      data->Mutex.Lock();
+      data->NumberOfFailures++;
+      data->Mutex.Unlock();
+      continue;
+    }
+
+    muLogMacro(<< "[" << i+1 << "/" << numSubjects << "] Started " << fn
+      << "\n");
+
+    std::string err = "";
+    try
+    {
+      runEMSWithAtlas(data->Parameters[i], data->DebugFlag,
+        data->WriteMoreFlag, data->Atlases[i]);
+    }
+    catch (itk::ExceptionObject& e)
+    {
+      std::ostringstream oss;
+      oss << e;
+      err = oss.str();
+    }
+    catch (std::exception& e)
+    {
+      err = e.what();
+    }
+    catch (std::string& s)
+    {
+      err = s;
+    }
+    catch (...)
+    {
+      err = "Unknown exception";
+    }
+
+    if (err.length() != 0)
+    {
+      muLogMacro(<< "[" << i+1 << "/" << numSubjects << "] FAILED " << fn
+        << ": " << err << "\n");
+      data->Mutex.Lock();
+      data->NumberOfFailures++;
+      data->Mutex.Unlock();
+    }
+    else
+    {
+      muLogMacro(<< "[" << i+1 << "/" << numSubjects << "] Finished " << fn
+        << "\n");
+    }
+  }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+unsigned int
+runEMSBatch(const DynArray<std::string>& paramFiles,
+  bool debugflag, bool writemoreflag,
+  unsigned int numConcurrent, unsigned int numThreads)
+{
+  unsigned int numSubjects = paramFiles.GetSize();
+  if (numSubjects == 0)
+    return 0;
+
+  Timer* timer = new Timer();
+
+  (mu::Log::GetInstance())->EchoOn();
+
+  if (numThreads == 0)
+    numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  if (numConcurrent == 0)
+    numConcurrent = 1;
+  if (numConcurrent > numSubjects)
+    numConcurrent = numSubjects;
+
+  unsigned int threadsPerSubject = numThreads / numConcurrent;
+  if (threadsPerSubject == 0)
+    threadsPerSubject = 1;
+
+  muLogMacro(<< "Batch of " << numSubjects << " subjects, " << numConcurrent
+    << " at a time with " << threadsPerSubject << " threads each\n");
+
+  EMSBatchData data;
+  data.DebugFlag = debugflag;
+  data.WriteMoreFlag = writemoreflag;
+  data.NextSubject = 0;
+  data.NumberOfFailures = 0;
+
+  // Read all the parameters first, so that bad files are reported right away
+  // and each atlas is loaded once
+  std::map<std::string, CompiledAtlas::Pointer> atlasMap;
+
+  for (unsigned int i = 0; i < numSubjects; i++)
+  {
+    data.ParameterFiles.Append(paramFiles[i]);
+
+    EMSParameters::Pointer emsp;
+    CompiledAtlas::Pointer atlas;
+    try
+    {
+      emsp = readEMSParametersXML(paramFiles[i].c_str());
+      if (emsp.IsNull() || !emsp->CheckValues())
+        throw std::string("Invalid segmentation parameter values");
+
+      std::string atlasdir = emsp->GetAtlasDirectory();
+      if (atlasdir[atlasdir.size()-1] != MU_DIR_SEPARATOR)
+        atlasdir += MU_DIR_SEPARATOR;
+
+      std::map<std::string, CompiledAtlas::Pointer>::iterator it =
+        atlasMap.find(atlasdir);
+      if (it != atlasMap.end())
+      {
+        atlas = it->second;
+      }
+      else
+      {
+        muLogMacro(<< "Loading atlas " << atlasdir << "\n");
+        atlas = CompiledAtlas::LoadDirectory(atlasdir);
+        atlasMap[atlasdir] = atlas;
+      }
+    }
+    catch (itk::ExceptionObject& e)
+    {
+      muLogMacro(<< "[" << i+1 << "/" << numSubjects << "] FAILED "
+        << paramFiles[i] << ": " << e << "\n");
+      emsp = 0;
+    }
+    catch (std::exception& e)
+    {
+      muLogMacro(<< "[" << i+1 << "/" << numSubjects << "] FAILED "
+        << paramFiles[i] << ": " << e.what() << "\n");
+      emsp = 0;
+    }
+    catch (std::string& s)
+    {
+      muLogMacro(<< "[" << i+1 << "/" << numSubjects << "] FAILED "
+        << paramFiles[i] << ": " << s << "\n");
+      emsp = 0;
+    }
+
+    data.Parameters.Append(emsp);
+    data.Atlases.Append(atlas);
+  }
+
+  // Filters created by each subject use its share of the threads
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threadsPerSubject);
+
+  // Subjects share the random number generators, seeded once for the batch
+  srand(542948474);
+  MersenneTwisterRNG* rng = MersenneTwisterRNG::GetGlobalInstance();
+  rng->Initialize(87584359);
+
+  // Shared caches and the image IO factories are set up here, before the
+  // subjects look them up concurrently
+  BinIndexImageCache::GetGlobalInstance();
+  for (unsigned int i = 0; i < numSubjects; i++)
+    if (!data.Parameters[i].IsNull())
+    {
+      itk::ImageIOFactory::CreateImageIO(
+        data.Parameters[i]->GetImages()[0].c_str(),
+        itk::ImageIOFactory::ReadMode);
+      break;
+    }
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads(numConcurrent);
+  threader->SetSingleMethod(_runEMSBatchThread, &data);
+  threader->SingleMethodExecute();
+
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads(numThreads);
+
+  timer->Stop();
+
+  muLogMacro(<< "Batch finished, " << numSubjects - data.NumberOfFailures
+    << " of " << numSubjects << " subjects segmented\n");
+  muLogMacro(<< "Batch took " << timer->GetElapsedHours() << " hours, ");
+  muLogMacro(<< timer->GetElapsedMinutes() << " minutes, ");
+  muLogMacro(<< timer->GetElapsedSeconds() << " seconds\n");
+
+  delete timer;
+
+  return data.NumberOfFailures;
+}
@@ -7,8 +7,32 @@
 #ifndef _runEMS_h
 #define _runEMS_h
 
+#include "CompiledAtlas.h"
+#include "DynArray.h"
 #include "EMSParameters.h"
 
+#include <string>
+
 void runEMS(EMSParameters* params, bool debugflag, bool writemoreflag);
 
+// Called from the segmenting thread as a subject passes each stage, with
+// "registered", "segmented" and "written"
+typedef void (*EMSProgressMethodType)(const char* stage, void* data);
+
+// Segment one subject of a batch using a shared atlas, the caller sets up
+// the threads and random number generators, messages from the calling
+// thread go to the subject log only
+void runEMSWithAtlas(EMSParameters* params, bool debugflag,
+  bool writemoreflag, CompiledAtlas* atlas,
+  EMSProgressMethodType progress = 0, void* progressData = 0);
+
+// Segment the subjects described by a list of parameter files, each atlas is
+// loaded once and shared by the subjects using it. Runs numConcurrent
+// subjects at a time, splitting numThreads threads (zero means the ITK
+// global default) between them. Each subject logs to its own output
+// directory, returns the number of subjects that failed.
+unsigned int runEMSBatch(const DynArray<std::string>& paramFiles,
+  bool debugflag, bool writemoreflag,
+  unsigned int numConcurrent, unsigned int numThreads);
+
 #endif
@@ -3,6 +3,22 @@
 
 #include "muException.h"
 
+#if defined(_MSC_VER)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+static unsigned long
+_currentThreadID()
+{
+#if defined(_MSC_VER)
+  return (unsigned long)GetCurrentThreadId();
+#else
+  return (unsigned long)pthread_self();
+#endif
+}
+
 namespace mu
 {
 
@@ -31,6 +47,10 @@ Log
 ::~Log()
 {
   this->CloseFile();
+
+  std::map<unsigned long, std::ofstream*>::iterator it;
+  for (it = m_ThreadOutputs.begin(); it != m_ThreadOutputs.end(); ++it)
+    delete it->second;
 }
 
 Log
@@ -73,6 +93,86 @@ Log
   this->SetOutputFileName(s.c_str());
 }
 
+void
+Log
+::SetThreadOutputFileName(const std::string& s)
+{
+  this->CloseThreadFile();
+
+  std::ofstream* output = new std::ofstream(s.c_str());
+  if (output->fail())
+  {
+    delete output;
+    muExceptionMacro(
+      << "[Log::SetThreadOutputFileName] Failed to open " << s);
+  }
+
+  m_WriteMutex.Lock();
+  m_ThreadOutputs[_currentThreadID()] = output;
+  m_WriteMutex.Unlock();
+}
+
+void
+Log
+::CloseThreadFile()
+{
+  m_WriteMutex.Lock();
+
+  std::map<unsigned long, std::ofstream*>::iterator it =
+    m_ThreadOutputs.find(_currentThreadID());
+  if (it != m_ThreadOutputs.end())
+  {
+    delete it->second;
+    m_ThreadOutputs.erase(it);
+  }
+
+  m_WriteMutex.Unlock();
+}
+
+unsigned long
+Log
+::GetThreadOwner()
+{
+  unsigned long id = _currentThreadID();
+
+  m_WriteMutex.Lock();
+
+  std::map<unsigned long, unsigned long>::iterator it =
+    m_ThreadOwners.find(id);
+  if (it != m_ThreadOwners.end())
+    id = it->second;
+
+  m_WriteMutex.Unlock();
+
+  return id;
+}
+
+unsigned long
+Log
+::SetThreadOwner(unsigned long owner)
+{
+  unsigned long id = _currentThreadID();
+  unsigned long prevOwner = id;
+
+  m_WriteMutex.Lock();
+
+  std::map<unsigned long, unsigned long>::iterator it =
+    m_ThreadOwners.find(id);
+  if (it != m_ThreadOwners.end())
+  {
+    prevOwner = it->second;
+    m_ThreadOwners.erase(it);
+  }
+
+  // A thread owning itself needs no entry
+  if (owner != id)
+    m_ThreadOwners[id] = owner;
+
+  m_WriteMutex.Unlock();
+
+  return prevOwner;
+}
+
 void
 Log
 ::WriteString(const char* s)
@@ -84,6 +184,28 @@ Log
     return;
   }
 
+  m_WriteMutex.Lock();
+
+  if (!m_ThreadOutputs.empty())
+  {
+    unsigned long id = _currentThreadID();
+
+    std::map<unsigned long, unsigned long>::iterator ownerIt =
+      m_ThreadOwners.find(id);
+    if (ownerIt != m_ThreadOwners.end())
+      id = ownerIt->second;
+
+    std::map<unsigned long, std::ofstream*>::iterator it =
+      m_ThreadOutputs.find(id);
+    if (it != m_ThreadOutputs.end())
+    {
+      *(it->second) << s;
+      it->second->flush();
+      m_WriteMutex.Unlock();
+      return;
+    }
+  }
+
   if (m_Output.good())
   {
     m_Output << s;
@@ -96,6 +218,8 @@ Log
     (std::cout).flush();
   }
 
+  m_WriteMutex.Unlock();
+
 }
 
 void
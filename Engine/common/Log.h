@@ -10,8 +10,11 @@
 #ifndef _Log_h
 #define _Log_h
 
+#include "itkSimpleFastMutexLock.h"
+
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <string>
 #include <sstream>
 
@@ -34,6 +37,19 @@ public:
   void SetOutputFileName(const char* s);
   void SetOutputFileName(const std::string& s);
 
+  // Messages from the calling thread go only to this file, not to the
+  // terminal or the main log (e.g. one log per subject when segmenting
+  // several subjects at once)
+  void SetThreadOutputFileName(const std::string& s);
+  void CloseThreadFile();
+
+  // Threads started on behalf of another thread (concurrent registrations,
+  // image prefetch and write threads) log wherever their owner logs. Get the
+  // owner in the starting thread, set it in the started thread and restore
+  // the previous owner, returned by SetThreadOwner, before the thread ends.
+  unsigned long GetThreadOwner();
+  unsigned long SetThreadOwner(unsigned long owner);
+
   void WriteString(const char* s);
   void WriteString(const std::string& s);
 
@@ -52,6 +68,13 @@ private:
 
   std::string m_OutputFileName;
 
+  std::map<unsigned long, std::ofstream*> m_ThreadOutputs;
+
+  std::map<unsigned long, unsigned long> m_ThreadOwners;
+
+  // Messages may come from concurrent registrations
+  itk::SimpleFastMutexLock m_WriteMutex;
+
 };
 
 } // namespace mu
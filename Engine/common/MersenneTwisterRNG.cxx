@@ -130,6 +130,8 @@ MersenneTwisterRNG
   static unsigned long mag01[2]={0x0UL, MT_MATRIX_A};
   // mag01[x] = x * MT_MATRIX_A  for x=0,1
 
+  m_StateMutex.Lock();
+
   // generate N words at one time
   if (m_StateIterator >= MT_N)
   {
@@ -157,6 +159,8 @@ MersenneTwisterRNG
   
   y = m_StateVector[m_StateIterator++];
 
+  m_StateMutex.Unlock();
+
   // Tempering
   y ^= (y >> 11);
   y ^= (y << 7) & 0x9d2c5680UL;
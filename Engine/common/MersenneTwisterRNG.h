@@ -53,6 +53,8 @@
 #ifndef _MersenneTwisterRNG_h
 #define _MersenneTwisterRNG_h
 
+#include "itkSimpleFastMutexLock.h"
+
 /* Period parameters */  
 #define MT_N 624
 #define MT_M 397
@@ -93,6 +95,9 @@ protected:
   unsigned long m_StateVector[MT_N];
   int m_StateIterator;
 
+  // Guards the state when the generator is shared between threads
+  itk::SimpleFastMutexLock m_StateMutex;
+
   static MersenneTwisterRNG* m_GlobalInstance;
 
 };
@@ -2,6 +2,7 @@
 #include "itkCommand.h"
 #include "itkEventObject.h"
 #include "itkExceptionObject.h"
+#include "itkNumericTraits.h"
 
 #include "AmoebaOptimizer.h"
 
@@ -87,7 +88,11 @@ AmoebaOptimizer
 
   m_CurrentIteration = 0;
 
+  m_NumberOfRestarts = 0;
+
   m_StopCondition = MaximumNumberOfIterations;
+
+  m_WorkerEvaluator = ParallelCostFunctionEvaluator::New();
 }
 
 AmoebaOptimizer
@@ -156,10 +161,135 @@ AmoebaOptimizer
   }
 
   // Evaluate values at the initial simplex locations
+  std::vector<double> values;
+  this->EvaluatePoints(m_Simplex, values);
+
   m_SimplexValues = ParametersType(m_Simplex.size());
   for (unsigned int i = 0; i < m_Simplex.size(); i++)
-    m_SimplexValues[i] = m_CostFunction->GetValue(m_Simplex[i]);
+    m_SimplexValues[i] = values[i];
+
+}
+
+void
+AmoebaOptimizer
+::AddWorkerCostFunction(CostFunctionType* f)
+{
+  m_WorkerEvaluator->AddCostFunction(f);
+}
+
+void
+AmoebaOptimizer
+::ClearWorkerCostFunctions()
+{
+  m_WorkerEvaluator->ClearCostFunctions();
+}
 
+void
+AmoebaOptimizer
+::EvaluatePoints(
+  const std::vector<ParametersType>& points, std::vector<double>& values)
+{
+  if (m_WorkerEvaluator->GetNumberOfCostFunctions() > 1)
+  {
+    m_WorkerEvaluator->Evaluate(points, values);
+    return;
+  }
+
+  values.resize(points.size());
+  for (unsigned int i = 0; i < points.size(); i++)
+    values[i] = m_CostFunction->GetValue(points[i]);
+}
+
+void
+AmoebaOptimizer
+::ParallelIteration(
+  unsigned int ibest, unsigned int iworst, unsigned int inextworst)
+{
+  unsigned int n = m_CostFunction->GetNumberOfParameters();
+
+  // Centroid of all points except the worst
+  ParametersType centroid(n);
+  centroid.Fill(0.0);
+
+  for (unsigned int i = 0; i < m_Simplex.size(); i++)
+  {
+    if (i == iworst)
+      continue;
+    for (unsigned int j = 0; j < n; j++)
+      centroid[j] += m_Simplex[i][j];
+  }
+
+  for (unsigned int j = 0; j < n; j++)
+    centroid[j] /= (m_Simplex.size() - 1);
+
+  // Reflection, expansion, outside and inside contraction
+  const double factors[4] = {1.0, 2.0, 0.5, -0.5};
+
+  std::vector<ParametersType> candidates;
+  for (unsigned int k = 0; k < 4; k++)
+  {
+    ParametersType p(n);
+    for (unsigned int j = 0; j < n; j++)
+      p[j] = centroid[j] + factors[k]*(centroid[j] - m_Simplex[iworst][j]);
+    candidates.push_back(p);
+  }
+
+  std::vector<double> values;
+  this->EvaluatePoints(candidates, values);
+
+  double f_r = values[0];
+  double f_e = values[1];
+  double f_oc = values[2];
+  double f_ic = values[3];
+
+  int accept = -1;
+
+  if (f_r < m_SimplexValues[ibest])
+    accept = (f_e < f_r) ? 1 : 0;
+  else if (f_r < m_SimplexValues[inextworst])
+    accept = 0;
+  else if (f_r < m_SimplexValues[iworst])
+  {
+    if (f_oc <= f_r)
+      accept = 2;
+  }
+  else if (f_ic < m_SimplexValues[iworst])
+  {
+    accept = 3;
+  }
+
+  if (accept >= 0)
+  {
+    m_Simplex[iworst] = candidates[accept];
+    m_SimplexValues[iworst] = values[accept];
+    return;
+  }
+
+  // Contract around best estimate
+  ParametersType simplex_best = m_Simplex[ibest];
+
+  std::vector<ParametersType> shrunk;
+  for (unsigned int i = 0; i < m_Simplex.size(); i++)
+  {
+    if (i == ibest)
+      continue;
+    ParametersType simplex_i = m_Simplex[i];
+    for (unsigned int j = 0; j < n; j++)
+      simplex_i[j] = 0.5 * (simplex_i[j] + simplex_best[j]);
+    shrunk.push_back(simplex_i);
+  }
+
+  this->EvaluatePoints(shrunk, values);
+
+  unsigned int k = 0;
+  for (unsigned int i = 0; i < m_Simplex.size(); i++)
+  {
+    if (i == ibest)
+      continue;
+    m_Simplex[i] = shrunk[k];
+    m_SimplexValues[i] = values[k];
+    k++;
+  }
 }
 
 void
@@ -192,6 +322,11 @@ AmoebaOptimizer
 
   unsigned int n = m_CostFunction->GetNumberOfParameters();
 
+  unsigned int numRestarts = 0;
+  double restartValue = itk::NumericTraits<double>::max();
+
+  bool parallel = m_WorkerEvaluator->GetNumberOfCostFunctions() > 1;
+
   // Loop until convergence
   while (true)
   {
@@ -246,6 +381,25 @@ AmoebaOptimizer
     double rad_p = this->SimplexParameterDistance(ibest);
     double rad_v = this->SimplexValueDistance(ibest);
 
+    // Restart around the minimum when converged before the maximum
+    // number of iterations
+    if (m_CurrentIteration <= m_MaxIterations
+        &&
+        (rad_p < m_ParameterTolerance || rad_v < m_FunctionTolerance)
+        &&
+        numRestarts < m_NumberOfRestarts
+        &&
+        (m_SimplexValues[ibest] < restartValue - m_FunctionTolerance))
+    {
+      numRestarts++;
+      restartValue = m_SimplexValues[ibest];
+
+      this->SetCurrentPosition(m_Simplex[ibest]);
+      this->InitializeSimplex();
+
+      continue;
+    }
+
     // Stop if simplex is too small or simplex values are too flat
     // or after N iterations
     if (m_CurrentIteration > m_MaxIterations
@@ -266,6 +420,23 @@ AmoebaOptimizer
       break;
     }
 
+    if (parallel)
+    {
+      this->ParallelIteration(ibest, iworst, inextworst);
+
+      ibest = 0;
+      for (unsigned int i = 1; i < m_Simplex.size(); i++)
+        if (m_SimplexValues[i] < m_SimplexValues[ibest])
+          ibest = i;
+
+      this->SetCurrentPosition(m_Simplex[ibest]);
+      m_Value = m_SimplexValues[ibest];
+
+      this->InvokeEvent(itk::IterationEvent());
+
+      continue;
+    }
+
     // Try reflection of worst point
     double test_value = this->TestPoint(iworst, -1.0f);
 
@@ -9,6 +9,8 @@
 
 #include "itkSingleValuedNonLinearOptimizer.h"
 
+#include "ParallelCostFunctionEvaluator.h"
+
 #include <vector>
 
 class AmoebaOptimizer:
@@ -60,6 +62,19 @@ public:
 
   itkSetMacro(InitialSimplexDeltas, ParametersType);
 
+  // Restart from a new simplex around the minimum after convergence, stops
+  // early when a restart does not improve the value
+  itkSetMacro(NumberOfRestarts, unsigned int);
+  itkGetConstMacro(NumberOfRestarts, unsigned int);
+
+  // Independent copies of the cost function (each with its own transform),
+  // with two or more the reflection, expansion, and contraction candidates
+  // and the shrink and restart simplices are evaluated concurrently
+  void AddWorkerCostFunction(CostFunctionType* f);
+  void ClearWorkerCostFunctions();
+  unsigned int GetNumberOfWorkerCostFunctions() const
+  { return m_WorkerEvaluator->GetNumberOfCostFunctions(); }
+
 protected:
 
   AmoebaOptimizer();
@@ -74,6 +89,15 @@ protected:
 
   void InitializeSimplex();
 
+  // Values at a list of points, in parallel if there are worker cost
+  // functions
+  void EvaluatePoints(
+    const std::vector<ParametersType>& points, std::vector<double>& values);
+
+  // One Nelder-Mead step with all candidates evaluated at once
+  void ParallelIteration(
+    unsigned int ibest, unsigned int iworst, unsigned int inextworst);
+
 private:
 
   ParametersType m_InitialSimplexDeltas;
@@ -88,8 +112,12 @@ private:
 
   unsigned int m_CurrentIteration;
 
+  unsigned int m_NumberOfRestarts;
+
   bool m_Verbose;
 
+  ParallelCostFunctionEvaluator::Pointer m_WorkerEvaluator;
+
   double m_Value;
 
   StopConditionType m_StopCondition;
@@ -20,12 +20,16 @@
 #include "itkAffineTransform.h"
 #include "itkArray.h"
 #include "itkImage.h"
+#include "itkMultiThreader.h"
 #include "itkObject.h"
 
 #include "DynArray.h"
 
 #include "ChainedAffineTransform3D.h"
+#include "CompiledAtlas.h"
+#include "ImagePrefetcher.h"
 #include "PairRegistrationMethod.h"
+#include "RegistrationResultCache.h"
 
 #include <string>
 
@@ -78,6 +82,7 @@ public:
 
   typedef DynArray<ProbabilityImagePointer> ProbabilityImageList;
   typedef DynArray<OutputImagePointer> OutputImageList;
+  typedef DynArray<InternalImagePointer> InternalImageList;
 
   typedef ChainedAffineTransform3D AffineTransformType;
   typedef typename AffineTransformType::Pointer AffineTransformPointer;
@@ -89,6 +94,13 @@ public:
 
   typedef itk::Array<unsigned char> FlagArrayType;
 
+  typedef PairRegistrationMethod<InternalImagePixelType> PairRegType;
+  typedef typename PairRegType::PyramidCacheType PyramidCacheType;
+
+  typedef RegistrationResultCache<InternalImageType> ResultCacheType;
+
+  typedef ImagePrefetcher<InternalImageType> PrefetcherType;
+
   void WriteParameters();
   void ReadParameters();
 
@@ -97,10 +109,24 @@ public:
   itkGetMacro(OutputDirectory, std::string);
   itkSetMacro(OutputDirectory, std::string);
 
+  // Directory with the template and priors (template.mha, 1.mha, ...), a
+  // compiled atlas in the directory (atlas.mua) is used instead when it is
+  // newer than the template
   void SetAtlasDirectory(const std::string& dir);
 
+  // Atlas used instead of the atlas directory files, may be shared with
+  // other registrations running at the same time
+  void SetCompiledAtlas(CompiledAtlas* atlas);
+
+  // Compiled atlas in use, NULL if reading the atlas files
+  CompiledAtlas* GetCompiledAtlas() { return m_CompiledAtlas; }
+
   void SetImageFileNames(StringList filenames);
 
+  // Images in memory used instead of image files, they are not modified, the
+  // transforms are then neither read nor written by Read/WriteParameters
+  void SetInputImages(const InternalImageList& images);
+
   void SetTemplateFileName(std::string filename);
 
   void SetAtlasOrientation(std::string orient);
@@ -152,6 +178,25 @@ public:
   void FastRegistrationOn() { m_FastRegistration = true; }
   void FastRegistrationOff() { m_FastRegistration = false; }
 
+  // Start affine registrations from aligned centroids / principal axes
+  void MomentInitializationOn() { m_MomentInitialization = true; }
+  void MomentInitializationOff() { m_MomentInitialization = false; }
+
+  // Register affine and rigid with Havrda-Charvat information instead of
+  // mutual information
+  void HCMetricOn() { m_HCMetric = true; }
+  void HCMetricOff() { m_HCMetric = false; }
+
+  // Number of pairwise registrations run at once, the threads are split
+  // between them (zero runs all of them at once)
+  itkSetMacro(NumberOfConcurrentRegistrations, unsigned int);
+  itkGetConstMacro(NumberOfConcurrentRegistrations, unsigned int);
+
+  // Directory of registration results keyed by image contents and settings,
+  // shared between runs (empty disables it)
+  itkSetMacro(RegistrationCacheDirectory, std::string);
+  itkGetConstMacro(RegistrationCacheDirectory, std::string);
+
 protected:
 
   AtlasRegistrationMethod();
@@ -159,11 +204,56 @@ protected:
 
   void VerifyInitialization();
 
+  // Number of input images or image files
+  unsigned int GetNumberOfInputs() const;
+
+  // Template from a file or a compiled atlas
+  bool HasTemplate() const;
+
+  // Identity transforms for a new list of inputs
+  void InitializeTransforms(unsigned int numImages);
+
   OutputImagePointer CopyOutputImage(InternalImagePointer img);
   ProbabilityImagePointer CopyProbabilityImage(InternalImagePointer img);
 
   InternalImagePointer PrefilterImage(InternalImagePointer& img);
 
+  void OpenCompiledAtlas();
+
+  // Starts reading the input images and the atlas files not in the compiled
+  // atlas in the background, each file is read once during an update
+  void PrefetchImages();
+
+  // Image from the prefetched files, or read now outside of an update
+  InternalImagePointer ReadImageFile(const std::string& fn);
+
+  // Template from the compiled atlas or file, in the orientation of the first
+  // image
+  InternalImagePointer ReadAtlasTemplate();
+  InternalImagePointer StandardizeAtlasImage(InternalImagePointer img);
+
+  // New image object using the same pixel buffer, compiled atlas images are
+  // never put in a pipeline directly
+  static InternalImagePointer ShareAtlasImage(InternalImageType* img);
+
+  // Pairwise registrations to the first image, index zero is the template
+  void RegisterTemplate(PyramidCacheType* pyramids, unsigned int numThreads);
+  void RegisterImage(unsigned int i,
+    PyramidCacheType* pyramids, unsigned int numThreads);
+
+  static ITK_THREAD_RETURN_TYPE _registerThread(void* arg);
+
+  // Settings that change the result of a registration, part of the key for
+  // the result cache
+  std::string GetRegistrationSettings(LinearTransformChoice c) const;
+
+  // Transform from the result cache, NULL if not cached, also returns the
+  // key for storing the result
+  AffineTransformPointer FindCachedTransform(InternalImageType* movingImg,
+    LinearTransformChoice c, std::string& key);
+  void StoreCachedTransform(
+    const std::string& key, const AffineTransformType* affine);
+
 private:
 
   std::string m_Suffix;
@@ -172,7 +262,11 @@ private:
 
   std::string m_AtlasDirectory;
 
+  CompiledAtlas::Pointer m_CompiledAtlas;
+  CompiledAtlas::Pointer m_GivenCompiledAtlas;
+
   StringList m_ImageFileNames;
+  InternalImageList m_GivenInputImages;
 
   std::string m_TemplateFileName;
 
@@ -215,6 +309,25 @@ private:
 
   bool m_FastRegistration;
 
+  bool m_MomentInitialization;
+
+  bool m_HCMetric;
+
+  unsigned int m_NumberOfConcurrentRegistrations;
+
+  // Work shared by the registration threads
+  DynArray<unsigned int> m_RegistrationTasks;
+  StringList m_RegistrationErrors;
+  typename PyramidCacheType::Pointer m_RegistrationPyramids;
+  unsigned int m_ThreadsPerRegistration;
+  unsigned long m_LogOwner;
+
+  std::string m_RegistrationCacheDirectory;
+  typename ResultCacheType::Pointer m_ResultCache;
+  std::string m_FirstImageDigest;
+
+  typename PrefetcherType::Pointer m_Prefetcher;
+
 };
 
 #ifndef MU_MANUAL_INSTANTIATION
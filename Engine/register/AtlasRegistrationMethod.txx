@@ -5,15 +5,14 @@
 #include "itkAffineTransform.h"
 #include "itkBSplineInterpolateImageFunction.h"
 #include "itkBinaryThresholdImageFilter.h"
-#include "itkImageFileReader.h"
 #include "itkImageRegionIterator.h"
-#include "itkImageRegionIteratorWithIndex.h"
-#include "itkLinearInterpolateImageFunction.h"
 #include "itkResampleImageFilter.h"
 #include "itkRescaleIntensityImageFilter.h"
 
 // MI registration module
 #include "AtlasRegistrationMethod.h"
+#include "LinearAffineResampler.h"
+#include "MappedImageReader.h"
 #include "PairRegistrationMethod.h"
 #include "RegistrationParameters.h"
 
@@ -24,9 +23,14 @@
 
 #include "LLSBiasCorrector.h"
 
+#include "BinIndexImage.h"
+#include "MersenneTwisterRNG.h"
+
 #include "Log.h"
 #include "muFile.h"
 
+#include "itksys/SystemTools.hxx"
+
 #include "ImageDirectionStandardizer.h"
 
 #include <fstream>
@@ -46,6 +50,7 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
   m_AtlasDirectory = "";
 
   m_ImageFileNames.Clear();
+  m_GivenInputImages.Clear();
 
   m_AtlasOrientation = "file";
   m_ImageOrientations.Clear();
@@ -78,6 +83,21 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
   m_ImageLinearTransformChoice = AFFINE_TRANSFORM;
 
   m_FastRegistration = true;
+
+  m_MomentInitialization = false;
+
+  m_HCMetric = false;
+
+  m_NumberOfConcurrentRegistrations = 0;
+  m_ThreadsPerRegistration = 1;
+  m_LogOwner = 0;
+
+  m_RegistrationCacheDirectory = "";
+
+  m_CompiledAtlas = 0;
+  m_GivenCompiledAtlas = 0;
+
+  m_Prefetcher = 0;
 }
 
 template <class TOutputPixel, class TProbabilityPixel>
@@ -99,10 +119,10 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
 ::VerifyInitialization()
 {
 
-  if (m_ImageFileNames.GetSize() < 1)
+  if (this->GetNumberOfInputs() < 1)
     itkExceptionMacro(<< "No data images specified");
 
-  if (m_ImageOrientations.GetSize() != m_ImageFileNames.GetSize())
+  if (m_ImageOrientations.GetSize() != this->GetNumberOfInputs())
     itkExceptionMacro(<< "Image - orientation info mismatch");
 
   /*
@@ -125,6 +145,10 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
 
   itkDebugMacro(<< "Write parameters");
 
+  // Transform files are named after the image files
+  if (m_ImageFileNames.GetSize() == 0)
+    return;
+
   if (!m_DoneRegistration)
     this->RegisterImages();
 
@@ -182,6 +206,9 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
 
   itkDebugMacro(<< "Read parameters");
 
+  if (m_ImageFileNames.GetSize() == 0)
+    return;
+
   m_DoneRegistration = false;
 
   std::string firststr =
@@ -243,7 +270,7 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
   }
 
   bool allReadOK = true;
-  for (unsigned i = 0; i < m_ImageFileNames.GetSize(); i++)
+  for (unsigned i = 0; i < this->GetNumberOfInputs(); i++)
     if (m_AffineTransformReadFlags[i] == 0)
        allReadOK = false;
 
@@ -301,6 +328,53 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
     itkExceptionMacro(<< "No images specified");
   
   m_ImageFileNames = names;
+  m_GivenInputImages.Clear();
+
+  this->InitializeTransforms(numImages);
+}
+
+template <class TOutputPixel, class TProbabilityPixel>
+void
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::SetInputImages(const InternalImageList& images)
+{
+
+  itkDebugMacro(<< "SetInputImages");
+
+  unsigned int numImages = images.GetSize();
+
+  if (numImages == 0)
+    itkExceptionMacro(<< "No images specified");
+
+  m_GivenInputImages = images;
+  m_ImageFileNames.Clear();
+
+  this->InitializeTransforms(numImages);
+}
+
+template <class TOutputPixel, class TProbabilityPixel>
+unsigned int
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::GetNumberOfInputs() const
+{
+  if (m_GivenInputImages.GetSize() != 0)
+    return m_GivenInputImages.GetSize();
+  return m_ImageFileNames.GetSize();
+}
+
+template <class TOutputPixel, class TProbabilityPixel>
+bool
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::HasTemplate() const
+{
+  return m_TemplateFileName.length() != 0 || !m_CompiledAtlas.IsNull();
+}
+
+template <class TOutputPixel, class TProbabilityPixel>
+void
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::InitializeTransforms(unsigned int numImages)
+{
 
   m_TemplateAffineTransform = AffineTransformType::New();
 
@@ -334,6 +408,8 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
 
   m_TemplateFileName = dir + std::string("template.mha");
 
+  m_CompiledAtlas = 0;
+
   m_TemplateAffineTransform = AffineTransformType::New();
 
   m_AffineTransformReadFlags[0] = 0;
@@ -344,6 +420,19 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
   m_Modified = true;
 }
 
+template <class TOutputPixel, class TProbabilityPixel>
+void
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::SetCompiledAtlas(CompiledAtlas* atlas)
+{
+  m_GivenCompiledAtlas = atlas;
+
+  m_DoneRegistration = false;
+  m_DoneResample = false;
+
+  m_Modified = true;
+}
+
 template <class TOutputPixel, class TProbabilityPixel>
 void
 AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
@@ -426,6 +515,8 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
 
   if (m_Modified)
   {
+    this->OpenCompiledAtlas();
+    this->PrefetchImages();
     this->ReadImages();
     m_DoneRegistration = false;
     m_DoneResample = false;
@@ -437,6 +528,9 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
   if (m_Modified || !m_DoneResample)
     this->ResampleImages();
 
+  // Release the files read for this update
+  m_Prefetcher = 0;
+
   m_Modified = false;
 
 }
@@ -496,27 +590,28 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
 
   this->VerifyInitialization();
 
-  typedef itk::ImageFileReader<InternalImageType> ReaderType;
-  typedef typename ReaderType::Pointer ReaderPointer;
-
   typedef ImageDirectionStandardizer<InternalImageType> DirectionFixerType;
   typedef typename DirectionFixerType::Pointer DirectionFixerPointer;
 
   typedef PairRegistrationMethod<InternalImagePixelType> PairRegType;
 
   m_InputImages.Clear();
-  m_InputImages.Initialize(m_ImageFileNames.GetSize(), 0);
-  for (unsigned int i = 0; i < m_ImageFileNames.GetSize(); i++)
+  m_InputImages.Initialize(this->GetNumberOfInputs(), 0);
+  for (unsigned int i = 0; i < this->GetNumberOfInputs(); i++)
   {
-    muLogMacro(
-      << "Reading image " << i+1 << ": " << m_ImageFileNames[i] << "...\n");
+    InternalImagePointer img_i;
 
-    ReaderPointer imgreader = ReaderType::New();
-    imgreader->SetFileName(m_ImageFileNames[i].c_str());
-
-    imgreader->Update();
+    if (m_GivenInputImages.GetSize() != 0)
+    {
+      img_i = m_GivenInputImages[i];
+    }
+    else
+    {
+      muLogMacro(
+        << "Reading image " << i+1 << ": " << m_ImageFileNames[i] << "...\n");
 
-    InternalImagePointer img_i = imgreader->GetOutput();
+      img_i = this->ReadImageFile(m_ImageFileNames[i]);
+    }
 
     m_InputImages[i] = img_i;
 
@@ -540,116 +635,512 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
 
   itkDebugMacro(<< "RegisterImages");
 
-  typedef itk::ImageFileReader<InternalImageType> ReaderType;
-  typedef typename ReaderType::Pointer ReaderPointer;
+  // Pairwise registrations are independent, run them as concurrent tasks
+  m_RegistrationTasks.Clear();
 
-  typedef ImageDirectionStandardizer<InternalImageType> DirectionFixerType;
-  typedef typename DirectionFixerType::Pointer DirectionFixerPointer;
+  if (this->HasTemplate()
+      &&
+      (m_AffineTransformReadFlags[0] == 0))
+    m_RegistrationTasks.Append(0);
 
-  typedef PairRegistrationMethod<InternalImagePixelType> PairRegType;
+  for (unsigned int i = 1; i < this->GetNumberOfInputs(); i++)
+    if (m_AffineTransformReadFlags[i] == 0)
+      m_RegistrationTasks.Append(i);
 
-  // Get the first image (for reference)
-  InternalImagePointer first = m_InputImages[0];
+  unsigned int numTasks = m_RegistrationTasks.GetSize();
 
-  // Register template to first image
-  if ((m_TemplateFileName.length() != 0)
-       &&
-      (m_AffineTransformReadFlags[0] == 0))
+  if (numTasks == 0)
   {
-    if (m_AtlasLinearTransformChoice == ID_TRANSFORM)
-    {
-      m_TemplateAffineTransform = AffineTransformType::New();
-      m_TemplateAffineTransform->SetIdentity();
-    }
+    m_DoneRegistration = true;
+    return;
+  }
 
-    itkDebugMacro(<< "Registering template " << m_TemplateFileName << "...");
-    ReaderPointer reader = ReaderType::New();
-    reader->SetFileName(m_TemplateFileName.c_str());
-    reader->Update();
+  unsigned int numThreads =
+    itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  unsigned int numConcurrent = numTasks;
+  if (m_NumberOfConcurrentRegistrations > 0
+      &&
+      numConcurrent > m_NumberOfConcurrentRegistrations)
+    numConcurrent = m_NumberOfConcurrentRegistrations;
+  if (numConcurrent > numThreads)
+    numConcurrent = numThreads;
+  if (numConcurrent < 1)
+    numConcurrent = 1;
+
+  // Split the threads between the concurrent registrations
+  m_ThreadsPerRegistration = numThreads / numConcurrent;
+  if (m_ThreadsPerRegistration < 1)
+    m_ThreadsPerRegistration = 1;
+
+  // Downsampled images of the first image are shared by all registrations
+  m_RegistrationPyramids = PyramidCacheType::New();
+
+  m_RegistrationErrors.Clear();
+  m_RegistrationErrors.Initialize(numTasks, std::string(""));
+
+  // Previous results for the same images and settings are reused
+  m_ResultCache = 0;
+  if (m_RegistrationCacheDirectory.length() != 0)
+  {
+    m_ResultCache = ResultCacheType::New();
+    m_ResultCache->SetDirectory(m_RegistrationCacheDirectory);
+    m_FirstImageDigest =
+      ResultCacheType::ComputeImageDigest(m_InputImages[0]);
+  }
 
-    InternalImagePointer templateImg = reader->GetOutput();
+  // Create the shared singletons before the threads use them
+  MersenneTwisterRNG::GetGlobalInstance();
+  BinIndexImageCache::GetGlobalInstance();
 
-    if (m_AtlasOrientation.length() != 0)
+  if (numConcurrent == 1)
+  {
+    for (unsigned int k = 0; k < numTasks; k++)
     {
-      DirectionFixerPointer dirstandf = DirectionFixerType::New();
-      dirstandf->SetTargetDirectionFromString(
-        m_InputImages[0], m_ImageOrientations[0]);
-      templateImg = dirstandf->Standardize(templateImg, m_AtlasOrientation);
+      if (m_RegistrationTasks[k] == 0)
+        this->RegisterTemplate(
+          m_RegistrationPyramids, m_ThreadsPerRegistration);
+      else
+        this->RegisterImage(m_RegistrationTasks[k],
+          m_RegistrationPyramids, m_ThreadsPerRegistration);
     }
+  }
+  else
+  {
+    muLogMacro(<< "Running " << numTasks << " registrations, "
+      << numConcurrent << " at a time...\n");
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    // Messages from the registration threads go to this thread's log
+    m_LogOwner = mu::Log::GetInstance()->GetThreadOwner();
+
+    threader->SetNumberOfThreads(numConcurrent);
+    threader->SetSingleMethod(
+      &AtlasRegistrationMethod::_registerThread, (void*)this);
+    threader->SingleMethodExecute();
+  }
+
+  m_RegistrationPyramids = 0;
+  m_ResultCache = 0;
+
+  std::string errors;
+  for (unsigned int k = 0; k < m_RegistrationErrors.GetSize(); k++)
+    errors += m_RegistrationErrors[k];
+
+  if (errors.size() != 0)
+    itkExceptionMacro(<< "Registration failed: " << errors);
+
+  m_DoneRegistration = true;
+
+}
 
-    muLogMacro(<< "Registering template to first image...\n");
+template <class TOutputPixel, class TProbabilityPixel>
+ITK_THREAD_RETURN_TYPE
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::_registerThread(void* arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfoType;
+  ThreadInfoType* infoStruct = static_cast<ThreadInfoType*>(arg);
+
+  const unsigned int threadId = infoStruct->ThreadID;
+  const unsigned int numThreads = infoStruct->NumberOfThreads;
+
+  AtlasRegistrationMethod* obj =
+    static_cast<AtlasRegistrationMethod*>(infoStruct->UserData);
+
+  unsigned long prevOwner =
+    mu::Log::GetInstance()->SetThreadOwner(obj->m_LogOwner);
 
-    if (m_AtlasLinearTransformChoice == AFFINE_TRANSFORM)
+  // Tasks are distributed over the threads actually started, in case the
+  // threader limits the number of threads
+  for (unsigned int k = threadId; k < obj->m_RegistrationTasks.GetSize();
+       k += numThreads)
+  {
+    try
     {
-      if (m_FastRegistration)
-        m_TemplateAffineTransform =
-          PairRegistrationMethod<InternalImagePixelType>::
-            RegisterAffineFast(first, templateImg, PairRegType::QuantizeNone);
+      unsigned int i = obj->m_RegistrationTasks[k];
+      if (i == 0)
+        obj->RegisterTemplate(
+          obj->m_RegistrationPyramids, obj->m_ThreadsPerRegistration);
       else
-        m_TemplateAffineTransform =
-          PairRegistrationMethod<InternalImagePixelType>::
-            RegisterAffine(first, templateImg, PairRegType::QuantizeNone);
+        obj->RegisterImage(i,
+          obj->m_RegistrationPyramids, obj->m_ThreadsPerRegistration);
     }
-
-    if (m_AtlasLinearTransformChoice == RIGID_TRANSFORM)
+    catch (itk::ExceptionObject& e)
     {
-      if (m_FastRegistration)
-        m_TemplateAffineTransform =
-          PairRegistrationMethod<InternalImagePixelType>::
-            RegisterRigidFast(first, templateImg, PairRegType::QuantizeNone);
-      else
-        m_TemplateAffineTransform =
-          PairRegistrationMethod<InternalImagePixelType>::
-            RegisterRigid(first, templateImg, PairRegType::QuantizeNone);
+      obj->m_RegistrationErrors[k] = e.GetDescription();
+    }
+    catch (std::exception& e)
+    {
+      obj->m_RegistrationErrors[k] = e.what();
     }
+  }
+
+  mu::Log::GetInstance()->SetThreadOwner(prevOwner);
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TOutputPixel, class TProbabilityPixel>
+void
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::RegisterTemplate(PyramidCacheType* pyramids, unsigned int numThreads)
+{
+
+  // Get the first image (for reference)
+  InternalImagePointer first = m_InputImages[0];
 
+  if (m_AtlasLinearTransformChoice == ID_TRANSFORM)
+  {
+    m_TemplateAffineTransform = AffineTransformType::New();
+    m_TemplateAffineTransform->SetIdentity();
   }
 
-  // Register each image to first image
-  for (unsigned int i = 1; i < m_ImageFileNames.GetSize(); i++)
+  itkDebugMacro(<< "Registering template " << m_TemplateFileName << "...");
+  InternalImagePointer templateImg = this->ReadAtlasTemplate();
+
+  std::string cacheKey;
+  AffineTransformPointer cached = this->FindCachedTransform(
+    templateImg, m_AtlasLinearTransformChoice, cacheKey);
+  if (!cached.IsNull())
   {
-    if (m_AffineTransformReadFlags[i] != 0)
-      continue;
+    muLogMacro(<< "Using cached registration of template to first image\n");
+    m_TemplateAffineTransform = cached;
+    return;
+  }
 
-    if (m_ImageLinearTransformChoice == ID_TRANSFORM)
+  muLogMacro(<< "Registering template to first image...\n");
+
+  // Downsampled templates from the compiled atlas, valid if the template was
+  // not reoriented
+  if (pyramids != 0 && !m_CompiledAtlas.IsNull())
+  {
+    InternalImagePointer compiledTemplate = m_CompiledAtlas->GetTemplate();
+    if (templateImg->GetBufferPointer() ==
+        compiledTemplate->GetBufferPointer()
+        &&
+        templateImg->GetDirection() == compiledTemplate->GetDirection())
     {
-      m_AffineTransforms[i] = AffineTransformType::New();
-      m_AffineTransforms[i]->SetIdentity();
-      continue;
+      for (unsigned int i = 0; i < m_CompiledAtlas->GetNumberOfTemplateLevels();
+           i++)
+        pyramids->SetLevel(templateImg,
+          m_CompiledAtlas->GetTemplateLevelFactors(i),
+          ShareAtlasImage(m_CompiledAtlas->GetTemplateLevel(i)));
     }
+  }
 
-    muLogMacro(<< "Registering image " << i+1 << " to first image...\n");
+  typename PairRegType::InitializationOption initOption =
+    PairRegType::InitializeCenters;
+  if (m_MomentInitialization)
+    initOption = PairRegType::InitializeMoments;
 
-    InternalImagePointer img_i = m_InputImages[i];
+  typename PairRegType::MetricOption metricOption = PairRegType::MetricMI;
+  if (m_HCMetric)
+    metricOption = PairRegType::MetricHC;
 
-    if (m_ImageLinearTransformChoice == AFFINE_TRANSFORM)
-    {
-      if (m_FastRegistration)
-        m_AffineTransforms[i] = 
-          PairRegistrationMethod<InternalImagePixelType>::
-            RegisterAffineFast(first, img_i, PairRegType::QuantizeNone);
-      else
-        m_AffineTransforms[i] = 
-          PairRegistrationMethod<InternalImagePixelType>::
-            RegisterAffine(first, img_i, PairRegType::QuantizeNone);
-    }
+  if (m_AtlasLinearTransformChoice == AFFINE_TRANSFORM)
+  {
+    if (m_FastRegistration)
+      m_TemplateAffineTransform =
+        PairRegType::RegisterAffineFast(first, templateImg,
+          PairRegType::QuantizeNone, metricOption, initOption,
+          pyramids, numThreads);
+    else
+      m_TemplateAffineTransform =
+        PairRegType::RegisterAffine(first, templateImg,
+          PairRegType::QuantizeNone, metricOption, initOption,
+          pyramids, numThreads);
+  }
+
+  if (m_AtlasLinearTransformChoice == RIGID_TRANSFORM)
+  {
+    if (m_FastRegistration)
+      m_TemplateAffineTransform =
+        PairRegType::RegisterRigidFast(first, templateImg,
+          PairRegType::QuantizeNone, metricOption, initOption,
+          pyramids, numThreads);
+    else
+      m_TemplateAffineTransform =
+        PairRegType::RegisterRigid(first, templateImg,
+          PairRegType::QuantizeNone, metricOption, initOption,
+          pyramids, numThreads);
+  }
+
+  this->StoreCachedTransform(cacheKey, m_TemplateAffineTransform);
 
-    if (m_ImageLinearTransformChoice == RIGID_TRANSFORM)
+}
+
+template <class TOutputPixel, class TProbabilityPixel>
+void
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::RegisterImage(unsigned int i,
+  PyramidCacheType* pyramids, unsigned int numThreads)
+{
+
+  if (m_ImageLinearTransformChoice == ID_TRANSFORM)
+  {
+    m_AffineTransforms[i] = AffineTransformType::New();
+    m_AffineTransforms[i]->SetIdentity();
+    return;
+  }
+
+  InternalImagePointer first = m_InputImages[0];
+  InternalImagePointer img_i = m_InputImages[i];
+
+  std::string cacheKey;
+  AffineTransformPointer cached = this->FindCachedTransform(
+    img_i, m_ImageLinearTransformChoice, cacheKey);
+  if (!cached.IsNull())
+  {
+    muLogMacro(<< "Using cached registration of image " << i+1
+      << " to first image\n");
+    m_AffineTransforms[i] = cached;
+    return;
+  }
+
+  muLogMacro(<< "Registering image " << i+1 << " to first image...\n");
+
+  typename PairRegType::InitializationOption initOption =
+    PairRegType::InitializeCenters;
+  if (m_MomentInitialization)
+    initOption = PairRegType::InitializeMoments;
+
+  typename PairRegType::MetricOption metricOption = PairRegType::MetricMI;
+  if (m_HCMetric)
+    metricOption = PairRegType::MetricHC;
+
+  if (m_ImageLinearTransformChoice == AFFINE_TRANSFORM)
+  {
+    if (m_FastRegistration)
+      m_AffineTransforms[i] =
+        PairRegType::RegisterAffineFast(first, img_i,
+          PairRegType::QuantizeNone, metricOption, initOption,
+          pyramids, numThreads);
+    else
+      m_AffineTransforms[i] =
+        PairRegType::RegisterAffine(first, img_i,
+          PairRegType::QuantizeNone, metricOption, initOption,
+          pyramids, numThreads);
+  }
+
+  if (m_ImageLinearTransformChoice == RIGID_TRANSFORM)
+  {
+    if (m_FastRegistration)
+      m_AffineTransforms[i] =
+        PairRegType::RegisterRigidFast(first, img_i,
+          PairRegType::QuantizeNone, metricOption, initOption,
+          pyramids, numThreads);
+    else
+      m_AffineTransforms[i] =
+        PairRegType::RegisterRigid(first, img_i,
+          PairRegType::QuantizeNone, metricOption, initOption,
+          pyramids, numThreads);
+  }
+
+  this->StoreCachedTransform(cacheKey, m_AffineTransforms[i]);
+
+}
+
+template <class TOutputPixel, class TProbabilityPixel>
+std::string
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::GetRegistrationSettings(LinearTransformChoice c) const
+{
+  std::ostringstream oss;
+
+  if (c == RIGID_TRANSFORM)
+    oss << "rigid";
+  else
+    oss << "affine";
+
+  if (m_FastRegistration)
+    oss << " fast";
+
+  if (m_MomentInitialization)
+    oss << " moments";
+
+  if (m_HCMetric)
+    oss << " hc";
+
+  oss << " prefilter " << m_PrefilteringMethod;
+  if (m_PrefilteringMethod.length() != 0)
+    oss << " " << m_PrefilteringIterations << " " << m_PrefilteringTimeStep;
+
+  return oss.str();
+}
+
+template <class TOutputPixel, class TProbabilityPixel>
+typename AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::AffineTransformPointer
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::FindCachedTransform(InternalImageType* movingImg,
+  LinearTransformChoice c, std::string& key)
+{
+  key = "";
+
+  if (m_ResultCache.IsNull() || c == ID_TRANSFORM)
+    return 0;
+
+  key = ResultCacheType::ComputeKey(m_FirstImageDigest,
+    ResultCacheType::ComputeImageDigest(movingImg),
+    this->GetRegistrationSettings(c));
+
+  return m_ResultCache->Find(key);
+}
+
+template <class TOutputPixel, class TProbabilityPixel>
+void
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::StoreCachedTransform(
+  const std::string& key, const AffineTransformType* affine)
+{
+  if (m_ResultCache.IsNull() || key.length() == 0)
+    return;
+
+  // Failing to store only costs time in later runs
+  try
+  {
+    m_ResultCache->Store(key, affine);
+  }
+  catch (itk::ExceptionObject& e)
+  {
+    muLogMacro(<< "Warning: " << e.GetDescription() << "\n");
+  }
+  catch (std::exception& e)
+  {
+    muLogMacro(<< "Warning: " << e.what() << "\n");
+  }
+}
+
+template <class TOutputPixel, class TProbabilityPixel>
+void
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::OpenCompiledAtlas()
+{
+  m_CompiledAtlas = 0;
+
+  if (!m_GivenCompiledAtlas.IsNull())
+  {
+    m_CompiledAtlas = m_GivenCompiledAtlas;
+    return;
+  }
+
+  // Only replaces the default template and the numbered priors
+  if (m_AtlasDirectory.length() == 0
+      ||
+      m_TemplateFileName.compare(m_AtlasDirectory + "template.mha") != 0)
+    return;
+
+  CompiledAtlas::Pointer atlas = CompiledAtlas::OpenDirectory(m_AtlasDirectory);
+  if (atlas.IsNull())
+    return;
+
+  muLogMacro(<< "Using compiled atlas " << atlas->GetFileName() << "\n");
+
+  m_CompiledAtlas = atlas;
+}
+
+template <class TOutputPixel, class TProbabilityPixel>
+void
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::PrefetchImages()
+{
+  m_Prefetcher = PrefetcherType::New();
+
+  // In the order they are needed
+  for (unsigned int i = 0; i < m_ImageFileNames.GetSize(); i++)
+    m_Prefetcher->AddFileName(m_ImageFileNames[i]);
+
+  if (m_CompiledAtlas.IsNull())
+  {
+    if (m_TemplateFileName.length() != 0)
+      m_Prefetcher->AddFileName(m_TemplateFileName);
+
+    // Priors are read until the first missing file
+    for (unsigned int k = 1; m_AtlasDirectory.length() != 0; k++)
     {
-      if (m_FastRegistration)
-        m_AffineTransforms[i] = 
-          PairRegistrationMethod<InternalImagePixelType>::
-            RegisterRigidFast(first, img_i, PairRegType::QuantizeNone);
-      else
-        m_AffineTransforms[i] = 
-          PairRegistrationMethod<InternalImagePixelType>::
-            RegisterRigid(first, img_i, PairRegType::QuantizeNone);
+      std::ostringstream oss;
+      oss << m_AtlasDirectory << k << ".mha";
+      if (!itksys::SystemTools::FileExists(oss.str().c_str(), true))
+        break;
+      m_Prefetcher->AddFileName(oss.str());
     }
+  }
+
+  if (m_OtherTemplateFileName.length() != 0)
+    m_Prefetcher->AddFileName(m_OtherTemplateFileName);
+
+  // Nothing to read with images and atlas in memory
+  if (m_Prefetcher->GetNumberOfFileNames() == 0)
+    return;
+
+  muLogMacro(<< "Reading " << m_Prefetcher->GetNumberOfFileNames()
+    << " files in the background...\n");
+
+  m_Prefetcher->Start();
+}
+
+template <class TOutputPixel, class TProbabilityPixel>
+typename AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::InternalImagePointer
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::ReadImageFile(const std::string& fn)
+{
+  if (!m_Prefetcher.IsNull())
+    return m_Prefetcher->GetImage(fn);
+
+  return MappedImageReader<InternalImageType>::ReadImage(fn);
+}
+
+template <class TOutputPixel, class TProbabilityPixel>
+typename AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::InternalImagePointer
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::ReadAtlasTemplate()
+{
+  InternalImagePointer templateImg;
 
+  if (!m_CompiledAtlas.IsNull())
+  {
+    templateImg = ShareAtlasImage(m_CompiledAtlas->GetTemplate());
+  }
+  else
+  {
+    templateImg = this->ReadImageFile(m_TemplateFileName);
   }
 
-  m_DoneRegistration = true;
+  return this->StandardizeAtlasImage(templateImg);
+}
+
+template <class TOutputPixel, class TProbabilityPixel>
+typename AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::InternalImagePointer
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::ShareAtlasImage(InternalImageType* img)
+{
+  InternalImagePointer share = InternalImageType::New();
+  share->CopyInformation(img);
+  share->SetRegions(img->GetLargestPossibleRegion());
+  share->SetPixelContainer(img->GetPixelContainer());
+
+  return share;
+}
+
+template <class TOutputPixel, class TProbabilityPixel>
+typename AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::InternalImagePointer
+AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
+::StandardizeAtlasImage(InternalImagePointer img)
+{
+  if (m_AtlasOrientation.length() == 0)
+    return img;
+
+  typedef ImageDirectionStandardizer<InternalImageType> DirectionFixerType;
+  typename DirectionFixerType::Pointer dirstandf = DirectionFixerType::New();
+  dirstandf->SetTargetDirectionFromString(
+    m_InputImages[0], m_ImageOrientations[0]);
 
+  return dirstandf->Standardize(img, m_AtlasOrientation);
 }
 
 template <class TOutputPixel, class TProbabilityPixel>
@@ -663,10 +1154,6 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
   if (!m_DoneRegistration)
     return;
 
-  // Define the internal reader type
-  typedef itk::ImageFileReader<InternalImageType> ReaderType;
-  typedef typename ReaderType::Pointer ReaderPointer;
-
   // Orientation standardizer
   typedef ImageDirectionStandardizer<InternalImageType> DirectionFixerType;
   typedef typename DirectionFixerType::Pointer DirectionFixerPointer;
@@ -674,69 +1161,50 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
   // Get the first image (for reference)
   InternalImagePointer first = m_InputImages[0];
 
+  // Linear interpolation maps rows of voxels with the index to index matrix
+  // of the affine transform
+  typedef LinearAffineResampler<InternalImageType> LinearResampleType;
+  typedef typename LinearResampleType::Pointer LinearResamplePointer;
+
   typedef itk::ResampleImageFilter<InternalImageType, InternalImageType>
     ResampleType;
   typedef typename ResampleType::Pointer ResamplePointer;
 
-  typedef itk::LinearInterpolateImageFunction<InternalImageType, double>
-    LinearInterpolatorType;
   typedef itk::BSplineInterpolateImageFunction<InternalImageType, double, double>
     SplineInterpolatorType;
 
-  typename LinearInterpolatorType::Pointer linearInt =
-    LinearInterpolatorType::New();
-
   // Spline interpolation, only available for input images, not atlas
   typename SplineInterpolatorType::Pointer splineInt =
     SplineInterpolatorType::New();
   splineInt->SetSplineOrder(3);
 
-  // Resample the template
-  if (m_TemplateFileName.length() != 0)
-  {
-    muLogMacro(<< "Resampling template...\n");
-
-    ReaderPointer reader = ReaderType::New();
-    reader->SetFileName(m_TemplateFileName.c_str());
-    reader->Update();
-
-    InternalImagePointer templateImg = reader->GetOutput();
-
-    if (m_AtlasOrientation.length() != 0)
-    {
-      DirectionFixerPointer dirstandf = DirectionFixerType::New();
-      dirstandf->SetTargetDirectionFromString(
-        m_InputImages[0], m_ImageOrientations[0]);
-      templateImg = dirstandf->Standardize(templateImg, m_AtlasOrientation);
-    }
-
-    ResamplePointer resampler = ResampleType::New();
-
-    resampler->SetInput(templateImg);
-    resampler->SetTransform(m_TemplateAffineTransform);
+  // Template, other template and priors are resampled in one pass, sharing
+  // the voxel mapping and interpolation weights, with the priors normalized
+  // as they are resampled
+  LinearResamplePointer atlasResampler = LinearResampleType::New();
+  atlasResampler->SetTransform(m_TemplateAffineTransform);
+  atlasResampler->SetReferenceImage(first);
+  atlasResampler->SetDefaultPixelValue(0);
 
-    resampler->SetInterpolator(linearInt);
-    resampler->SetOutputParametersFromImage(first);
-    resampler->SetDefaultPixelValue(0);
+  unsigned int numAtlasImages = 0;
 
-    resampler->Update();
-
-    m_AffineTemplate = CopyOutputImage(resampler->GetOutput());
+  int templateInput = -1;
+  if (this->HasTemplate())
+  {
+    InternalImagePointer templateImg = this->ReadAtlasTemplate();
 
+    templateInput = numAtlasImages++;
+    atlasResampler->SetInput(templateInput, templateImg);
   }
 
 //TODO
 // HACK
-  // Resample the "other" template
+  // The "other" template
+  int otherTemplateInput = -1;
   if (m_OtherTemplateFileName.length() != 0)
   {
-    muLogMacro(<< "Resampling other template...\n");
-
-    ReaderPointer reader = ReaderType::New();
-    reader->SetFileName(m_OtherTemplateFileName.c_str());
-    reader->Update();
-
-    InternalImagePointer templateImg = reader->GetOutput();
+    InternalImagePointer templateImg =
+      this->ReadImageFile(m_OtherTemplateFileName);
 
     if (m_AtlasOrientation.length() != 0)
     {
@@ -746,90 +1214,75 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
       templateImg = dirstandf->Standardize(templateImg, m_AtlasOrientation);
     }
 
-    ResamplePointer resampler = ResampleType::New();
-
-    resampler->SetInput(templateImg);
-    resampler->SetTransform(m_TemplateAffineTransform);
-
-    resampler->SetInterpolator(linearInt);
-    resampler->SetOutputParametersFromImage(first);
-    resampler->SetDefaultPixelValue(0);
-
-    resampler->Update();
-
-    m_OtherAffineTemplate = CopyOutputImage(resampler->GetOutput());
+    otherTemplateInput = numAtlasImages++;
+    atlasResampler->SetInput(otherTemplateInput, templateImg);
   }
 
-  // Resample the probabilities
-  for (unsigned int i = 0; i < m_Probabilities.GetSize(); i++)
-    m_Probabilities[i] = 0;
-  m_Probabilities.Clear();
+  // The probabilities
+  unsigned int firstPriorInput = numAtlasImages;
+  if (!m_CompiledAtlas.IsNull())
+  {
+    for (unsigned int k = 0; k < m_CompiledAtlas->GetNumberOfPriors(); k++)
+    {
+      atlasResampler->SetInput(numAtlasImages,
+        this->StandardizeAtlasImage(
+          ShareAtlasImage(m_CompiledAtlas->GetPrior(k))));
+      atlasResampler->SetNormalizeInput(numAtlasImages, true);
+      numAtlasImages++;
+    }
+  }
   unsigned int prIndex = 0;
-  while (true)
+  while (m_CompiledAtlas.IsNull())
   {
     ++prIndex;
 
-    ReaderPointer reader = ReaderType::New();
+    InternalImagePointer prob_i;
 
     try
     {
       std::ostringstream oss;
-      oss << m_AtlasDirectory << prIndex << ".mha" << std::ends;
-      reader->SetFileName(oss.str().c_str());
-      reader->Update();
+      oss << m_AtlasDirectory << prIndex << ".mha";
+      prob_i = this->ReadImageFile(oss.str());
     }
     catch (...)
     {
       break;
     }
 
-    muLogMacro(<< "Resampling atlas prior " << prIndex << "...\n");
-
-    InternalImagePointer prob_i = reader->GetOutput();
-
-    if (m_AtlasOrientation.length() != 0)
-    {
-      DirectionFixerPointer dirstandf = DirectionFixerType::New();
-      dirstandf->SetTargetDirectionFromString(
-        m_InputImages[0], m_ImageOrientations[0]);
-      prob_i = dirstandf->Standardize(prob_i, m_AtlasOrientation);
-    }
-
-    ResamplePointer resampler = ResampleType::New();
+    prob_i = this->StandardizeAtlasImage(prob_i);
 
-    resampler->SetInput(prob_i);
-    resampler->SetTransform(m_TemplateAffineTransform);
-
-    resampler->SetInterpolator(linearInt);
-    resampler->SetOutputParametersFromImage(first);
-    resampler->SetDefaultPixelValue(0);
-
-    resampler->Update();
+    atlasResampler->SetInput(numAtlasImages, prob_i);
+    atlasResampler->SetNormalizeInput(numAtlasImages, true);
+    numAtlasImages++;
+  }
 
-    m_Probabilities.Append(CopyProbabilityImage(resampler->GetOutput()));
+  unsigned int numPriors = numAtlasImages - firstPriorInput;
 
+  if (numAtlasImages > 0)
+  {
+    muLogMacro(<< "Resampling atlas, "
+      << (templateInput >= 0 ? "template, " : "")
+      << (otherTemplateInput >= 0 ? "other template, " : "")
+      << numPriors << " priors...\n");
+    atlasResampler->Update();
   }
 
-  if (m_Probabilities.GetSize() > 0)
-  {
-    // Normalize probabilities
-    typedef itk::ImageRegionIteratorWithIndex<ProbabilityImageType>
-      ProbabilityIteratorType;
-    ProbabilityIteratorType it(
-      m_Probabilities[0], m_Probabilities[0]->GetLargestPossibleRegion());
-    for (it.GoToBegin(); !it.IsAtEnd(); ++it)
-    {
-      ProbabilityImageIndexType ind = it.GetIndex();
+  if (templateInput >= 0)
+    m_AffineTemplate =
+      CopyOutputImage(atlasResampler->GetOutput(templateInput));
 
-      double sump = 1e-20;
-      for (unsigned int k = 0; k < m_Probabilities.GetSize(); k++)
-        sump += m_Probabilities[k]->GetPixel(ind);
+  if (otherTemplateInput >= 0)
+    m_OtherAffineTemplate =
+      CopyOutputImage(atlasResampler->GetOutput(otherTemplateInput));
 
-      for (unsigned int k = 0; k < m_Probabilities.GetSize(); k++)
-        m_Probabilities[k]->SetPixel(ind,
-          m_Probabilities[k]->GetPixel(ind) / sump);
-    }
-  }
+  for (unsigned int i = 0; i < m_Probabilities.GetSize(); i++)
+    m_Probabilities[i] = 0;
+  m_Probabilities.Clear();
+  for (unsigned int k = 0; k < numPriors; k++)
+    m_Probabilities.Append(
+      CopyProbabilityImage(atlasResampler->GetOutput(firstPriorInput+k)));
+
+  atlasResampler = 0;
 
   // Clear image list
   for (unsigned int i = 0; i < m_Images.GetSize(); i++)
@@ -857,26 +1310,39 @@ AtlasRegistrationMethod<TOutputPixel, TProbabilityPixel>
   }
 
   // Resample the other images
-  for (unsigned int i = 1; i < m_ImageFileNames.GetSize(); i++)
+  for (unsigned int i = 1; i < this->GetNumberOfInputs(); i++)
   {
     muLogMacro(<< "Resampling input image " << i+1 << "...\n");
 
-    ResamplePointer resampler = ResampleType::New();
-
-    resampler->SetInput(m_InputImages[i]);
-    resampler->SetTransform(m_AffineTransforms[i]);
+    InternalImagePointer tmp;
 
     if (m_UseNonLinearInterpolation)
+    {
+      ResamplePointer resampler = ResampleType::New();
+
+      resampler->SetInput(m_InputImages[i]);
+      resampler->SetTransform(m_AffineTransforms[i]);
       resampler->SetInterpolator(splineInt);
+      resampler->SetDefaultPixelValue(m_OutsideFOVCode);
+      resampler->SetOutputParametersFromImage(first);
+
+      resampler->Update();
+
+      tmp = resampler->GetOutput();
+    }
     else
-      resampler->SetInterpolator(linearInt);
+    {
+      LinearResamplePointer resampler = LinearResampleType::New();
 
-    resampler->SetDefaultPixelValue(m_OutsideFOVCode);
-    resampler->SetOutputParametersFromImage(first);
+      resampler->SetInput(m_InputImages[i]);
+      resampler->SetTransform(m_AffineTransforms[i]);
+      resampler->SetReferenceImage(first);
+      resampler->SetDefaultPixelValue(m_OutsideFOVCode);
 
-    resampler->Update();
+      resampler->Update();
 
-    InternalImagePointer tmp = resampler->GetOutput();
+      tmp = resampler->GetOutput();
+    }
 
     // Zero the mask region outside FOV and also the intensities with outside
     // FOV code
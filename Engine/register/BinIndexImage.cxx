@@ -0,0 +1,299 @@
+
+#include "BinIndexImage.h"
+
+#include "itkImageRegionConstIteratorWithIndex.h"
+
+#include "muException.h"
+
+#include <algorithm>
+
+#include <stddef.h>
+
+BinIndexImage
+::BinIndexImage()
+{
+  m_NumberOfBins = 0;
+  m_BytesPerBin = 4;
+
+  m_Bricked = false;
+
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    m_Size[i] = 0;
+    m_BrickCounts[i] = 0;
+  }
+
+  m_NumberOfElements = 0;
+
+  m_Buffer8 = 0;
+  m_Buffer16 = 0;
+  m_Buffer32 = 0;
+}
+
+void
+BinIndexImage
+::Initialize(const IndexImageType* img, unsigned int numBins, bool bricked)
+{
+  if (img == 0)
+    muExceptionMacro(<< "NULL index image");
+
+  m_NumberOfBins = numBins;
+  m_Bricked = bricked;
+
+  // Largest value is reserved for invalid voxels
+  if (numBins <= 255)
+    m_BytesPerBin = 1;
+  else if (numBins <= 65535)
+    m_BytesPerBin = 2;
+  else
+    m_BytesPerBin = 4;
+
+  unsigned int invalidBin = 0xFFFFFFFF;
+  if (m_BytesPerBin == 1)
+    invalidBin = 0xFF;
+  else if (m_BytesPerBin == 2)
+    invalidBin = 0xFFFF;
+
+  IndexImageType::RegionType region = img->GetLargestPossibleRegion();
+  IndexImageType::SizeType size = region.GetSize();
+
+  for (unsigned int i = 0; i < 3; i++)
+    m_Size[i] = size[i];
+
+  if (m_Bricked)
+  {
+    // Pad to whole bricks
+    for (unsigned int i = 0; i < 3; i++)
+      m_BrickCounts[i] = (m_Size[i] + BrickSize - 1) / BrickSize;
+    m_NumberOfElements =
+      m_BrickCounts[0]*m_BrickCounts[1]*m_BrickCounts[2] *
+      BrickSize*BrickSize*BrickSize;
+  }
+  else
+  {
+    for (unsigned int i = 0; i < 3; i++)
+      m_BrickCounts[i] = 0;
+    m_NumberOfElements = m_Size[0]*m_Size[1]*m_Size[2];
+  }
+
+  // Align the start of the buffer, and so every brick, to a cache line
+  const size_t alignment = 64;
+
+  m_Storage.clear();
+  m_Storage.resize(m_NumberOfElements*m_BytesPerBin + alignment - 1);
+
+  size_t address = (size_t)&m_Storage[0];
+  unsigned char* buffer =
+    &m_Storage[0] + (alignment - address % alignment) % alignment;
+
+  m_Buffer8 = 0;
+  m_Buffer16 = 0;
+  m_Buffer32 = 0;
+
+  if (m_BytesPerBin == 1)
+  {
+    m_Buffer8 = buffer;
+    std::fill(m_Buffer8, m_Buffer8 + m_NumberOfElements,
+      (unsigned char)invalidBin);
+  }
+  else if (m_BytesPerBin == 2)
+  {
+    m_Buffer16 = (unsigned short*)buffer;
+    std::fill(m_Buffer16, m_Buffer16 + m_NumberOfElements,
+      (unsigned short)invalidBin);
+  }
+  else
+  {
+    m_Buffer32 = (unsigned int*)buffer;
+    std::fill(m_Buffer32, m_Buffer32 + m_NumberOfElements, invalidBin);
+  }
+
+  typedef itk::ImageRegionConstIteratorWithIndex<IndexImageType> IteratorType;
+  IteratorType it(img, region);
+
+  for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+  {
+    IndexImageType::IndexType ind = it.GetIndex();
+
+    unsigned int b = it.Get();
+    if (b >= numBins)
+      b = invalidBin;
+
+    long offset = this->ComputeOffset(
+      ind[0] - region.GetIndex()[0],
+      ind[1] - region.GetIndex()[1],
+      ind[2] - region.GetIndex()[2]);
+
+    if (m_BytesPerBin == 1)
+      m_Buffer8[offset] = (unsigned char)b;
+    else if (m_BytesPerBin == 2)
+      m_Buffer16[offset] = (unsigned short)b;
+    else
+      m_Buffer32[offset] = b;
+  }
+
+  this->Modified();
+}
+
+void
+BinIndexImage
+::PrintSelf(std::ostream& os, itk::Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+  os << indent << "NumberOfBins: " << m_NumberOfBins << std::endl;
+  os << indent << "BytesPerBin: " << m_BytesPerBin << std::endl;
+  os << indent << "Bricked: " << m_Bricked << std::endl;
+  os << indent << "Size: " << m_Size[0] << " x " << m_Size[1] << " x "
+     << m_Size[2] << std::endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+BinIndexImageCache* BinIndexImageCache::m_GlobalInstance = 0;
+
+// Guards the creation of the global instance, concurrent registrations of
+// different subjects may ask for it at the same time
+static itk::SimpleFastMutexLock _globalInstanceMutex;
+
+BinIndexImageCache
+::BinIndexImageCache()
+{
+  m_MaximumNumberOfEntries = 16;
+
+  m_UseCounter = 0;
+
+  m_NumberOfHits = 0;
+  m_NumberOfMisses = 0;
+}
+
+BinIndexImageCache*
+BinIndexImageCache
+::GetGlobalInstance()
+{
+  _globalInstanceMutex.Lock();
+  if (m_GlobalInstance == 0)
+    m_GlobalInstance = new BinIndexImageCache();
+  BinIndexImageCache* cache = m_GlobalInstance;
+  _globalInstanceMutex.Unlock();
+
+  return cache;
+}
+
+BinIndexImage::Pointer
+BinIndexImageCache
+::Find(const itk::Object* img,
+  unsigned int numBins, float sampleSpacing, MappingType mapping,
+  bool bricked)
+{
+  BinIndexImage::Pointer bins;
+
+  if (img == 0)
+    return bins;
+
+  unsigned long mtime = img->GetMTime();
+
+  m_Mutex.Lock();
+
+  for (unsigned int i = 0; i < m_Entries.size(); i++)
+  {
+    EntryType& e = m_Entries[i];
+    if (e.Image == img && e.ImageMTime == mtime
+        &&
+        e.NumberOfBins == numBins && e.SampleSpacing == sampleSpacing
+        &&
+        e.Mapping == mapping && e.Bricked == bricked)
+    {
+      e.LastUse = ++m_UseCounter;
+      bins = e.Bins;
+      break;
+    }
+  }
+
+  if (bins.IsNull())
+    m_NumberOfMisses++;
+  else
+    m_NumberOfHits++;
+
+  m_Mutex.Unlock();
+
+  return bins;
+}
+
+void
+BinIndexImageCache
+::Add(const itk::Object* img,
+  unsigned int numBins, float sampleSpacing, MappingType mapping,
+  bool bricked, BinIndexImage* bins)
+{
+  if (img == 0 || bins == 0 || m_MaximumNumberOfEntries == 0)
+    return;
+
+  EntryType e;
+  e.Image = img;
+  e.ImageMTime = img->GetMTime();
+  e.NumberOfBins = numBins;
+  e.SampleSpacing = sampleSpacing;
+  e.Mapping = mapping;
+  e.Bricked = bricked;
+  e.Bins = bins;
+
+  m_Mutex.Lock();
+
+  // Replace stale entries for the same image and settings
+  for (unsigned int i = 0; i < m_Entries.size(); i++)
+  {
+    EntryType& old = m_Entries[i];
+    if (old.Image == img
+        &&
+        old.NumberOfBins == numBins && old.SampleSpacing == sampleSpacing
+        &&
+        old.Mapping == mapping && old.Bricked == bricked)
+    {
+      m_Entries.erase(m_Entries.begin() + i);
+      break;
+    }
+  }
+
+  while (m_Entries.size() >= m_MaximumNumberOfEntries)
+    this->RemoveLeastRecentlyUsed();
+
+  e.LastUse = ++m_UseCounter;
+  m_Entries.push_back(e);
+
+  m_Mutex.Unlock();
+}
+
+void
+BinIndexImageCache
+::Clear()
+{
+  m_Mutex.Lock();
+  m_Entries.clear();
+  m_Mutex.Unlock();
+}
+
+void
+BinIndexImageCache
+::SetMaximumNumberOfEntries(unsigned int n)
+{
+  m_Mutex.Lock();
+  m_MaximumNumberOfEntries = n;
+  while (m_Entries.size() > m_MaximumNumberOfEntries)
+    this->RemoveLeastRecentlyUsed();
+  m_Mutex.Unlock();
+}
+
+void
+BinIndexImageCache
+::RemoveLeastRecentlyUsed()
+{
+  if (m_Entries.size() == 0)
+    return;
+
+  unsigned int oldest = 0;
+  for (unsigned int i = 1; i < m_Entries.size(); i++)
+    if (m_Entries[i].LastUse < m_Entries[oldest].LastUse)
+      oldest = i;
+
+  m_Entries.erase(m_Entries.begin() + oldest);
+}
@@ -0,0 +1,200 @@
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Compact storage of histogram bin indices for the MI metrics
+//
+// Bins are stored as 8, 16, or 32-bit values depending on the number of
+// bins. Values >= number of bins mark invalid voxels. Optionally stored as
+// 4x4x4 bricks, so the 2x2x2 neighborhoods used in partial volume
+// interpolation mostly come from one brick. The buffer is 64 byte aligned,
+// an 8-bit brick fills exactly one cache line.
+//
+// BinIndexImageCache keeps the bin images of recently quantized images so
+// metrics created for the same image (different registration stages, levels,
+// or image pairs) do not repeat the quantization.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _BinIndexImage_h
+#define _BinIndexImage_h
+
+#include "itkImage.h"
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkSimpleFastMutexLock.h"
+
+#include <vector>
+
+class BinIndexImage: public itk::Object
+{
+public:
+
+  /** Standard class typedefs. */
+  typedef BinIndexImage Self;
+  typedef itk::Object Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(BinIndexImage, itk::Object);
+
+  // Full size bin indices, as produced by the intensity mapping functions
+  typedef itk::Image<unsigned int, 3> IndexImageType;
+
+  // Bricks are BrickSize^3 voxels
+  enum { BrickShift = 2, BrickSize = 4, BrickMask = 3 };
+
+  void Initialize(
+    const IndexImageType* img, unsigned int numBins, bool bricked);
+
+  unsigned int GetNumberOfBins() const { return m_NumberOfBins; }
+
+  // 1, 2, or 4
+  unsigned int GetBytesPerBin() const { return m_BytesPerBin; }
+
+  bool IsBricked() const { return m_Bricked; }
+
+  const long* GetSize() const { return m_Size; }
+
+  unsigned long GetMemorySize() const
+  { return m_NumberOfElements * m_BytesPerBin; }
+
+  // Only the buffer matching the bytes per bin is valid
+  const unsigned char* GetBuffer8() const { return m_Buffer8; }
+  const unsigned short* GetBuffer16() const { return m_Buffer16; }
+  const unsigned int* GetBuffer32() const { return m_Buffer32; }
+
+  // Buffer offset of a voxel, no bounds checking
+  inline long ComputeOffset(long x, long y, long z) const
+  {
+    if (!m_Bricked)
+      return x + y*m_Size[0] + z*m_Size[0]*m_Size[1];
+
+    long brick =
+      ((z >> BrickShift)*m_BrickCounts[1] + (y >> BrickShift))*m_BrickCounts[0]
+      + (x >> BrickShift);
+
+    return (brick << (3*BrickShift))
+      + ((z & BrickMask) << (2*BrickShift))
+      + ((y & BrickMask) << BrickShift)
+      + (x & BrickMask);
+  }
+
+  inline unsigned int GetBinAtOffset(long offset) const
+  {
+    switch (m_BytesPerBin)
+    {
+      case 1: return m_Buffer8[offset];
+      case 2: return m_Buffer16[offset];
+      default: return m_Buffer32[offset];
+    }
+  }
+
+  inline unsigned int GetBin(long x, long y, long z) const
+  { return this->GetBinAtOffset(this->ComputeOffset(x, y, z)); }
+
+  template <class TIndex>
+  inline unsigned int GetBin(const TIndex& ind) const
+  { return this->GetBinAtOffset(this->ComputeOffset(ind[0], ind[1], ind[2])); }
+
+protected:
+
+  BinIndexImage();
+  ~BinIndexImage() { }
+
+  void PrintSelf(std::ostream& os, itk::Indent indent) const;
+
+private:
+  BinIndexImage(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  unsigned int m_NumberOfBins;
+  unsigned int m_BytesPerBin;
+
+  bool m_Bricked;
+
+  long m_Size[3];
+  long m_BrickCounts[3];
+
+  unsigned long m_NumberOfElements;
+
+  // Padded allocation, the buffers start at its first 64 byte boundary
+  std::vector<unsigned char> m_Storage;
+
+  unsigned char* m_Buffer8;
+  unsigned short* m_Buffer16;
+  unsigned int* m_Buffer32;
+
+};
+
+class BinIndexImageCache
+{
+
+public:
+
+  // Intensity to bin mapping used to create the cached bins
+  typedef enum{LinearMapping, KMeansMapping} MappingType;
+
+  // Get the pointer to the single global instance of the cache, created on
+  // first use, safe to call from any thread
+  static BinIndexImageCache* GetGlobalInstance();
+
+  // Returns a null pointer if there is no entry for the image, entries for an
+  // image that has been modified since quantization never match
+  BinIndexImage::Pointer Find(const itk::Object* img,
+    unsigned int numBins, float sampleSpacing, MappingType mapping,
+    bool bricked);
+
+  void Add(const itk::Object* img,
+    unsigned int numBins, float sampleSpacing, MappingType mapping,
+    bool bricked, BinIndexImage* bins);
+
+  void Clear();
+
+  // Least recently used entries are removed when full
+  void SetMaximumNumberOfEntries(unsigned int n);
+  unsigned int GetMaximumNumberOfEntries() const
+  { return m_MaximumNumberOfEntries; }
+
+  unsigned long GetNumberOfHits() const { return m_NumberOfHits; }
+  unsigned long GetNumberOfMisses() const { return m_NumberOfMisses; }
+
+protected:
+
+  BinIndexImageCache();
+  ~BinIndexImageCache() { }
+
+  struct EntryType
+  {
+    // Image identity, only compared and never dereferenced
+    const void* Image;
+    unsigned long ImageMTime;
+    unsigned int NumberOfBins;
+    float SampleSpacing;
+    MappingType Mapping;
+    bool Bricked;
+    BinIndexImage::Pointer Bins;
+    unsigned long LastUse;
+  };
+
+  void RemoveLeastRecentlyUsed();
+
+  std::vector<EntryType> m_Entries;
+
+  unsigned int m_MaximumNumberOfEntries;
+
+  unsigned long m_UseCounter;
+
+  unsigned long m_NumberOfHits;
+  unsigned long m_NumberOfMisses;
+
+  itk::SimpleFastMutexLock m_Mutex;
+
+  static BinIndexImageCache* m_GlobalInstance;
+
+};
+
+#endif
@@ -10,6 +10,12 @@ ChainedAffineTransform3D
   m_SourceCenter.Fill(0);
   m_TargetCenter.Fill(0);
 
+  m_IndexToIndexFixed = 0;
+  m_IndexToIndexMoving = 0;
+  m_IndexToIndexMTime = 0;
+  m_IndexToIndexFixedMTime = 0;
+  m_IndexToIndexMovingMTime = 0;
+
   this->SetIdentity();
 }
 
@@ -24,6 +30,12 @@ ChainedAffineTransform3D
   this->m_TargetCenter = other.m_TargetCenter;
   this->m_Parameters = other.m_Parameters;
   this->m_ForwardEvaluation = other.m_ForwardEvaluation;
+
+  m_IndexToIndexFixed = 0;
+  m_IndexToIndexMoving = 0;
+  m_IndexToIndexMTime = 0;
+  m_IndexToIndexFixedMTime = 0;
+  m_IndexToIndexMovingMTime = 0;
 }
 
 ChainedAffineTransform3D
@@ -44,6 +56,12 @@ ChainedAffineTransform3D
   this->m_Parameters = other.m_Parameters;
   this->m_ForwardEvaluation = other.m_ForwardEvaluation;
 
+  m_IndexToIndexFixed = 0;
+  m_IndexToIndexMoving = 0;
+  m_IndexToIndexMTime = 0;
+  m_IndexToIndexFixedMTime = 0;
+  m_IndexToIndexMovingMTime = 0;
+
   return *this;
 }
 
@@ -322,3 +340,192 @@ ChainedAffineTransform3D
 
   return inverse;
 }
+
+void
+ChainedAffineTransform3D
+::TransformPoints(const double* in, double* out, unsigned long n) const
+{
+  const MatrixType& A = this->GetMatrix();
+  const OffsetType& t = this->GetOffset();
+
+  const double a00 = A[0][0], a01 = A[0][1], a02 = A[0][2];
+  const double a10 = A[1][0], a11 = A[1][1], a12 = A[1][2];
+  const double a20 = A[2][0], a21 = A[2][1], a22 = A[2][2];
+  const double t0 = t[0], t1 = t[1], t2 = t[2];
+
+  for (unsigned long k = 0; k < 3*n; k += 3)
+  {
+    double x = in[k];
+    double y = in[k+1];
+    double z = in[k+2];
+    out[k] = a00*x + a01*y + a02*z + t0;
+    out[k+1] = a10*x + a11*y + a12*z + t1;
+    out[k+2] = a20*x + a21*y + a22*z + t2;
+  }
+}
+
+void
+ChainedAffineTransform3D
+::TransformPoints(const float* in, float* out, unsigned long n) const
+{
+  const MatrixType& A = this->GetMatrix();
+  const OffsetType& t = this->GetOffset();
+
+  const float a00 = A[0][0], a01 = A[0][1], a02 = A[0][2];
+  const float a10 = A[1][0], a11 = A[1][1], a12 = A[1][2];
+  const float a20 = A[2][0], a21 = A[2][1], a22 = A[2][2];
+  const float t0 = t[0], t1 = t[1], t2 = t[2];
+
+  for (unsigned long k = 0; k < 3*n; k += 3)
+  {
+    float x = in[k];
+    float y = in[k+1];
+    float z = in[k+2];
+    out[k] = a00*x + a01*y + a02*z + t0;
+    out[k+1] = a10*x + a11*y + a12*z + t1;
+    out[k+2] = a20*x + a21*y + a22*z + t2;
+  }
+}
+
+void
+ChainedAffineTransform3D
+::ComputeIndexToIndexMatrix(
+  const MatrixOffsetTransformType* transform,
+  const ImageBaseType* fixedImg, const ImageBaseType* movingImg, double* M)
+{
+  if (transform == 0 || fixedImg == 0 || movingImg == 0)
+    itkGenericExceptionMacro(<< "NULL input for index to index matrix");
+
+  // Fixed index to physical point: x = Of + Df*Sf*i
+  // Transform: y = A*x + t
+  // Physical point to moving index: j = inv(Sm)*inv(Dm)*(y - Om)
+  VNLMatrixType fixedToPhys(3, 3);
+  VNLMatrixType physToMoving(3, 3);
+  VNLMatrixType A(3, 3);
+
+  ImageBaseType::DirectionType fixedDir = fixedImg->GetDirection();
+  ImageBaseType::SpacingType fixedSpacing = fixedImg->GetSpacing();
+
+  ImageBaseType::DirectionType movingInvDir =
+    movingImg->GetInverseDirection();
+  ImageBaseType::SpacingType movingSpacing = movingImg->GetSpacing();
+
+  const MatrixOffsetTransformType::MatrixType& affineMatrix =
+    transform->GetMatrix();
+
+  for (unsigned int i = 0; i < 3; i++)
+    for (unsigned int j = 0; j < 3; j++)
+    {
+      fixedToPhys(i, j) = fixedDir[i][j] * fixedSpacing[j];
+      physToMoving(i, j) = movingInvDir[i][j] / movingSpacing[i];
+      A(i, j) = affineMatrix[i][j];
+    }
+
+  VNLMatrixType B = physToMoving * A * fixedToPhys;
+
+  const MatrixOffsetTransformType::OffsetType& affineOffset =
+    transform->GetOffset();
+  ImageBaseType::PointType fixedOrigin = fixedImg->GetOrigin();
+  ImageBaseType::PointType movingOrigin = movingImg->GetOrigin();
+
+  double y[3];
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    y[i] = affineOffset[i] - movingOrigin[i];
+    for (unsigned int j = 0; j < 3; j++)
+      y[i] += A(i, j) * fixedOrigin[j];
+  }
+
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    for (unsigned int j = 0; j < 3; j++)
+      M[4*i + j] = B(i, j);
+    M[4*i + 3] = 0.0;
+    for (unsigned int j = 0; j < 3; j++)
+      M[4*i + 3] += physToMoving(i, j) * y[j];
+  }
+}
+
+void
+ChainedAffineTransform3D
+::GetIndexToIndexMatrix(
+  const ImageBaseType* fixedImg, const ImageBaseType* movingImg,
+  double* M) const
+{
+  if (fixedImg == 0 || movingImg == 0)
+    itkExceptionMacro(<< "NULL image for index to index matrix");
+
+  unsigned long mtime = this->GetMTime();
+  unsigned long fixedMTime = fixedImg->GetMTime();
+  unsigned long movingMTime = movingImg->GetMTime();
+
+  m_IndexToIndexMutex.Lock();
+
+  if (fixedImg != m_IndexToIndexFixed || movingImg != m_IndexToIndexMoving
+      ||
+      mtime != m_IndexToIndexMTime
+      ||
+      fixedMTime != m_IndexToIndexFixedMTime
+      ||
+      movingMTime != m_IndexToIndexMovingMTime)
+  {
+    ComputeIndexToIndexMatrix(this, fixedImg, movingImg, m_IndexToIndexMatrix);
+    m_IndexToIndexFixed = fixedImg;
+    m_IndexToIndexMoving = movingImg;
+    m_IndexToIndexMTime = mtime;
+    m_IndexToIndexFixedMTime = fixedMTime;
+    m_IndexToIndexMovingMTime = movingMTime;
+  }
+
+  for (unsigned int i = 0; i < 12; i++)
+    M[i] = m_IndexToIndexMatrix[i];
+
+  m_IndexToIndexMutex.Unlock();
+}
+
+void
+ChainedAffineTransform3D
+::TransformIndexRow(const double* M, const IndexType& ind,
+  long step, unsigned long n, double* x, double* y, double* z)
+{
+  double x0 = M[0]*ind[0] + M[1]*ind[1] + M[2]*ind[2] + M[3];
+  double y0 = M[4]*ind[0] + M[5]*ind[1] + M[6]*ind[2] + M[7];
+  double z0 = M[8]*ind[0] + M[9]*ind[1] + M[10]*ind[2] + M[11];
+
+  double dx = M[0]*step;
+  double dy = M[4]*step;
+  double dz = M[8]*step;
+
+  // Computed from the row start instead of accumulated, so errors do not
+  // build up along long rows
+  for (unsigned long k = 0; k < n; k++)
+  {
+    double s = (double)k;
+    x[k] = x0 + s*dx;
+    y[k] = y0 + s*dy;
+    z[k] = z0 + s*dz;
+  }
+}
+
+void
+ChainedAffineTransform3D
+::TransformIndexRow(const double* M, const IndexType& ind,
+  long step, unsigned long n, float* x, float* y, float* z)
+{
+  // Row start in double precision, steps in single precision
+  float x0 = M[0]*ind[0] + M[1]*ind[1] + M[2]*ind[2] + M[3];
+  float y0 = M[4]*ind[0] + M[5]*ind[1] + M[6]*ind[2] + M[7];
+  float z0 = M[8]*ind[0] + M[9]*ind[1] + M[10]*ind[2] + M[11];
+
+  float dx = M[0]*step;
+  float dy = M[4]*step;
+  float dz = M[8]*step;
+
+  for (unsigned long k = 0; k < n; k++)
+  {
+    float s = (float)k;
+    x[k] = x0 + s*dx;
+    y[k] = y0 + s*dy;
+    z[k] = z0 + s*dz;
+  }
+}
@@ -33,6 +33,9 @@
 #define _ChainedAffineTransform3D_h
 
 #include "itkAffineTransform.h"
+#include "itkImageBase.h"
+#include "itkIndex.h"
+#include "itkSimpleFastMutexLock.h"
 
 #include "vnl/vnl_matrix.h"
 
@@ -72,6 +75,12 @@ public:
 
   typedef vnl_matrix<double> VNLMatrixType;
 
+  typedef itk::MatrixOffsetTransformBase<double, 3, 3>
+    MatrixOffsetTransformType;
+
+  typedef itk::ImageBase<3> ImageBaseType;
+  typedef itk::Index<3> IndexType;
+
   void SetIdentity();
 
   const ParametersType& GetParameters() const
@@ -102,6 +111,31 @@ public:
 
   Pointer GetInverse() const;
 
+  // Map n points stored as consecutive (x, y, z) triplets, in and out may
+  // be the same array
+  void TransformPoints(const double* in, double* out, unsigned long n) const;
+  void TransformPoints(const float* in, float* out, unsigned long n) const;
+
+  // Matrix mapping fixed image indices to moving image continuous indices,
+  // 3x4 row major with the offset in the last column
+  static void ComputeIndexToIndexMatrix(
+    const MatrixOffsetTransformType* transform,
+    const ImageBaseType* fixedImg, const ImageBaseType* movingImg, double* M);
+
+  // Index to index matrix for this transform, cached until the transform or
+  // the images are modified
+  void GetIndexToIndexMatrix(
+    const ImageBaseType* fixedImg, const ImageBaseType* movingImg,
+    double* M) const;
+
+  // Moving continuous indices of n fixed indices along a row, starting at
+  // ind and stepping by step voxels along x, stored in separate x, y, z
+  // arrays so the loop vectorizes
+  static void TransformIndexRow(const double* M, const IndexType& ind,
+    long step, unsigned long n, double* x, double* y, double* z);
+  static void TransformIndexRow(const double* M, const IndexType& ind,
+    long step, unsigned long n, float* x, float* y, float* z);
+
 private:
 
   ChainedAffineTransform3D();
@@ -119,6 +153,15 @@ private:
 
   bool m_ForwardEvaluation;
 
+  // Cached index to index matrix and what it was computed for
+  mutable double m_IndexToIndexMatrix[12];
+  mutable const ImageBaseType* m_IndexToIndexFixed;
+  mutable const ImageBaseType* m_IndexToIndexMoving;
+  mutable unsigned long m_IndexToIndexMTime;
+  mutable unsigned long m_IndexToIndexFixedMTime;
+  mutable unsigned long m_IndexToIndexMovingMTime;
+  mutable itk::SimpleFastMutexLock m_IndexToIndexMutex;
+
 };
 
 #endif
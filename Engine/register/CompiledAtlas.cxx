@@ -0,0 +1,751 @@
+
+#include "CompiledAtlas.h"
+
+#include "itkImageFileReader.h"
+
+#include "itksys/SystemTools.hxx"
+
+#include "vxl_config.h"
+
+#include "ImagePyramidCache.h"
+
+#include "Log.h"
+#include "muException.h"
+#include "muFile.h"
+
+#include <fstream>
+#include <sstream>
+
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#include <process.h>
+#define MU_GETPID _getpid
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#define MU_GETPID getpid
+#endif
+
+#define MU_COMPILED_ATLAS_MAGIC "MUATLAS"
+#define MU_COMPILED_ATLAS_VERSION 1
+#define MU_COMPILED_ATLAS_BYTE_ORDER 0x01020304
+
+// Volume data offsets are multiples of this, so mapped volumes start on page
+// boundaries
+#define MU_COMPILED_ATLAS_ALIGNMENT 4096
+
+// On disk layout, native byte order, all fields naturally aligned
+
+struct CompiledAtlasHeader
+{
+  char Magic[8];
+  vxl_uint_32 ByteOrder;
+  vxl_uint_32 Version;
+  vxl_uint_32 NumberOfVolumes;
+  vxl_uint_32 Reserved;
+  vxl_int_32 ROILowerBound[3];
+  vxl_int_32 ROIUpperBound[3];
+};
+
+typedef enum{VolumeTemplate, VolumePrior, VolumeMask, VolumeTemplateLevel}
+  CompiledAtlasVolumeKind;
+
+typedef enum{PixelFloat, PixelByte} CompiledAtlasPixelKind;
+
+struct CompiledAtlasVolume
+{
+  vxl_uint_32 Kind;
+  vxl_uint_32 PixelKind;
+  vxl_uint_32 Size[3];
+  vxl_uint_32 ShrinkFactors[3];
+  double Spacing[3];
+  double Origin[3];
+  double Direction[9];
+  vxl_uint_64 DataOffset;
+  vxl_uint_64 DataSize;
+};
+
+static void
+_fillVolumeRecord(CompiledAtlasVolume& v, const itk::ImageBase<3>* img,
+  unsigned int kind, unsigned int pixelKind, unsigned int pixelSize)
+{
+  memset(&v, 0, sizeof(CompiledAtlasVolume));
+
+  v.Kind = kind;
+  v.PixelKind = pixelKind;
+
+  itk::ImageBase<3>::SizeType size = img->GetLargestPossibleRegion().GetSize();
+
+  unsigned long numPixels = 1;
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    v.Size[i] = size[i];
+    v.ShrinkFactors[i] = 1;
+    v.Spacing[i] = img->GetSpacing()[i];
+    v.Origin[i] = img->GetOrigin()[i];
+    for (unsigned int j = 0; j < 3; j++)
+      v.Direction[3*i + j] = img->GetDirection()[i][j];
+    numPixels *= size[i];
+  }
+
+  v.DataSize = (vxl_uint_64)numPixels * pixelSize;
+}
+
+// Pixel container of a mapped volume, keeps the mapping alive while the
+// image is in use
+template <class TImage>
+class CompiledAtlasPixelContainer: public TImage::PixelContainer
+{
+public:
+  typedef CompiledAtlasPixelContainer Self;
+  typedef itk::SmartPointer<Self> Pointer;
+
+  itkNewMacro(Self);
+
+  CompiledAtlas::Pointer MappingOwner;
+
+protected:
+  CompiledAtlasPixelContainer() { }
+  ~CompiledAtlasPixelContainer() { }
+};
+
+template <class TImage>
+static typename TImage::Pointer
+_wrapVolume(CompiledAtlas* owner, unsigned char* base,
+  const CompiledAtlasVolume& v)
+{
+  typename TImage::Pointer img = TImage::New();
+
+  typename TImage::RegionType region;
+  typename TImage::SizeType size;
+  typename TImage::SpacingType spacing;
+  typename TImage::PointType origin;
+  typename TImage::DirectionType direction;
+
+  unsigned long numPixels = 1;
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    size[i] = v.Size[i];
+    spacing[i] = v.Spacing[i];
+    origin[i] = v.Origin[i];
+    for (unsigned int j = 0; j < 3; j++)
+      direction[i][j] = v.Direction[3*i + j];
+    numPixels *= v.Size[i];
+  }
+  region.SetSize(size);
+
+  img->SetRegions(region);
+  img->SetSpacing(spacing);
+  img->SetOrigin(origin);
+  img->SetDirection(direction);
+
+  // Container does not own the memory, it references the mapping instead
+  typedef CompiledAtlasPixelContainer<TImage> ContainerType;
+  typename ContainerType::Pointer container = ContainerType::New();
+  container->SetImportPointer(
+    (typename TImage::PixelType*)(base + v.DataOffset), numPixels, false);
+  container->MappingOwner = owner;
+
+  img->SetPixelContainer(container);
+
+  return img;
+}
+
+static vxl_uint_64
+_alignOffset(vxl_uint_64 offset)
+{
+  vxl_uint_64 a = MU_COMPILED_ATLAS_ALIGNMENT;
+  return ((offset + a - 1) / a) * a;
+}
+
+CompiledAtlas
+::CompiledAtlas()
+{
+  m_FileName = "";
+
+  m_Mapping = 0;
+  m_MappingSize = 0;
+
+#if defined(_MSC_VER)
+  m_FileHandle = 0;
+  m_MappingHandle = 0;
+#endif
+
+  m_ROILowerBound.Fill(0);
+  m_ROIUpperBound.Fill(0);
+}
+
+CompiledAtlas
+::~CompiledAtlas()
+{
+  this->Close();
+}
+
+CompiledAtlas::Pointer
+CompiledAtlas
+::Compile(FloatImageType* templateImg,
+  const DynArray<FloatImagePointer>& priors,
+  const DynArray<ShrinkFactorsType>& levelFactors)
+{
+  if (templateImg == 0)
+    muExceptionMacro(<< "No template for compiled atlas");
+  if (priors.GetSize() == 0)
+    muExceptionMacro(<< "No priors for compiled atlas");
+
+  FloatImageType::RegionType region = priors[0]->GetLargestPossibleRegion();
+
+  for (unsigned int k = 1; k < priors.GetSize(); k++)
+    if (priors[k]->GetLargestPossibleRegion().GetSize() != region.GetSize())
+      muExceptionMacro(<< "Prior " << k+1 << " size mismatch");
+
+  unsigned long numVoxels = region.GetNumberOfPixels();
+
+  Pointer atlas = CompiledAtlas::New();
+
+  atlas->m_Template = templateImg;
+
+  // Normalized priors and the mask
+  for (unsigned int k = 0; k < priors.GetSize(); k++)
+  {
+    FloatImagePointer p = FloatImageType::New();
+    p->CopyInformation(priors[k]);
+    p->SetRegions(region);
+    p->Allocate();
+    atlas->m_Priors.Append(p);
+  }
+
+  atlas->m_Mask = ByteImageType::New();
+  atlas->m_Mask->CopyInformation(priors[0]);
+  atlas->m_Mask->SetRegions(region);
+  atlas->m_Mask->Allocate();
+
+  FloatImageType::SizeType size = region.GetSize();
+
+  IndexType lower;
+  IndexType upper;
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    lower[i] = size[i]-1;
+    upper[i] = 0;
+  }
+
+  unsigned char* maskBuf = atlas->m_Mask->GetBufferPointer();
+
+  for (unsigned long n = 0; n < numVoxels; n++)
+  {
+    double sumRaw = 0;
+    double sump = 1e-20;
+    for (unsigned int k = 0; k < priors.GetSize(); k++)
+    {
+      double p = priors[k]->GetBufferPointer()[n];
+      sumRaw += p;
+      if (p < 0)
+        p = 0;
+      sump += p;
+    }
+
+    for (unsigned int k = 0; k < priors.GetSize(); k++)
+    {
+      double p = priors[k]->GetBufferPointer()[n];
+      if (p < 0)
+        p = 0;
+      atlas->m_Priors[k]->GetBufferPointer()[n] = (float)(p / sump);
+    }
+
+    maskBuf[n] = (sumRaw > 0) ? 1 : 0;
+
+    if (sumRaw > 0)
+    {
+      long ind[3];
+      ind[0] = n % size[0];
+      ind[1] = (n / size[0]) % size[1];
+      ind[2] = n / (size[0]*size[1]);
+      for (unsigned int i = 0; i < 3; i++)
+      {
+        if (ind[i] < lower[i])
+          lower[i] = ind[i];
+        if (ind[i] > upper[i])
+          upper[i] = ind[i];
+      }
+    }
+  }
+
+  // Empty mask, bounds cover the whole image
+  if (lower[0] > upper[0])
+    for (unsigned int i = 0; i < 3; i++)
+    {
+      lower[i] = 0;
+      upper[i] = size[i]-1;
+    }
+
+  atlas->m_ROILowerBound = lower;
+  atlas->m_ROIUpperBound = upper;
+
+  // Downsampled templates, computed the same way as during registration
+  typedef ImagePyramidCache<FloatImageType> PyramidCacheType;
+  PyramidCacheType::Pointer pyramids = PyramidCacheType::New();
+
+  for (unsigned int i = 0; i < levelFactors.GetSize(); i++)
+  {
+    atlas->m_TemplateLevels.Append(
+      pyramids->GetLevel(templateImg, levelFactors[i]));
+    atlas->m_TemplateLevelFactors.Append(levelFactors[i]);
+  }
+
+  return atlas;
+}
+
+CompiledAtlas::Pointer
+CompiledAtlas
+::ReadDirectory(const std::string& dir)
+{
+  std::string atlasdir = dir;
+  if (atlasdir.length() != 0 && atlasdir[atlasdir.length()-1] != MU_DIR_SEPARATOR)
+    atlasdir += MU_DIR_SEPARATOR;
+
+  typedef itk::ImageFileReader<FloatImageType> ReaderType;
+
+  std::string templatefn = atlasdir + std::string("template.mha");
+
+  ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(templatefn.c_str());
+  reader->Update();
+
+  FloatImagePointer templateImg = reader->GetOutput();
+
+  // Priors are numbered from one, until a file cannot be read
+  DynArray<FloatImagePointer> priors;
+  unsigned int prIndex = 0;
+  while (true)
+  {
+    ++prIndex;
+
+    std::ostringstream oss;
+    oss << atlasdir << prIndex << ".mha";
+
+    ReaderType::Pointer prReader = ReaderType::New();
+    try
+    {
+      prReader->SetFileName(oss.str().c_str());
+      prReader->Update();
+    }
+    catch (...)
+    {
+      break;
+    }
+
+    priors.Append(prReader->GetOutput());
+  }
+
+  // Shrink factors of the coarse registration levels for atlas and subject
+  // images with similar voxel sizes
+  DynArray<ShrinkFactorsType> levelFactors;
+  ShrinkFactorsType factors;
+  factors.Fill(2);
+  levelFactors.Append(factors);
+  factors.Fill(4);
+  levelFactors.Append(factors);
+
+  return Compile(templateImg, priors, levelFactors);
+}
+
+DynArray<std::string>
+CompiledAtlas
+::GetSourceFileNames(const std::string& dir)
+{
+  std::string atlasdir = dir;
+  if (atlasdir.length() != 0 && atlasdir[atlasdir.length()-1] != MU_DIR_SEPARATOR)
+    atlasdir += MU_DIR_SEPARATOR;
+
+  DynArray<std::string> fileNames;
+
+  std::string templatefn = atlasdir + std::string("template.mha");
+  if (itksys::SystemTools::FileExists(templatefn.c_str()))
+    fileNames.Append(templatefn);
+
+  // Priors are numbered from one, until a file is missing
+  unsigned int prIndex = 0;
+  while (true)
+  {
+    ++prIndex;
+
+    std::ostringstream oss;
+    oss << atlasdir << prIndex << ".mha";
+
+    if (!itksys::SystemTools::FileExists(oss.str().c_str()))
+      break;
+
+    fileNames.Append(oss.str());
+  }
+
+  return fileNames;
+}
+
+CompiledAtlas::Pointer
+CompiledAtlas
+::OpenDirectory(const std::string& dir)
+{
+  std::string atlasdir = dir;
+  if (atlasdir.length() != 0 && atlasdir[atlasdir.length()-1] != MU_DIR_SEPARATOR)
+    atlasdir += MU_DIR_SEPARATOR;
+
+  std::string fn = atlasdir + std::string(MU_COMPILED_ATLAS_NAME);
+
+  if (!itksys::SystemTools::FileExists(fn.c_str()))
+    return 0;
+
+  // Stale if any of the template and priors changed after compiling
+  DynArray<std::string> sourcefns = GetSourceFileNames(atlasdir);
+  for (unsigned int i = 0; i < sourcefns.GetSize(); i++)
+  {
+    int cmp = 0;
+    if (itksys::SystemTools::FileTimeCompare(
+          fn.c_str(), sourcefns[i].c_str(), &cmp)
+        &&
+        cmp < 0)
+    {
+      muLogMacro(<< "WARNING: " << fn << " is older than " << sourcefns[i]
+        << ", reading atlas files instead\n");
+      return 0;
+    }
+  }
+
+  Pointer atlas = CompiledAtlas::New();
+  try
+  {
+    atlas->Open(fn.c_str());
+  }
+  catch (mu::Exception& e)
+  {
+    muLogMacro(<< "WARNING: cannot use " << fn << ": " << e.what() << "\n");
+    return 0;
+  }
+
+  return atlas;
+}
+
+CompiledAtlas::Pointer
+CompiledAtlas
+::LoadDirectory(const std::string& dir)
+{
+  Pointer atlas = OpenDirectory(dir);
+  if (atlas.IsNull())
+    atlas = ReadDirectory(dir);
+
+  return atlas;
+}
+
+void
+CompiledAtlas
+::Write(const char* fn) const
+{
+  if (m_Template.IsNull() || m_Priors.GetSize() == 0 || m_Mask.IsNull())
+    muExceptionMacro(<< "Compiled atlas is empty");
+
+  // Volume records and the data they point to
+  DynArray<CompiledAtlasVolume> volumes;
+  DynArray<const void*> volumeData;
+
+  CompiledAtlasVolume v;
+
+  _fillVolumeRecord(v, m_Template, VolumeTemplate, PixelFloat, sizeof(float));
+  volumes.Append(v);
+  volumeData.Append(m_Template->GetBufferPointer());
+
+  for (unsigned int k = 0; k < m_Priors.GetSize(); k++)
+  {
+    _fillVolumeRecord(v, m_Priors[k], VolumePrior, PixelFloat, sizeof(float));
+    volumes.Append(v);
+    volumeData.Append(m_Priors[k]->GetBufferPointer());
+  }
+
+  _fillVolumeRecord(v, m_Mask, VolumeMask, PixelByte, sizeof(unsigned char));
+  volumes.Append(v);
+  volumeData.Append(m_Mask->GetBufferPointer());
+
+  for (unsigned int i = 0; i < m_TemplateLevels.GetSize(); i++)
+  {
+    _fillVolumeRecord(v, m_TemplateLevels[i], VolumeTemplateLevel, PixelFloat,
+      sizeof(float));
+    for (unsigned int j = 0; j < 3; j++)
+      v.ShrinkFactors[j] = m_TemplateLevelFactors[i][j];
+    volumes.Append(v);
+    volumeData.Append(m_TemplateLevels[i]->GetBufferPointer());
+  }
+
+  CompiledAtlasHeader header;
+  memset(&header, 0, sizeof(CompiledAtlasHeader));
+  strncpy(header.Magic, MU_COMPILED_ATLAS_MAGIC, 8);
+  header.ByteOrder = MU_COMPILED_ATLAS_BYTE_ORDER;
+  header.Version = MU_COMPILED_ATLAS_VERSION;
+  header.NumberOfVolumes = volumes.GetSize();
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    header.ROILowerBound[i] = m_ROILowerBound[i];
+    header.ROIUpperBound[i] = m_ROIUpperBound[i];
+  }
+
+  vxl_uint_64 offset = _alignOffset(
+    sizeof(CompiledAtlasHeader) +
+    volumes.GetSize() * sizeof(CompiledAtlasVolume));
+  for (unsigned int i = 0; i < volumes.GetSize(); i++)
+  {
+    volumes[i].DataOffset = offset;
+    offset = _alignOffset(offset + volumes[i].DataSize);
+  }
+
+  // Written to a temporary file and renamed, jobs mapping an older version
+  // keep their copy
+  std::ostringstream tmposs;
+  tmposs << fn << "." << MU_GETPID() << ".tmp";
+  std::string tmpfn = tmposs.str();
+
+  std::ofstream outfile;
+  outfile.open(tmpfn.c_str(), std::ios::out | std::ios::binary);
+  if (outfile.fail())
+    muExceptionMacro(<< "Failed opening " << tmpfn);
+
+  outfile.write((const char*)&header, sizeof(CompiledAtlasHeader));
+  outfile.write((const char*)volumes.GetRawArray(),
+    volumes.GetSize() * sizeof(CompiledAtlasVolume));
+
+  for (unsigned int i = 0; i < volumes.GetSize(); i++)
+  {
+    // Zero padding up to the aligned offset
+    while ((vxl_uint_64)outfile.tellp() < volumes[i].DataOffset)
+      outfile.put(0);
+    outfile.write((const char*)volumeData[i], volumes[i].DataSize);
+  }
+
+  bool failed = outfile.fail();
+  outfile.close();
+
+  if (failed
+      ||
+      !itksys::SystemTools::RenameFile(tmpfn.c_str(), fn))
+  {
+    itksys::SystemTools::RemoveFile(tmpfn.c_str());
+    muExceptionMacro(<< "Failed writing " << fn);
+  }
+}
+
+void
+CompiledAtlas
+::MapFile(const char* fn)
+{
+#if defined(_MSC_VER)
+  HANDLE fh = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ, NULL,
+    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (fh == INVALID_HANDLE_VALUE)
+    muExceptionMacro(<< "Failed opening " << fn);
+
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(fh, &fileSize) || fileSize.QuadPart == 0)
+  {
+    CloseHandle(fh);
+    muExceptionMacro(<< "Failed reading size of " << fn);
+  }
+
+  HANDLE mh = CreateFileMapping(fh, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+  if (mh == NULL)
+  {
+    CloseHandle(fh);
+    muExceptionMacro(<< "Failed mapping " << fn);
+  }
+
+  void* p = MapViewOfFile(mh, FILE_MAP_COPY, 0, 0, 0);
+  if (p == NULL)
+  {
+    CloseHandle(mh);
+    CloseHandle(fh);
+    muExceptionMacro(<< "Failed mapping " << fn);
+  }
+
+  m_FileHandle = fh;
+  m_MappingHandle = mh;
+  m_MappingSize = (unsigned long)fileSize.QuadPart;
+#else
+  int fd = open(fn, O_RDONLY);
+  if (fd < 0)
+    muExceptionMacro(<< "Failed opening " << fn);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0)
+  {
+    close(fd);
+    muExceptionMacro(<< "Failed reading size of " << fn);
+  }
+
+  // Private writable mapping, pages are shared until written to
+  void* p = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (p == MAP_FAILED)
+    muExceptionMacro(<< "Failed mapping " << fn);
+
+  m_MappingSize = st.st_size;
+#endif
+
+  m_Mapping = p;
+  m_FileName = fn;
+}
+
+void
+CompiledAtlas
+::UnmapFile()
+{
+  if (m_Mapping == 0)
+    return;
+
+#if defined(_MSC_VER)
+  UnmapViewOfFile(m_Mapping);
+  CloseHandle((HANDLE)m_MappingHandle);
+  CloseHandle((HANDLE)m_FileHandle);
+  m_MappingHandle = 0;
+  m_FileHandle = 0;
+#else
+  munmap(m_Mapping, m_MappingSize);
+#endif
+
+  m_Mapping = 0;
+  m_MappingSize = 0;
+  m_FileName = "";
+}
+
+void
+CompiledAtlas
+::Open(const char* fn)
+{
+  this->Close();
+
+  // The mapping belongs to a separate object referenced by the pixel
+  // containers of the mapped images, it is unmapped once this atlas and all
+  // of its images are gone
+  Pointer owner = CompiledAtlas::New();
+  owner->MapFile(fn);
+
+  m_MappingOwner = owner;
+  m_FileName = fn;
+
+  unsigned char* base = (unsigned char*)owner->m_Mapping;
+  unsigned long mappingSize = owner->m_MappingSize;
+
+  try
+  {
+    if (mappingSize < sizeof(CompiledAtlasHeader))
+      muExceptionMacro(<< fn << " is not a compiled atlas");
+
+    const CompiledAtlasHeader* header = (const CompiledAtlasHeader*)base;
+
+    if (strncmp(header->Magic, MU_COMPILED_ATLAS_MAGIC, 8) != 0)
+      muExceptionMacro(<< fn << " is not a compiled atlas");
+    if (header->ByteOrder != MU_COMPILED_ATLAS_BYTE_ORDER)
+      muExceptionMacro(<< fn << " was compiled on a machine with different byte order");
+    if (header->Version != MU_COMPILED_ATLAS_VERSION)
+      muExceptionMacro(<< fn << " has unsupported version " << header->Version);
+
+    vxl_uint_64 tableEnd = sizeof(CompiledAtlasHeader) +
+      (vxl_uint_64)header->NumberOfVolumes * sizeof(CompiledAtlasVolume);
+    if (tableEnd > mappingSize)
+      muExceptionMacro(<< fn << " is truncated");
+
+    for (unsigned int i = 0; i < 3; i++)
+    {
+      m_ROILowerBound[i] = header->ROILowerBound[i];
+      m_ROIUpperBound[i] = header->ROIUpperBound[i];
+    }
+
+    const CompiledAtlasVolume* volumes =
+      (const CompiledAtlasVolume*)(base + sizeof(CompiledAtlasHeader));
+
+    for (unsigned int k = 0; k < header->NumberOfVolumes; k++)
+    {
+      const CompiledAtlasVolume& v = volumes[k];
+
+      vxl_uint_64 pixelSize =
+        (v.PixelKind == PixelByte) ? sizeof(unsigned char) : sizeof(float);
+      vxl_uint_64 numPixels =
+        (vxl_uint_64)v.Size[0] * v.Size[1] * v.Size[2];
+
+      if (v.PixelKind != PixelFloat && v.PixelKind != PixelByte)
+        muExceptionMacro(<< fn << ": invalid pixel type in volume " << k);
+      if (v.DataSize != numPixels*pixelSize
+          ||
+          v.DataOffset % MU_COMPILED_ATLAS_ALIGNMENT != 0
+          ||
+          v.DataOffset < tableEnd
+          ||
+          v.DataOffset + v.DataSize > mappingSize)
+        muExceptionMacro(<< fn << ": invalid data range in volume " << k);
+
+      bool isFloat = (v.PixelKind == PixelFloat);
+
+      switch (v.Kind)
+      {
+        case VolumeTemplate:
+          if (!isFloat || !m_Template.IsNull())
+            muExceptionMacro(<< fn << ": invalid template volume");
+          m_Template = _wrapVolume<FloatImageType>(owner, base, v);
+          break;
+        case VolumePrior:
+          if (!isFloat)
+            muExceptionMacro(<< fn << ": invalid prior volume");
+          m_Priors.Append(_wrapVolume<FloatImageType>(owner, base, v));
+          break;
+        case VolumeMask:
+          if (isFloat || !m_Mask.IsNull())
+            muExceptionMacro(<< fn << ": invalid mask volume");
+          m_Mask = _wrapVolume<ByteImageType>(owner, base, v);
+          break;
+        case VolumeTemplateLevel:
+        {
+          if (!isFloat)
+            muExceptionMacro(<< fn << ": invalid template level volume");
+          m_TemplateLevels.Append(_wrapVolume<FloatImageType>(owner, base, v));
+          ShrinkFactorsType factors;
+          for (unsigned int j = 0; j < 3; j++)
+            factors[j] = v.ShrinkFactors[j];
+          m_TemplateLevelFactors.Append(factors);
+          break;
+        }
+        default:
+          // Volumes added by later versions are skipped
+          break;
+      }
+    }
+
+    if (m_Template.IsNull() || m_Priors.GetSize() == 0 || m_Mask.IsNull())
+      muExceptionMacro(<< fn << " is missing the template, priors or mask");
+  }
+  catch (...)
+  {
+    this->Close();
+    throw;
+  }
+}
+
+void
+CompiledAtlas
+::Close()
+{
+  m_Template = 0;
+  for (unsigned int i = 0; i < m_Priors.GetSize(); i++)
+    m_Priors[i] = 0;
+  m_Priors.Clear();
+  m_Mask = 0;
+  for (unsigned int i = 0; i < m_TemplateLevels.GetSize(); i++)
+    m_TemplateLevels[i] = 0;
+  m_TemplateLevels.Clear();
+  m_TemplateLevelFactors.Clear();
+
+  // Images still in use keep the mapping
+  m_MappingOwner = 0;
+  m_FileName = "";
+
+  this->UnmapFile();
+}
@@ -0,0 +1,151 @@
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Single file container for a compiled atlas: the template, the normalized
+// priors, the atlas mask and its bounding box, and downsampled templates for
+// registration
+//
+// Volumes are stored uncompressed at page aligned offsets, the file is mapped
+// read-only (copy on write) and the images point directly into the mapping,
+// so concurrent jobs on a machine share one page cached copy of the atlas.
+// The pixel containers of the images reference the mapping, which stays
+// until the atlas is closed and none of its images are in use.
+//
+// A compiled atlas can also be built in memory from the atlas files, to share
+// one copy between segmentations running in the same process.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _CompiledAtlas_h
+#define _CompiledAtlas_h
+
+#include "itkFixedArray.h"
+#include "itkImage.h"
+#include "itkIndex.h"
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+
+#include "DynArray.h"
+
+#include <string>
+
+// Name of the container in an atlas directory
+#define MU_COMPILED_ATLAS_NAME "atlas.mua"
+
+class CompiledAtlas: public itk::Object
+{
+
+public:
+
+  /** Standard class typedefs. */
+  typedef CompiledAtlas Self;
+  typedef itk::Object Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(CompiledAtlas, itk::Object);
+
+  typedef itk::Image<float, 3> FloatImageType;
+  typedef FloatImageType::Pointer FloatImagePointer;
+
+  typedef itk::Image<unsigned char, 3> ByteImageType;
+  typedef ByteImageType::Pointer ByteImagePointer;
+
+  typedef itk::Index<3> IndexType;
+
+  typedef itk::FixedArray<unsigned int, 3> ShrinkFactorsType;
+
+  // Compile in memory, the priors are normalized to sum to one at each voxel
+  // and the mask is where the priors are nonzero, the template is stored
+  // downsampled by each of the given shrink factors
+  static Pointer Compile(FloatImageType* templateImg,
+    const DynArray<FloatImagePointer>& priors,
+    const DynArray<ShrinkFactorsType>& levelFactors);
+
+  // Compile the template and priors of an atlas directory (template.mha,
+  // 1.mha, 2.mha, ...)
+  static Pointer ReadDirectory(const std::string& dir);
+
+  // Atlas files a container is compiled from, the template and the priors
+  // that exist in the directory
+  static DynArray<std::string> GetSourceFileNames(const std::string& dir);
+
+  // Mapped container of an atlas directory, NULL if there is none or if it
+  // is older than the template or any of the priors
+  static Pointer OpenDirectory(const std::string& dir);
+
+  // Mapped container if up to date, otherwise compiled from the files
+  static Pointer LoadDirectory(const std::string& dir);
+
+  void Write(const char* fn) const;
+
+  // Map a container file, throws an exception if the file is not a valid
+  // container
+  void Open(const char* fn);
+  void Close();
+
+  bool IsMapped() const { return !m_MappingOwner.IsNull(); }
+
+  const std::string& GetFileName() const { return m_FileName; }
+
+  FloatImagePointer GetTemplate() const { return m_Template; }
+
+  unsigned int GetNumberOfPriors() const { return m_Priors.GetSize(); }
+  FloatImagePointer GetPrior(unsigned int i) const { return m_Priors[i]; }
+
+  ByteImagePointer GetMask() const { return m_Mask; }
+
+  // Bounding box of the mask, in template voxel indices
+  const IndexType& GetROILowerBound() const { return m_ROILowerBound; }
+  const IndexType& GetROIUpperBound() const { return m_ROIUpperBound; }
+
+  unsigned int GetNumberOfTemplateLevels() const
+  { return m_TemplateLevels.GetSize(); }
+  FloatImagePointer GetTemplateLevel(unsigned int i) const
+  { return m_TemplateLevels[i]; }
+  const ShrinkFactorsType& GetTemplateLevelFactors(unsigned int i) const
+  { return m_TemplateLevelFactors[i]; }
+
+protected:
+
+  CompiledAtlas();
+  ~CompiledAtlas();
+
+private:
+  CompiledAtlas(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  // Mapping of the file into memory, done by a separate object held by the
+  // images
+  void MapFile(const char* fn);
+  void UnmapFile();
+
+  std::string m_FileName;
+
+  Pointer m_MappingOwner;
+
+  void* m_Mapping;
+  unsigned long m_MappingSize;
+
+#if defined(_MSC_VER)
+  void* m_FileHandle;
+  void* m_MappingHandle;
+#endif
+
+  FloatImagePointer m_Template;
+  DynArray<FloatImagePointer> m_Priors;
+  ByteImagePointer m_Mask;
+
+  IndexType m_ROILowerBound;
+  IndexType m_ROIUpperBound;
+
+  DynArray<FloatImagePointer> m_TemplateLevels;
+  DynArray<ShrinkFactorsType> m_TemplateLevelFactors;
+
+};
+
+#endif
@@ -0,0 +1,116 @@
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Reads a list of image files on background threads, so that reading and
+// decompression overlap with each other and with the computations using the
+// images
+//
+// Each file is read once, asking for a file still in the queue reads it
+// right away instead of waiting for the reader threads. The images are
+// shared by everyone asking for the same file and must not be modified.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _ImagePrefetcher_h
+#define _ImagePrefetcher_h
+
+#include "itkConditionVariable.h"
+#include "itkMultiThreader.h"
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkSimpleMutexLock.h"
+
+#include "DynArray.h"
+
+#include <string>
+
+template <class TImage>
+class ImagePrefetcher: public itk::Object
+{
+
+public:
+
+  /** Standard class typedefs. */
+  typedef ImagePrefetcher Self;
+  typedef itk::Object Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(ImagePrefetcher, itk::Object);
+
+  typedef TImage ImageType;
+  typedef typename ImageType::Pointer ImagePointer;
+
+  // Reader threads, zero means the ITK global default
+  itkSetMacro(NumberOfThreads, unsigned int);
+  itkGetConstMacro(NumberOfThreads, unsigned int);
+
+  // Files to read in the background, in the order given
+  void AddFileName(const std::string& fn);
+  unsigned int GetNumberOfFileNames() const { return m_Entries.GetSize(); }
+
+  // Starts the reader threads
+  void Start();
+
+  // Stops the reader threads after the files being read, the images read so
+  // far are kept
+  void Stop();
+
+  // Image of a file, read now if not read yet (also for files not in the
+  // list), throws if the file could not be read
+  ImagePointer GetImage(const std::string& fn);
+
+  // Drop the image of a file that is no longer needed
+  void ReleaseImage(const std::string& fn);
+
+protected:
+
+  ImagePrefetcher();
+  ~ImagePrefetcher();
+
+  typedef enum{Queued, Reading, Done} EntryState;
+
+  struct EntryType
+  {
+    std::string FileName;
+    EntryState State;
+    ImagePointer Image;
+    std::string Error;
+  };
+
+  // Entry for a file name, -1 if not found, call with the mutex locked
+  int FindEntry(const std::string& fn) const;
+
+  // Reads the image of an entry claimed by the caller
+  void ReadEntry(unsigned int i, const std::string& fn);
+
+  static ITK_THREAD_RETURN_TYPE _readThread(void* arg);
+
+private:
+  ImagePrefetcher(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  unsigned int m_NumberOfThreads;
+
+  DynArray<EntryType> m_Entries;
+  unsigned int m_NextEntry;
+
+  itk::MultiThreader::Pointer m_Threader;
+  DynArray<int> m_ThreadIDs;
+  unsigned long m_LogOwner;
+
+  // Guards the entries, signalled when an entry is done
+  itk::SimpleMutexLock m_Mutex;
+  itk::ConditionVariable::Pointer m_EntryDone;
+
+};
+
+#ifndef MU_MANUAL_INSTANTIATION
+#include "ImagePrefetcher.txx"
+#endif
+
+#endif
@@ -0,0 +1,246 @@
+
+#ifndef _ImagePrefetcher_txx
+#define _ImagePrefetcher_txx
+
+#include "ImagePrefetcher.h"
+
+#include "itkImageIOFactory.h"
+
+#include "Log.h"
+#include "MappedImageReader.h"
+
+template <class TImage>
+ImagePrefetcher<TImage>
+::ImagePrefetcher()
+{
+  m_NumberOfThreads = 0;
+
+  m_NextEntry = 0;
+
+  m_LogOwner = 0;
+
+  m_Threader = itk::MultiThreader::New();
+
+  m_EntryDone = itk::ConditionVariable::New();
+}
+
+template <class TImage>
+ImagePrefetcher<TImage>
+::~ImagePrefetcher()
+{
+  this->Stop();
+}
+
+template <class TImage>
+void
+ImagePrefetcher<TImage>
+::AddFileName(const std::string& fn)
+{
+  m_Mutex.Lock();
+
+  if (this->FindEntry(fn) < 0)
+  {
+    EntryType e;
+    e.FileName = fn;
+    e.State = Queued;
+    e.Image = 0;
+    e.Error = "";
+    m_Entries.Append(e);
+  }
+
+  m_Mutex.Unlock();
+}
+
+template <class TImage>
+int
+ImagePrefetcher<TImage>
+::FindEntry(const std::string& fn) const
+{
+  for (unsigned int i = 0; i < m_Entries.GetSize(); i++)
+    if (m_Entries[i].FileName.compare(fn) == 0)
+      return i;
+  return -1;
+}
+
+template <class TImage>
+void
+ImagePrefetcher<TImage>
+::Start()
+{
+  if (m_ThreadIDs.GetSize() != 0 || m_Entries.GetSize() == 0)
+    return;
+
+  unsigned int numThreads = m_NumberOfThreads;
+  if (numThreads == 0)
+    numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  if (numThreads > m_Entries.GetSize())
+    numThreads = m_Entries.GetSize();
+  if (numThreads < 1)
+    numThreads = 1;
+
+  // Register the image IO factories before the threads look them up
+  itk::ImageIOFactory::CreateImageIO(
+    m_Entries[0].FileName.c_str(), itk::ImageIOFactory::ReadMode);
+
+  // Messages from the reader threads go to the log of the starting thread
+  m_LogOwner = mu::Log::GetInstance()->GetThreadOwner();
+
+  for (unsigned int t = 0; t < numThreads; t++)
+    m_ThreadIDs.Append(
+      m_Threader->SpawnThread(&ImagePrefetcher::_readThread, (void*)this));
+}
+
+template <class TImage>
+void
+ImagePrefetcher<TImage>
+::Stop()
+{
+  for (unsigned int t = 0; t < m_ThreadIDs.GetSize(); t++)
+    m_Threader->TerminateThread(m_ThreadIDs[t]);
+  m_ThreadIDs.Clear();
+}
+
+template <class TImage>
+void
+ImagePrefetcher<TImage>
+::ReadEntry(unsigned int i, const std::string& fn)
+{
+  ImagePointer img;
+  std::string err = "";
+
+  try
+  {
+    img = MappedImageReader<ImageType>::ReadImage(fn);
+  }
+  catch (itk::ExceptionObject& e)
+  {
+    err = e.GetDescription();
+  }
+  catch (std::exception& e)
+  {
+    err = e.what();
+  }
+
+  m_Mutex.Lock();
+  m_Entries[i].Image = img;
+  m_Entries[i].Error = err;
+  m_Entries[i].State = Done;
+  m_EntryDone->Broadcast();
+  m_Mutex.Unlock();
+}
+
+template <class TImage>
+ITK_THREAD_RETURN_TYPE
+ImagePrefetcher<TImage>
+::_readThread(void* arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfoType;
+  ThreadInfoType* infoStruct = static_cast<ThreadInfoType*>(arg);
+
+  ImagePrefetcher* obj = static_cast<ImagePrefetcher*>(infoStruct->UserData);
+
+  unsigned long prevOwner =
+    mu::Log::GetInstance()->SetThreadOwner(obj->m_LogOwner);
+
+  while (true)
+  {
+    // Stop requested?
+    infoStruct->ActiveFlagLock->Lock();
+    int active = *(infoStruct->ActiveFlag);
+    infoStruct->ActiveFlagLock->Unlock();
+
+    if (!active)
+      break;
+
+    // Claim the next queued file, files already taken by GetImage are skipped
+    obj->m_Mutex.Lock();
+
+    while (obj->m_NextEntry < obj->m_Entries.GetSize()
+           &&
+           obj->m_Entries[obj->m_NextEntry].State != Queued)
+      obj->m_NextEntry++;
+
+    if (obj->m_NextEntry >= obj->m_Entries.GetSize())
+    {
+      obj->m_Mutex.Unlock();
+      break;
+    }
+
+    unsigned int i = obj->m_NextEntry++;
+    obj->m_Entries[i].State = Reading;
+    std::string fn = obj->m_Entries[i].FileName;
+
+    obj->m_Mutex.Unlock();
+
+    obj->ReadEntry(i, fn);
+  }
+
+  mu::Log::GetInstance()->SetThreadOwner(prevOwner);
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TImage>
+typename ImagePrefetcher<TImage>::ImagePointer
+ImagePrefetcher<TImage>
+::GetImage(const std::string& fn)
+{
+  m_Mutex.Lock();
+
+  int i = this->FindEntry(fn);
+
+  if (i < 0)
+  {
+    EntryType e;
+    e.FileName = fn;
+    e.State = Queued;
+    e.Image = 0;
+    e.Error = "";
+    m_Entries.Append(e);
+
+    i = m_Entries.GetSize() - 1;
+  }
+
+  // Read it here rather than wait for a reader thread to get to it
+  if (m_Entries[i].State == Queued)
+  {
+    m_Entries[i].State = Reading;
+    m_Mutex.Unlock();
+
+    this->ReadEntry(i, fn);
+
+    m_Mutex.Lock();
+  }
+
+  while (m_Entries[i].State != Done)
+    m_EntryDone->Wait(&m_Mutex);
+
+  ImagePointer img = m_Entries[i].Image;
+  std::string err = m_Entries[i].Error;
+
+  m_Mutex.Unlock();
+
+  if (err.length() != 0)
+    itkExceptionMacro(<< "Error reading " << fn << ": " << err);
+
+  if (img.IsNull())
+    itkExceptionMacro(<< "Image " << fn << " has been released");
+
+  return img;
+}
+
+template <class TImage>
+void
+ImagePrefetcher<TImage>
+::ReleaseImage(const std::string& fn)
+{
+  m_Mutex.Lock();
+
+  int i = this->FindEntry(fn);
+  if (i >= 0 && m_Entries[i].State == Done)
+    m_Entries[i].Image = 0;
+
+  m_Mutex.Unlock();
+}
+
+#endif
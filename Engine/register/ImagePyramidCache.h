@@ -0,0 +1,110 @@
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Cache of smoothed and downsampled images for multi resolution registration
+//
+// Levels are keyed by the source image (identity and modification time) and
+// the shrink factors, so registrations sharing an image (e.g. all channels
+// registered to the first image) build each level once
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _ImagePyramidCache_h
+#define _ImagePyramidCache_h
+
+#include "itkConditionVariable.h"
+#include "itkFixedArray.h"
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkSimpleMutexLock.h"
+
+#include "MRUTable.h"
+
+#include <vector>
+
+template <class TImage>
+class ImagePyramidCache: public itk::Object
+{
+
+public:
+
+  /** Standard class typedefs. */
+  typedef ImagePyramidCache Self;
+  typedef itk::Object Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(ImagePyramidCache, itk::Object);
+
+  typedef TImage ImageType;
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename ImageType::SpacingType SpacingType;
+
+  typedef itk::FixedArray<unsigned int, 3> ShrinkFactorsType;
+
+  // Downsampled image, the image itself if all factors are one, levels are
+  // computed outside the lock and threads only wait for the same level
+  ImagePointer GetLevel(ImageType* img, const ShrinkFactorsType& factors);
+
+  // Level with voxel spacing close to (and not exceeding) the given spacing
+  ImagePointer GetLevelAtSpacing(ImageType* img, double spacing);
+
+  // Use a level computed elsewhere (e.g. stored in a compiled atlas)
+  void SetLevel(ImageType* img, const ShrinkFactorsType& factors,
+    ImageType* level);
+
+  void Clear();
+
+  unsigned long GetNumberOfHits() const { return m_NumberOfHits; }
+  unsigned long GetNumberOfMisses() const { return m_NumberOfMisses; }
+
+protected:
+
+  ImagePyramidCache();
+  ~ImagePyramidCache() { }
+
+  struct LevelType
+  {
+    // Image identity, only compared and never dereferenced
+    const void* Image;
+    unsigned long ImageMTime;
+    ShrinkFactorsType Factors;
+    ImagePointer Level;
+  };
+
+  ImagePointer ComputeLevel(ImageType* img, const ShrinkFactorsType& factors);
+
+  // Index of the cached level or of the level being computed, -1 if there is
+  // none, called with the mutex locked
+  int FindLevel(const ImageType* img, unsigned long mtime,
+    const ShrinkFactorsType& factors);
+  int FindComputing(const ImageType* img, unsigned long mtime,
+    const ShrinkFactorsType& factors) const;
+
+private:
+  ImagePyramidCache(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  MRUTable<LevelType> m_Levels;
+
+  // Levels being computed by some thread, without the image
+  std::vector<LevelType> m_Computing;
+
+  unsigned long m_NumberOfHits;
+  unsigned long m_NumberOfMisses;
+
+  // Guards the levels, signalled when a level is computed
+  itk::SimpleMutexLock m_Mutex;
+  itk::ConditionVariable::Pointer m_LevelDone;
+
+};
+
+#ifndef MU_MANUAL_INSTANTIATION
+#include "ImagePyramidCache.txx"
+#endif
+
+#endif
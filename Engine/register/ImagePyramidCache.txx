@@ -0,0 +1,233 @@
+
+#ifndef _ImagePyramidCache_txx
+#define _ImagePyramidCache_txx
+
+#include "ImagePyramidCache.h"
+
+#include "itkMultiResolutionPyramidImageFilter.h"
+
+#include "muException.h"
+
+#define MU_PYRAMID_CACHE_SIZE 16
+
+template <class TImage>
+ImagePyramidCache<TImage>
+::ImagePyramidCache(): m_Levels(MU_PYRAMID_CACHE_SIZE)
+{
+  m_NumberOfHits = 0;
+  m_NumberOfMisses = 0;
+
+  m_LevelDone = itk::ConditionVariable::New();
+}
+
+template <class TImage>
+int
+ImagePyramidCache<TImage>
+::FindLevel(const ImageType* img, unsigned long mtime,
+  const ShrinkFactorsType& factors)
+{
+  for (unsigned int i = 0; i < m_Levels.GetSize(); i++)
+  {
+    LevelType& e = m_Levels.GetElement(i);
+    if (e.Image == img && e.ImageMTime == mtime && e.Factors == factors)
+      return i;
+  }
+
+  return -1;
+}
+
+template <class TImage>
+int
+ImagePyramidCache<TImage>
+::FindComputing(const ImageType* img, unsigned long mtime,
+  const ShrinkFactorsType& factors) const
+{
+  for (unsigned int i = 0; i < m_Computing.size(); i++)
+  {
+    const LevelType& e = m_Computing[i];
+    if (e.Image == img && e.ImageMTime == mtime && e.Factors == factors)
+      return i;
+  }
+
+  return -1;
+}
+
+template <class TImage>
+typename ImagePyramidCache<TImage>::ImagePointer
+ImagePyramidCache<TImage>
+::GetLevel(ImageType* img, const ShrinkFactorsType& factors)
+{
+  if (img == 0)
+    muExceptionMacro(<< "NULL image for pyramid level");
+
+  bool shrink = false;
+  for (unsigned int dim = 0; dim < 3; dim++)
+    if (factors[dim] > 1)
+      shrink = true;
+
+  if (!shrink)
+    return img;
+
+  unsigned long mtime = img->GetMTime();
+
+  m_Mutex.Lock();
+
+  // Threads asking for a level being computed wait for it instead of
+  // computing it again, other levels are computed concurrently
+  while (true)
+  {
+    int i = this->FindLevel(img, mtime, factors);
+    if (i >= 0)
+    {
+      m_NumberOfHits++;
+      ImagePointer level = m_Levels.GetElement(i).Level;
+      m_Mutex.Unlock();
+      return level;
+    }
+
+    if (this->FindComputing(img, mtime, factors) < 0)
+      break;
+
+    m_LevelDone->Wait(&m_Mutex);
+  }
+
+  m_NumberOfMisses++;
+
+  LevelType e;
+  e.Image = img;
+  e.ImageMTime = mtime;
+  e.Factors = factors;
+
+  m_Computing.push_back(e);
+
+  m_Mutex.Unlock();
+
+  try
+  {
+    e.Level = this->ComputeLevel(img, factors);
+  }
+  catch (...)
+  {
+    // Waiting threads find no level and compute it themselves
+    m_Mutex.Lock();
+    m_Computing.erase(
+      m_Computing.begin() + this->FindComputing(img, mtime, factors));
+    m_LevelDone->Broadcast();
+    m_Mutex.Unlock();
+    throw;
+  }
+
+  m_Mutex.Lock();
+
+  m_Computing.erase(
+    m_Computing.begin() + this->FindComputing(img, mtime, factors));
+
+  // Set in the meantime with SetLevel, otherwise the oldest level is
+  // replaced when full
+  int i = this->FindLevel(img, mtime, factors);
+  if (i >= 0)
+    m_Levels.GetElement(i).Level = e.Level;
+  else
+    m_Levels.Insert(e);
+
+  m_LevelDone->Broadcast();
+
+  m_Mutex.Unlock();
+
+  return e.Level;
+}
+
+template <class TImage>
+typename ImagePyramidCache<TImage>::ImagePointer
+ImagePyramidCache<TImage>
+::GetLevelAtSpacing(ImageType* img, double spacing)
+{
+  if (img == 0)
+    muExceptionMacro(<< "NULL image for pyramid level");
+
+  SpacingType imgSpacing = img->GetSpacing();
+
+  ShrinkFactorsType factors;
+  for (unsigned int dim = 0; dim < 3; dim++)
+  {
+    unsigned int f = (unsigned int)(spacing / imgSpacing[dim]);
+    if (f < 1)
+      f = 1;
+    factors[dim] = f;
+  }
+
+  return this->GetLevel(img, factors);
+}
+
+template <class TImage>
+void
+ImagePyramidCache<TImage>
+::SetLevel(ImageType* img, const ShrinkFactorsType& factors, ImageType* level)
+{
+  if (img == 0 || level == 0)
+    muExceptionMacro(<< "NULL image for pyramid level");
+
+  unsigned long mtime = img->GetMTime();
+
+  m_Mutex.Lock();
+
+  int i = this->FindLevel(img, mtime, factors);
+  if (i >= 0)
+  {
+    m_Levels.GetElement(i).Level = level;
+    m_Mutex.Unlock();
+    return;
+  }
+
+  LevelType e;
+  e.Image = img;
+  e.ImageMTime = mtime;
+  e.Factors = factors;
+  e.Level = level;
+
+  m_Levels.Insert(e);
+
+  m_Mutex.Unlock();
+}
+
+template <class TImage>
+void
+ImagePyramidCache<TImage>
+::Clear()
+{
+  m_Mutex.Lock();
+  m_Levels = MRUTable<LevelType>(m_Levels.GetMaxSize());
+  m_Mutex.Unlock();
+}
+
+template <class TImage>
+typename ImagePyramidCache<TImage>::ImagePointer
+ImagePyramidCache<TImage>
+::ComputeLevel(ImageType* img, const ShrinkFactorsType& factors)
+{
+  typedef itk::MultiResolutionPyramidImageFilter<ImageType, ImageType>
+    PyramidType;
+
+  typename PyramidType::ScheduleType schedule(1, 3);
+  for (unsigned int dim = 0; dim < 3; dim++)
+    schedule[0][dim] = factors[dim];
+
+  // Pipeline on a graft sharing the voxels, threads computing other levels
+  // of the same image do not share its requested region
+  ImagePointer input = ImageType::New();
+  input->Graft(img);
+
+  // Gaussian smoothing followed by resampling
+  typename PyramidType::Pointer pyramid = PyramidType::New();
+  pyramid->SetInput(input);
+  pyramid->SetNumberOfLevels(1);
+  pyramid->SetSchedule(schedule);
+  pyramid->Update();
+
+  ImagePointer level = pyramid->GetOutput(0);
+  level->DisconnectPipeline();
+
+  return level;
+}
+
+#endif
@@ -0,0 +1,123 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Resampling of an image through an affine transform with trilinear
+// interpolation
+//
+// Output voxels are mapped a row at a time with the index to index matrix of
+// the transform, instead of transforming each voxel center separately, and
+// blocks of planes are resampled in parallel
+//
+// Multiple inputs are resampled in one pass, inputs with the same geometry
+// (e.g. atlas priors and template) share the mapping and the interpolation
+// weights
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _LinearAffineResampler_h
+#define _LinearAffineResampler_h
+
+#include "itkImage.h"
+#include "itkImageBase.h"
+#include "itkMultiThreader.h"
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+
+#include "ChainedAffineTransform3D.h"
+#include "DynArray.h"
+
+template <class TImage>
+class LinearAffineResampler: public itk::Object
+{
+
+public:
+
+  /** Standard class typedefs. */
+  typedef LinearAffineResampler Self;
+  typedef itk::Object Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(LinearAffineResampler, itk::Object);
+
+  typedef TImage ImageType;
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename ImageType::ConstPointer ImageConstPointer;
+  typedef typename ImageType::PixelType PixelType;
+
+  typedef itk::ImageBase<3> ReferenceImageType;
+
+  typedef ChainedAffineTransform3D TransformType;
+
+  void SetInput(const ImageType* img) { this->SetInput(0, img); }
+  void SetInput(unsigned int i, const ImageType* img);
+
+  unsigned int GetNumberOfInputs() const { return m_Inputs.GetSize(); }
+
+  // Outputs of normalized inputs are scaled to sum to one at each voxel,
+  // with negative values set to zero (e.g. for atlas priors)
+  void SetNormalizeInput(unsigned int i, bool b);
+
+  // Transform mapping reference (output) points to input points
+  void SetTransform(const TransformType* t)
+  { m_Transform = t; this->Modified(); }
+
+  // Output has the size, spacing, origin and direction of the reference
+  void SetReferenceImage(const ReferenceImageType* img)
+  { m_ReferenceImage = img; this->Modified(); }
+
+  // Value of output voxels mapped outside the input
+  itkGetConstMacro(DefaultPixelValue, PixelType);
+  itkSetMacro(DefaultPixelValue, PixelType);
+
+  // Zero means the ITK global default
+  itkGetConstMacro(NumberOfThreads, unsigned int);
+  itkSetMacro(NumberOfThreads, unsigned int);
+
+  void Update();
+
+  ImagePointer GetOutput() { return this->GetOutput(0); }
+  ImagePointer GetOutput(unsigned int i);
+
+protected:
+
+  LinearAffineResampler();
+  ~LinearAffineResampler() { }
+
+  void ResamplePlanes(long zbegin, long zend);
+
+  static ITK_THREAD_RETURN_TYPE _resampleThread(void* arg);
+
+private:
+  LinearAffineResampler(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  DynArray<ImageConstPointer> m_Inputs;
+  DynArray<unsigned char> m_NormalizeFlags;
+
+  TransformType::ConstPointer m_Transform;
+  ReferenceImageType::ConstPointer m_ReferenceImage;
+
+  DynArray<ImagePointer> m_Outputs;
+
+  PixelType m_DefaultPixelValue;
+
+  unsigned int m_NumberOfThreads;
+
+  // Output buffer index to input buffer continuous index, 12 values for
+  // each input
+  DynArray<double> m_IndexToIndexMatrices;
+
+  // Inputs grouped by geometry
+  DynArray< DynArray<unsigned int> > m_InputGroups;
+
+};
+
+#ifndef MU_MANUAL_INSTANTIATION
+#include "LinearAffineResampler.txx"
+#endif
+
+#endif
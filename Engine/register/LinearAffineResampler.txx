@@ -0,0 +1,347 @@
+
+#ifndef _LinearAffineResampler_txx
+#define _LinearAffineResampler_txx
+
+#include "LinearAffineResampler.h"
+
+#include "muException.h"
+
+#include <vector>
+
+template <class TImage>
+LinearAffineResampler<TImage>
+::LinearAffineResampler()
+{
+  m_Transform = 0;
+  m_ReferenceImage = 0;
+
+  m_DefaultPixelValue = 0;
+
+  m_NumberOfThreads = 0;
+}
+
+template <class TImage>
+void
+LinearAffineResampler<TImage>
+::SetInput(unsigned int i, const ImageType* img)
+{
+  while (m_Inputs.GetSize() <= i)
+  {
+    m_Inputs.Append(0);
+    m_NormalizeFlags.Append(0);
+  }
+
+  m_Inputs[i] = img;
+
+  this->Modified();
+}
+
+template <class TImage>
+void
+LinearAffineResampler<TImage>
+::SetNormalizeInput(unsigned int i, bool b)
+{
+  if (i >= m_NormalizeFlags.GetSize())
+    muExceptionMacro(<< "Invalid input index " << i);
+
+  m_NormalizeFlags[i] = b ? 1 : 0;
+
+  this->Modified();
+}
+
+template <class TImage>
+typename LinearAffineResampler<TImage>::ImagePointer
+LinearAffineResampler<TImage>
+::GetOutput(unsigned int i)
+{
+  if (i >= m_Outputs.GetSize())
+    return 0;
+  return m_Outputs[i];
+}
+
+template <class TImage>
+void
+LinearAffineResampler<TImage>
+::Update()
+{
+  if (m_Inputs.GetSize() == 0 || m_Transform.IsNull()
+      ||
+      m_ReferenceImage.IsNull())
+    muExceptionMacro(<< "Resampler needs input, transform and reference image");
+
+  unsigned int numInputs = m_Inputs.GetSize();
+
+  for (unsigned int i = 0; i < numInputs; i++)
+    if (m_Inputs[i].IsNull())
+      muExceptionMacro(<< "Resampler input " << i << " not set");
+
+  m_Outputs.Clear();
+  for (unsigned int i = 0; i < numInputs; i++)
+  {
+    ImagePointer out = ImageType::New();
+    out->CopyInformation(m_ReferenceImage);
+    out->SetRegions(m_ReferenceImage->GetLargestPossibleRegion());
+    out->Allocate();
+    m_Outputs.Append(out);
+  }
+
+  typename ImageType::IndexType outStart =
+    m_Outputs[0]->GetBufferedRegion().GetIndex();
+
+  m_IndexToIndexMatrices.Initialize(12*numInputs, 0.0);
+
+  for (unsigned int k = 0; k < numInputs; k++)
+  {
+    double* M = m_IndexToIndexMatrices.GetRawArray() + 12*k;
+
+    m_Transform->GetIndexToIndexMatrix(m_ReferenceImage, m_Inputs[k], M);
+
+    // Map buffer indices of the output to buffer indices of the input
+    typename ImageType::IndexType inStart =
+      m_Inputs[k]->GetBufferedRegion().GetIndex();
+    for (unsigned int i = 0; i < 3; i++)
+    {
+      for (unsigned int j = 0; j < 3; j++)
+        M[4*i + 3] += M[4*i + j] * outStart[j];
+      M[4*i + 3] -= inStart[i];
+    }
+  }
+
+  // Group inputs with the same buffer size and mapping
+  m_InputGroups.Clear();
+  for (unsigned int k = 0; k < numInputs; k++)
+  {
+    const double* Mk = m_IndexToIndexMatrices.GetRawArray() + 12*k;
+
+    bool found = false;
+    for (unsigned int g = 0; g < m_InputGroups.GetSize(); g++)
+    {
+      unsigned int lead = m_InputGroups[g][0];
+      const double* Ml = m_IndexToIndexMatrices.GetRawArray() + 12*lead;
+
+      bool same =
+        m_Inputs[k]->GetBufferedRegion().GetSize() ==
+        m_Inputs[lead]->GetBufferedRegion().GetSize();
+      for (unsigned int i = 0; same && i < 12; i++)
+        same = (Mk[i] == Ml[i]);
+
+      if (same)
+      {
+        m_InputGroups[g].Append(k);
+        found = true;
+        break;
+      }
+    }
+
+    if (!found)
+    {
+      DynArray<unsigned int> group;
+      group.Append(k);
+      m_InputGroups.Append(group);
+    }
+  }
+
+  unsigned int numThreads = m_NumberOfThreads;
+  if (numThreads == 0)
+    numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  long numPlanes = m_Outputs[0]->GetBufferedRegion().GetSize()[2];
+  if (numThreads > (unsigned int)numPlanes)
+    numThreads = numPlanes;
+
+  if (numThreads <= 1)
+  {
+    this->ResamplePlanes(0, numPlanes);
+    return;
+  }
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads(numThreads);
+  threader->SetSingleMethod(
+    &LinearAffineResampler::_resampleThread, (void*)this);
+  threader->SingleMethodExecute();
+}
+
+template <class TImage>
+ITK_THREAD_RETURN_TYPE
+LinearAffineResampler<TImage>
+::_resampleThread(void* arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfoType;
+  ThreadInfoType* infoStruct = static_cast<ThreadInfoType*>(arg);
+
+  const long threadId = infoStruct->ThreadID;
+  const long numThreads = infoStruct->NumberOfThreads;
+
+  LinearAffineResampler* obj =
+    static_cast<LinearAffineResampler*>(infoStruct->UserData);
+
+  long numPlanes = obj->m_Outputs[0]->GetBufferedRegion().GetSize()[2];
+  long blockSize = (numPlanes + numThreads - 1) / numThreads;
+
+  long zbegin = threadId * blockSize;
+  long zend = zbegin + blockSize;
+  if (zend > numPlanes)
+    zend = numPlanes;
+
+  if (zbegin < zend)
+    obj->ResamplePlanes(zbegin, zend);
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TImage>
+void
+LinearAffineResampler<TImage>
+::ResamplePlanes(long zbegin, long zend)
+{
+  const unsigned int numInputs = m_Inputs.GetSize();
+
+  typename ImageType::SizeType outSize =
+    m_Outputs[0]->GetBufferedRegion().GetSize();
+
+  const unsigned long rowLength = outSize[0];
+
+  std::vector<double> mx(rowLength);
+  std::vector<double> my(rowLength);
+  std::vector<double> mz(rowLength);
+
+  std::vector<const PixelType*> inBufs(numInputs);
+  std::vector<PixelType*> outBufs(numInputs);
+  for (unsigned int i = 0; i < numInputs; i++)
+  {
+    inBufs[i] = m_Inputs[i]->GetBufferPointer();
+    outBufs[i] = m_Outputs[i]->GetBufferPointer();
+  }
+
+  bool normalize = false;
+  for (unsigned int i = 0; i < numInputs; i++)
+    if (m_NormalizeFlags[i] != 0)
+      normalize = true;
+
+  ChainedAffineTransform3D::IndexType ind;
+  ind[0] = 0;
+
+  for (ind[2] = zbegin; ind[2] < zend; ind[2]++)
+    for (ind[1] = 0; ind[1] < (long)outSize[1]; ind[1]++)
+    {
+      unsigned long rowOffset = (ind[2]*outSize[1] + ind[1])*outSize[0];
+
+      for (unsigned int g = 0; g < m_InputGroups.GetSize(); g++)
+      {
+        const DynArray<unsigned int>& group = m_InputGroups[g];
+        const unsigned int numMembers = group.GetSize();
+
+        ChainedAffineTransform3D::TransformIndexRow(
+          m_IndexToIndexMatrices.GetRawArray() + 12*group[0], ind, 1,
+          rowLength, &mx[0], &my[0], &mz[0]);
+
+        typename ImageType::SizeType inSize =
+          m_Inputs[group[0]]->GetBufferedRegion().GetSize();
+
+        const long nx = inSize[0];
+        const long ny = inSize[1];
+        const long nz = inSize[2];
+        const long sliceSize = nx*ny;
+
+        // Inside test is done in the continuous index domain, same as
+        // IsInsideBuffer in ITK, [-0.5, size-0.5)
+        const double endX = nx - 0.5;
+        const double endY = ny - 0.5;
+        const double endZ = nz - 0.5;
+
+        const double maxX = nx - 1;
+        const double maxY = ny - 1;
+        const double maxZ = nz - 1;
+
+        for (unsigned long k = 0; k < rowLength; k++)
+        {
+          double cx = mx[k];
+          double cy = my[k];
+          double cz = mz[k];
+
+          if (cx < -0.5 || cy < -0.5 || cz < -0.5
+              ||
+              cx >= endX || cy >= endY || cz >= endZ)
+          {
+            for (unsigned int m = 0; m < numMembers; m++)
+              outBufs[group[m]][rowOffset+k] = m_DefaultPixelValue;
+            continue;
+          }
+
+          // Within half a voxel of the border, take the border voxels as
+          // LinearInterpolateImageFunction does
+          if (cx < 0.0)
+            cx = 0.0;
+          else if (cx > maxX)
+            cx = maxX;
+          if (cy < 0.0)
+            cy = 0.0;
+          else if (cy > maxY)
+            cy = maxY;
+          if (cz < 0.0)
+            cz = 0.0;
+          else if (cz > maxZ)
+            cz = maxZ;
+
+          long x0 = (long)cx;
+          long y0 = (long)cy;
+          long z0 = (long)cz;
+
+          double fx = cx - x0;
+          double fy = cy - y0;
+          double fz = cz - z0;
+
+          // Neighbors clamped at the upper boundary
+          long dx = (x0 < nx-1) ? 1 : 0;
+          long dy = (y0 < ny-1) ? nx : 0;
+          long dz = (z0 < nz-1) ? sliceSize : 0;
+
+          long offset = z0*sliceSize + y0*nx + x0;
+
+          for (unsigned int m = 0; m < numMembers; m++)
+          {
+            const PixelType* p = inBufs[group[m]] + offset;
+
+            double v00 = p[0] + fx*((double)p[dx] - p[0]);
+            double v10 = p[dy] + fx*((double)p[dy+dx] - p[dy]);
+            double v01 = p[dz] + fx*((double)p[dz+dx] - p[dz]);
+            double v11 = p[dz+dy] + fx*((double)p[dz+dy+dx] - p[dz+dy]);
+
+            double v0 = v00 + fy*(v10 - v00);
+            double v1 = v01 + fy*(v11 - v01);
+
+            outBufs[group[m]][rowOffset+k] =
+              static_cast<PixelType>(v0 + fz*(v1 - v0));
+          }
+        }
+      }
+
+      if (!normalize)
+        continue;
+
+      for (unsigned long k = 0; k < rowLength; k++)
+      {
+        double sump = 1e-20;
+        for (unsigned int i = 0; i < numInputs; i++)
+        {
+          if (m_NormalizeFlags[i] == 0)
+            continue;
+          PixelType& p = outBufs[i][rowOffset+k];
+          if (p < 0)
+            p = 0;
+          sump += p;
+        }
+
+        for (unsigned int i = 0; i < numInputs; i++)
+        {
+          if (m_NormalizeFlags[i] == 0)
+            continue;
+          PixelType& p = outBufs[i][rowOffset+k];
+          p = static_cast<PixelType>(p / sump);
+        }
+      }
+    }
+}
+
+#endif
@@ -0,0 +1,614 @@
+
+#include "MappedImageFile.h"
+
+#include "itksys/SystemTools.hxx"
+
+#include "vxl_config.h"
+
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+// Headers are short, stop looking for the end of one after this many bytes
+#define MU_MAPPED_IMAGE_MAX_HEADER 65536
+
+static std::string
+_trim(const std::string& s)
+{
+  std::string::size_type first = s.find_first_not_of(" \t\r\n");
+  if (first == std::string::npos)
+    return std::string("");
+  std::string::size_type last = s.find_last_not_of(" \t\r\n");
+  return s.substr(first, last-first+1);
+}
+
+// Reads n numbers, brackets and commas are treated as spaces
+static bool
+_parseNumbers(const std::string& s, double* v, unsigned int n)
+{
+  std::string t = s;
+  for (unsigned int i = 0; i < t.size(); i++)
+    if (t[i] == '(' || t[i] == ')' || t[i] == ',')
+      t[i] = ' ';
+
+  std::istringstream iss(t);
+  for (unsigned int i = 0; i < n; i++)
+    if (!(iss >> v[i]))
+      return false;
+
+  std::string rest;
+  if (iss >> rest)
+    return false;
+
+  return true;
+}
+
+static std::string
+_metaTypeName(const std::string& t)
+{
+  if (t.compare("MET_FLOAT") == 0)
+    return "float";
+  if (t.compare("MET_DOUBLE") == 0)
+    return "double";
+  if (t.compare("MET_SHORT") == 0)
+    return "short";
+  if (t.compare("MET_USHORT") == 0)
+    return "unsigned short";
+  if (t.compare("MET_CHAR") == 0)
+    return "char";
+  if (t.compare("MET_UCHAR") == 0)
+    return "unsigned char";
+  if (t.compare("MET_INT") == 0)
+    return "int";
+  if (t.compare("MET_UINT") == 0)
+    return "unsigned int";
+  return "";
+}
+
+static std::string
+_nrrdTypeName(const std::string& t)
+{
+  if (t.compare("float") == 0)
+    return "float";
+  if (t.compare("double") == 0)
+    return "double";
+  if (t.compare("short") == 0 || t.compare("short int") == 0
+      || t.compare("signed short") == 0 || t.compare("signed short int") == 0
+      || t.compare("int16") == 0 || t.compare("int16_t") == 0)
+    return "short";
+  if (t.compare("ushort") == 0 || t.compare("unsigned short") == 0
+      || t.compare("unsigned short int") == 0
+      || t.compare("uint16") == 0 || t.compare("uint16_t") == 0)
+    return "unsigned short";
+  if (t.compare("signed char") == 0 || t.compare("int8") == 0
+      || t.compare("int8_t") == 0)
+    return "char";
+  if (t.compare("uchar") == 0 || t.compare("unsigned char") == 0
+      || t.compare("uint8") == 0 || t.compare("uint8_t") == 0)
+    return "unsigned char";
+  if (t.compare("int") == 0 || t.compare("signed int") == 0
+      || t.compare("int32") == 0 || t.compare("int32_t") == 0)
+    return "int";
+  if (t.compare("uint") == 0 || t.compare("unsigned int") == 0
+      || t.compare("uint32") == 0 || t.compare("uint32_t") == 0)
+    return "unsigned int";
+  return "";
+}
+
+// Data file names are relative to the header
+static std::string
+_dataFilePath(const char* headerfn, const std::string& name)
+{
+  if (itksys::SystemTools::FileIsFullPath(name.c_str()))
+    return name;
+
+  std::string dir = itksys::SystemTools::GetFilenamePath(headerfn);
+  if (dir.length() == 0)
+    return name;
+
+  return dir + "/" + name;
+}
+
+MappedImageFile
+::MappedImageFile()
+{
+  m_DataFileName = "";
+  m_DataOffset = 0;
+
+  m_PixelTypeName = "";
+  m_BigEndian = false;
+
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    m_Size[i] = 0;
+    m_Spacing[i] = 1.0;
+    m_Origin[i] = 0.0;
+    for (unsigned int j = 0; j < 3; j++)
+      m_Direction[i][j] = (i == j) ? 1.0 : 0.0;
+  }
+
+  m_Mapping = 0;
+  m_MappingSize = 0;
+
+#if defined(_MSC_VER)
+  m_FileHandle = 0;
+  m_MappingHandle = 0;
+#endif
+}
+
+MappedImageFile
+::~MappedImageFile()
+{
+  this->Unmap();
+}
+
+MappedImageFile::Pointer
+MappedImageFile
+::Open(const char* fn)
+{
+  std::string ext = itksys::SystemTools::LowerCase(
+    itksys::SystemTools::GetFilenameLastExtension(fn));
+
+  Pointer file = Self::New();
+
+  bool ok = false;
+  if (ext.compare(".mha") == 0 || ext.compare(".mhd") == 0)
+    ok = file->ReadMetaHeader(fn);
+  else if (ext.compare(".nrrd") == 0 || ext.compare(".nhdr") == 0)
+    ok = file->ReadNrrdHeader(fn);
+
+  if (!ok)
+    return 0;
+
+  for (unsigned int i = 0; i < 3; i++)
+    if (file->m_Size[i] == 0)
+      return 0;
+
+  return file;
+}
+
+bool
+MappedImageFile
+::IsNativeByteOrder() const
+{
+  // Byte order does not matter for single bytes
+  if (m_PixelTypeName.compare("char") == 0
+      ||
+      m_PixelTypeName.compare("unsigned char") == 0)
+    return true;
+
+#if VXL_BIG_ENDIAN
+  return m_BigEndian;
+#else
+  return !m_BigEndian;
+#endif
+}
+
+bool
+MappedImageFile
+::ReadMetaHeader(const char* fn)
+{
+  std::ifstream infile(fn, std::ios::in | std::ios::binary);
+  if (infile.fail())
+    return false;
+
+  std::string line;
+  while (std::getline(infile, line))
+  {
+    if ((unsigned long)infile.tellg() > MU_MAPPED_IMAGE_MAX_HEADER)
+      return false;
+
+    std::string::size_type eq = line.find('=');
+    if (eq == std::string::npos)
+      return false;
+
+    std::string key = _trim(line.substr(0, eq));
+    std::string value = _trim(line.substr(eq+1));
+
+    double v[9];
+
+    if (key.compare("ObjectType") == 0)
+    {
+      if (value.compare("Image") != 0)
+        return false;
+    }
+    else if (key.compare("NDims") == 0)
+    {
+      if (value.compare("3") != 0)
+        return false;
+    }
+    else if (key.compare("DimSize") == 0)
+    {
+      if (!_parseNumbers(value, v, 3))
+        return false;
+      for (unsigned int i = 0; i < 3; i++)
+        m_Size[i] = (unsigned long)v[i];
+    }
+    else if (key.compare("ElementSpacing") == 0)
+    {
+      if (!_parseNumbers(value, m_Spacing, 3))
+        return false;
+    }
+    else if (key.compare("Offset") == 0 || key.compare("Position") == 0
+             || key.compare("Origin") == 0)
+    {
+      if (!_parseNumbers(value, m_Origin, 3))
+        return false;
+    }
+    else if (key.compare("TransformMatrix") == 0
+             || key.compare("Rotation") == 0
+             || key.compare("Orientation") == 0)
+    {
+      if (!_parseNumbers(value, v, 9))
+        return false;
+      // Rows of the matrix are the axis directions
+      for (unsigned int i = 0; i < 3; i++)
+        for (unsigned int j = 0; j < 3; j++)
+          m_Direction[j][i] = v[3*i + j];
+    }
+    else if (key.compare("ElementType") == 0)
+    {
+      m_PixelTypeName = _metaTypeName(value);
+      if (m_PixelTypeName.length() == 0)
+        return false;
+    }
+    else if (key.compare("BinaryDataByteOrderMSB") == 0
+             || key.compare("ElementByteOrderMSB") == 0)
+    {
+      m_BigEndian = (value.compare("True") == 0);
+    }
+    else if (key.compare("BinaryData") == 0)
+    {
+      if (value.compare("True") != 0)
+        return false;
+    }
+    else if (key.compare("CompressedData") == 0)
+    {
+      if (value.compare("False") != 0)
+        return false;
+    }
+    else if (key.compare("ElementNumberOfChannels") == 0)
+    {
+      if (value.compare("1") != 0)
+        return false;
+    }
+    else if (key.compare("HeaderSize") == 0)
+    {
+      if (value.compare("0") != 0)
+        return false;
+    }
+    else if (key.compare("ElementDataFile") == 0)
+    {
+      // Last field of the header
+      if (value.compare("LOCAL") == 0)
+      {
+        m_DataFileName = fn;
+        m_DataOffset = (unsigned long)infile.tellg();
+      }
+      else
+      {
+        // Lists and numbered file patterns
+        if (value.compare(0, 4, "LIST") == 0
+            ||
+            value.find('%') != std::string::npos
+            ||
+            value.find(' ') != std::string::npos)
+          return false;
+        m_DataFileName = _dataFilePath(fn, value);
+        m_DataOffset = 0;
+      }
+
+      return m_PixelTypeName.length() != 0;
+    }
+  }
+
+  return false;
+}
+
+bool
+MappedImageFile
+::ReadNrrdHeader(const char* fn)
+{
+  std::ifstream infile(fn, std::ios::in | std::ios::binary);
+  if (infile.fail())
+    return false;
+
+  std::string line;
+  if (!std::getline(infile, line) || line.compare(0, 7, "NRRD000") != 0)
+    return false;
+
+  bool haveDirections = false;
+  bool haveSpacings = false;
+  bool haveEndian = false;
+  bool raw = false;
+
+  // Sign of the x and y axes going to LPS
+  double flip[3] = {1.0, 1.0, 1.0};
+
+  double directions[3][3];
+
+  m_DataFileName = "";
+
+  while (true)
+  {
+    if (!std::getline(infile, line))
+    {
+      // Header only file without a blank line at the end
+      if (m_DataFileName.length() == 0)
+        return false;
+      break;
+    }
+
+    if ((unsigned long)infile.tellg() > MU_MAPPED_IMAGE_MAX_HEADER)
+      return false;
+
+    line = _trim(line);
+
+    // End of the header, attached data follows
+    if (line.length() == 0)
+    {
+      if (m_DataFileName.length() == 0)
+      {
+        m_DataFileName = fn;
+        m_DataOffset = (unsigned long)infile.tellg();
+      }
+      break;
+    }
+
+    if (line[0] == '#')
+      continue;
+
+    // Key/value pairs
+    if (line.find(":=") != std::string::npos)
+      continue;
+
+    std::string::size_type colon = line.find(": ");
+    if (colon == std::string::npos)
+      return false;
+
+    std::string key = line.substr(0, colon);
+    std::string value = _trim(line.substr(colon+2));
+
+    double v[9];
+
+    if (key.compare("type") == 0)
+    {
+      m_PixelTypeName = _nrrdTypeName(value);
+      if (m_PixelTypeName.length() == 0)
+        return false;
+    }
+    else if (key.compare("dimension") == 0 || key.compare("space dimension") == 0)
+    {
+      if (value.compare("3") != 0)
+        return false;
+    }
+    else if (key.compare("sizes") == 0)
+    {
+      if (!_parseNumbers(value, v, 3))
+        return false;
+      for (unsigned int i = 0; i < 3; i++)
+        m_Size[i] = (unsigned long)v[i];
+    }
+    else if (key.compare("encoding") == 0)
+    {
+      if (value.compare("raw") != 0)
+        return false;
+      raw = true;
+    }
+    else if (key.compare("endian") == 0)
+    {
+      if (value.compare("big") == 0)
+        m_BigEndian = true;
+      else if (value.compare("little") == 0)
+        m_BigEndian = false;
+      else
+        return false;
+      haveEndian = true;
+    }
+    else if (key.compare("space") == 0)
+    {
+      if (value.compare("right-anterior-superior") == 0
+          || value.compare("RAS") == 0)
+      {
+        flip[0] = -1.0;
+        flip[1] = -1.0;
+      }
+      else if (value.compare("left-anterior-superior") == 0
+               || value.compare("LAS") == 0)
+      {
+        flip[1] = -1.0;
+      }
+      else if (value.compare("left-posterior-superior") != 0
+               && value.compare("LPS") != 0)
+        return false;
+    }
+    else if (key.compare("space directions") == 0)
+    {
+      if (!_parseNumbers(value, v, 9))
+        return false;
+      for (unsigned int i = 0; i < 3; i++)
+        for (unsigned int j = 0; j < 3; j++)
+          directions[i][j] = v[3*i + j];
+      haveDirections = true;
+    }
+    else if (key.compare("space origin") == 0)
+    {
+      if (!_parseNumbers(value, m_Origin, 3))
+        return false;
+    }
+    else if (key.compare("spacings") == 0)
+    {
+      if (!_parseNumbers(value, m_Spacing, 3))
+        return false;
+      haveSpacings = true;
+    }
+    else if (key.compare("byte skip") == 0 || key.compare("byteskip") == 0
+             || key.compare("line skip") == 0 || key.compare("lineskip") == 0)
+    {
+      if (value.compare("0") != 0)
+        return false;
+    }
+    else if (key.compare("data file") == 0 || key.compare("datafile") == 0)
+    {
+      if (value.compare(0, 4, "LIST") == 0
+          ||
+          value.find('%') != std::string::npos
+          ||
+          value.find(' ') != std::string::npos)
+        return false;
+      m_DataFileName = _dataFilePath(fn, value);
+      m_DataOffset = 0;
+    }
+    else if (key.compare("kinds") == 0)
+    {
+      std::istringstream iss(value);
+      std::string kind;
+      while (iss >> kind)
+        if (kind.compare("domain") != 0 && kind.compare("space") != 0)
+          return false;
+    }
+  }
+
+  if (!raw || m_PixelTypeName.length() == 0)
+    return false;
+
+  // Required for all but single byte voxels
+  if (!haveEndian && m_PixelTypeName.find("char") == std::string::npos)
+    return false;
+
+  if (haveDirections)
+  {
+    // Axis spacings are the lengths of the direction vectors
+    for (unsigned int i = 0; i < 3; i++)
+    {
+      double len = 0;
+      for (unsigned int j = 0; j < 3; j++)
+        len += directions[i][j] * directions[i][j];
+      len = sqrt(len);
+      if (len == 0)
+        return false;
+
+      m_Spacing[i] = len;
+      for (unsigned int j = 0; j < 3; j++)
+        m_Direction[j][i] = flip[j] * directions[i][j] / len;
+    }
+  }
+  else if (!haveSpacings)
+  {
+    for (unsigned int i = 0; i < 3; i++)
+      m_Spacing[i] = 1.0;
+  }
+
+  for (unsigned int i = 0; i < 3; i++)
+    m_Origin[i] *= flip[i];
+
+  return true;
+}
+
+void*
+MappedImageFile
+::Map(unsigned int pixelSize)
+{
+  this->Unmap();
+
+  if (pixelSize == 0 || (m_DataOffset % pixelSize) != 0)
+    return 0;
+
+  unsigned long dataSize = pixelSize;
+  for (unsigned int i = 0; i < 3; i++)
+    dataSize *= m_Size[i];
+
+  const char* fn = m_DataFileName.c_str();
+
+#if defined(_MSC_VER)
+  HANDLE fh = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ, NULL,
+    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (fh == INVALID_HANDLE_VALUE)
+    return 0;
+
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(fh, &fileSize)
+      ||
+      (unsigned long)fileSize.QuadPart < m_DataOffset + dataSize)
+  {
+    CloseHandle(fh);
+    return 0;
+  }
+
+  HANDLE mh = CreateFileMapping(fh, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+  if (mh == NULL)
+  {
+    CloseHandle(fh);
+    return 0;
+  }
+
+  void* p = MapViewOfFile(mh, FILE_MAP_COPY, 0, 0, 0);
+  if (p == NULL)
+  {
+    CloseHandle(mh);
+    CloseHandle(fh);
+    return 0;
+  }
+
+  m_FileHandle = fh;
+  m_MappingHandle = mh;
+  m_MappingSize = (unsigned long)fileSize.QuadPart;
+#else
+  int fd = open(fn, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0
+      ||
+      (unsigned long)st.st_size < m_DataOffset + dataSize)
+  {
+    close(fd);
+    return 0;
+  }
+
+  // Private writable mapping, pages are shared until written to
+  void* p = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (p == MAP_FAILED)
+    return 0;
+
+  m_MappingSize = st.st_size;
+#endif
+
+  m_Mapping = p;
+
+  return (unsigned char*)m_Mapping + m_DataOffset;
+}
+
+void
+MappedImageFile
+::Unmap()
+{
+  if (m_Mapping == 0)
+    return;
+
+#if defined(_MSC_VER)
+  UnmapViewOfFile(m_Mapping);
+  CloseHandle((HANDLE)m_MappingHandle);
+  CloseHandle((HANDLE)m_FileHandle);
+  m_MappingHandle = 0;
+  m_FileHandle = 0;
+#else
+  munmap(m_Mapping, m_MappingSize);
+#endif
+
+  m_Mapping = 0;
+  m_MappingSize = 0;
+}
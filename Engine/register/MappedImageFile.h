@@ -0,0 +1,93 @@
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Uncompressed MetaImage (.mha, .mhd) or NRRD (.nrrd, .nhdr) file with the
+// voxels stored in one raw block, mapped copy on write instead of read
+//
+// Only the header fields that describe a single 3D scalar volume are
+// supported, files using anything else (compression, lists of data files,
+// header skips, other NRRD spaces) are rejected so that they are read by the
+// ITK readers instead.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _MappedImageFile_h
+#define _MappedImageFile_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+
+#include <string>
+
+class MappedImageFile: public itk::Object
+{
+
+public:
+
+  /** Standard class typedefs. */
+  typedef MappedImageFile Self;
+  typedef itk::Object Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(MappedImageFile, itk::Object);
+
+  // Header of a file that can be mapped, NULL otherwise
+  static Pointer Open(const char* fn);
+
+  // Voxel type ("float", "short", "unsigned char", ...)
+  const std::string& GetPixelTypeName() const { return m_PixelTypeName; }
+
+  bool IsNativeByteOrder() const;
+
+  // Geometry in ITK (LPS) conventions, column j of the direction matrix is
+  // the direction of axis j
+  const unsigned long* GetSize() const { return m_Size; }
+  const double* GetSpacing() const { return m_Spacing; }
+  const double* GetOrigin() const { return m_Origin; }
+  double GetDirection(unsigned int i, unsigned int j) const
+  { return m_Direction[i][j]; }
+
+  // Maps the data file and returns the first voxel, NULL if the file is too
+  // short or the voxels are not aligned for the pixel size
+  void* Map(unsigned int pixelSize);
+  void Unmap();
+
+protected:
+
+  MappedImageFile();
+  ~MappedImageFile();
+
+  bool ReadMetaHeader(const char* fn);
+  bool ReadNrrdHeader(const char* fn);
+
+private:
+  MappedImageFile(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  std::string m_DataFileName;
+  unsigned long m_DataOffset;
+
+  std::string m_PixelTypeName;
+  bool m_BigEndian;
+
+  unsigned long m_Size[3];
+  double m_Spacing[3];
+  double m_Origin[3];
+  double m_Direction[3][3];
+
+  void* m_Mapping;
+  unsigned long m_MappingSize;
+
+#if defined(_MSC_VER)
+  void* m_FileHandle;
+  void* m_MappingHandle;
+#endif
+
+};
+
+#endif
@@ -0,0 +1,65 @@
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Reads 3D images by mapping uncompressed MetaImage / NRRD files whose voxel
+// type and byte order match the image, the image points into the mapping
+// (copy on write, so writing to it never changes the file) and keeps the file
+// mapped while in use. Other files are read with ImageFileReader.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _MappedImageReader_h
+#define _MappedImageReader_h
+
+#include "itkImage.h"
+#include "itkObjectFactory.h"
+
+#include "MappedImageFile.h"
+
+#include <string>
+
+template <class TImage>
+class MappedImageReader
+{
+
+public:
+
+  typedef TImage ImageType;
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename ImageType::PixelType PixelType;
+
+  // Mapped image, NULL if the file can not be mapped as this image type
+  static ImagePointer MapImage(const std::string& fn);
+
+  // Mapped image if possible, otherwise read
+  static ImagePointer ReadImage(const std::string& fn);
+
+  // Name of the pixel type as reported by MappedImageFile, empty if the type
+  // is never mapped
+  static std::string GetPixelTypeName();
+
+protected:
+
+  // Pixel container using the mapped voxels
+  class MappedPixelContainer: public ImageType::PixelContainer
+  {
+  public:
+    typedef MappedPixelContainer Self;
+    typedef itk::SmartPointer<Self> Pointer;
+
+    itkNewMacro(Self);
+
+    MappedImageFile::Pointer File;
+
+  protected:
+    MappedPixelContainer() { }
+    ~MappedPixelContainer() { }
+  };
+
+};
+
+#ifndef MU_MANUAL_INSTANTIATION
+#include "MappedImageReader.txx"
+#endif
+
+#endif
@@ -0,0 +1,111 @@
+
+#ifndef _MappedImageReader_txx
+#define _MappedImageReader_txx
+
+#include "MappedImageReader.h"
+
+#include "itkImageFileReader.h"
+
+#include <typeinfo>
+
+template <class TImage>
+std::string
+MappedImageReader<TImage>
+::GetPixelTypeName()
+{
+  if (typeid(PixelType) == typeid(float))
+    return "float";
+  if (typeid(PixelType) == typeid(double))
+    return "double";
+  if (typeid(PixelType) == typeid(short))
+    return "short";
+  if (typeid(PixelType) == typeid(unsigned short))
+    return "unsigned short";
+  if (typeid(PixelType) == typeid(char) || typeid(PixelType) == typeid(signed char))
+    return "char";
+  if (typeid(PixelType) == typeid(unsigned char))
+    return "unsigned char";
+  if (typeid(PixelType) == typeid(int))
+    return "int";
+  if (typeid(PixelType) == typeid(unsigned int))
+    return "unsigned int";
+  return "";
+}
+
+template <class TImage>
+typename MappedImageReader<TImage>::ImagePointer
+MappedImageReader<TImage>
+::MapImage(const std::string& fn)
+{
+  if (ImageType::ImageDimension != 3)
+    return 0;
+
+  std::string typeName = GetPixelTypeName();
+  if (typeName.length() == 0)
+    return 0;
+
+  MappedImageFile::Pointer file = MappedImageFile::Open(fn.c_str());
+  if (file.IsNull())
+    return 0;
+
+  if (file->GetPixelTypeName().compare(typeName) != 0
+      ||
+      !file->IsNativeByteOrder())
+    return 0;
+
+  PixelType* voxels = (PixelType*)file->Map(sizeof(PixelType));
+  if (voxels == 0)
+    return 0;
+
+  typename ImageType::RegionType region;
+  typename ImageType::SpacingType spacing;
+  typename ImageType::PointType origin;
+  typename ImageType::DirectionType direction;
+
+  unsigned long numPixels = 1;
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    region.SetSize(i, file->GetSize()[i]);
+    spacing[i] = file->GetSpacing()[i];
+    origin[i] = file->GetOrigin()[i];
+    for (unsigned int j = 0; j < 3; j++)
+      direction[i][j] = file->GetDirection(i, j);
+    numPixels *= file->GetSize()[i];
+  }
+
+  typename MappedPixelContainer::Pointer container =
+    MappedPixelContainer::New();
+  container->SetImportPointer(voxels, numPixels, false);
+  container->File = file;
+
+  ImagePointer img = ImageType::New();
+  img->SetRegions(region);
+  img->SetSpacing(spacing);
+  img->SetOrigin(origin);
+  img->SetDirection(direction);
+  img->SetPixelContainer(container);
+
+  return img;
+}
+
+template <class TImage>
+typename MappedImageReader<TImage>::ImagePointer
+MappedImageReader<TImage>
+::ReadImage(const std::string& fn)
+{
+  ImagePointer img = MapImage(fn);
+  if (!img.IsNull())
+    return img;
+
+  typedef itk::ImageFileReader<ImageType> ReaderType;
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(fn.c_str());
+  reader->Update();
+
+  img = reader->GetOutput();
+  img->DisconnectPipeline();
+
+  return img;
+}
+
+#endif
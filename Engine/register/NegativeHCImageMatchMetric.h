@@ -11,9 +11,12 @@
 #include "itkImage.h"
 #include "itkImageToImageMetric.h"
 #include "itkIndex.h"
+#include "itkMatrixOffsetTransformBase.h"
 #include "itkPoint.h"
 #include "itkSingleValuedCostFunction.h"
 
+#include "itkMultiThreader.h"
+
 #include "vnl/vnl_matrix.h"
 
 template <class TFixedImage, class TMovingImage>
@@ -75,6 +78,8 @@ public:
 
   typedef vnl_matrix<double> HistogramType;
 
+  typedef itk::MatrixOffsetTransformBase<double, 3, 3> MatrixOffsetTransformType;
+
   /** Enum of the moving image dimension. */
   itkStaticConstMacro(MovingImageDimension, unsigned int,
                       MovingImageType::ImageDimension);
@@ -106,9 +111,18 @@ public:
   itkGetConstMacro(NumberOfBins, unsigned int);
   void SetNumberOfBins(unsigned int numbins);
 
+  // Number of threads used for the histogram, defaults to the global ITK
+  // setting
+  itkGetConstMacro(NumberOfHistogramThreads, unsigned int);
+  void SetNumberOfHistogramThreads(unsigned int n);
+
   itkGetConstMacro(Alpha, double);
   itkSetMacro(Alpha, double);
 
+  // Normalized joint histogram of the last evaluation, rows are fixed image
+  // bins
+  const HistogramType& GetHistogram() const { return *m_HistogramPointer; }
+
   virtual unsigned int GetNumberOfParameters() const
   {
     return this->m_Transform->GetNumberOfParameters();
@@ -116,15 +130,29 @@ public:
 
 protected:
   NegativeHCImageMatchMetric();
-  virtual ~NegativeHCImageMatchMetric() { delete m_HistogramPointer; }
+  virtual ~NegativeHCImageMatchMetric()
+  { delete m_HistogramPointer; delete [] m_ThreadHistograms; }
   void PrintSelf(std::ostream& os, itk::Indent indent) const;
 
   void MapFixedImage();
   void MapMovingImage();
 
   void ComputeHistogram() const;
+
+  // Each thread fills a partial histogram from a block of sample planes,
+  // the partial histograms are then summed over blocks of rows
+  void AllocateThreadHistograms();
+
+  void ThreadedComputeHistogram() const;
+  static ITK_THREAD_RETURN_TYPE _threadFillHistogram(void* arg);
+  static ITK_THREAD_RETURN_TYPE _threadReduceHistograms(void* arg);
+
   double ComputeHC() const;
 
+  // Fixed index to moving continuous index matrix (3x4, row major), false
+  // if the transform is not affine
+  bool GetIndexToIndexMatrix(double* M) const;
+
 private:
   NegativeHCImageMatchMetric(const Self&); //purposely not implemented
   void operator=(const Self&); //purposely not implemented
@@ -140,6 +168,10 @@ private:
 
   HistogramType* m_HistogramPointer;
 
+  HistogramType* m_ThreadHistograms;
+  unsigned int m_NumberOfThreadHistograms;
+  unsigned int m_NumberOfHistogramThreads;
+
   double m_Alpha;
 
   ParametersType m_DerivativeStepLengths;
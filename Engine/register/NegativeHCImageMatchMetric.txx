@@ -11,10 +11,12 @@
 
 #include "NegativeHCImageMatchMetric.h"
 
+#include "ChainedAffineTransform3D.h"
 #include "MersenneTwisterRNG.h"
 
 #include <cfloat>
 #include <cmath>
+#include <vector>
 
 
 // Image to histogram index mapping using linear mapping
@@ -116,6 +118,11 @@ NegativeHCImageMatchMetric<TFixedImage, TMovingImage>
   m_HistogramPointer = new HistogramType(m_NumberOfBins, m_NumberOfBins);
   m_HistogramPointer->fill(0);
 
+  m_ThreadHistograms = 0;
+  m_NumberOfThreadHistograms = 0;
+  m_NumberOfHistogramThreads =
+    itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+
   this->m_FixedImage = 0;
   this->m_MovingImage = 0;
 
@@ -132,6 +139,8 @@ NegativeHCImageMatchMetric<TFixedImage, TMovingImage>
 
   m_DerivativeStepLengths = ParametersType(1);
   m_DerivativeStepLengths.Fill(1e-2);
+
+  this->SetNumberOfBins(m_NumberOfBins);
 }
 
 template <class TFixedImage, class TMovingImage>
@@ -295,9 +304,47 @@ NegativeHCImageMatchMetric<TFixedImage, TMovingImage>
   this->MapFixedImage();
   this->MapMovingImage();
 
+  this->AllocateThreadHistograms();
+
   this->Modified();
 }
 
+template <class TFixedImage, class TMovingImage>
+void
+NegativeHCImageMatchMetric<TFixedImage, TMovingImage>
+::SetNumberOfHistogramThreads(unsigned int n)
+{
+  if (n < 1)
+    n = 1;
+
+  if (n == m_NumberOfHistogramThreads)
+    return;
+
+  m_NumberOfHistogramThreads = n;
+
+  this->AllocateThreadHistograms();
+
+  this->Modified();
+}
+
+template <class TFixedImage, class TMovingImage>
+void
+NegativeHCImageMatchMetric<TFixedImage, TMovingImage>
+::AllocateThreadHistograms()
+{
+  unsigned int numThreads = m_NumberOfHistogramThreads;
+
+  delete [] m_ThreadHistograms;
+  m_ThreadHistograms = new HistogramType[numThreads];
+  m_NumberOfThreadHistograms = numThreads;
+
+  for (unsigned int i = 0; i < numThreads; i++)
+  {
+    m_ThreadHistograms[i].set_size(m_NumberOfBins, m_NumberOfBins);
+    m_ThreadHistograms[i].fill(0);
+  }
+}
+
 template <class TFixedImage, class TMovingImage>
 void
 NegativeHCImageMatchMetric<TFixedImage, TMovingImage>
@@ -323,11 +370,29 @@ NegativeHCImageMatchMetric<TFixedImage, TMovingImage>
   MovingImageSizeType movingSize =
     m_MovingIndexImage->GetLargestPossibleRegion().GetSize();
 
+  // Affine transforms map a row of samples at once
+  double M[12];
+  bool useMatrix = this->GetIndexToIndexMatrix(M);
+
+  unsigned long numRowSamples = (fixedSize[0] + m_Skips[0] - 1) / m_Skips[0];
+  std::vector<double> rowX(numRowSamples);
+  std::vector<double> rowY(numRowSamples);
+  std::vector<double> rowZ(numRowSamples);
+
   FixedImageIndexType ind;
 
   for (ind[2] = 0; ind[2] < (long)fixedSize[2]; ind[2] += m_Skips[2])
     for (ind[1] = 0; ind[1] < (long)fixedSize[1]; ind[1] += m_Skips[1])
-      for (ind[0] = 0; ind[0] < (long)fixedSize[0]; ind[0] += m_Skips[0])
+    {
+      if (useMatrix)
+      {
+        ind[0] = 0;
+        ChainedAffineTransform3D::TransformIndexRow(M, ind, m_Skips[0],
+          numRowSamples, &rowX[0], &rowY[0], &rowZ[0]);
+      }
+
+      unsigned long k = 0;
+      for (ind[0] = 0; ind[0] < (long)fixedSize[0]; ind[0] += m_Skips[0], k++)
       {
         // Get sampled fixed image histogram index
         unsigned int r = m_FixedIndexImage->GetPixel(ind);
@@ -338,19 +403,28 @@ NegativeHCImageMatchMetric<TFixedImage, TMovingImage>
           continue;
         }
 
-        FixedImagePointType fixedPoint;
-        this->m_FixedImage->TransformIndexToPhysicalPoint(ind, fixedPoint);
-
-        MovingImagePointType mappedPoint =
-          this->m_Transform->TransformPoint(fixedPoint);
-
         // Use Partial Volume interpolation
     
         // Get continuous moving image coordinates (in voxels)
         typedef itk::ContinuousIndex<double, 3> ContinuousIndexType;
         ContinuousIndexType movingInd;
-        this->m_MovingImage->TransformPhysicalPointToContinuousIndex(
-          mappedPoint, movingInd);
+        if (useMatrix)
+        {
+          movingInd[0] = rowX[k];
+          movingInd[1] = rowY[k];
+          movingInd[2] = rowZ[k];
+        }
+        else
+        {
+          FixedImagePointType fixedPoint;
+          this->m_FixedImage->TransformIndexToPhysicalPoint(ind, fixedPoint);
+
+          MovingImagePointType mappedPoint =
+            this->m_Transform->TransformPoint(fixedPoint);
+
+          this->m_MovingImage->TransformPhysicalPointToContinuousIndex(
+            mappedPoint, movingInd);
+        }
 
         // Get image neighborhood
         int x0 = (int)movingInd[0];
@@ -432,6 +506,7 @@ NegativeHCImageMatchMetric<TFixedImage, TMovingImage>
 #undef partialVolumeWeightMacro
 
       }
+    }
 
   // Normalize histogram values
   double sumHist = 0;
@@ -443,13 +518,249 @@ NegativeHCImageMatchMetric<TFixedImage, TMovingImage>
 
 }
 
+template <class TFixedImage, class TMovingImage>
+void
+NegativeHCImageMatchMetric<TFixedImage, TMovingImage>
+::ThreadedComputeHistogram() const
+{
+
+  itkDebugMacro(<< "ThreadedComputeHistogram");
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+
+  // One partial histogram per thread, threader may clamp the number further
+  threader->SetNumberOfThreads(m_NumberOfThreadHistograms);
+
+  threader->SetSingleMethod(
+    &NegativeHCImageMatchMetric::_threadFillHistogram, (void*)this);
+  threader->SingleMethodExecute();
+
+  threader->SetSingleMethod(
+    &NegativeHCImageMatchMetric::_threadReduceHistograms, (void*)this);
+  threader->SingleMethodExecute();
+
+  HistogramType& H = *m_HistogramPointer;
+
+  // Normalize histogram values
+  double sumHist = 0;
+  for (unsigned int r = 0; r < m_NumberOfBins; r++)
+    for (unsigned int c = 0; c < m_NumberOfBins; c++)
+      sumHist += H(r, c);
+  if (sumHist != 0)
+    H /= sumHist;
+
+}
+
+template <class TFixedImage, class TMovingImage>
+ITK_THREAD_RETURN_TYPE
+NegativeHCImageMatchMetric<TFixedImage, TMovingImage>
+::_threadFillHistogram(void* arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfoType;
+  ThreadInfoType * infoStruct = static_cast< ThreadInfoType * >( arg );
+
+  const unsigned int threadId = infoStruct->ThreadID;
+  const unsigned int numThreads = infoStruct->NumberOfThreads;
+
+  NegativeHCImageMatchMetric* obj = static_cast< NegativeHCImageMatchMetric* >( infoStruct->UserData );
+
+  HistogramType& H = obj->m_ThreadHistograms[threadId];
+  H.fill(0);
+
+  FixedImageSizeType fixedSize =
+    obj->m_FixedIndexImage->GetLargestPossibleRegion().GetSize();
+
+  MovingImageSizeType movingSize =
+    obj->m_MovingIndexImage->GetLargestPossibleRegion().GetSize();
+
+  const unsigned int numBins = obj->m_NumberOfBins;
+
+  // Block of sample planes along z for this thread
+  long numPlanes = (fixedSize[2] + obj->m_Skips[2] - 1) / obj->m_Skips[2];
+  long blockSize = (numPlanes + numThreads - 1) / numThreads;
+
+  long zbegin = threadId * blockSize * obj->m_Skips[2];
+  long zend = (threadId+1) * blockSize * obj->m_Skips[2];
+  if (zend > (long)fixedSize[2])
+    zend = fixedSize[2];
+
+  // Affine transforms map a row of samples at once
+  double M[12];
+  bool useMatrix = obj->GetIndexToIndexMatrix(M);
+
+  unsigned long numRowSamples =
+    (fixedSize[0] + obj->m_Skips[0] - 1) / obj->m_Skips[0];
+  std::vector<double> rowX(numRowSamples);
+  std::vector<double> rowY(numRowSamples);
+  std::vector<double> rowZ(numRowSamples);
+
+  FixedImageIndexType ind;
+
+  for (ind[2] = zbegin; ind[2] < zend; ind[2] += obj->m_Skips[2])
+    for (ind[1] = 0; ind[1] < (long)fixedSize[1]; ind[1] += obj->m_Skips[1])
+    {
+      if (useMatrix)
+      {
+        ind[0] = 0;
+        ChainedAffineTransform3D::TransformIndexRow(M, ind, obj->m_Skips[0],
+          numRowSamples, &rowX[0], &rowY[0], &rowZ[0]);
+      }
+
+      unsigned long k = 0;
+      for (ind[0] = 0; ind[0] < (long)fixedSize[0];
+           ind[0] += obj->m_Skips[0], k++)
+      {
+        // Get sampled fixed image histogram index
+        unsigned int r = obj->m_FixedIndexImage->GetPixel(ind);
+
+        // Skip if fixed image histogram index is invalid
+        if (r >= numBins)
+          continue;
+
+        // Get continuous moving image coordinates (in voxels)
+        typedef itk::ContinuousIndex<double, 3> ContinuousIndexType;
+        ContinuousIndexType movingInd;
+        if (useMatrix)
+        {
+          movingInd[0] = rowX[k];
+          movingInd[1] = rowY[k];
+          movingInd[2] = rowZ[k];
+        }
+        else
+        {
+          FixedImagePointType fixedPoint;
+          obj->m_FixedImage->TransformIndexToPhysicalPoint(ind, fixedPoint);
+
+          MovingImagePointType mappedPoint =
+            obj->m_Transform->TransformPoint(fixedPoint);
+
+          obj->m_MovingImage->TransformPhysicalPointToContinuousIndex(
+            mappedPoint, movingInd);
+        }
+
+        // Get image neighborhood
+        int x0 = (int)movingInd[0];
+        int y0 = (int)movingInd[1];
+        int z0 = (int)movingInd[2];
+
+        int x1 = x0 + 1;
+        int y1 = y0 + 1;
+        int z1 = z0 + 1;
+
+        // Get distances to the image grid
+        double fx = movingInd[0] - (double)x0;
+        double fy = movingInd[1] - (double)y0;
+        double fz = movingInd[2] - (double)z0;
+
+        double gx = 1.0 - fx;
+        double gy = 1.0 - fy;
+        double gz = 1.0 - fz;
+
+        // Moving image histogram index (column)
+        unsigned int c = 0;
+
+// PV interpolation
+// Macro for adding trilinear weights
+// Only add if inside moving image and moving index is valid
+#define partialVolumeWeightMacro(x, y, z, w) \
+  if ((0 <= (x)) && ((x) < (long)movingSize[0]) && \
+    (0 <= (y)) && ((y) < (long)movingSize[1]) && \
+    (0 <= (z)) && ((z) < (long)movingSize[2])) \
+  { \
+    MovingImageIndexType pvind = {{(x), (y), (z)}}; \
+    c = obj->m_MovingIndexImage->GetPixel(pvind); \
+    if (c < numBins) \
+      H(r, c) += (w); \
+  }
+
+        // Fill histogram with trilinear weights
+        partialVolumeWeightMacro(x0, y0, z0, gx*gy*gz);
+        partialVolumeWeightMacro(x0, y0, z1, gx*gy*fz);
+        partialVolumeWeightMacro(x0, y1, z0, gx*fy*gz);
+        partialVolumeWeightMacro(x0, y1, z1, gx*fy*fz);
+        partialVolumeWeightMacro(x1, y0, z0, fx*gy*gz);
+        partialVolumeWeightMacro(x1, y0, z1, fx*gy*fz);
+        partialVolumeWeightMacro(x1, y1, z0, fx*fy*gz);
+        partialVolumeWeightMacro(x1, y1, z1, fx*fy*fz);
+
+#undef partialVolumeWeightMacro
+
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TFixedImage, class TMovingImage>
+ITK_THREAD_RETURN_TYPE
+NegativeHCImageMatchMetric<TFixedImage, TMovingImage>
+::_threadReduceHistograms(void* arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfoType;
+  ThreadInfoType * infoStruct = static_cast< ThreadInfoType * >( arg );
+
+  const unsigned int threadId = infoStruct->ThreadID;
+  const unsigned int numThreads = infoStruct->NumberOfThreads;
+
+  NegativeHCImageMatchMetric* obj = static_cast< NegativeHCImageMatchMetric* >( infoStruct->UserData );
+
+  HistogramType& H = *obj->m_HistogramPointer;
+
+  unsigned int numBins = obj->m_NumberOfBins;
+
+  unsigned int blockSize = (numBins + numThreads - 1) / numThreads;
+
+  unsigned int rowBegin = threadId * blockSize;
+  unsigned int rowEnd = rowBegin + blockSize;
+  if (rowEnd > numBins)
+    rowEnd = numBins;
+
+  // Threads write to disjoint row blocks
+  for (unsigned int r = rowBegin; r < rowEnd; r++)
+  {
+    double* h = H[r];
+
+    const double* h0 = obj->m_ThreadHistograms[0][r];
+    for (unsigned int c = 0; c < numBins; c++)
+      h[c] = h0[c];
+
+    for (unsigned int t = 1; t < numThreads; t++)
+    {
+      const double* ht = obj->m_ThreadHistograms[t][r];
+      for (unsigned int c = 0; c < numBins; c++)
+        h[c] += ht[c];
+    }
+  }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TFixedImage, class TMovingImage>
+bool
+NegativeHCImageMatchMetric<TFixedImage, TMovingImage>
+::GetIndexToIndexMatrix(double* M) const
+{
+  const MatrixOffsetTransformType* affine =
+    dynamic_cast<const MatrixOffsetTransformType*>(
+      this->m_Transform.GetPointer());
+
+  if (affine == 0)
+    return false;
+
+  ChainedAffineTransform3D::ComputeIndexToIndexMatrix(affine,
+    this->m_FixedImage, this->m_MovingImage, M);
+
+  return true;
+}
+
 template <class TFixedImage, class TMovingImage>
 double
 NegativeHCImageMatchMetric<TFixedImage, TMovingImage>
 ::ComputeHC() const
 {
   // Compute histogram
-  this->ComputeHistogram();
+  //this->ComputeHistogram();
+  this->ThreadedComputeHistogram();
 
   itkDebugMacro(<< "Start MI");
 
@@ -14,17 +14,20 @@
 #ifndef _NegativeMIImageMatchMetric_h
 #define _NegativeMIImageMatchMetric_h
 
+#include "itkBSplineDeformableTransform.h"
 #include "itkImage.h"
 #include "itkImageToImageMetric.h"
 #include "itkIndex.h"
+#include "itkMatrixOffsetTransformBase.h"
 #include "itkPoint.h"
 #include "itkSingleValuedCostFunction.h"
 
 #include "itkMultiThreader.h"
-#include "itkSimpleFastMutexLock.h"
 
 #include "vnl/vnl_matrix.h"
 
+#include "BinIndexImage.h"
+
 #include <vector>
 
 template <class TFixedImage, class TMovingImage>
@@ -74,7 +77,8 @@ public:
   typedef typename TransformType::InputPointType FixedImagePointType;
   typedef typename TransformType::OutputPointType MovingImagePointType;
 
-  // Image type containing histogram indices
+  // Image type containing histogram indices, converted to the compact
+  // BinIndexImage after mapping
   //typedef itk::Image<unsigned int, itkGetStaticConstMacro(ImageDimension)>
   typedef itk::Image<unsigned int, 3>
     IndexImageType;
@@ -86,6 +90,10 @@ public:
 
   typedef vnl_matrix<float> HistogramType;
 
+  // Transforms with analytic derivatives
+  typedef itk::MatrixOffsetTransformBase<double, 3, 3> MatrixOffsetTransformType;
+  typedef itk::BSplineDeformableTransform<double, 3, 3> BSplineTransformType;
+
   /** Enum of the moving image dimension. */
   itkStaticConstMacro(MovingImageDimension, unsigned int,
                       MovingImageType::ImageDimension);
@@ -105,6 +113,8 @@ public:
   void GetValueAndDerivative( const ParametersType& parameters,
     MeasureType& Value, DerivativeType& Derivative ) const;
 
+  // Samples are taken on the fixed image grid, inside the fixed image mask
+  // if one was set before
   void SetFixedImage(const FixedImageType* img);
   void SetMovingImage(const MovingImageType* img);
 
@@ -130,9 +140,34 @@ public:
   itkGetConstMacro(DerivativeStepLengths, ParametersType);
   itkSetMacro(DerivativeStepLengths, ParametersType);
 
+  // Use the exact gradient of the partial volume histogram for affine
+  // (matrix + offset) and B-spline transforms, finite differences are used
+  // for other transforms or when turned off
+  itkGetConstMacro(UseAnalyticDerivative, bool);
+  itkSetMacro(UseAnalyticDerivative, bool);
+
   itkGetConstMacro(NumberOfBins, unsigned int);
   void SetNumberOfBins(unsigned int numbins);
 
+  // Number of threads used for the histogram, defaults to the global ITK
+  // setting
+  itkGetConstMacro(NumberOfHistogramThreads, unsigned int);
+  void SetNumberOfHistogramThreads(unsigned int n);
+
+  // Use the fixed image samples of another metric with the same fixed image,
+  // so that copies used in parallel evaluations agree with random sampling
+  void CopySampleIndices(const Self* other);
+
+  // Store the moving bin indices in 4x4x4 bricks, must be set before the
+  // moving image
+  itkGetConstMacro(BrickedMovingIndexImage, bool);
+  itkSetMacro(BrickedMovingIndexImage, bool);
+
+  // Share quantized images with other metric instances through the global
+  // BinIndexImageCache, must be set before the images
+  itkGetConstMacro(UseBinIndexImageCache, bool);
+  itkSetMacro(UseBinIndexImageCache, bool);
+
   virtual unsigned int GetNumberOfParameters() const
   {
     return this->m_Transform->GetNumberOfParameters();
@@ -150,19 +185,67 @@ protected:
 
   void ComputeHistogram() const; 
 
-  void ThreadedComputeHistogram() const;
+  void AllocateThreadHistograms();
+
+  // Returns the total histogram weight before normalization
+  float ThreadedComputeHistogram() const;
   static ITK_THREAD_RETURN_TYPE _threadFillHistogram(void* arg);
+  static ITK_THREAD_RETURN_TYPE _threadReduceHistograms(void* arg);
+
+  // Combine fixed index to physical point, affine transform, and physical
+  // point to moving index mapping into one 3x4 matrix, only valid for
+  // affine (matrix + offset) transforms
+  void UpdateIndexToIndexMatrix() const;
+
+  // Histogram filling using the index to index matrix, stepped along the
+  // rows of the sample grid, on the raw index image buffers
+  void FillHistogramAffine(HistogramType& H,
+    unsigned int posBegin, unsigned int posEnd) const;
+
+  // Add partial volume weights for a batch of mapped samples
+  void AddPartialVolumeBatch(HistogramType& H, unsigned int n,
+    const unsigned int* rows,
+    const double* mx, const double* my, const double* mz) const;
+  template <class TBin>
+  void AddPartialVolumeBatch(HistogramType& H, const TBin* movingBuffer,
+    unsigned int n, const unsigned int* rows,
+    const double* mx, const double* my, const double* mz) const;
 
   float ComputeMI() const;
 
+  // Single pass MI value and gradient using the derivatives of the partial
+  // volume weights, returns false if the transform is not supported
+  bool ComputeAnalyticDerivative(const ParametersType& parameters,
+    MeasureType& value, DerivativeType& derivative) const;
+
+  // Per-thread data for the gradient pass
+  struct DerivativeThreadStruct
+  {
+    const NegativeMIImageMatchMetric* Metric;
+    const MatrixOffsetTransformType* AffineTransform;
+    const BSplineTransformType* BSplineTransform;
+    // Histogram bin weights, d(MI)/d(bin mass)
+    const HistogramType* BinWeights;
+    // Moving physical point to continuous index Jacobian
+    double PointToIndex[3][3];
+    unsigned int AccumulatorSize;
+    std::vector<double> Accumulators;
+  };
+
+  static ITK_THREAD_RETURN_TYPE _threadAccumulateDerivative(void* arg);
+
 private:
   NegativeMIImageMatchMetric(const Self&); //purposely not implemented
   void operator=(const Self&); //purposely not implemented
 
   unsigned int m_NumberOfBins;
 
-  IndexImagePointer m_FixedIndexImage;
-  IndexImagePointer m_MovingIndexImage;
+  BinIndexImage::Pointer m_FixedIndexImage;
+  BinIndexImage::Pointer m_MovingIndexImage;
+
+  bool m_BrickedMovingIndexImage;
+
+  bool m_UseBinIndexImageCache;
 
   bool m_QuantizeFixed;
   bool m_QuantizeMoving;
@@ -178,13 +261,20 @@ private:
 
   ParametersType m_DerivativeStepLengths;
 
+  bool m_UseAnalyticDerivative;
+
   bool m_RandomSampling;
 
-  itk::SimpleFastMutexLock m_Mutex;
+  // Fixed index to moving continuous index mapping, updated at every
+  // histogram computation
+  mutable bool m_UseIndexToIndexMatrix;
+  mutable double m_IndexToIndexMatrix[3][4];
 
+  // Per-thread partial histograms, each thread fills its own using a
+  // contiguous block of the sample indices
   HistogramType* m_ThreadHistograms;
-
-  int* m_ThreadIndexCount;
+  unsigned int m_NumberOfThreadHistograms;
+  unsigned int m_NumberOfHistogramThreads;
 
   std::vector<FixedImageIndexType> m_ThreadIndices;
 
@@ -11,12 +11,17 @@
 
 #include "NegativeMIImageMatchMetric.h"
 
+#include "ChainedAffineTransform3D.h"
 #include "KMeansQuantizeImageFilter.h"
 #include "MersenneTwisterRNG.h"
 
 #include <cfloat>
 #include <cmath>
 
+// Number of samples mapped before their partial volume weights are added to
+// the histogram
+#define MU_MI_SAMPLE_BATCH 16
+
 
 // Image to histogram index mapping using linear mapping
 template <class TImage, class TIndexImage>
@@ -158,12 +163,21 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
   m_DerivativeStepLengths = ParametersType(1);
   m_DerivativeStepLengths.Fill(1e-2);
 
+  m_UseAnalyticDerivative = true;
+
+  m_UseIndexToIndexMatrix = false;
+
+  m_BrickedMovingIndexImage = false;
+
+  m_UseBinIndexImageCache = true;
+
   m_ThreadHistograms = 0;
+  m_NumberOfThreadHistograms = 0;
+  m_NumberOfHistogramThreads =
+    itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
 
   //m_NumberOfBins = 255;
   this->SetNumberOfBins(255);
-
-  m_ThreadIndexCount = new int;
 }
 
 template <class TFixedImage, class TMovingImage>
@@ -172,7 +186,6 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
 {
   delete m_HistogramPointer;
   delete [] m_ThreadHistograms;
-  delete m_ThreadIndexCount;
 }
 
 template <class TFixedImage, class TMovingImage>
@@ -225,10 +238,18 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
   m_ThreadIndices.clear();
 
   FixedImageIndexType ind;
+  FixedImagePointType fixedPoint;
   for (ind[2] = m_Skips[2]; ind[2] < (long)size[2]; ind[2] += m_Skips[2])
     for (ind[1] = m_Skips[1]; ind[1] < (long)size[1]; ind[1] += m_Skips[1])
       for (ind[0] = m_Skips[0]; ind[0] < (long)size[0]; ind[0] += m_Skips[0])
       {
+        // Only samples inside the fixed image mask, if there is one
+        if (!this->m_FixedImageMask.IsNull())
+        {
+          this->m_FixedImage->TransformIndexToPhysicalPoint(ind, fixedPoint);
+          if (!this->m_FixedImageMask->IsInside(fixedPoint))
+            continue;
+        }
         m_ThreadIndices.push_back(ind);
       }
 
@@ -251,6 +272,26 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
   }
 }
 
+template <class TFixedImage, class TMovingImage>
+void
+NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
+::CopySampleIndices(const Self* other)
+{
+  if (other == 0)
+    itkExceptionMacro(<< "NULL metric");
+
+  if (other->m_FixedImage != this->m_FixedImage)
+    itkExceptionMacro(<< "Cannot copy samples between different fixed images");
+
+  for (unsigned int i = 0; i < 3; i++)
+    m_Skips[i] = other->m_Skips[i];
+  m_SampleSpacing = other->m_SampleSpacing;
+
+  m_ThreadIndices = other->m_ThreadIndices;
+
+  this->Modified();
+}
+
 template <class TFixedImage, class TMovingImage>
 void
 NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
@@ -313,18 +354,41 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
   if (this->m_FixedImage.IsNull())
     return;
 
+  BinIndexImageCache::MappingType mapping = m_QuantizeFixed ?
+    BinIndexImageCache::KMeansMapping : BinIndexImageCache::LinearMapping;
+
+  BinIndexImageCache* cache = BinIndexImageCache::GetGlobalInstance();
+
+  if (m_UseBinIndexImageCache)
+  {
+    m_FixedIndexImage = cache->Find(this->m_FixedImage,
+      m_NumberOfBins, m_KMeansSampleSpacing, mapping, false);
+    if (!m_FixedIndexImage.IsNull())
+      return;
+  }
+
+  IndexImagePointer indexImg;
   if (m_QuantizeFixed)
   {
-    m_FixedIndexImage =
+    indexImg =
       _kMeansMapIntensityToHistogramIndex<FixedImageType, IndexImageType>(
         this->m_FixedImage, m_NumberOfBins, m_KMeansSampleSpacing);
   }
   else
   {
-    m_FixedIndexImage =
+    indexImg =
       _linearMapIntensityToHistogramIndex<FixedImageType, IndexImageType>(
         this->m_FixedImage, m_NumberOfBins, m_KMeansSampleSpacing);
   }
+
+  // Fixed bins are accessed one voxel per sample, never bricked
+  m_FixedIndexImage = BinIndexImage::New();
+  m_FixedIndexImage->Initialize(indexImg, m_NumberOfBins, false);
+
+  if (m_UseBinIndexImageCache)
+    cache->Add(this->m_FixedImage,
+      m_NumberOfBins, m_KMeansSampleSpacing, mapping, false,
+      m_FixedIndexImage);
 }
 
 template <class TFixedImage, class TMovingImage>
@@ -337,18 +401,42 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
   if (this->m_MovingImage.IsNull())
     return;
 
+  BinIndexImageCache::MappingType mapping = m_QuantizeMoving ?
+    BinIndexImageCache::KMeansMapping : BinIndexImageCache::LinearMapping;
+
+  BinIndexImageCache* cache = BinIndexImageCache::GetGlobalInstance();
+
+  if (m_UseBinIndexImageCache)
+  {
+    m_MovingIndexImage = cache->Find(this->m_MovingImage,
+      m_NumberOfBins, m_KMeansSampleSpacing, mapping,
+      m_BrickedMovingIndexImage);
+    if (!m_MovingIndexImage.IsNull())
+      return;
+  }
+
+  IndexImagePointer indexImg;
   if (m_QuantizeMoving)
   {
-    m_MovingIndexImage =
+    indexImg =
       _kMeansMapIntensityToHistogramIndex<MovingImageType, IndexImageType>(
         this->m_MovingImage, m_NumberOfBins, m_KMeansSampleSpacing);
   }
   else
   {
-    m_MovingIndexImage =
+    indexImg =
       _linearMapIntensityToHistogramIndex<MovingImageType, IndexImageType>(
         this->m_MovingImage, m_NumberOfBins, m_KMeansSampleSpacing);
   }
+
+  m_MovingIndexImage = BinIndexImage::New();
+  m_MovingIndexImage->Initialize(
+    indexImg, m_NumberOfBins, m_BrickedMovingIndexImage);
+
+  if (m_UseBinIndexImageCache)
+    cache->Add(this->m_MovingImage,
+      m_NumberOfBins, m_KMeansSampleSpacing, mapping,
+      m_BrickedMovingIndexImage, m_MovingIndexImage);
 }
 
 template <class TFixedImage, class TMovingImage>
@@ -381,19 +469,45 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
   this->MapFixedImage();
   this->MapMovingImage();
 
-  // Initialize thread histograms (use default number of threads)
-  int numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  this->AllocateThreadHistograms();
+
+  this->Modified();
+}
+
+template <class TFixedImage, class TMovingImage>
+void
+NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
+::SetNumberOfHistogramThreads(unsigned int n)
+{
+  if (n < 1)
+    n = 1;
+
+  if (n == m_NumberOfHistogramThreads)
+    return;
+
+  m_NumberOfHistogramThreads = n;
+
+  this->AllocateThreadHistograms();
+
+  this->Modified();
+}
+
+template <class TFixedImage, class TMovingImage>
+void
+NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
+::AllocateThreadHistograms()
+{
+  unsigned int numThreads = m_NumberOfHistogramThreads;
 
   delete [] m_ThreadHistograms;
   m_ThreadHistograms = new HistogramType[numThreads];
+  m_NumberOfThreadHistograms = numThreads;
 
   for (unsigned int i = 0; i < numThreads; i++)
   {
     m_ThreadHistograms[i].set_size(m_NumberOfBins, m_NumberOfBins);
     m_ThreadHistograms[i].fill(0);
   }
-
-  this->Modified();
 }
 
 template <class TFixedImage, class TMovingImage>
@@ -407,19 +521,19 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
   HistogramType& H = *m_HistogramPointer;
   H.fill(0);
 
-  FixedImagePointType fixedOrigin = m_FixedIndexImage->GetOrigin();
+  FixedImagePointType fixedOrigin = this->m_FixedImage->GetOrigin();
 
-  FixedImageSpacingType fixedSpacing = m_FixedIndexImage->GetSpacing();
+  FixedImageSpacingType fixedSpacing = this->m_FixedImage->GetSpacing();
 
   FixedImageSizeType fixedSize =
-    m_FixedIndexImage->GetLargestPossibleRegion().GetSize();
+    this->m_FixedImage->GetLargestPossibleRegion().GetSize();
 
-  MovingImagePointType movingOrigin = m_MovingIndexImage->GetOrigin();
+  MovingImagePointType movingOrigin = this->m_MovingImage->GetOrigin();
 
-  MovingImageSpacingType movingSpacing = m_MovingIndexImage->GetSpacing();
+  MovingImageSpacingType movingSpacing = this->m_MovingImage->GetSpacing();
 
   MovingImageSizeType movingSize =
-    m_MovingIndexImage->GetLargestPossibleRegion().GetSize();
+    this->m_MovingImage->GetLargestPossibleRegion().GetSize();
 
   FixedImageIndexType ind;
 
@@ -428,7 +542,7 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
       for (ind[0] = m_Skips[0]; ind[0] < (long)fixedSize[0]; ind[0] += m_Skips[0])
       {
         // Get sampled fixed image histogram index
-        unsigned int r = m_FixedIndexImage->GetPixel(ind);
+        unsigned int r = m_FixedIndexImage->GetBin(ind);
 
         // Skip if fixed image histogram index is invalid
         if (r >= m_NumberOfBins)
@@ -484,7 +598,7 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
         nn_ind[2] < 0 || nn_ind[2] >= (long)movingSize[2])
 // PP: Add BG component???
       continue;
-    c = m_MovingIndexImage->GetPixel(nn_ind);
+    c = m_MovingIndexImage->GetBin(nn_ind);
     if (c >= m_NumberOfBins)
       continue;
     H(r, c) += 1.0;
@@ -502,7 +616,7 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
     (0 <= (z)) && ((z) < (long)movingSize[2])) \
   { \
     MovingImageIndexType local_ind = {{(x), (y), (z)}}; \
-    c_interp += (w) * m_MovingIndexImage->GetPixel(local_ind); \
+    c_interp += (w) * m_MovingIndexImage->GetBin(local_ind); \
   }
         interpWeightMacro(x0, y0, z0, gx*gy*gz);
         interpWeightMacro(x0, y0, z1, gx*gy*fz);
@@ -531,7 +645,7 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
     (0 <= (z)) && ((z) < (long)movingSize[2])) \
   { \
     MovingImageIndexType pvind = {{(x), (y), (z)}}; \
-    c = m_MovingIndexImage->GetPixel(pvind); \
+    c = m_MovingIndexImage->GetBin(pvind); \
     if (c < m_NumberOfBins) \
       H(r, c) += (w); \
   }
@@ -561,32 +675,30 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
 }
 
 template <class TFixedImage, class TMovingImage>
-void
+float
 NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
 ::ThreadedComputeHistogram() const
 {
 
   itkDebugMacro(<< "ThreadedComputeHistogram");
 
-  *m_ThreadIndexCount = 0;
-
-  int numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
-
-  for (int i = 0; i < numThreads; i++)
-    m_ThreadHistograms[i].fill(0);
+  this->UpdateIndexToIndexMatrix();
 
   itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
 
-  threader->SetNumberOfThreads(numThreads);
+  // One partial histogram per thread, threader may clamp the number further
+  threader->SetNumberOfThreads(m_NumberOfThreadHistograms);
+
   threader->SetSingleMethod(
     &NegativeMIImageMatchMetric::_threadFillHistogram, (void*)this);
   threader->SingleMethodExecute();
 
-  HistogramType& H = *m_HistogramPointer;
-  H.fill(0);
+  // Sum the partial histograms, each thread handles a block of rows
+  threader->SetSingleMethod(
+    &NegativeMIImageMatchMetric::_threadReduceHistograms, (void*)this);
+  threader->SingleMethodExecute();
 
-  for (int i = 0; i < numThreads; i++)
-    H += m_ThreadHistograms[i];
+  HistogramType& H = *m_HistogramPointer;
 
   // Normalize histogram values
   float sumHist = 0;
@@ -596,6 +708,7 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
   if (sumHist != 0)
     H /= sumHist;
 
+  return sumHist;
 }
 
 template <class TFixedImage, class TMovingImage>
@@ -608,38 +721,49 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
 
   const unsigned int threadId = infoStruct->ThreadID;
 
+  const unsigned int numThreads = infoStruct->NumberOfThreads;
+
   NegativeMIImageMatchMetric* obj = static_cast< NegativeMIImageMatchMetric* >( infoStruct->UserData );
 
   HistogramType& H = obj->m_ThreadHistograms[threadId];
+  H.fill(0);
 
-  FixedImagePointType fixedOrigin = obj->m_FixedIndexImage->GetOrigin();
+  FixedImagePointType fixedOrigin = obj->m_FixedImage->GetOrigin();
 
-  FixedImageSpacingType fixedSpacing = obj->m_FixedIndexImage->GetSpacing();
+  FixedImageSpacingType fixedSpacing = obj->m_FixedImage->GetSpacing();
 
   FixedImageSizeType fixedSize =
-    obj->m_FixedIndexImage->GetLargestPossibleRegion().GetSize();
+    obj->m_FixedImage->GetLargestPossibleRegion().GetSize();
 
-  MovingImagePointType movingOrigin = obj->m_MovingIndexImage->GetOrigin();
+  MovingImagePointType movingOrigin = obj->m_MovingImage->GetOrigin();
 
-  MovingImageSpacingType movingSpacing = obj->m_MovingIndexImage->GetSpacing();
+  MovingImageSpacingType movingSpacing = obj->m_MovingImage->GetSpacing();
 
   MovingImageSizeType movingSize =
-    obj->m_MovingIndexImage->GetLargestPossibleRegion().GetSize();
+    obj->m_MovingImage->GetLargestPossibleRegion().GetSize();
 
-  while (true)
-  {
+  // Static schedule, each thread processes a contiguous block of samples
+  unsigned int numIndices = obj->m_ThreadIndices.size();
+  unsigned int blockSize = (numIndices + numThreads - 1) / numThreads;
 
-    obj->m_Mutex.Lock();
-    int pos = (*obj->m_ThreadIndexCount)++;
-    obj->m_Mutex.Unlock();
+  unsigned int posBegin = threadId * blockSize;
+  unsigned int posEnd = posBegin + blockSize;
+  if (posEnd > numIndices)
+    posEnd = numIndices;
 
-    if (pos >= obj->m_ThreadIndices.size())
-      break;
+  if (obj->m_UseIndexToIndexMatrix)
+  {
+    obj->FillHistogramAffine(H, posBegin, posEnd);
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  for (unsigned int pos = posBegin; pos < posEnd; pos++)
+  {
 
     FixedImageIndexType ind = obj->m_ThreadIndices[pos];
 
     // Get sampled fixed image histogram index
-    unsigned int r = obj->m_FixedIndexImage->GetPixel(ind);
+    unsigned int r = obj->m_FixedIndexImage->GetBin(ind);
 
     // Skip if fixed image histogram index is invalid
     if (r >= obj->m_NumberOfBins)
@@ -693,7 +817,7 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
         nn_ind[2] < 0 || nn_ind[2] >= (long)movingSize[2])
 // PP: Add BG component???
       continue;
-    c = obj->m_MovingIndexImage->GetPixel(nn_ind);
+    c = obj->m_MovingIndexImage->GetBin(nn_ind);
     if (c >= obj->m_NumberOfBins)
       continue;
     H(r, c) += 1.0;
@@ -711,7 +835,7 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
     (0 <= (z)) && ((z) < (long)movingSize[2])) \
   { \
     MovingImageIndexType local_ind = {{(x), (y), (z)}}; \
-    c_interp += (w) * obj->m_MovingIndexImage->GetPixel(local_ind); \
+    c_interp += (w) * obj->m_MovingIndexImage->GetBin(local_ind); \
   }
         interpWeightMacro(x0, y0, z0, gx*gy*gz);
         interpWeightMacro(x0, y0, z1, gx*gy*fz);
@@ -740,7 +864,7 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
     (0 <= (z)) && ((z) < (long)movingSize[2])) \
   { \
     MovingImageIndexType pvind = {{(x), (y), (z)}}; \
-    c = obj->m_MovingIndexImage->GetPixel(pvind); \
+    c = obj->m_MovingIndexImage->GetBin(pvind); \
     if (c < obj->m_NumberOfBins) \
       H(r, c) += (w); \
   }
@@ -762,6 +886,240 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
   return ITK_THREAD_RETURN_VALUE;
 }
 
+template <class TFixedImage, class TMovingImage>
+void
+NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
+::UpdateIndexToIndexMatrix() const
+{
+  const MatrixOffsetTransformType* affine =
+    dynamic_cast<const MatrixOffsetTransformType*>(
+      this->m_Transform.GetPointer());
+
+  m_UseIndexToIndexMatrix = (affine != 0);
+
+  if (!m_UseIndexToIndexMatrix)
+    return;
+
+  ChainedAffineTransform3D::ComputeIndexToIndexMatrix(affine,
+    this->m_FixedImage, this->m_MovingImage, &m_IndexToIndexMatrix[0][0]);
+}
+
+template <class TFixedImage, class TMovingImage>
+void
+NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
+::FillHistogramAffine(HistogramType& H,
+  unsigned int posBegin, unsigned int posEnd) const
+{
+  // Moving index increment between neighboring samples along a row
+  const long skipX = m_Skips[0];
+  double stepX[3];
+  for (unsigned int i = 0; i < 3; i++)
+    stepX[i] = m_IndexToIndexMatrix[i][0] * skipX;
+
+  unsigned int rows[MU_MI_SAMPLE_BATCH];
+  double mx[MU_MI_SAMPLE_BATCH];
+  double my[MU_MI_SAMPLE_BATCH];
+  double mz[MU_MI_SAMPLE_BATCH];
+  unsigned int batchCount = 0;
+
+  double mapped[3] = {0.0, 0.0, 0.0};
+
+  FixedImageIndexType prevInd;
+  prevInd[0] = -1;
+  prevInd[1] = -1;
+  prevInd[2] = -1;
+
+  for (unsigned int pos = posBegin; pos < posEnd; pos++)
+  {
+    const FixedImageIndexType& ind = m_ThreadIndices[pos];
+
+    // Step along the row when possible, otherwise evaluate the matrix
+    if (ind[1] == prevInd[1] && ind[2] == prevInd[2]
+        &&
+        ind[0] == prevInd[0] + skipX)
+    {
+      mapped[0] += stepX[0];
+      mapped[1] += stepX[1];
+      mapped[2] += stepX[2];
+    }
+    else
+    {
+      for (unsigned int i = 0; i < 3; i++)
+        mapped[i] =
+          m_IndexToIndexMatrix[i][0] * ind[0] +
+          m_IndexToIndexMatrix[i][1] * ind[1] +
+          m_IndexToIndexMatrix[i][2] * ind[2] +
+          m_IndexToIndexMatrix[i][3];
+    }
+    prevInd = ind;
+
+    unsigned int r = m_FixedIndexImage->GetBin(ind);
+
+    // Skip if fixed image histogram index is invalid
+    if (r >= m_NumberOfBins)
+      continue;
+
+    rows[batchCount] = r;
+    mx[batchCount] = mapped[0];
+    my[batchCount] = mapped[1];
+    mz[batchCount] = mapped[2];
+    batchCount++;
+
+    if (batchCount == MU_MI_SAMPLE_BATCH)
+    {
+      this->AddPartialVolumeBatch(H, batchCount, rows, mx, my, mz);
+      batchCount = 0;
+    }
+  }
+
+  if (batchCount > 0)
+    this->AddPartialVolumeBatch(H, batchCount, rows, mx, my, mz);
+}
+
+template <class TFixedImage, class TMovingImage>
+void
+NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
+::AddPartialVolumeBatch(HistogramType& H, unsigned int n,
+  const unsigned int* rows,
+  const double* mx, const double* my, const double* mz) const
+{
+  // Dispatch once per batch on the bin storage type
+  switch (m_MovingIndexImage->GetBytesPerBin())
+  {
+    case 1:
+      this->AddPartialVolumeBatch(H, m_MovingIndexImage->GetBuffer8(),
+        n, rows, mx, my, mz);
+      break;
+    case 2:
+      this->AddPartialVolumeBatch(H, m_MovingIndexImage->GetBuffer16(),
+        n, rows, mx, my, mz);
+      break;
+    default:
+      this->AddPartialVolumeBatch(H, m_MovingIndexImage->GetBuffer32(),
+        n, rows, mx, my, mz);
+  }
+}
+
+template <class TFixedImage, class TMovingImage>
+template <class TBin>
+void
+NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
+::AddPartialVolumeBatch(HistogramType& H, const TBin* movingBuffer,
+  unsigned int n, const unsigned int* rows,
+  const double* mx, const double* my, const double* mz) const
+{
+  const BinIndexImage* movingBins = m_MovingIndexImage.GetPointer();
+
+  const long* movingSize = movingBins->GetSize();
+
+  const long nx = movingSize[0];
+  const long ny = movingSize[1];
+  const long nz = movingSize[2];
+
+  long x0[MU_MI_SAMPLE_BATCH];
+  long y0[MU_MI_SAMPLE_BATCH];
+  long z0[MU_MI_SAMPLE_BATCH];
+
+  float fx[MU_MI_SAMPLE_BATCH];
+  float fy[MU_MI_SAMPLE_BATCH];
+  float fz[MU_MI_SAMPLE_BATCH];
+
+  // Neighborhood and distances to the grid, same truncation as the generic
+  // path in _threadFillHistogram
+  for (unsigned int i = 0; i < n; i++)
+  {
+    x0[i] = (long)mx[i];
+    y0[i] = (long)my[i];
+    z0[i] = (long)mz[i];
+    fx[i] = mx[i] - (double)x0[i];
+    fy[i] = my[i] - (double)y0[i];
+    fz[i] = mz[i] - (double)z0[i];
+  }
+
+  for (unsigned int i = 0; i < n; i++)
+  {
+    // Validity of the lower and upper neighbor along each axis
+    bool vx[2] = {0 <= x0[i] && x0[i] < nx, 0 <= x0[i]+1 && x0[i]+1 < nx};
+    bool vy[2] = {0 <= y0[i] && y0[i] < ny, 0 <= y0[i]+1 && y0[i]+1 < ny};
+    bool vz[2] = {0 <= z0[i] && z0[i] < nz, 0 <= z0[i]+1 && z0[i]+1 < nz};
+
+    if (!(vx[0] || vx[1]) || !(vy[0] || vy[1]) || !(vz[0] || vz[1]))
+      continue;
+
+    float wx[2] = {1.0f - fx[i], fx[i]};
+    float wy[2] = {1.0f - fy[i], fy[i]};
+    float wz[2] = {1.0f - fz[i], fz[i]};
+
+    float* h = H[rows[i]];
+
+    for (unsigned int c = 0; c < 2; c++)
+    {
+      if (!vz[c])
+        continue;
+      for (unsigned int b = 0; b < 2; b++)
+      {
+        if (!vy[b])
+          continue;
+        float wyz = wy[b] * wz[c];
+        for (unsigned int a = 0; a < 2; a++)
+        {
+          if (!vx[a])
+            continue;
+          unsigned int col = movingBuffer[
+            movingBins->ComputeOffset(x0[i] + a, y0[i] + b, z0[i] + c)];
+          if (col < m_NumberOfBins)
+            h[col] += wx[a] * wyz;
+        }
+      }
+    }
+  }
+}
+
+template <class TFixedImage, class TMovingImage>
+ITK_THREAD_RETURN_TYPE
+NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
+::_threadReduceHistograms(void* arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfoType;
+  ThreadInfoType * infoStruct = static_cast< ThreadInfoType * >( arg );
+
+  const unsigned int threadId = infoStruct->ThreadID;
+  const unsigned int numThreads = infoStruct->NumberOfThreads;
+
+  NegativeMIImageMatchMetric* obj = static_cast< NegativeMIImageMatchMetric* >( infoStruct->UserData );
+
+  HistogramType& H = *obj->m_HistogramPointer;
+
+  unsigned int numBins = obj->m_NumberOfBins;
+
+  unsigned int blockSize = (numBins + numThreads - 1) / numThreads;
+
+  unsigned int rowBegin = threadId * blockSize;
+  unsigned int rowEnd = rowBegin + blockSize;
+  if (rowEnd > numBins)
+    rowEnd = numBins;
+
+  // Rows of the joint histogram are contiguous in memory, threads write to
+  // disjoint row blocks
+  for (unsigned int r = rowBegin; r < rowEnd; r++)
+  {
+    float* h = H[r];
+
+    const float* h0 = obj->m_ThreadHistograms[0][r];
+    for (unsigned int c = 0; c < numBins; c++)
+      h[c] = h0[c];
+
+    for (unsigned int t = 1; t < numThreads; t++)
+    {
+      const float* ht = obj->m_ThreadHistograms[t][r];
+      for (unsigned int c = 0; c < numBins; c++)
+        h[c] += ht[c];
+    }
+  }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 template <class TFixedImage, class TMovingImage>
 float
 NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
@@ -918,6 +1276,9 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
 ::GetValueAndDerivative(const ParametersType& parameters, MeasureType& value,
   DerivativeType& derivative) const
 {
+  if (this->ComputeAnalyticDerivative(parameters, value, derivative))
+    return;
+
   value = this->GetValue(parameters);
   //this->GetDerivative(parameters, derivative);
   this->GetStochasticDerivative(parameters, derivative);
@@ -928,6 +1289,10 @@ void
 NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
 ::GetDerivative(const ParametersType& parameters, DerivativeType & derivative) const
 {
+  MeasureType value;
+  if (this->ComputeAnalyticDerivative(parameters, value, derivative))
+    return;
+
   unsigned int numParams = this->m_Transform->GetNumberOfParameters();
 
   if (m_DerivativeStepLengths.GetSize() != numParams)
@@ -952,6 +1317,375 @@ NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
   }
 }
 
+// With partial volume interpolation, each sample adds trilinear weights w_k
+// to the bins (r, c_k). The MI gradient is
+//   d(MI)/d(mu) = sum_{r,c} W(r,c) * d(h(r,c))/d(mu)
+// where h is the unnormalized histogram and W the bin weights computed from
+// the normalized histogram. The histogram derivative is accumulated from the
+// spatial derivatives of w_k and the transform Jacobian in one pass.
+template <class TFixedImage, class TMovingImage>
+bool
+NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
+::ComputeAnalyticDerivative(const ParametersType& parameters,
+  MeasureType& value, DerivativeType& derivative) const
+{
+  if (!m_UseAnalyticDerivative)
+    return false;
+
+  const MatrixOffsetTransformType* affine =
+    dynamic_cast<const MatrixOffsetTransformType*>(
+      this->m_Transform.GetPointer());
+  const BSplineTransformType* bspline =
+    dynamic_cast<const BSplineTransformType*>(
+      this->m_Transform.GetPointer());
+
+  if (affine == 0 && bspline == 0)
+    return false;
+
+  itkDebugMacro(<< "ComputeAnalyticDerivative");
+
+  unsigned int numParams = this->m_Transform->GetNumberOfParameters();
+
+  derivative = DerivativeType(numParams);
+  derivative.Fill(0);
+
+  this->m_Transform->SetParameters(parameters);
+
+  double totalWeight = this->ThreadedComputeHistogram();
+
+  HistogramType& H = *m_HistogramPointer;
+
+  value = 0;
+
+  if (totalWeight <= 0.0)
+    return true;
+
+  // Marginals of the normalized histogram
+  std::vector<double> logMarginalA(m_NumberOfBins, 0.0);
+  std::vector<double> logMarginalB(m_NumberOfBins, 0.0);
+  for (unsigned int r = 0; r < m_NumberOfBins; r++)
+    for (unsigned int c = 0; c < m_NumberOfBins; c++)
+    {
+      logMarginalA[r] += H(r, c);
+      logMarginalB[c] += H(r, c);
+    }
+
+  double entropyA = 0.0;
+  double entropyB = 0.0;
+  for (unsigned int i = 0; i < m_NumberOfBins; i++)
+  {
+    if (logMarginalA[i] > 0.0)
+    {
+      logMarginalA[i] = log(logMarginalA[i]);
+      entropyA -= exp(logMarginalA[i]) * logMarginalA[i];
+    }
+    if (logMarginalB[i] > 0.0)
+    {
+      logMarginalB[i] = log(logMarginalB[i]);
+      entropyB -= exp(logMarginalB[i]) * logMarginalB[i];
+    }
+  }
+
+  double jointEntropy = 0.0;
+  for (unsigned int r = 0; r < m_NumberOfBins; r++)
+    for (unsigned int c = 0; c < m_NumberOfBins; c++)
+    {
+      double p = H(r, c);
+      if (p > 0.0)
+        jointEntropy -= p * log(p);
+    }
+
+  double mi = (entropyA + entropyB) - jointEntropy;
+  if (m_Normalized)
+  {
+    if (jointEntropy == 0.0)
+      return true;
+    mi = (entropyA + entropyB) / jointEntropy;
+  }
+
+  value = -mi;
+
+  // Derivative of MI w.r.t. the normalized bin values, empty bins are
+  // ignored
+  HistogramType binWeights(m_NumberOfBins, m_NumberOfBins);
+  binWeights.fill(0);
+
+  double meanWeight = 0.0;
+  for (unsigned int r = 0; r < m_NumberOfBins; r++)
+    for (unsigned int c = 0; c < m_NumberOfBins; c++)
+    {
+      double p = H(r, c);
+      if (p <= 0.0)
+        continue;
+      double w = 0.0;
+      if (m_Normalized)
+        w = (mi*log(p) - logMarginalA[r] - logMarginalB[c]) / jointEntropy;
+      else
+        w = log(p) - logMarginalA[r] - logMarginalB[c];
+      binWeights(r, c) = w;
+      meanWeight += p * w;
+    }
+
+  // Chain rule through the normalization by the total weight
+  for (unsigned int r = 0; r < m_NumberOfBins; r++)
+    for (unsigned int c = 0; c < m_NumberOfBins; c++)
+      if (H(r, c) > 0.0)
+        binWeights(r, c) = (binWeights(r, c) - meanWeight) / totalWeight;
+
+  DerivativeThreadStruct threadData;
+  threadData.Metric = this;
+  threadData.AffineTransform = 0;
+  threadData.BSplineTransform = bspline;
+  threadData.BinWeights = &binWeights;
+
+  // Physical point to continuous index is diag(1/spacing) * inv(direction)
+  typename MovingImageType::DirectionType invDir =
+    this->m_MovingImage->GetInverseDirection();
+  MovingImageSpacingType movingSpacing = this->m_MovingImage->GetSpacing();
+  for (unsigned int i = 0; i < 3; i++)
+    for (unsigned int j = 0; j < 3; j++)
+      threadData.PointToIndex[i][j] = invDir[i][j] / movingSpacing[i];
+
+  // Affine gradient is accumulated as sum(g * x^T) and sum(g), independent
+  // of the transform parametrization
+  if (bspline == 0)
+  {
+    threadData.AffineTransform = affine;
+    threadData.AccumulatorSize = 12;
+  }
+  else
+  {
+    threadData.AccumulatorSize = numParams;
+  }
+
+  threadData.Accumulators.resize(
+    m_NumberOfThreadHistograms*threadData.AccumulatorSize, 0.0);
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads(m_NumberOfThreadHistograms);
+  threader->SetSingleMethod(
+    &NegativeMIImageMatchMetric::_threadAccumulateDerivative,
+    (void*)&threadData);
+  threader->SingleMethodExecute();
+
+  std::vector<double> acc(threadData.AccumulatorSize, 0.0);
+  for (unsigned int t = 0; t < m_NumberOfThreadHistograms; t++)
+  {
+    const double* accT =
+      &threadData.Accumulators[t*threadData.AccumulatorSize];
+    for (unsigned int k = 0; k < threadData.AccumulatorSize; k++)
+      acc[k] += accT[k];
+  }
+
+  if (bspline != 0)
+  {
+    for (unsigned int k = 0; k < numParams; k++)
+      derivative[k] = -acc[k];
+    return true;
+  }
+
+  // Derivatives of the affine matrix and offset w.r.t. the transform
+  // parameters, central differences are cheap as they do not involve the
+  // images
+  ParametersType p = parameters;
+  for (unsigned int k = 0; k < numParams; k++)
+  {
+    double h = 1e-6 * vnl_math_max(1.0, fabs(parameters[k]));
+
+    p[k] = parameters[k] + h;
+    this->m_Transform->SetParameters(p);
+    typename MatrixOffsetTransformType::MatrixType A2 = affine->GetMatrix();
+    typename MatrixOffsetTransformType::OffsetType t2 = affine->GetOffset();
+
+    p[k] = parameters[k] - h;
+    this->m_Transform->SetParameters(p);
+    typename MatrixOffsetTransformType::MatrixType A1 = affine->GetMatrix();
+    typename MatrixOffsetTransformType::OffsetType t1 = affine->GetOffset();
+
+    p[k] = parameters[k];
+
+    double d = 0.0;
+    for (unsigned int i = 0; i < 3; i++)
+    {
+      for (unsigned int j = 0; j < 3; j++)
+        d += (A2[i][j] - A1[i][j]) * acc[3*i+j];
+      d += (t2[i] - t1[i]) * acc[9+i];
+    }
+
+    derivative[k] = -d / (2.0*h);
+  }
+
+  this->m_Transform->SetParameters(parameters);
+
+  return true;
+}
+
+template <class TFixedImage, class TMovingImage>
+ITK_THREAD_RETURN_TYPE
+NegativeMIImageMatchMetric<TFixedImage, TMovingImage>
+::_threadAccumulateDerivative(void* arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfoType;
+  ThreadInfoType * infoStruct = static_cast< ThreadInfoType * >( arg );
+
+  const unsigned int threadId = infoStruct->ThreadID;
+  const unsigned int numThreads = infoStruct->NumberOfThreads;
+
+  DerivativeThreadStruct* data =
+    static_cast< DerivativeThreadStruct* >( infoStruct->UserData );
+
+  const NegativeMIImageMatchMetric* obj = data->Metric;
+
+  const HistogramType& W = *data->BinWeights;
+
+  double* acc = &data->Accumulators[threadId*data->AccumulatorSize];
+
+  MovingImageSizeType movingSize =
+    obj->m_MovingImage->GetLargestPossibleRegion().GetSize();
+
+  const BSplineTransformType* bspline = data->BSplineTransform;
+
+  typename BSplineTransformType::WeightsType bsplineWeights;
+  typename BSplineTransformType::ParameterIndexArrayType bsplineIndices;
+  unsigned int numParamsPerDim = 0;
+  if (bspline != 0)
+  {
+    bsplineWeights.SetSize(bspline->GetNumberOfWeights());
+    bsplineIndices.SetSize(bspline->GetNumberOfWeights());
+    numParamsPerDim = bspline->GetNumberOfParametersPerDimension();
+  }
+
+  // Same static schedule as the histogram threads
+  unsigned int numIndices = obj->m_ThreadIndices.size();
+  unsigned int blockSize = (numIndices + numThreads - 1) / numThreads;
+
+  unsigned int posBegin = threadId * blockSize;
+  unsigned int posEnd = posBegin + blockSize;
+  if (posEnd > numIndices)
+    posEnd = numIndices;
+
+  for (unsigned int pos = posBegin; pos < posEnd; pos++)
+  {
+    FixedImageIndexType ind = obj->m_ThreadIndices[pos];
+
+    unsigned int r = obj->m_FixedIndexImage->GetBin(ind);
+
+    if (r >= obj->m_NumberOfBins)
+      continue;
+
+    FixedImagePointType fixedPoint;
+    obj->m_FixedImage->TransformIndexToPhysicalPoint(ind, fixedPoint);
+
+    MovingImagePointType mappedPoint;
+    if (bspline != 0)
+    {
+      bool inside = false;
+      bspline->TransformPoint(
+        fixedPoint, mappedPoint, bsplineWeights, bsplineIndices, inside);
+      // No control points affect this sample
+      if (!inside)
+        continue;
+    }
+    else
+    {
+      mappedPoint = obj->m_Transform->TransformPoint(fixedPoint);
+    }
+
+    typedef itk::ContinuousIndex<double, 3> ContinuousIndexType;
+    ContinuousIndexType movingInd;
+    obj->m_MovingImage->TransformPhysicalPointToContinuousIndex(
+      mappedPoint, movingInd);
+
+    // Same neighborhood and weights as _threadFillHistogram
+    int x0 = (int)movingInd[0];
+    int y0 = (int)movingInd[1];
+    int z0 = (int)movingInd[2];
+
+    float f[3];
+    f[0] = movingInd[0] - (float)x0;
+    f[1] = movingInd[1] - (float)y0;
+    f[2] = movingInd[2] - (float)z0;
+
+    // Gradient of sum_k W(r, c_k) * w_k w.r.t. the continuous index
+    double gradInd[3] = {0.0, 0.0, 0.0};
+
+    for (unsigned int k = 0; k < 8; k++)
+    {
+      unsigned int a = k & 1;
+      unsigned int b = (k >> 1) & 1;
+      unsigned int e = (k >> 2) & 1;
+
+      MovingImageIndexType pvind;
+      pvind[0] = x0 + (long)a;
+      pvind[1] = y0 + (long)b;
+      pvind[2] = z0 + (long)e;
+
+      if (pvind[0] < 0 || pvind[0] >= (long)movingSize[0]
+          ||
+          pvind[1] < 0 || pvind[1] >= (long)movingSize[1]
+          ||
+          pvind[2] < 0 || pvind[2] >= (long)movingSize[2])
+        continue;
+
+      unsigned int c = obj->m_MovingIndexImage->GetBin(pvind);
+      if (c >= obj->m_NumberOfBins)
+        continue;
+
+      double wrc = W(r, c);
+      if (wrc == 0.0)
+        continue;
+
+      double wx = a ? f[0] : 1.0 - f[0];
+      double wy = b ? f[1] : 1.0 - f[1];
+      double wz = e ? f[2] : 1.0 - f[2];
+
+      double dx = a ? 1.0 : -1.0;
+      double dy = b ? 1.0 : -1.0;
+      double dz = e ? 1.0 : -1.0;
+
+      gradInd[0] += wrc * dx * wy * wz;
+      gradInd[1] += wrc * wx * dy * wz;
+      gradInd[2] += wrc * wx * wy * dz;
+    }
+
+    if (gradInd[0] == 0.0 && gradInd[1] == 0.0 && gradInd[2] == 0.0)
+      continue;
+
+    // Gradient w.r.t. the mapped physical point
+    double g[3];
+    for (unsigned int i = 0; i < 3; i++)
+    {
+      g[i] = 0.0;
+      for (unsigned int j = 0; j < 3; j++)
+        g[i] += data->PointToIndex[j][i] * gradInd[j];
+    }
+
+    if (bspline != 0)
+    {
+      // Displacement at the point is the weighted sum of the coefficients
+      // in the support region
+      for (unsigned int k = 0; k < bsplineWeights.GetSize(); k++)
+      {
+        double w = bsplineWeights[k];
+        unsigned long paramIndex = bsplineIndices[k];
+        for (unsigned int dim = 0; dim < 3; dim++)
+          acc[paramIndex + dim*numParamsPerDim] += g[dim] * w;
+      }
+    }
+    else
+    {
+      for (unsigned int i = 0; i < 3; i++)
+      {
+        for (unsigned int j = 0; j < 3; j++)
+          acc[3*i+j] += g[i] * fixedPoint[j];
+        acc[9+i] += g[i];
+      }
+    }
+  }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 // Compute derivative following SPSA (Spall)
 template <class TFixedImage, class TMovingImage>
 void
@@ -14,11 +14,17 @@
 #include "itkAffineTransform.h"
 #include "itkBSplineDeformableTransform.h"
 #include "itkImage.h"
+#include "itkImageToImageMetric.h"
 #include "itkVector.h"
 
+#include "vnl/vnl_matrix.h"
+#include "vnl/vnl_vector.h"
+
 #include "ChainedAffineTransform3D.h"
+#include "ImagePyramidCache.h"
 
 #include <fstream>
+#include <vector>
 
 template <class TPixel>
 class PairRegistrationMethod
@@ -46,26 +52,55 @@ public:
   typedef enum{QuantizeNone, QuantizeFixed, QuantizeMoving, QuantizeBoth}
     QuantizationOption;
 
+  // Image match metric for affine registration, mutual information or
+  // Havrda-Charvat information (quantization options ignored)
+  typedef enum{MetricMI, MetricHC} MetricOption;
+
+  // Initial transform for affine registration, identity about the image
+  // centers or aligned intensity centroids and principal axes (whichever
+  // matches best at the coarsest level)
+  typedef enum{InitializeCenters, InitializeMoments} InitializationOption;
+
+  typedef itk::ImageToImageMetric<ImageType, ImageType> MetricBaseType;
+  typedef std::vector<typename MetricBaseType::Pointer> MetricListType;
+
+  // Downsampled images shared between registrations, when given to the
+  // affine and rigid registrations the coarse levels use smoothed and
+  // downsampled images instead of sparse sampling of the full images
+  typedef ImagePyramidCache<ImageType> PyramidCacheType;
+
   //
   // Registration functions
   //
+  // The affine and rigid registrations use at most numThreads threads for
+  // metric evaluation, zero means the ITK global default (set lower when
+  // running several registrations at once)
+  //
 
   static AffineTransformType::Pointer
     RegisterAffine(ImageType* fixedImg, ImageType* movingImg,
-      QuantizationOption qopt=QuantizeNone);
+      QuantizationOption qopt=QuantizeNone, MetricOption mopt=MetricMI,
+      InitializationOption iopt=InitializeCenters,
+      PyramidCacheType* pyramids=0, unsigned int numThreads=0);
 
   static AffineTransformType::Pointer
     RegisterAffineFast(ImageType* fixedImg, ImageType* movingImg,
-      QuantizationOption qopt=QuantizeNone);
+      QuantizationOption qopt=QuantizeNone, MetricOption mopt=MetricMI,
+      InitializationOption iopt=InitializeCenters,
+      PyramidCacheType* pyramids=0, unsigned int numThreads=0);
 
   // Affine with unit scaling and zero skew
   static AffineTransformType::Pointer
     RegisterRigid(ImageType* fixedImg, ImageType* movingImg,
-      QuantizationOption qopt=QuantizeNone);
+      QuantizationOption qopt=QuantizeNone, MetricOption mopt=MetricMI,
+      InitializationOption iopt=InitializeCenters,
+      PyramidCacheType* pyramids=0, unsigned int numThreads=0);
 
   static AffineTransformType::Pointer
     RegisterRigidFast(ImageType* fixedImg, ImageType* movingImg,
-      QuantizationOption qopt=QuantizeNone);
+      QuantizationOption qopt=QuantizeNone, MetricOption mopt=MetricMI,
+      InitializationOption iopt=InitializeCenters,
+      PyramidCacheType* pyramids=0, unsigned int numThreads=0);
 
   static BSplineTransformType::Pointer
     RegisterBSpline(ImageType* fixedImg, ImageType* movingImg,
@@ -95,6 +130,57 @@ public:
 
 private:
 
+  // Create a metric for affine registration with the fixed, moving images
+  // and the transform set
+  static typename MetricBaseType::Pointer
+    CreateAffineMetric(ImageType* fixedImg, ImageType* movingImg,
+      AffineTransformType* affine, unsigned int numBins, bool randomSampling,
+      QuantizationOption qopt, MetricOption mopt, unsigned int numThreads);
+
+  static void SetMetricSampleSpacing(MetricBaseType* metric, double s);
+
+  // Copies of the affine metric, each with its own transform, for the
+  // optimizers that evaluate the metric on multiple threads, empty if only
+  // one thread is available
+  static MetricListType
+    CreateAffineMetricCopies(ImageType* fixedImg, ImageType* movingImg,
+      const AffineTransformType* affine, unsigned int numBins,
+      bool randomSampling, QuantizationOption qopt, MetricOption mopt,
+      unsigned int numThreads);
+
+  // Set sample spacing of the metric and its copies, copies use the same
+  // samples as the metric
+  static void SetMetricSampleSpacing(MetricBaseType* metric,
+    MetricListType& copies, double s);
+
+  // Metric and its copies for one resolution level with the given sample
+  // spacing, the images are taken from the pyramid cache if available
+  static typename MetricBaseType::Pointer
+    CreateLevelMetric(PyramidCacheType* pyramids,
+      ImageType* fixedImg, ImageType* movingImg,
+      AffineTransformType* affine, double sampleSpacing,
+      unsigned int numBins, bool randomSampling,
+      QuantizationOption qopt, MetricOption mopt, unsigned int numThreads,
+      MetricListType& copies);
+
+  // Intensity weighted centroid and principal axes (columns, sorted by
+  // decreasing variance) of an image in physical space
+  static void ComputeImageMoments(ImageType* img,
+    vnl_vector<double>& centroid, vnl_matrix<double>& axes,
+    vnl_vector<double>& variances);
+
+  // Centers the transform at the image centroids and lists the initial
+  // parameters to try: image centers aligned, centroids aligned, and
+  // principal axes aligned when the axes are well defined
+  static void CreateMomentCandidates(ImageType* fixedImg, ImageType* movingImg,
+    AffineTransformType* affine,
+    std::vector<typename MetricBaseType::ParametersType>& candidates);
+
+  // Candidate with the lowest metric value
+  static typename MetricBaseType::ParametersType
+    SelectInitialParameters(MetricBaseType* metric,
+      const std::vector<typename MetricBaseType::ParametersType>& candidates);
+
   // Find next uncommented line (doesn't begin with #)
   static void ReadNextLine(char* s, std::ifstream& infile);
 
@@ -10,15 +10,16 @@
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkImageMaskSpatialObject.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
 #include "itkLinearInterpolateImageFunction.h"
-#include "itkMattesMutualInformationImageToImageMetric.h"
 #include "itkMultiResolutionImageRegistrationMethod.h"
-#include "itkRescaleIntensityImageFilter.h"
 
 #include "itkLBFGSBOptimizer.h"
 #include "itkRegularStepGradientDescentOptimizer.h"
 
+#include "vnl/vnl_det.h"
 #include "vnl/vnl_math.h"
+#include "vnl/algo/vnl_symmetric_eigensystem.h"
 
 #include "AmoebaOptimizer.h"
 #include "PairRegistrationMethod.h"
@@ -277,7 +278,8 @@ template <class TPixel>
 PairRegistrationMethod<TPixel>::AffineTransformType::Pointer
 PairRegistrationMethod<TPixel>
 ::RegisterAffine(ImageType* fixedImg, ImageType* movingImg,
-  QuantizationOption qopt)
+  QuantizationOption qopt, MetricOption mopt, InitializationOption iopt,
+  PyramidCacheType* pyramids, unsigned int numThreads)
 {
   if (fixedImg == NULL || movingImg == NULL)
     muExceptionMacro(<< "One of input images is NULL");
@@ -316,8 +318,6 @@ PairRegistrationMethod<TPixel>
   // Define framework
   typedef itk::LinearInterpolateImageFunction<
     ImageType, double> InterpolatorType;
-  typedef NegativeMIImageMatchMetric<ImageType, ImageType> MetricType;    
-  //typedef NegativeHCImageMatchMetric<ImageType, ImageType> MetricType;    
   //typedef itk::MattesMutualInformationImageToImageMetric<
   //  ImageType, ImageType> MetricType;
   
@@ -330,11 +330,9 @@ PairRegistrationMethod<TPixel>
   SimulatedAnnealingOptimizer::Pointer anneal = SimulatedAnnealingOptimizer::New();
   typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
   typename RegistrationType::Pointer registration = RegistrationType::New();
-  typename MetricType::Pointer metric = MetricType::New();
 
   registration->SetOptimizer(powell);
   registration->SetInterpolator(interpolator);
-  registration->SetMetric(metric);
 
   interpolator->SetInputImage(movingImg);
 
@@ -343,6 +341,20 @@ PairRegistrationMethod<TPixel>
   affine->SetSourceCenter(fixedCenter[0], fixedCenter[1], fixedCenter[2]);
   affine->SetTargetCenter(movingCenter[0], movingCenter[1], movingCenter[2]);
 
+  // Moment initialization changes the centers, done before the metric
+  // copies take their own transforms
+  std::vector<typename MetricBaseType::ParametersType> initCandidates;
+  if (iopt == InitializeMoments)
+    CreateMomentCandidates(fixedImg, movingImg, affine, initCandidates);
+
+  typename MetricBaseType::Pointer metric = CreateAffineMetric(
+    fixedImg, movingImg, affine, 200, false, qopt, mopt, numThreads);
+  registration->SetMetric(metric);
+
+  // Metric copies for the parallel simplex and the tempering fallback
+  MetricListType metricCopies = CreateAffineMetricCopies(
+    fixedImg, movingImg, affine, 200, false, qopt, mopt, numThreads);
+
   registration->SetTransform(affine);
   registration->SetInitialTransformParameters(affine->GetParameters());
 
@@ -394,25 +406,6 @@ PairRegistrationMethod<TPixel>
   anneal->SetBurnInIterations(20);
   anneal->SetMaxIterations(220);
 
-  typename MetricType::ParametersType derivSteps(12);
-  derivSteps.Fill(1e-8);
-  for (int i = 0; i < 3; i++)
-    derivSteps[i] = 1e-4; // Translation steps
-  metric->SetDerivativeStepLengths(derivSteps);
-
-  metric->SetNumberOfBins(200);
-
-  // Not needed for Havrda-Charvat
-  metric->SetNormalized(true);
-  if (qopt == QuantizeFixed || qopt == QuantizeBoth)
-    metric->QuantizeFixedImageOn();
-  else
-    metric->QuantizeFixedImageOff();
-  if (qopt == QuantizeMoving || qopt == QuantizeBoth)
-    metric->QuantizeMovingImageOn();
-  else
-    metric->QuantizeMovingImageOff();
-
 /*
   // ITK's MI metric
   metric->SetNumberOfHistogramBins(200);
@@ -439,7 +432,7 @@ PairRegistrationMethod<TPixel>
   muLogMacro(<< "Beginning affine registration...\n");
 #if 0
   // Use ITK framework to handle multi resolution registration
-  //metric->SetSampleSpacing(minSpacing);
+  //SetMetricSampleSpacing(metric, minSpacing);
 
   registration->SetOptimizer(amoeba);
 
@@ -449,30 +442,99 @@ PairRegistrationMethod<TPixel>
   affine->SetParameters(registration->GetLastTransformParameters());
 #else
   // Manage the multi resolution registration here
-  metric->SetFixedImage(fixedImg);
-  metric->SetMovingImage(movingImg);
-  metric->SetTransform(affine);
-
   // Start with amoeba (slow, less prone to local minima)
   muLogMacro(<< "Registering at [4x4x4]...\n");
-  metric->SetSampleSpacing(4.0*minSpacing);
-  amoeba->SetMaxIterations(100);
-  amoeba->SetCostFunction(metric);
-  amoeba->SetInitialPosition(affine->GetParameters());
-  amoeba->StartOptimization();
-  //anneal->SetCostFunction(metric);
-  //anneal->SetInitialPosition(affine->GetParameters());
-  //anneal->StartOptimization();
+  {
+    MetricListType levelCopies = metricCopies;
+    typename MetricBaseType::Pointer levelMetric = metric;
+    if (pyramids != 0)
+      levelMetric = CreateLevelMetric(pyramids, fixedImg, movingImg, affine,
+        4.0*minSpacing, 200, false, qopt, mopt, numThreads, levelCopies);
+    else
+      SetMetricSampleSpacing(metric, metricCopies, 4.0*minSpacing);
+
+    amoeba->ClearWorkerCostFunctions();
+    for (unsigned int i = 0; i < levelCopies.size(); i++)
+      amoeba->AddWorkerCostFunction(levelCopies[i]);
+
+    if (initCandidates.size() != 0)
+      affine->SetParameters(
+        SelectInitialParameters(levelMetric, initCandidates));
+
+    // Restarts only at the coarsest level, where local minima are worst,
+    // the finer levels start near the minimum already
+    amoeba->SetNumberOfRestarts(MU_AFFINE_COARSE_RESTARTS);
+    amoeba->SetMaxIterations(100);
+    amoeba->SetCostFunction(levelMetric);
+    amoeba->SetInitialPosition(affine->GetParameters());
+    amoeba->StartOptimization();
+    amoeba->SetNumberOfRestarts(0);
+  }
 
   muLogMacro(<< "Registering at [2x2x2]...\n");
-  amoeba->SetMaxIterations(50);
-  metric->SetSampleSpacing(2.0*minSpacing);
-  amoeba->SetInitialPosition(amoeba->GetCurrentPosition());
-  amoeba->StartOptimization();
+  {
+    MetricListType levelCopies = metricCopies;
+    typename MetricBaseType::Pointer levelMetric = metric;
+    if (pyramids != 0)
+      levelMetric = CreateLevelMetric(pyramids, fixedImg, movingImg, affine,
+        2.0*minSpacing, 200, false, qopt, mopt, numThreads, levelCopies);
+    else
+      SetMetricSampleSpacing(metric, metricCopies, 2.0*minSpacing);
+
+    amoeba->ClearWorkerCostFunctions();
+    for (unsigned int i = 0; i < levelCopies.size(); i++)
+      amoeba->AddWorkerCostFunction(levelCopies[i]);
+
+    amoeba->SetMaxIterations(50);
+    amoeba->SetCostFunction(levelMetric);
+    amoeba->SetInitialPosition(amoeba->GetCurrentPosition());
+    amoeba->StartOptimization();
+
+    // Failed registrations are searched again with parallel tempering from
+    // the simplex result, judged by normalized MI whatever the metric
+    double nmi = -amoeba->GetValue();
+    if (mopt != MetricMI)
+    {
+      typename MetricBaseType::Pointer nmiMetric = CreateAffineMetric(
+        fixedImg, movingImg, affine, 200, false, qopt, MetricMI, numThreads);
+      SetMetricSampleSpacing(nmiMetric, 2.0*minSpacing);
+      nmi = -nmiMetric->GetValue(amoeba->GetCurrentPosition());
+    }
+
+    if (nmi < MU_AFFINE_ANNEAL_MIN_NMI)
+    {
+      muLogMacro(<< "Normalized MI = " << nmi << ", annealing...\n");
+
+      // Temperatures relative to the metric value, the metrics differ in
+      // scale
+      double absValue = fabs(amoeba->GetValue());
+      anneal->SetTemperatureRange(1e-3*absValue, 5e-2*absValue);
+
+      anneal->ClearWorkerCostFunctions();
+      for (unsigned int i = 0; i < levelCopies.size(); i++)
+        anneal->AddWorkerCostFunction(levelCopies[i]);
+
+      anneal->SetCostFunction(levelMetric);
+      anneal->SetInitialPosition(amoeba->GetCurrentPosition());
+      anneal->StartOptimization();
+
+      // Simplex again from the best state of the chains
+      if (anneal->GetValue() < amoeba->GetValue())
+      {
+        amoeba->SetInitialPosition(anneal->GetCurrentPosition());
+        amoeba->StartOptimization();
+      }
+    }
+  }
 
   // Refine results using Powell's method
   muLogMacro(<< "Refining registration at [1x1x1]...\n");
-  metric->SetSampleSpacing(1.0*minSpacing);
+  SetMetricSampleSpacing(metric, metricCopies, 1.0*minSpacing);
+
+  amoeba->ClearWorkerCostFunctions();
+  for (unsigned int i = 0; i < metricCopies.size(); i++)
+    amoeba->AddWorkerCostFunction(metricCopies[i]);
+  amoeba->SetCostFunction(metric);
 
 /*
   powell->SetCostFunction(metric);
@@ -489,14 +551,14 @@ PairRegistrationMethod<TPixel>
 /*
   // Powell only?
   muLogMacro(<< "Registering at [2x2x2]...\n");
-  metric->SetSampleSpacing(2.0*minSpacing);
+  SetMetricSampleSpacing(metric, 2.0*minSpacing);
   powell->SetCostFunction(metric);
   powell->SetInitialPosition(affine->GetParameters());
   powell->SetMaximumIterations(10);
   powell->StartOptimization();
 
   muLogMacro(<< "Registering at [2x2x2]...\n");
-  metric->SetSampleSpacing(2.0*minSpacing);
+  SetMetricSampleSpacing(metric, 2.0*minSpacing);
   powell->SetCostFunction(metric);
   powell->SetInitialPosition(powell->GetCurrentPosition());
   powell->SetMaximumIterations(5);
@@ -516,7 +578,8 @@ template <class TPixel>
 PairRegistrationMethod<TPixel>::AffineTransformType::Pointer
 PairRegistrationMethod<TPixel>
 ::RegisterAffineFast(ImageType* fixedImg, ImageType* movingImg,
-  QuantizationOption qopt)
+  QuantizationOption qopt, MetricOption mopt, InitializationOption iopt,
+  PyramidCacheType* pyramids, unsigned int numThreads)
 {
   if (fixedImg == NULL || movingImg == NULL)
     muExceptionMacro(<< "One of input images is NULL");
@@ -557,7 +620,6 @@ PairRegistrationMethod<TPixel>
     ImageType, double> InterpolatorType;
   //typedef itk::MattesMutualInformationImageToImageMetric<
   //  ImageType, ImageType> MetricType;
-  typedef NegativeMIImageMatchMetric<ImageType, ImageType> MetricType;    
   
   typedef itk::MultiResolutionImageRegistrationMethod<
     ImageType, ImageType> RegistrationType;
@@ -568,8 +630,6 @@ PairRegistrationMethod<TPixel>
   typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
   typename RegistrationType::Pointer registration = RegistrationType::New();
 
-  typename MetricType::Pointer metric = MetricType::New();
-
 /*
   typename OptimizerType::Pointer optimizer = OptimizerType::New();
   optimizer->SetMinimumStepLength(1e-6);
@@ -582,7 +642,6 @@ PairRegistrationMethod<TPixel>
   //registration->SetOptimizer(optimizer);
   registration->SetOptimizer(powell);
   registration->SetInterpolator(interpolator);
-  registration->SetMetric(metric);
 
   interpolator->SetInputImage(movingImg);
 
@@ -591,6 +650,18 @@ PairRegistrationMethod<TPixel>
   affine->SetSourceCenter(fixedCenter[0], fixedCenter[1], fixedCenter[2]);
   affine->SetTargetCenter(movingCenter[0], movingCenter[1], movingCenter[2]);
 
+  std::vector<typename MetricBaseType::ParametersType> initCandidates;
+  if (iopt == InitializeMoments)
+    CreateMomentCandidates(fixedImg, movingImg, affine, initCandidates);
+
+  // Registration is done at one level, the metric copies are for the
+  // parallel line search
+  MetricListType metricCopies;
+  typename MetricBaseType::Pointer metric = CreateLevelMetric(
+    pyramids, fixedImg, movingImg, affine, 4.0*minSpacing, 64, true,
+    qopt, mopt, numThreads, metricCopies);
+  registration->SetMetric(metric);
+
   registration->SetTransform(affine);
   registration->SetInitialTransformParameters(affine->GetParameters());
 
@@ -644,20 +715,6 @@ PairRegistrationMethod<TPixel>
   anneal->SetMaxIterations(220);
 */
 
-  metric->SetNumberOfBins(64);
-  metric->SetRandomSampling(true);
-
-  // Not needed for Havrda-Charvat
-  metric->SetNormalized(true);
-  if (qopt == QuantizeFixed || qopt == QuantizeBoth)
-    metric->QuantizeFixedImageOn();
-  else
-    metric->QuantizeFixedImageOff();
-  if (qopt == QuantizeMoving || qopt == QuantizeBoth)
-    metric->QuantizeMovingImageOn();
-  else
-    metric->QuantizeMovingImageOff();
-
 /*
   // ITK's MI metric
   metric->SetNumberOfHistogramBins(200);
@@ -685,7 +742,7 @@ PairRegistrationMethod<TPixel>
   muLogMacro(<< "Beginning affine registration...\n");
 /*
   // Use ITK framework to handle multi resolution registration
-  //metric->SetSampleSpacing(minSpacing);
+  //SetMetricSampleSpacing(metric, minSpacing);
 
   //registration->SetOptimizer(amoeba);
   //registration->SetOptimizer(powell);
@@ -696,12 +753,13 @@ PairRegistrationMethod<TPixel>
   affine->SetParameters(registration->GetLastTransformParameters());
 */
 
-  metric->SetFixedImage(fixedImg);
-  metric->SetMovingImage(movingImg);
-  metric->SetTransform(affine);
+  for (unsigned int i = 0; i < metricCopies.size(); i++)
+    powell->AddLineSearchCostFunction(metricCopies[i]);
+
+  if (initCandidates.size() != 0)
+    affine->SetParameters(SelectInitialParameters(metric, initCandidates));
 
   muLogMacro(<< "Registering at [4x4x4]...\n");
-  metric->SetSampleSpacing(4.0*minSpacing);
   powell->SetCostFunction(metric);
   powell->SetInitialPosition(affine->GetParameters());
   powell->SetMaximumIterations(8);
@@ -718,12 +776,14 @@ template <class TPixel>
 PairRegistrationMethod<TPixel>::AffineTransformType::Pointer
 PairRegistrationMethod<TPixel>
 ::RegisterRigid(ImageType* fixedImg, ImageType* movingImg,
-  QuantizationOption qopt)
+  QuantizationOption qopt, MetricOption mopt, InitializationOption iopt,
+  PyramidCacheType* pyramids, unsigned int numThreads)
 {
   if (fixedImg == NULL || movingImg == NULL)
     muExceptionMacro(<< "One of input images is NULL");
 
-  AffineTransformType::Pointer affine = RegisterAffine(fixedImg, movingImg, qopt);
+  AffineTransformType::Pointer affine =
+    RegisterAffine(fixedImg, movingImg, qopt, mopt, iopt, pyramids, numThreads);
 
   AffineTransformType::ParametersType p = affine->GetParameters();
 
@@ -746,12 +806,14 @@ template <class TPixel>
 PairRegistrationMethod<TPixel>::AffineTransformType::Pointer
 PairRegistrationMethod<TPixel>
 ::RegisterRigidFast(ImageType* fixedImg, ImageType* movingImg,
-  QuantizationOption qopt)
+  QuantizationOption qopt, MetricOption mopt, InitializationOption iopt,
+  PyramidCacheType* pyramids, unsigned int numThreads)
 {
   if (fixedImg == NULL || movingImg == NULL)
     muExceptionMacro(<< "One of input images is NULL");
 
-  AffineTransformType::Pointer affine = RegisterAffineFast(fixedImg, movingImg, qopt);
+  AffineTransformType::Pointer affine =
+    RegisterAffineFast(fixedImg, movingImg, qopt, mopt, iopt, pyramids, numThreads);
 
   AffineTransformType::ParametersType p = affine->GetParameters();
 
@@ -781,101 +843,26 @@ PairRegistrationMethod<TPixel>
   if (nx < 1 || ny < 1 || nz < 1)
     muExceptionMacro(<< "Grid size in any dimension must be >= 1");
 
-  // Quantize images to improve histogram MI estimates
-  typedef itk::Image<short, 3> IndexImageType;
+  // Partial volume MI with its analytic gradient w.r.t. the B-spline
+  // coefficients, the metric quantizes the images itself
+  typedef NegativeMIImageMatchMetric<ImageType, ImageType> MIMetricType;
 
-  typedef KMeansQuantizeImageFilter<ImageType, IndexImageType>
-    QuantizerType;
-  typedef itk::RescaleIntensityImageFilter<ImageType, IndexImageType>
-    RescalerType;
+  typedef itk::LBFGSBOptimizer OptimizerType;
 
   unsigned int numHistogramBins = 200;
 
-  IndexImageType::Pointer qdFixedImg;
-  if (qopt == QuantizeFixed || qopt == QuantizeBoth)
-  {
-    typename QuantizerType::Pointer qfilter = QuantizerType::New();
-    qfilter->SetInput(fixedImg);
-    qfilter->SetNumberOfBins(numHistogramBins);
-    qfilter->SetTrimFraction(0.01);
-    qfilter->TrimAboveOff();
-    qfilter->TrimBelowOff();
-    qfilter->SetTrimAboveValue(numHistogramBins);
-    qfilter->SetTrimBelowValue(0);
-    qfilter->Update();
-
-    qdFixedImg = qfilter->GetOutput();
-  }
-  else
-  {
-    typename RescalerType::Pointer rescaler = RescalerType::New();
-    rescaler->SetInput(fixedImg);
-    rescaler->SetOutputMinimum(1);
-    rescaler->SetOutputMaximum(numHistogramBins);
-    rescaler->Update();
-
-    qdFixedImg = rescaler->GetOutput();
-  }
-
-  IndexImageType::Pointer qdMovingImg;
-  if (qopt == QuantizeMoving || qopt == QuantizeBoth)
-  {
-    typename QuantizerType::Pointer qfilter = QuantizerType::New();
-    qfilter->SetInput(movingImg);
-    qfilter->SetNumberOfBins(numHistogramBins);
-    qfilter->SetTrimFraction(0.001);
-    qfilter->TrimAboveOn();
-    qfilter->TrimBelowOn();
-    qfilter->SetTrimAboveValue(numHistogramBins);
-    qfilter->SetTrimBelowValue(0);
-    qfilter->Update();
-
-    qdMovingImg = qfilter->GetOutput();
-  }
-  else
-  {
-    typename RescalerType::Pointer rescaler = RescalerType::New();
-    rescaler->SetInput(movingImg);
-    rescaler->SetOutputMinimum(1);
-    rescaler->SetOutputMaximum(numHistogramBins);
-    rescaler->Update();
-
-    qdMovingImg = rescaler->GetOutput();
-  }
+  typename ImageType::SpacingType spacing = fixedImg->GetSpacing();
 
-  typedef itk::MattesMutualInformationImageToImageMetric<
-    IndexImageType, IndexImageType> MIMetricType;
-  //typedef NegativeMIImageMatchMetric<IndexImageType, IndexImageType>
-  //  MIMetricType;
-
-  typedef itk::LinearInterpolateImageFunction<IndexImageType, double>
-    InterpolatorType;
-
-  typedef itk::LBFGSBOptimizer OptimizerType;
-
-  typedef itk::MultiResolutionImageRegistrationMethod<
-    IndexImageType, IndexImageType> RegistrationType;
+  double minSpacing = spacing[0];
+  for (unsigned int i = 1; i < 3; i++)
+    if (spacing[i] < minSpacing)
+      minSpacing = spacing[i];
 
   typename MIMetricType::Pointer metric = MIMetricType::New();
-  typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
   OptimizerType::Pointer optimizer = OptimizerType::New();
 
   BSplineTransformType::Pointer btrafo = BSplineTransformType::New();
 
-  typename RegistrationType::Pointer registration = RegistrationType::New();
-  registration->SetMetric(metric);
-  registration->SetOptimizer(optimizer);
-  registration->SetInterpolator(interpolator);
-
-  interpolator->SetInputImage(qdMovingImg);
-
-  registration->SetTransform(btrafo);
-
-  registration->SetFixedImage(qdFixedImg);
-  registration->SetMovingImage(qdMovingImg);
-
-  registration->SetFixedImageRegion(qdFixedImg->GetLargestPossibleRegion());
-
   unsigned int gridSize[3] = {nx, ny, nz};
 
   typedef BSplineTransformType::RegionType RegionType;
@@ -893,7 +880,6 @@ PairRegistrationMethod<TPixel>
   OriginType origin = fixedImg->GetOrigin();
 
   typedef BSplineTransformType::SpacingType SpacingType;
-  SpacingType spacing = fixedImg->GetSpacing();
 
   SpacingType shift;
 
@@ -952,20 +938,7 @@ PairRegistrationMethod<TPixel>
   BSplineIterationUpdate::Pointer obs = BSplineIterationUpdate::New();
   optimizer->AddObserver(itk::IterationEvent(), obs);
 
-#if 1
-  unsigned int numSamples =
-    fixedImg->GetLargestPossibleRegion().GetNumberOfPixels() / 5;
-  if (numSamples > 500000)
-    numSamples = 500000;
-
-  registration->SetInitialTransformParameters(initp);
-
-  metric->SetNumberOfHistogramBins(numHistogramBins);
-  metric->SetNumberOfSpatialSamples(numSamples);
-
-  metric->UseAllPixelsOn();
-
-  // Set up mask for MI
+  // Set up mask for MI, samples are selected when the fixed image is set
   if (fixedMask != 0)
   {
     // Use image mask spatial object, evaluates and checks for non-zero voxels
@@ -975,54 +948,37 @@ PairRegistrationMethod<TPixel>
     metric->SetFixedImageMask(imso);
   }
 
-  metric->ReinitializeSeed( 76926294 );
-
-  registration->SetNumberOfLevels(1);
-  registration->Update();
-
-  btrafo->SetParametersByValue(registration->GetLastTransformParameters());
-
-#else
-
-  metric->SetFixedImage(qdFixedImg);
-  metric->SetMovingImage(qdMovingImg);
-  metric->SetTransform(btrafo);
-
+  // Finite difference steps, only used if the analytic gradient is not
+  // available
   typename MIMetricType::ParametersType derivSteps(numParams);
   derivSteps.Fill(0.5);
   metric->SetDerivativeStepLengths(derivSteps);
+  metric->SetUseAnalyticDerivative(true);
 
   metric->SetNumberOfBins(numHistogramBins);
   metric->SetNormalized(true);
 
+  if (qopt == QuantizeFixed || qopt == QuantizeBoth)
+    metric->QuantizeFixedImageOn();
+  else
+    metric->QuantizeFixedImageOff();
+  if (qopt == QuantizeMoving || qopt == QuantizeBoth)
+    metric->QuantizeMovingImageOn();
+  else
+    metric->QuantizeMovingImageOff();
+
   metric->SetSampleSpacing(2.0*minSpacing);
+
+  metric->SetFixedImage(fixedImg);
+  metric->SetMovingImage(movingImg);
+  metric->SetTransform(btrafo);
+
   optimizer->SetCostFunction(metric);
   optimizer->SetInitialPosition(initp);
   optimizer->StartOptimization();
 
   btrafo->SetParametersByValue(optimizer->GetCurrentPosition());
 
-/*
-  AmoebaOptimizer::Pointer amoeba = AmoebaOptimizer::New();
-  amoeba->SetMaxIterations(10);
-  amoeba->SetParameterTolerance(1e-2);
-  amoeba->SetFunctionTolerance(1e-3);
-
-  typename MIMetricType::ParametersType deltas(numParams);
-  deltas.Fill(1.0);
-  amoeba->SetInitialSimplexDeltas(deltas);
-
-  amoeba->AddObserver(itk::IterationEvent(), BSplineIterationUpdate::New());
-
-  metric->SetSampleSpacing(4.0*minSpacing);
-  amoeba->SetCostFunction(metric);
-  amoeba->SetInitialPosition(initp);
-  amoeba->StartOptimization();
-
-  btrafo->SetParametersByValue(amoeba->GetCurrentPosition());
-*/
-#endif
-
   return btrafo;
 }
 
@@ -1063,6 +1019,381 @@ PairRegistrationMethod<TPixel>
   return demons->GetOutput();
 }
 
+template <class TPixel>
+void
+PairRegistrationMethod<TPixel>
+::ComputeImageMoments(ImageType* img,
+  vnl_vector<double>& centroid, vnl_matrix<double>& axes,
+  vnl_vector<double>& variances)
+{
+  typedef itk::ImageRegionConstIteratorWithIndex<ImageType> IteratorType;
+
+  // Weighted sums in index space, mapped to physical space at the end
+  double sumW = 0.0;
+  vnl_vector<double> sumX(3, 0.0);
+  vnl_matrix<double> sumXX(3, 3, 0.0);
+
+  IteratorType it(img, img->GetLargestPossibleRegion());
+  for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+  {
+    double w = it.Get();
+    if (w <= 0.0)
+      continue;
+
+    typename ImageType::IndexType ind = it.GetIndex();
+
+    double x[3];
+    for (unsigned int i = 0; i < 3; i++)
+      x[i] = ind[i];
+
+    sumW += w;
+    for (unsigned int i = 0; i < 3; i++)
+    {
+      sumX[i] += w*x[i];
+      for (unsigned int j = i; j < 3; j++)
+        sumXX(i, j) += w*x[i]*x[j];
+    }
+  }
+
+  if (sumW <= 0.0)
+    muExceptionMacro(<< "No positive intensities for image moments");
+
+  vnl_vector<double> meanInd = sumX / sumW;
+
+  vnl_matrix<double> covInd(3, 3);
+  for (unsigned int i = 0; i < 3; i++)
+    for (unsigned int j = i; j < 3; j++)
+    {
+      covInd(i, j) = sumXX(i, j) / sumW - meanInd[i]*meanInd[j];
+      covInd(j, i) = covInd(i, j);
+    }
+
+  // Index to physical space, x = origin + D*S*i
+  vnl_matrix<double> A(3, 3);
+  for (unsigned int i = 0; i < 3; i++)
+    for (unsigned int j = 0; j < 3; j++)
+      A(i, j) = img->GetDirection()[i][j] * img->GetSpacing()[j];
+
+  centroid = A * meanInd;
+  for (unsigned int i = 0; i < 3; i++)
+    centroid[i] += img->GetOrigin()[i];
+
+  vnl_matrix<double> cov = A * covInd * A.transpose();
+
+  // Eigenvalues are sorted in increasing order
+  vnl_symmetric_eigensystem<double> eig(cov);
+
+  axes.set_size(3, 3);
+  variances.set_size(3);
+  for (unsigned int k = 0; k < 3; k++)
+  {
+    variances[k] = eig.get_eigenvalue(2-k);
+    axes.set_column(k, eig.get_eigenvector(2-k));
+  }
+
+  // Right handed axes
+  if (vnl_det(axes) < 0.0)
+    axes.set_column(2, -axes.get_column(2));
+}
+
+template <class TPixel>
+void
+PairRegistrationMethod<TPixel>
+::CreateMomentCandidates(ImageType* fixedImg, ImageType* movingImg,
+  AffineTransformType* affine,
+  std::vector<typename MetricBaseType::ParametersType>& candidates)
+{
+  candidates.clear();
+
+  vnl_vector<double> fixedCentroid;
+  vnl_matrix<double> fixedAxes;
+  vnl_vector<double> fixedVars;
+  ComputeImageMoments(fixedImg, fixedCentroid, fixedAxes, fixedVars);
+
+  vnl_vector<double> movingCentroid;
+  vnl_matrix<double> movingAxes;
+  vnl_vector<double> movingVars;
+  ComputeImageMoments(movingImg, movingCentroid, movingAxes, movingVars);
+
+  AffineTransformType::CenterType fixedCenter = affine->GetSourceCenter();
+  AffineTransformType::CenterType movingCenter = affine->GetTargetCenter();
+
+  affine->SetSourceCenter(
+    fixedCentroid[0], fixedCentroid[1], fixedCentroid[2]);
+  affine->SetTargetCenter(
+    movingCentroid[0], movingCentroid[1], movingCentroid[2]);
+
+  typename MetricBaseType::ParametersType p(12);
+  p.Fill(0.0);
+  p[6] = 1.0;
+  p[7] = 1.0;
+  p[8] = 1.0;
+
+  // Image centers aligned, as without initialization
+  typename MetricBaseType::ParametersType p_centers = p;
+  for (unsigned int i = 0; i < 3; i++)
+    p_centers[i] = (movingCenter[i] - movingCentroid[i])
+      - (fixedCenter[i] - fixedCentroid[i]);
+  candidates.push_back(p_centers);
+
+  // Centroids aligned
+  candidates.push_back(p);
+
+  // Principal axes aligned, if distinct in both images
+  for (unsigned int k = 0; k < 2; k++)
+  {
+    if (fixedVars[k] < MU_MOMENT_MIN_AXIS_RATIO*fixedVars[k+1])
+      return;
+    if (movingVars[k] < MU_MOMENT_MIN_AXIS_RATIO*movingVars[k+1])
+      return;
+  }
+
+  // Axes are defined up to sign, use the proper rotation closest to
+  // identity as the scans are roughly aligned
+  static const double flips[4][3] =
+    {{1, 1, 1}, {1, -1, -1}, {-1, 1, -1}, {-1, -1, 1}};
+
+  vnl_matrix<double> R;
+  double bestTrace = -vnl_huge_val(1.0);
+  for (unsigned int f = 0; f < 4; f++)
+  {
+    vnl_matrix<double> flippedAxes = movingAxes;
+    for (unsigned int k = 0; k < 3; k++)
+      flippedAxes.set_column(k, flips[f][k] * movingAxes.get_column(k));
+
+    // Maps the fixed axes to the moving axes
+    vnl_matrix<double> R_f = flippedAxes * fixedAxes.transpose();
+
+    double trace = R_f(0, 0) + R_f(1, 1) + R_f(2, 2);
+    if (trace > bestTrace)
+    {
+      bestTrace = trace;
+      R = R_f;
+    }
+  }
+
+  // Angles of R = Rx * Ry * Rz, as composed by the forward transform
+  typename MetricBaseType::ParametersType p_axes = p;
+  p_axes[3] = atan2(R(1, 2), R(2, 2));
+  p_axes[4] = asin(-vnl_math_max(-1.0, vnl_math_min(1.0, R(0, 2))));
+  p_axes[5] = atan2(R(0, 1), R(0, 0));
+  candidates.push_back(p_axes);
+}
+
+template <class TPixel>
+typename PairRegistrationMethod<TPixel>::MetricBaseType::ParametersType
+PairRegistrationMethod<TPixel>
+::SelectInitialParameters(MetricBaseType* metric,
+  const std::vector<typename MetricBaseType::ParametersType>& candidates)
+{
+  if (candidates.size() == 0)
+    muExceptionMacro(<< "No initial parameters to select from");
+
+  unsigned int best = 0;
+  double bestValue = metric->GetValue(candidates[0]);
+
+  for (unsigned int i = 1; i < candidates.size(); i++)
+  {
+    double v = metric->GetValue(candidates[i]);
+    if (v < bestValue)
+    {
+      bestValue = v;
+      best = i;
+    }
+  }
+
+  muLogMacro(<< "Initial transform from candidate " << best+1 << " of "
+    << candidates.size() << "\n");
+
+  return candidates[best];
+}
+
+template <class TPixel>
+typename PairRegistrationMethod<TPixel>::MetricBaseType::Pointer
+PairRegistrationMethod<TPixel>
+::CreateAffineMetric(ImageType* fixedImg, ImageType* movingImg,
+  AffineTransformType* affine, unsigned int numBins, bool randomSampling,
+  QuantizationOption qopt, MetricOption mopt, unsigned int numThreads)
+{
+  if (numThreads == 0)
+    numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  typename MetricBaseType::ParametersType derivSteps(12);
+  derivSteps.Fill(1e-8);
+  for (int i = 0; i < 3; i++)
+    derivSteps[i] = 1e-4; // Translation steps
+
+  if (mopt == MetricHC)
+  {
+    typedef NegativeHCImageMatchMetric<ImageType, ImageType> HCMetricType;
+    typename HCMetricType::Pointer metric = HCMetricType::New();
+
+    metric->SetDerivativeStepLengths(derivSteps);
+    metric->SetNumberOfBins(numBins);
+    metric->SetNumberOfHistogramThreads(numThreads);
+
+    metric->SetFixedImage(fixedImg);
+    metric->SetMovingImage(movingImg);
+    metric->SetTransform(affine);
+
+    return metric.GetPointer();
+  }
+
+  typedef NegativeMIImageMatchMetric<ImageType, ImageType> MIMetricType;
+  typename MIMetricType::Pointer metric = MIMetricType::New();
+
+  metric->SetDerivativeStepLengths(derivSteps);
+  metric->SetNumberOfBins(numBins);
+  metric->SetRandomSampling(randomSampling);
+  metric->SetNumberOfHistogramThreads(numThreads);
+
+  metric->SetNormalized(true);
+  if (qopt == QuantizeFixed || qopt == QuantizeBoth)
+    metric->QuantizeFixedImageOn();
+  else
+    metric->QuantizeFixedImageOff();
+  if (qopt == QuantizeMoving || qopt == QuantizeBoth)
+    metric->QuantizeMovingImageOn();
+  else
+    metric->QuantizeMovingImageOff();
+
+  metric->SetFixedImage(fixedImg);
+  metric->SetMovingImage(movingImg);
+  metric->SetTransform(affine);
+
+  return metric.GetPointer();
+}
+
+template <class TPixel>
+void
+PairRegistrationMethod<TPixel>
+::SetMetricSampleSpacing(MetricBaseType* metric, double s)
+{
+  typedef NegativeMIImageMatchMetric<ImageType, ImageType> MIMetricType;
+  typedef NegativeHCImageMatchMetric<ImageType, ImageType> HCMetricType;
+
+  MIMetricType* mi = dynamic_cast<MIMetricType*>(metric);
+  if (mi != 0)
+  {
+    mi->SetSampleSpacing(s);
+    return;
+  }
+
+  HCMetricType* hc = dynamic_cast<HCMetricType*>(metric);
+  if (hc != 0)
+  {
+    hc->SetSampleSpacing(s);
+    return;
+  }
+
+  muExceptionMacro(<< "Unknown affine registration metric");
+}
+
+template <class TPixel>
+typename PairRegistrationMethod<TPixel>::MetricListType
+PairRegistrationMethod<TPixel>
+::CreateAffineMetricCopies(ImageType* fixedImg, ImageType* movingImg,
+  const AffineTransformType* affine, unsigned int numBins,
+  bool randomSampling, QuantizationOption qopt, MetricOption mopt,
+  unsigned int numThreads)
+{
+  MetricListType copies;
+
+  if (numThreads == 0)
+    numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  unsigned int numWorkers = MU_AFFINE_PARALLEL_WORKERS;
+  if (numWorkers > numThreads)
+    numWorkers = numThreads;
+
+  if (numWorkers < 2)
+    return copies;
+
+  // Split the threads between the metric copies
+  unsigned int histThreads = numThreads / numWorkers;
+  if (histThreads < 1)
+    histThreads = 1;
+
+  for (unsigned int i = 0; i < numWorkers; i++)
+  {
+    AffineTransformType::Pointer workerAffine = AffineTransformType::New();
+    workerAffine->SetAllParameters(affine->GetParameters(),
+      affine->GetSourceCenter()[0],
+      affine->GetSourceCenter()[1],
+      affine->GetSourceCenter()[2],
+      affine->GetTargetCenter()[0],
+      affine->GetTargetCenter()[1],
+      affine->GetTargetCenter()[2],
+      affine->IsForwardEvaluation());
+
+    // Quantized images are shared through the bin index image cache
+    typename MetricBaseType::Pointer workerMetric = CreateAffineMetric(
+      fixedImg, movingImg, workerAffine, numBins, randomSampling, qopt, mopt,
+      histThreads);
+
+    copies.push_back(workerMetric);
+  }
+
+  return copies;
+}
+
+template <class TPixel>
+void
+PairRegistrationMethod<TPixel>
+::SetMetricSampleSpacing(MetricBaseType* metric, MetricListType& copies,
+  double s)
+{
+  SetMetricSampleSpacing(metric, s);
+
+  typedef NegativeMIImageMatchMetric<ImageType, ImageType> MIMetricType;
+
+  MIMetricType* mi = dynamic_cast<MIMetricType*>(metric);
+
+  for (unsigned int i = 0; i < copies.size(); i++)
+  {
+    SetMetricSampleSpacing(copies[i], s);
+
+    // Same (random) samples as the main metric
+    if (mi != 0)
+    {
+      MIMetricType* mi_i = dynamic_cast<MIMetricType*>(copies[i].GetPointer());
+      mi_i->CopySampleIndices(mi);
+    }
+  }
+}
+
+template <class TPixel>
+typename PairRegistrationMethod<TPixel>::MetricBaseType::Pointer
+PairRegistrationMethod<TPixel>
+::CreateLevelMetric(PyramidCacheType* pyramids,
+  ImageType* fixedImg, ImageType* movingImg,
+  AffineTransformType* affine, double sampleSpacing,
+  unsigned int numBins, bool randomSampling,
+  QuantizationOption qopt, MetricOption mopt, unsigned int numThreads,
+  MetricListType& copies)
+{
+  typename ImageType::Pointer fixedLevel = fixedImg;
+  typename ImageType::Pointer movingLevel = movingImg;
+
+  if (pyramids != 0)
+  {
+    fixedLevel = pyramids->GetLevelAtSpacing(fixedImg, sampleSpacing);
+    movingLevel = pyramids->GetLevelAtSpacing(movingImg, sampleSpacing);
+  }
+
+  typename MetricBaseType::Pointer metric = CreateAffineMetric(
+    fixedLevel, movingLevel, affine, numBins, randomSampling, qopt, mopt,
+    numThreads);
+
+  copies = CreateAffineMetricCopies(
+    fixedLevel, movingLevel, affine, numBins, randomSampling, qopt, mopt,
+    numThreads);
+
+  SetMetricSampleSpacing(metric, copies, sampleSpacing);
+
+  return metric;
+}
+
 template <class TPixel>
 PairRegistrationMethod<TPixel>::AffineTransformType::Pointer
 PairRegistrationMethod<TPixel>
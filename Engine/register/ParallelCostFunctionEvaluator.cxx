@@ -0,0 +1,138 @@
+
+#include "ParallelCostFunctionEvaluator.h"
+
+#include "itkExceptionObject.h"
+
+struct _ParallelEvaluationData
+{
+  const std::vector<ParallelCostFunctionEvaluator::ParametersType>* Points;
+  std::vector<double>* Values;
+  unsigned int NumberOfWorkers;
+};
+
+void
+ParallelCostFunctionEvaluator
+::AddCostFunction(CostFunctionType* f)
+{
+  if (f == 0)
+    itkExceptionMacro(<< "NULL cost function");
+
+  m_CostFunctions.push_back(f);
+
+  this->Modified();
+}
+
+void
+ParallelCostFunctionEvaluator
+::ClearCostFunctions()
+{
+  m_CostFunctions.clear();
+
+  this->Modified();
+}
+
+void
+ParallelCostFunctionEvaluator
+::Evaluate(
+  const std::vector<ParametersType>& points, std::vector<double>& values)
+{
+  if (m_CostFunctions.size() == 0)
+    itkExceptionMacro(<< "No cost functions for parallel evaluation");
+
+  values.resize(points.size());
+
+  if (points.size() == 0)
+    return;
+
+  unsigned int numWorkers = m_CostFunctions.size();
+  if (numWorkers > points.size())
+    numWorkers = points.size();
+
+  _ParallelEvaluationData evalData;
+  evalData.Points = &points;
+  evalData.Values = &values;
+  evalData.NumberOfWorkers = numWorkers;
+
+  this->Execute(_evaluatePoints, &evalData, numWorkers);
+}
+
+void
+ParallelCostFunctionEvaluator
+::Execute(WorkerMethodType method, void* data, unsigned int numWorkers)
+{
+  if (numWorkers == 0 || numWorkers > m_CostFunctions.size())
+    numWorkers = m_CostFunctions.size();
+
+  if (numWorkers == 0)
+    itkExceptionMacro(<< "No cost functions for parallel evaluation");
+
+  ThreadStruct* str = new ThreadStruct;
+  str->Evaluator = this;
+  str->Method = method;
+  str->UserData = data;
+  str->Errors.resize(numWorkers);
+
+  // Worker ids are distributed over the threads actually started, in case
+  // the threader limits the number of threads
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads(numWorkers);
+  threader->SetSingleMethod(_threadExecute, str);
+  threader->SingleMethodExecute();
+
+  std::string errors;
+  for (unsigned int i = 0; i < numWorkers; i++)
+    errors += str->Errors[i];
+
+  delete str;
+
+  if (errors.size() != 0)
+    itkExceptionMacro(<< "Parallel evaluation failed: " << errors);
+}
+
+ITK_THREAD_RETURN_TYPE
+ParallelCostFunctionEvaluator
+::_threadExecute(void* arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfoType;
+
+  ThreadInfoType* threadInfo = static_cast<ThreadInfoType*>(arg);
+
+  unsigned int threadId = threadInfo->ThreadID;
+  unsigned int numThreads = threadInfo->NumberOfThreads;
+
+  ThreadStruct* str = static_cast<ThreadStruct*>(threadInfo->UserData);
+
+  unsigned int numWorkers = str->Errors.size();
+
+  for (unsigned int w = threadId; w < numWorkers; w += numThreads)
+  {
+    try
+    {
+      str->Method(
+        w, str->Evaluator->m_CostFunctions[w].GetPointer(), str->UserData);
+    }
+    catch (itk::ExceptionObject& e)
+    {
+      str->Errors[w] = e.GetDescription();
+    }
+  }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+void
+ParallelCostFunctionEvaluator
+::_evaluatePoints(unsigned int workerId, CostFunctionType* f, void* data)
+{
+  _ParallelEvaluationData* evalData =
+    static_cast<_ParallelEvaluationData*>(data);
+
+  const std::vector<ParametersType>& points = *(evalData->Points);
+  std::vector<double>& values = *(evalData->Values);
+
+  for (unsigned int i = workerId; i < points.size();
+       i += evalData->NumberOfWorkers)
+  {
+    values[i] = f->GetValue(points[i]);
+  }
+}
@@ -0,0 +1,89 @@
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Concurrent evaluation of a cost function using independent copies, one
+// worker thread per copy
+//
+// Copies must not share state that is modified by GetValue (e.g. each image
+// match metric needs its own transform)
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _ParallelCostFunctionEvaluator_h
+#define _ParallelCostFunctionEvaluator_h
+
+#include "itkMultiThreader.h"
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkSingleValuedCostFunction.h"
+
+#include <string>
+#include <vector>
+
+class ParallelCostFunctionEvaluator: public itk::Object
+{
+public:
+
+  /** Standard class typedefs. */
+  typedef ParallelCostFunctionEvaluator Self;
+  typedef itk::Object Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(ParallelCostFunctionEvaluator, itk::Object);
+
+  typedef itk::SingleValuedCostFunction CostFunctionType;
+  typedef CostFunctionType::ParametersType ParametersType;
+
+  // Function run by each worker, exceptions are passed to the caller of
+  // Execute after all workers are done
+  typedef void (*WorkerMethodType)(
+    unsigned int workerId, CostFunctionType* f, void* data);
+
+  void AddCostFunction(CostFunctionType* f);
+  void ClearCostFunctions();
+
+  unsigned int GetNumberOfCostFunctions() const
+  { return m_CostFunctions.size(); }
+
+  CostFunctionType* GetCostFunction(unsigned int i) const
+  { return m_CostFunctions[i]; }
+
+  // Values at all points, points are distributed cyclically over the workers
+  void Evaluate(
+    const std::vector<ParametersType>& points, std::vector<double>& values);
+
+  // Run the method on numWorkers threads (all workers if zero)
+  void Execute(WorkerMethodType method, void* data, unsigned int numWorkers=0);
+
+protected:
+
+  ParallelCostFunctionEvaluator() { }
+  ~ParallelCostFunctionEvaluator() { }
+
+  struct ThreadStruct
+  {
+    ParallelCostFunctionEvaluator* Evaluator;
+    WorkerMethodType Method;
+    void* UserData;
+    std::vector<std::string> Errors;
+  };
+
+  static ITK_THREAD_RETURN_TYPE _threadExecute(void* arg);
+
+  static void _evaluatePoints(
+    unsigned int workerId, CostFunctionType* f, void* data);
+
+private:
+  ParallelCostFunctionEvaluator(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  std::vector<CostFunctionType::Pointer> m_CostFunctions;
+
+};
+
+#endif
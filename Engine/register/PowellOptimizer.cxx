@@ -7,6 +7,8 @@
 
 #include "PowellOptimizer.h"
 
+#include <algorithm>
+
 #define POWELL_GOLD 1.618033988749894848 // (1+sqrt(5))/2
 #define POWELL_CONJUGATE_GOLD 0.3819660112501051 // 2 - (1-sqrt(5))/2
 #define POWELL_EPS 1e-20
@@ -42,6 +44,8 @@ PowellOptimizer
   m_BrentFracTol = 1e-2;
 
   m_UseNewDirections = false;
+
+  m_LineSearchEvaluator = ParallelCostFunctionEvaluator::New();
 }
 
 void
@@ -282,6 +286,12 @@ PowellOptimizer
 {
   itkDebugMacro(<< "LineSearch");
 
+  if (m_LineSearchEvaluator->GetNumberOfCostFunctions() > 1)
+  {
+    this->ParallelLineSearch(step);
+    return;
+  }
+
   // Bracket
   itkDebugMacro(<< "Bracket");
 
@@ -558,7 +568,14 @@ PowellOptimizer
   // Done with line search, update variables
   // fx is the min value along the line
   // x is the min location along the line
+  this->MoveAlongLine(x, fx);
 
+}
+
+void
+PowellOptimizer
+::MoveAlongLine(double x, double fx)
+{
   m_Value = fx;
 
   ParametersType pos = this->GetCurrentPosition();
@@ -568,7 +585,172 @@ PowellOptimizer
     newPosition[j] = pos[j] + x*m_CurrentDirection[j];
 
   this->SetCurrentPosition(newPosition);
+}
+
+// Index of the smallest value, ties resolved in favor of the given index
+static unsigned int
+_powellArgMin(const std::vector<double>& values, unsigned int pref)
+{
+  unsigned int imin = pref;
+  for (unsigned int i = 0; i < values.size(); i++)
+    if (values[i] < values[imin])
+      imin = i;
+  return imin;
+}
+
+// Merge new samples into a list sorted by step
+static void
+_powellMergeSamples(std::vector<double>& xs, std::vector<double>& fs,
+  const std::vector<double>& newx, const std::vector<double>& newf)
+{
+  std::vector<std::pair<double, double> > samples;
+  for (unsigned int i = 0; i < xs.size(); i++)
+    samples.push_back(std::pair<double, double>(xs[i], fs[i]));
+  for (unsigned int i = 0; i < newx.size(); i++)
+    samples.push_back(std::pair<double, double>(newx[i], newf[i]));
 
+  std::sort(samples.begin(), samples.end());
+
+  xs.clear();
+  fs.clear();
+  for (unsigned int i = 0; i < samples.size(); i++)
+  {
+    xs.push_back(samples[i].first);
+    fs.push_back(samples[i].second);
+  }
+}
+
+void
+PowellOptimizer
+::ParallelLineSearch(double step)
+{
+  itkDebugMacro(<< "ParallelLineSearch");
+
+  unsigned int numWorkers = m_LineSearchEvaluator->GetNumberOfCostFunctions();
+
+  // Samples along the line sorted by step, starting at the current position
+  std::vector<double> xs;
+  std::vector<double> fs;
+  xs.push_back(0.0);
+  fs.push_back(m_Value);
+
+  std::vector<double> newx;
+  std::vector<double> newf;
+
+  // Bracket, evaluate both sides with golden ratio growth and keep extending
+  // the side with the smallest value until it is enclosed
+  itkDebugMacro(<< "Parallel bracket");
+
+  double g = 1.0;
+  for (unsigned int k = 0; k < numWorkers; k++)
+  {
+    double sign = (k % 2 == 0) ? 1.0 : -1.0;
+    newx.push_back(sign*step*g);
+    if (k % 2 == 1)
+      g *= POWELL_GOLD;
+  }
+
+  unsigned int bracketIters = 0;
+
+  unsigned int imin = 0;
+
+  while (true)
+  {
+    this->EvaluateLineAt(newx, newf);
+
+    double prevMin = xs[_powellArgMin(fs, 0)];
+
+    _powellMergeSamples(xs, fs, newx, newf);
+
+    unsigned int iprev = 0;
+    while (xs[iprev] != prevMin)
+      iprev++;
+
+    imin = _powellArgMin(fs, iprev);
+
+    if (imin > 0 && imin < (xs.size()-1))
+      break;
+
+    bracketIters++;
+
+#if LIMIT_BRACKET_ITERS
+    if (bracketIters >= m_BracketMaxIters)
+      break;
+#endif
+
+    // Continue past the end with the smallest value
+    double last, inc;
+    if (imin == 0)
+    {
+      last = xs[0];
+      inc = POWELL_GOLD*(xs[0] - xs[1]);
+    }
+    else
+    {
+      last = xs[xs.size()-1];
+      inc = POWELL_GOLD*(xs[xs.size()-1] - xs[xs.size()-2]);
+    }
+
+    newx.clear();
+    for (unsigned int k = 0; k < numWorkers; k++)
+    {
+      last += inc;
+      newx.push_back(last);
+      inc *= POWELL_GOLD;
+    }
+  }
+
+  // Refine, evaluate a uniform grid within the bracket around the minimum
+  itkDebugMacro(<< "Parallel grid refinement");
+
+  double x = xs[imin];
+  double fx = fs[imin];
+
+  if (imin > 0 && imin < (xs.size()-1))
+  {
+    double a = xs[imin-1];
+    double b = xs[imin+1];
+    double fa = fs[imin-1];
+    double fb = fs[imin+1];
+
+    for (unsigned iter = 0; iter < m_BrentMaxIters; iter++)
+    {
+      double tol1 = m_BrentFracTol*vnl_math_abs(x) + POWELL_EPS;
+      double dt = 0.5*(b-a);
+      if (dt <= tol1 || dt < m_BrentAbsTol)
+        break;
+
+      newx.clear();
+      for (unsigned int k = 0; k < numWorkers; k++)
+        newx.push_back(a + (b-a)*(k+1) / (numWorkers+1));
+
+      this->EvaluateLineAt(newx, newf);
+
+      xs.clear();
+      fs.clear();
+      xs.push_back(a); fs.push_back(fa);
+      xs.push_back(x); fs.push_back(fx);
+      xs.push_back(b); fs.push_back(fb);
+
+      _powellMergeSamples(xs, fs, newx, newf);
+
+      unsigned int iprev = 0;
+      while (xs[iprev] != x)
+        iprev++;
+
+      imin = _powellArgMin(fs, iprev);
+
+      // Bracket endpoints are never smaller than the minimum found so far
+      if (imin == 0 || imin == (xs.size()-1))
+        imin = iprev;
+
+      a = xs[imin-1]; fa = fs[imin-1];
+      b = xs[imin+1]; fb = fs[imin+1];
+      x = xs[imin]; fx = fs[imin];
+    }
+  }
+
+  this->MoveAlongLine(x, fx);
 }
 
 double
@@ -583,3 +765,44 @@ PowellOptimizer
 
   return m_CostFunction->GetValue(p);
 }
+
+void
+PowellOptimizer
+::AddLineSearchCostFunction(CostFunctionType* f)
+{
+  m_LineSearchEvaluator->AddCostFunction(f);
+}
+
+void
+PowellOptimizer
+::ClearLineSearchCostFunctions()
+{
+  m_LineSearchEvaluator->ClearCostFunctions();
+}
+
+void
+PowellOptimizer
+::EvaluateLineAt(
+  const std::vector<double>& steps, std::vector<double>& values)
+{
+  if (m_LineSearchEvaluator->GetNumberOfCostFunctions() == 0)
+  {
+    values.resize(steps.size());
+    for (unsigned int i = 0; i < steps.size(); i++)
+      values[i] = this->EvaluateLineAt(steps[i]);
+    return;
+  }
+
+  ParametersType pos = this->GetCurrentPosition();
+
+  std::vector<ParametersType> points;
+  for (unsigned int i = 0; i < steps.size(); i++)
+  {
+    ParametersType p(m_SpaceDimension);
+    for (unsigned int j = 0; j < m_SpaceDimension; j++)
+      p[j] = pos[j] + steps[i]*m_CurrentDirection[j];
+    points.push_back(p);
+  }
+
+  m_LineSearchEvaluator->Evaluate(points, values);
+}
@@ -14,6 +14,10 @@
 
 #include "vnl/vnl_matrix.h"
 
+#include "ParallelCostFunctionEvaluator.h"
+
+#include <vector>
+
 class PowellOptimizer : public itk::SingleValuedNonLinearOptimizer
 {
 
@@ -95,6 +99,20 @@ public:
   itkSetMacro(UseNewDirections, bool);
   itkBooleanMacro(UseNewDirections);
 
+  // Independent copies of the cost function (each with its own transform),
+  // with two or more the steps along a direction are evaluated concurrently,
+  // one worker thread per copy, using parallel bracketing followed by grid
+  // refinement instead of Brent's method
+  void AddLineSearchCostFunction(CostFunctionType* f);
+  void ClearLineSearchCostFunctions();
+  unsigned int GetNumberOfLineSearchCostFunctions() const
+  { return m_LineSearchEvaluator->GetNumberOfCostFunctions(); }
+
+  // Values at a set of steps along the current direction, evaluated in
+  // parallel using the line search cost functions
+  void EvaluateLineAt(
+    const std::vector<double>& steps, std::vector<double>& values);
+
 protected:
 
   PowellOptimizer();
@@ -104,6 +122,10 @@ protected:
 
   void AdvanceOneStep();
   void LineSearch(double step);
+  void ParallelLineSearch(double step);
+
+  // Move to step x along the current direction, fx is the value there
+  void MoveAlongLine(double x, double fx);
 
   unsigned int m_SpaceDimension;
 
@@ -135,6 +157,8 @@ protected:
 
   bool m_UseNewDirections;
 
+  ParallelCostFunctionEvaluator::Pointer m_LineSearchEvaluator;
+
 private:
 
   PowellOptimizer(const Self&); //purposely not implemented
@@ -25,6 +25,34 @@
 #define MU_AFFINE_STEP_SCALE 0.2
 #define MU_AFFINE_STEP_SKEW 0.01
 
+//
+// Parallel optimization
+//
+
+// Maximum number of metric copies evaluated concurrently by the affine
+// optimizers (Powell line search, simplex candidates, tempering chains)
+#define MU_AFFINE_PARALLEL_WORKERS 8
+
+// Simplex restarts around the minimum at the coarsest affine level, the
+// restart simplices are evaluated concurrently with the metric copies
+#define MU_AFFINE_COARSE_RESTARTS 2
+
+//
+// Annealing fallback
+//
+
+// Affine registrations ending below this normalized MI, (H(A)+H(B))/H(A,B),
+// are taken as failed and searched again with parallel tempering
+#define MU_AFFINE_ANNEAL_MIN_NMI 1.1
+
+//
+// Moment initialization
+//
+
+// Minimum ratio between principal variances for the principal axes to be
+// used, axes of nearly isotropic intensity distributions are unstable
+#define MU_MOMENT_MIN_AXIS_RATIO 1.05
+
 //
 // Optimization order
 //
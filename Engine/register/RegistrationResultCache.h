@@ -0,0 +1,84 @@
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Cache of affine registration results in a directory shared between runs
+//
+// Results are stored as .affine files named by a key, which is a MD5 digest
+// of the fixed and moving image contents (voxels and geometry) and a string
+// describing the registration settings. Renaming the input files or changing
+// the output directory does not invalidate the results.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _RegistrationResultCache_h
+#define _RegistrationResultCache_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+
+#include "ChainedAffineTransform3D.h"
+
+#include <string>
+
+template <class TImage>
+class RegistrationResultCache: public itk::Object
+{
+
+public:
+
+  /** Standard class typedefs. */
+  typedef RegistrationResultCache Self;
+  typedef itk::Object Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(RegistrationResultCache, itk::Object);
+
+  typedef TImage ImageType;
+  typedef typename ImageType::PixelType PixelType;
+
+  typedef ChainedAffineTransform3D AffineTransformType;
+  typedef AffineTransformType::Pointer AffineTransformPointer;
+
+  // Directory is created when the first result is stored
+  void SetDirectory(const std::string& dir);
+  itkGetConstMacro(Directory, std::string);
+
+  // Hex digest of the image voxels, size, spacing, origin and direction
+  static std::string ComputeImageDigest(const ImageType* img);
+
+  // Key for a registration of the moving image to the fixed image
+  static std::string ComputeKey(const std::string& fixedDigest,
+    const std::string& movingDigest, const std::string& settings);
+
+  // Stored transform, NULL if not found or not readable
+  AffineTransformPointer Find(const std::string& key) const;
+
+  // Results are written to a temporary file and renamed, so concurrent runs
+  // never see partially written files
+  void Store(const std::string& key, const AffineTransformType* affine);
+
+protected:
+
+  RegistrationResultCache();
+  ~RegistrationResultCache() { }
+
+  std::string GetFileName(const std::string& key) const;
+
+private:
+  RegistrationResultCache(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  std::string m_Directory;
+
+};
+
+#ifndef MU_MANUAL_INSTANTIATION
+#include "RegistrationResultCache.txx"
+#endif
+
+#endif
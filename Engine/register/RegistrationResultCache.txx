@@ -0,0 +1,194 @@
+
+#ifndef _RegistrationResultCache_txx
+#define _RegistrationResultCache_txx
+
+#include "RegistrationResultCache.h"
+
+#include "itksys/MD5.h"
+#include "itksys/SystemTools.hxx"
+
+#include "PairRegistrationMethod.h"
+
+#include "muException.h"
+#include "muFile.h"
+
+#include <iomanip>
+#include <sstream>
+
+#if defined(_MSC_VER)
+#include <process.h>
+#define MU_GETPID _getpid
+#else
+#include <unistd.h>
+#define MU_GETPID getpid
+#endif
+
+// Changed whenever the registration changes enough to invalidate old results
+// 2: moment initialization, index to index sample mapping in the metrics
+#define MU_REGISTRATION_CACHE_VERSION "2"
+
+template <class TImage>
+RegistrationResultCache<TImage>
+::RegistrationResultCache()
+{
+  m_Directory = "";
+}
+
+template <class TImage>
+void
+RegistrationResultCache<TImage>
+::SetDirectory(const std::string& dir)
+{
+  m_Directory = dir;
+  if (m_Directory.length() != 0
+      &&
+      m_Directory[m_Directory.length()-1] != MU_DIR_SEPARATOR)
+    m_Directory += MU_DIR_SEPARATOR;
+
+  this->Modified();
+}
+
+template <class TImage>
+std::string
+RegistrationResultCache<TImage>
+::ComputeImageDigest(const ImageType* img)
+{
+  if (img == 0)
+    muExceptionMacro(<< "NULL image for digest");
+
+  typename ImageType::SizeType size =
+    img->GetLargestPossibleRegion().GetSize();
+
+  // Geometry as text, with enough digits to round trip
+  std::ostringstream oss;
+  oss << std::setprecision(17);
+  for (unsigned int i = 0; i < ImageType::ImageDimension; i++)
+    oss << size[i] << " ";
+  for (unsigned int i = 0; i < ImageType::ImageDimension; i++)
+    oss << img->GetSpacing()[i] << " ";
+  for (unsigned int i = 0; i < ImageType::ImageDimension; i++)
+    oss << img->GetOrigin()[i] << " ";
+  for (unsigned int i = 0; i < ImageType::ImageDimension; i++)
+    for (unsigned int j = 0; j < ImageType::ImageDimension; j++)
+      oss << img->GetDirection()[i][j] << " ";
+  oss << sizeof(PixelType);
+
+  std::string geom = oss.str();
+
+  itksysMD5* md5 = itksysMD5_New();
+  itksysMD5_Initialize(md5);
+
+  itksysMD5_Append(md5,
+    (const unsigned char*)geom.c_str(), (int)geom.length());
+
+  // Voxels in chunks, MD5 takes int lengths
+  const unsigned char* data =
+    (const unsigned char*)img->GetBufferPointer();
+  unsigned long numBytes =
+    img->GetBufferedRegion().GetNumberOfPixels() * sizeof(PixelType);
+
+  const unsigned long chunkSize = 1 << 24;
+  while (numBytes > 0)
+  {
+    unsigned long n = numBytes;
+    if (n > chunkSize)
+      n = chunkSize;
+    itksysMD5_Append(md5, data, (int)n);
+    data += n;
+    numBytes -= n;
+  }
+
+  char hex[33];
+  itksysMD5_FinalizeHex(md5, hex);
+  hex[32] = 0;
+
+  itksysMD5_Delete(md5);
+
+  return std::string(hex);
+}
+
+template <class TImage>
+std::string
+RegistrationResultCache<TImage>
+::ComputeKey(const std::string& fixedDigest,
+  const std::string& movingDigest, const std::string& settings)
+{
+  std::string s =
+    std::string(MU_REGISTRATION_CACHE_VERSION) + "|" +
+    fixedDigest + "|" + movingDigest + "|" + settings;
+
+  itksysMD5* md5 = itksysMD5_New();
+  itksysMD5_Initialize(md5);
+  itksysMD5_Append(md5, (const unsigned char*)s.c_str(), (int)s.length());
+
+  char hex[33];
+  itksysMD5_FinalizeHex(md5, hex);
+  hex[32] = 0;
+
+  itksysMD5_Delete(md5);
+
+  return std::string(hex);
+}
+
+template <class TImage>
+std::string
+RegistrationResultCache<TImage>
+::GetFileName(const std::string& key) const
+{
+  return m_Directory + key + std::string(".affine");
+}
+
+template <class TImage>
+typename RegistrationResultCache<TImage>::AffineTransformPointer
+RegistrationResultCache<TImage>
+::Find(const std::string& key) const
+{
+  if (m_Directory.length() == 0)
+    return 0;
+
+  std::string fn = this->GetFileName(key);
+
+  if (!itksys::SystemTools::FileExists(fn.c_str()))
+    return 0;
+
+  AffineTransformPointer affine;
+  try
+  {
+    affine = PairRegistrationMethod<PixelType>::ReadAffineTransform(fn.c_str());
+  }
+  catch (...)
+  {
+    return 0;
+  }
+
+  return affine;
+}
+
+template <class TImage>
+void
+RegistrationResultCache<TImage>
+::Store(const std::string& key, const AffineTransformType* affine)
+{
+  if (m_Directory.length() == 0 || affine == 0)
+    return;
+
+  if (!itksys::SystemTools::MakeDirectory(m_Directory.c_str()))
+    muExceptionMacro(<< "Failed creating " << m_Directory);
+
+  std::string fn = this->GetFileName(key);
+
+  // Temporary name unique to this process and transform
+  std::ostringstream tmposs;
+  tmposs << fn << "." << MU_GETPID() << "." << (const void*)affine << ".tmp";
+  std::string tmpfn = tmposs.str();
+
+  PairRegistrationMethod<PixelType>::WriteAffineTransform(tmpfn.c_str(), affine);
+
+  if (!itksys::SystemTools::RenameFile(tmpfn.c_str(), fn.c_str()))
+  {
+    itksys::SystemTools::RemoveFile(tmpfn.c_str());
+    muExceptionMacro(<< "Failed storing " << fn);
+  }
+}
+
+#endif
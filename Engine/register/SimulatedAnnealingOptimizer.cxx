@@ -29,7 +29,11 @@ SimulatedAnnealingOptimizer
   m_MinTemperature = 0.1;
   m_MaxTemperature = 10.0;
 
+  m_SwapInterval = 10;
+
   m_StopCondition = MaximumNumberOfIterations;
+
+  m_WorkerEvaluator = ParallelCostFunctionEvaluator::New();
 }
 
 SimulatedAnnealingOptimizer
@@ -55,6 +59,12 @@ SimulatedAnnealingOptimizer
 {
   InvokeEvent(itk::StartEvent());
 
+  if (m_WorkerEvaluator->GetNumberOfCostFunctions() > 1)
+  {
+    this->ParallelTempering();
+    return;
+  }
+
   unsigned int n = m_CostFunction->GetNumberOfParameters();
 
   unsigned int adjustIters = m_MaxIterations / 10;
@@ -67,10 +77,6 @@ SimulatedAnnealingOptimizer
   ParametersType p_curr = this->GetCurrentPosition();
   ParametersType p_min = p_curr;
 
-  ParametersType stepVars(n);
-  for (unsigned int i = 0; i < n; i++)
-    stepVars[i] = m_RandomWalkSteps[i]*m_RandomWalkSteps[i];
-
   m_Value = m_CostFunction->GetValue(p_curr);
 
   double v_curr = m_Value;
@@ -87,13 +93,13 @@ SimulatedAnnealingOptimizer
 
     // Random walk
     for (unsigned int i = 0; i < n; i++)
-      p_next[i] += 
-        (2.0*rng->GenerateUniformRealClosedInterval()-1.0) * stepVars[i];
-      //p_next[i] += rng->GenerateNormal(0.0, stepVars[i]);
+      p_next[i] +=
+        (2.0*rng->GenerateUniformRealClosedInterval()-1.0)
+        * m_RandomWalkSteps[i];
 
     double v_next = m_CostFunction->GetValue(p_next);
 
-    double acc = exp(K * (v_next - v_curr));
+    double acc = exp(-K * (v_next - v_curr));
     if (acc > 1.0)
       acc = 1.0;
 
@@ -115,7 +121,7 @@ SimulatedAnnealingOptimizer
       this->SetCurrentPosition(p_min);
     }
 
-    if ((iter % adjustIters) == 0)
+    if ((iter % adjustIters) == 0 && (T - stepT) >= m_MinTemperature)
     {
       T -= stepT;
       K = 1.0 / T;
@@ -133,3 +139,175 @@ SimulatedAnnealingOptimizer
 {
   InvokeEvent(itk::EndEvent());
 }
+
+void
+SimulatedAnnealingOptimizer
+::AddWorkerCostFunction(CostFunctionType* f)
+{
+  m_WorkerEvaluator->AddCostFunction(f);
+}
+
+void
+SimulatedAnnealingOptimizer
+::ClearWorkerCostFunctions()
+{
+  m_WorkerEvaluator->ClearCostFunctions();
+}
+
+void
+SimulatedAnnealingOptimizer
+::ParallelTempering()
+{
+  unsigned int numChains = m_WorkerEvaluator->GetNumberOfCostFunctions();
+
+  ParametersType p_init = this->GetCurrentPosition();
+
+  m_Value = m_CostFunction->GetValue(p_init);
+
+  MersenneTwisterRNG* rng = MersenneTwisterRNG::GetGlobalInstance();
+
+  double tmin = m_MinTemperature;
+  double tmax = m_MaxTemperature;
+  if (tmin <= 0.0)
+    tmin = 1e-4;
+  if (tmax < tmin)
+    tmax = tmin;
+
+  // Chains at geometrically spaced temperatures, each with its own random
+  // number generator seeded from the global one
+  std::vector<ChainType> chains(numChains);
+  for (unsigned int k = 0; k < numChains; k++)
+  {
+    ChainType& c = chains[k];
+    c.Temperature =
+      tmin * pow(tmax / tmin, (double)k / (double)(numChains-1));
+    c.Position = p_init;
+    c.Value = m_Value;
+    c.BestPosition = p_init;
+    c.BestValue = m_Value;
+    c.RNG = new MersenneTwisterRNG();
+    c.RNG->Initialize(rng->GenerateUniformInteger());
+  }
+
+  unsigned int swapInterval = m_SwapInterval;
+  if (swapInterval < 1)
+    swapInterval = 1;
+
+  TemperingThreadStruct* str = new TemperingThreadStruct;
+  str->Optimizer = this;
+  str->Chains = &chains;
+
+  m_CurrentIteration = 0;
+
+  try
+  {
+    while (m_CurrentIteration < m_MaxIterations)
+    {
+      unsigned int numSteps = swapInterval;
+      if (m_CurrentIteration + numSteps > m_MaxIterations)
+        numSteps = m_MaxIterations - m_CurrentIteration;
+
+      str->NumberOfSteps = numSteps;
+      m_WorkerEvaluator->Execute(_runChain, str);
+
+      m_CurrentIteration += numSteps;
+
+      // Exchange states of adjacent chains, alternating even and odd pairs
+      unsigned int start = (m_CurrentIteration / swapInterval) % 2;
+      for (unsigned int k = start; (k+1) < numChains; k += 2)
+      {
+        ChainType& c0 = chains[k];
+        ChainType& c1 = chains[k+1];
+
+        double acc = exp(
+          (1.0/c0.Temperature - 1.0/c1.Temperature) * (c0.Value - c1.Value));
+        if (acc > 1.0)
+          acc = 1.0;
+
+        if (rng->GenerateUniformRealOpenInterval() <= acc)
+        {
+          ParametersType tp = c0.Position;
+          c0.Position = c1.Position;
+          c1.Position = tp;
+
+          double tv = c0.Value;
+          c0.Value = c1.Value;
+          c1.Value = tv;
+        }
+      }
+
+      for (unsigned int k = 0; k < numChains; k++)
+      {
+        if (chains[k].BestValue < m_Value)
+        {
+          m_Value = chains[k].BestValue;
+          this->SetCurrentPosition(chains[k].BestPosition);
+        }
+      }
+
+      this->InvokeEvent(itk::IterationEvent());
+    }
+  }
+  catch (itk::ExceptionObject& e)
+  {
+    for (unsigned int k = 0; k < numChains; k++)
+      delete chains[k].RNG;
+    delete str;
+
+    m_StopCondition = MetricError;
+    this->StopOptimization();
+    throw e;
+  }
+
+  for (unsigned int k = 0; k < numChains; k++)
+    delete chains[k].RNG;
+  delete str;
+
+  m_StopCondition = MaximumNumberOfIterations;
+  this->StopOptimization();
+}
+
+void
+SimulatedAnnealingOptimizer
+::_runChain(unsigned int workerId, CostFunctionType* f, void* data)
+{
+  TemperingThreadStruct* str = static_cast<TemperingThreadStruct*>(data);
+
+  SimulatedAnnealingOptimizer* obj = str->Optimizer;
+
+  ChainType& c = (*str->Chains)[workerId];
+
+  unsigned int n = c.Position.GetSize();
+
+  double K = 1.0 / c.Temperature;
+
+  for (unsigned int iter = 0; iter < str->NumberOfSteps; iter++)
+  {
+    ParametersType p_next = c.Position;
+
+    // Random walk
+    for (unsigned int i = 0; i < n; i++)
+      p_next[i] +=
+        (2.0*c.RNG->GenerateUniformRealClosedInterval()-1.0)
+        * obj->m_RandomWalkSteps[i];
+
+    double v_next = f->GetValue(p_next);
+
+    // Metropolis acceptance for minimization
+    double acc = exp(-K * (v_next - c.Value));
+    if (acc > 1.0)
+      acc = 1.0;
+
+    if (c.RNG->GenerateUniformRealOpenInterval() <= acc)
+    {
+      c.Position = p_next;
+      c.Value = v_next;
+    }
+
+    if (c.Value < c.BestValue)
+    {
+      c.BestValue = c.Value;
+      c.BestPosition = c.Position;
+    }
+  }
+}
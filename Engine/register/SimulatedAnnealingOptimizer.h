@@ -6,8 +6,12 @@
 
 #include "itkSingleValuedNonLinearOptimizer.h"
 
+#include "ParallelCostFunctionEvaluator.h"
+
 #include <vector>
 
+class MersenneTwisterRNG;
+
 class SimulatedAnnealingOptimizer:
   public itk::SingleValuedNonLinearOptimizer
 {
@@ -55,13 +59,50 @@ public:
   void SetTemperatureRange(double tmin, double tmax)
   { m_MinTemperature = tmin; m_MaxTemperature = tmax; }
 
+  // Largest random walk step of each parameter, moves are uniform in
+  // [-step, step] for the serial walk and the tempering chains alike
   itkSetMacro(RandomWalkSteps, ParametersType);
 
+  // Independent copies of the cost function (each with its own transform),
+  // with two or more the optimizer runs parallel tempering: one chain per
+  // copy at temperatures spaced geometrically in the temperature range,
+  // adjacent chains exchange states every SwapInterval iterations
+  void AddWorkerCostFunction(CostFunctionType* f);
+  void ClearWorkerCostFunctions();
+  unsigned int GetNumberOfWorkerCostFunctions() const
+  { return m_WorkerEvaluator->GetNumberOfCostFunctions(); }
+
+  itkSetMacro(SwapInterval, unsigned int);
+  itkGetConstMacro(SwapInterval, unsigned int);
+
 protected:
 
   SimulatedAnnealingOptimizer();
   virtual ~SimulatedAnnealingOptimizer();
 
+  void ParallelTempering();
+
+  // State of one tempering chain
+  struct ChainType
+  {
+    double Temperature;
+    ParametersType Position;
+    double Value;
+    ParametersType BestPosition;
+    double BestValue;
+    MersenneTwisterRNG* RNG;
+  };
+
+  struct TemperingThreadStruct
+  {
+    SimulatedAnnealingOptimizer* Optimizer;
+    std::vector<ChainType>* Chains;
+    unsigned int NumberOfSteps;
+  };
+
+  static void _runChain(
+    unsigned int workerId, CostFunctionType* f, void* data);
+
 private:
 
   ParametersType m_RandomWalkSteps;
@@ -73,9 +114,13 @@ private:
 
   bool m_Verbose;
 
-  bool m_Temperature;
-  bool m_MinTemperature;
-  bool m_MaxTemperature;
+  double m_Temperature;
+  double m_MinTemperature;
+  double m_MaxTemperature;
+
+  unsigned int m_SwapInterval;
+
+  ParallelCostFunctionEvaluator::Pointer m_WorkerEvaluator;
 
   double m_Value;
 
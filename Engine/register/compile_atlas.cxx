@@ -0,0 +1,60 @@
+
+// Compile an atlas directory (template.mha, 1.mha, 2.mha, ...) into a single
+// memory mappable file, written to atlas.mua in the directory by default
+
+#include "itkOutputWindow.h"
+#include "itkTextOutput.h"
+
+#include "CompiledAtlas.h"
+#include "muException.h"
+#include "muFile.h"
+
+#include <iostream>
+#include <string>
+
+int
+main(int argc, char **argv)
+{
+
+  if (argc != 2 && argc != 3)
+  {
+    std::cerr << "Usage: " << argv[0];
+    std::cerr << " <atlas directory> [output file]" << std::endl;
+    return 1;
+  }
+
+  itk::OutputWindow::SetInstance(itk::TextOutput::New());
+
+  std::string atlasdir = argv[1];
+  if (atlasdir[atlasdir.size()-1] != MU_DIR_SEPARATOR)
+    atlasdir += MU_DIR_SEPARATOR;
+
+  std::string outfn = atlasdir + std::string(MU_COMPILED_ATLAS_NAME);
+  if (argc == 3)
+    outfn = argv[2];
+
+  try
+  {
+    std::cout << "Reading " << atlasdir << "..." << std::endl;
+    CompiledAtlas::Pointer atlas = CompiledAtlas::ReadDirectory(atlasdir);
+
+    std::cout << "Writing " << outfn << " with " << atlas->GetNumberOfPriors()
+      << " priors..." << std::endl;
+    atlas->Write(outfn.c_str());
+  }
+  catch (itk::ExceptionObject& exc)
+  {
+    std::cerr << "Exception caught!" << std::endl;
+    std::cerr << exc << std::endl;
+    return -1;
+  }
+  catch (mu::Exception& exc)
+  {
+    std::cerr << "Exception caught!" << std::endl;
+    std::cerr << exc << std::endl;
+    return -1;
+  }
+
+  return 0;
+
+}
@@ -81,6 +81,59 @@ EMSParametersXMLFileReader
   {
     m_PObject->SetOutputFormat(m_CurrentString);
   }
+  else if(itksys::SystemTools::Strucmp(name,"COMPRESS-LABELS") == 0)
+  {
+    unsigned int i = atoi(m_CurrentString.c_str());
+    m_PObject->SetCompressLabels(i != 0);
+  }
+  else if(itksys::SystemTools::Strucmp(name,"COMPRESS-POSTERIORS") == 0)
+  {
+    unsigned int i = atoi(m_CurrentString.c_str());
+    m_PObject->SetCompressPosteriors(i != 0);
+  }
+  else if(itksys::SystemTools::Strucmp(name,"COMPRESS-CORRECTED") == 0)
+  {
+    unsigned int i = atoi(m_CurrentString.c_str());
+    m_PObject->SetCompressCorrected(i != 0);
+  }
+  else if(itksys::SystemTools::Strucmp(name,"COMPRESS-REGISTERED") == 0)
+  {
+    unsigned int i = atoi(m_CurrentString.c_str());
+    m_PObject->SetCompressRegistered(i != 0);
+  }
+  else if(itksys::SystemTools::Strucmp(name,"COMPRESS-WARPED-TEMPLATE") == 0)
+  {
+    unsigned int i = atoi(m_CurrentString.c_str());
+    m_PObject->SetCompressWarpedTemplate(i != 0);
+  }
+  else if(itksys::SystemTools::Strucmp(name,"COMPRESS-DISPLACEMENT") == 0)
+  {
+    unsigned int i = atoi(m_CurrentString.c_str());
+    m_PObject->SetCompressDisplacement(i != 0);
+  }
+  else if(itksys::SystemTools::Strucmp(name,"POSTERIOR-FORMAT") == 0)
+  {
+    m_PObject->SetPosteriorFormat(m_CurrentString);
+  }
+  else if(itksys::SystemTools::Strucmp(name,"POSTERIOR-BITS") == 0)
+  {
+    int bits = atoi(m_CurrentString.c_str());
+    if (bits != 8 && bits != 16)
+      itkExceptionMacro(<< "Error: posterior bits must be 8 or 16");
+    m_PObject->SetPosteriorBits(bits);
+  }
+  else if(itksys::SystemTools::Strucmp(name,"EMBED-LABELS") == 0)
+  {
+    unsigned int i = atoi(m_CurrentString.c_str());
+    m_PObject->SetEmbedLabels(i != 0);
+  }
+  else if(itksys::SystemTools::Strucmp(name,"OUTPUT-WRITER-THREADS") == 0)
+  {
+    int n = atoi(m_CurrentString.c_str());
+    if (n < 0)
+      itkExceptionMacro(<< "Error: negative #output writer threads");
+    m_PObject->SetOutputWriterThreads(n);
+  }
   else if(itksys::SystemTools::Strucmp(name,"FILE") == 0)
   {
     m_LastFile = m_CurrentString;
@@ -116,6 +169,10 @@ EMSParametersXMLFileReader
       itkExceptionMacro(<< "Error: negative bias degree");
     m_PObject->SetMaxBiasDegree(degree);
   }
+  else if(itksys::SystemTools::Strucmp(name,"BIAS-CORRECTION-METHOD") == 0)
+  {
+    m_PObject->SetBiasCorrectionMethod(m_CurrentString);
+  }
   else if(itksys::SystemTools::Strucmp(name,"PRIOR") == 0)
   {
     double p = atof(m_CurrentString.c_str());
@@ -145,6 +202,18 @@ EMSParametersXMLFileReader
     double w = atof(m_CurrentString.c_str());
     m_PObject->SetAtlasWarpKernelWidth(w);
   }
+  else if(itksys::SystemTools::Strucmp(name,"DO-ATLAS-CROP") == 0)
+  {
+    unsigned int i = atoi(m_CurrentString.c_str());
+    m_PObject->SetDoAtlasCrop(i != 0);
+  }
+  else if(itksys::SystemTools::Strucmp(name,"ATLAS-CROP-PADDING") == 0)
+  {
+    double pad = atof(m_CurrentString.c_str());
+    if (pad < 0)
+      itkExceptionMacro(<< "Error: negative atlas crop padding");
+    m_PObject->SetAtlasCropPadding(pad);
+  }
   else if(itksys::SystemTools::Strucmp(name,"ATLAS-LINEAR-MAP-TYPE") == 0)
   {
     m_PObject->SetAtlasLinearMapType(m_CurrentString);
@@ -160,6 +229,18 @@ EMSParametersXMLFileReader
       itkExceptionMacro(<< "Error: #threads must be >= 1");
     m_PObject->SetNumberOfThreads(n);
   }
+  else if(itksys::SystemTools::Strucmp(name,"AFFINE-INITIALIZATION") == 0)
+  {
+    m_PObject->SetAffineInitialization(m_CurrentString);
+  }
+  else if(itksys::SystemTools::Strucmp(name,"AFFINE-METRIC") == 0)
+  {
+    m_PObject->SetAffineMetric(m_CurrentString);
+  }
+  else if(itksys::SystemTools::Strucmp(name,"REGISTRATION-CACHE-DIRECTORY") == 0)
+  {
+    m_PObject->SetRegistrationCacheDirectory(m_CurrentString);
+  }
 }
 
 void
@@ -239,6 +320,26 @@ EMSParametersXMLFileWriter
 
   WriteField<std::string>(this, "OUTPUT-FORMAT", p->GetOutputFormat(), output);
 
+  WriteField<bool>(this, "COMPRESS-LABELS", p->GetCompressLabels(), output);
+
+  WriteField<bool>(this, "COMPRESS-POSTERIORS", p->GetCompressPosteriors(), output);
+
+  WriteField<bool>(this, "COMPRESS-CORRECTED", p->GetCompressCorrected(), output);
+
+  WriteField<bool>(this, "COMPRESS-REGISTERED", p->GetCompressRegistered(), output);
+
+  WriteField<bool>(this, "COMPRESS-WARPED-TEMPLATE", p->GetCompressWarpedTemplate(), output);
+
+  WriteField<bool>(this, "COMPRESS-DISPLACEMENT", p->GetCompressDisplacement(), output);
+
+  WriteField<std::string>(this, "POSTERIOR-FORMAT", p->GetPosteriorFormat(), output);
+
+  WriteField<unsigned int>(this, "POSTERIOR-BITS", p->GetPosteriorBits(), output);
+
+  WriteField<bool>(this, "EMBED-LABELS", p->GetEmbedLabels(), output);
+
+  WriteField<unsigned int>(this, "OUTPUT-WRITER-THREADS", p->GetOutputWriterThreads(), output);
+
   // Write the list of images
   for (unsigned int k = 0; k < p->GetImages().GetSize(); k++)
   {
@@ -263,6 +364,8 @@ EMSParametersXMLFileWriter
 
   WriteField<unsigned int>(this, "MAX-BIAS-DEGREE", p->GetMaxBiasDegree(), output);
 
+  WriteField<std::string>(this, "BIAS-CORRECTION-METHOD", p->GetBiasCorrectionMethod(), output);
+
   std::vector<double> prWeights = p->GetPriorWeights();
   for (unsigned int i = 0; i < prWeights.size(); i++)
     WriteField<float>(this, "PRIOR", prWeights[i], output);
@@ -277,12 +380,22 @@ EMSParametersXMLFileWriter
 
   WriteField<float>(this, "ATLAS-WARP-KERNEL-WIDTH", p->GetAtlasWarpKernelWidth(), output);
 
+  WriteField<bool>(this, "DO-ATLAS-CROP", p->GetDoAtlasCrop(), output);
+
+  WriteField<float>(this, "ATLAS-CROP-PADDING", p->GetAtlasCropPadding(), output);
+
   WriteField<std::string>(this, "ATLAS-LINEAR-MAP-TYPE", p->GetAtlasLinearMapType(), output);
 
   WriteField<std::string>(this, "IMAGE-LINEAR-MAP-TYPE", p->GetImageLinearMapType(), output);
 
+  WriteField<std::string>(this, "AFFINE-INITIALIZATION", p->GetAffineInitialization(), output);
+
+  WriteField<std::string>(this, "AFFINE-METRIC", p->GetAffineMetric(), output);
+
   WriteField<unsigned int>(this, "NUMBER-OF-THREADS", p->GetNumberOfThreads(), output);
 
+  WriteField<std::string>(this, "REGISTRATION-CACHE-DIRECTORY", p->GetRegistrationCacheDirectory(), output);
+
   // Finish
   WriteEndElement("SEGMENTATION-PARAMETERS", output);
   output << std::endl;
@@ -4,22 +4,57 @@
 #include "itkOutputWindow.h"
 #include "itkTextOutput.h"
 
+#include "DynArray.h"
 #include "EMSParameters.h"
 #include "EMSParametersXMLFile.h"
 #include "runEMS.h"
 
 #include <exception>
+#include <fstream>
 #include <iostream>
+#include <string>
+
+#include <stdlib.h>
+#include <string.h>
 
 
 void
 printUsage(char* progname)
 {
   std::cerr << "Usage: " << progname << " <segfile> [options]" << std::endl;
+  std::cerr << "       " << progname << " --batch <listfile> [options]"
+    << std::endl;
   std::cerr << "Available options:" << std::endl;
   std::cerr << "--debug:\tdisplay debug messages" << std::endl;
   std::cerr << "--write-less:\tdon't write posteriors and filtered, bias corrected images";
   std::cerr << std::endl;
+  std::cerr << "Batch options (listfile has one segfile per line):" << std::endl;
+  std::cerr << "--concurrent-subjects <n>:\tnumber of subjects segmented at once"
+    << std::endl;
+  std::cerr << "--threads <n>:\ttotal number of threads, split between subjects"
+    << std::endl;
+}
+
+// Parameter files listed one per line, blank lines and lines starting with #
+// are skipped
+bool
+readBatchList(const char* fn, DynArray<std::string>& list)
+{
+  std::ifstream infile(fn);
+  if (infile.fail())
+    return false;
+
+  std::string line;
+  while (std::getline(infile, line))
+  {
+    std::string::size_type first = line.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos || line[first] == '#')
+      continue;
+    std::string::size_type last = line.find_last_not_of(" \t\r\n");
+    list.Append(line.substr(first, last-first+1));
+  }
+
+  return true;
 }
 
 int
@@ -39,12 +74,29 @@ main(int argc, char** argv)
   bool debugflag = false;
   bool writeflag = true;
 
-  for (int i = 2; i < argc; i++)
+  bool batchflag = (strcmp(argv[1], "--batch") == 0);
+  unsigned int numConcurrent = 1;
+  unsigned int numThreads = 0;
+
+  int firstOption = 2;
+  if (batchflag)
+  {
+    if (argc < 3)
+      validargs = false;
+    firstOption = 3;
+  }
+
+  for (int i = firstOption; i < argc; i++)
   {
     if (strcmp(argv[i], "--debug") == 0)
       debugflag = true;
     else if (strcmp(argv[i], "--write-less") == 0)
       writeflag = false;
+    else if (batchflag && strcmp(argv[i], "--concurrent-subjects") == 0
+        && i+1 < argc)
+      numConcurrent = (unsigned int)atoi(argv[++i]);
+    else if (batchflag && strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+      numThreads = (unsigned int)atoi(argv[++i]);
     else
       validargs = false;
   }
@@ -57,6 +109,42 @@ main(int argc, char** argv)
 
   itk::OutputWindow::SetInstance(itk::TextOutput::New());
 
+  if (batchflag)
+  {
+    DynArray<std::string> paramFiles;
+    if (!readBatchList(argv[2], paramFiles))
+    {
+      std::cerr << "Failed reading " << argv[2] << std::endl;
+      return -1;
+    }
+
+    unsigned int numFailures = 0;
+    try
+    {
+      numFailures = runEMSBatch(
+        paramFiles, debugflag, writeflag, numConcurrent, numThreads);
+    }
+    catch (itk::ExceptionObject& e)
+    {
+      std::cerr << e << std::endl;
+      return -1;
+    }
+    catch (std::exception& e)
+    {
+      std::cerr << "Exception: " << e.what() << std::endl;
+      return -1;
+    }
+
+    if (numFailures != 0)
+    {
+      std::cerr << numFailures << " of " << paramFiles.GetSize()
+        << " subjects failed" << std::endl;
+      return -1;
+    }
+
+    return 0;
+  }
+
   try
   {
     std::cout << "Reading " << argv[1] << "..." << std::endl;
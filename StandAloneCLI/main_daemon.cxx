@@ -0,0 +1,127 @@
+
+// Segmentation worker, runs the jobs submitted to a spool directory until a
+// file named stop is created in it, any number of workers on any hosts can
+// share the spool directory
+
+#include "mu.h"
+
+#include "itkOutputWindow.h"
+#include "itkTextOutput.h"
+
+#include "Log.h"
+#include "SegmentationDaemon.h"
+
+#include <exception>
+#include <iostream>
+#include <string>
+
+#include <stdlib.h>
+#include <string.h>
+
+void
+printUsage(char* progname)
+{
+  std::cerr << "Usage: " << progname << " <spool directory> [options]"
+    << std::endl;
+  std::cerr << "Submit jobs by moving segmentation parameter files into"
+    << " <spool directory>/incoming" << std::endl;
+  std::cerr << "Available options:" << std::endl;
+  std::cerr << "--debug:\tdisplay debug messages" << std::endl;
+  std::cerr << "--write-less:\tdon't write posteriors and filtered, bias corrected images";
+  std::cerr << std::endl;
+  std::cerr << "--concurrent-jobs <n>:\tnumber of jobs running at once"
+    << std::endl;
+  std::cerr << "--threads <n>:\ttotal number of threads, split between jobs"
+    << std::endl;
+  std::cerr << "--max-memory <MB>:\tlimit on the estimated memory of the running jobs"
+    << std::endl;
+  std::cerr << "--poll <seconds>:\tinterval between scans for new jobs"
+    << std::endl;
+  std::cerr << "--worker-id <id>:\tunique worker name, host name and process ID by default"
+    << std::endl;
+  std::cerr << "--heartbeat-timeout <seconds>:\treclaim jobs of workers silent for this long"
+    << std::endl;
+  std::cerr << "--per-job-outputs:\twrite results to <spool directory>/results/<job>"
+    << std::endl;
+  std::cerr << "--exit-when-idle:\tstop when no jobs are left" << std::endl;
+}
+
+int
+main(int argc, char** argv)
+{
+
+  if (argc < 2)
+  {
+    printUsage(argv[0]);
+    return -1;
+  }
+
+  SegmentationDaemon::Pointer daemon = SegmentationDaemon::New();
+
+  bool validargs = true;
+
+  for (int i = 2; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--debug") == 0)
+      daemon->DebugOn();
+    else if (strcmp(argv[i], "--write-less") == 0)
+      daemon->WriteMoreOutputsOff();
+    else if (strcmp(argv[i], "--concurrent-jobs") == 0 && i+1 < argc)
+      daemon->SetNumberOfConcurrentJobs((unsigned int)atoi(argv[++i]));
+    else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+      daemon->SetNumberOfThreads((unsigned int)atoi(argv[++i]));
+    else if (strcmp(argv[i], "--max-memory") == 0 && i+1 < argc)
+      daemon->SetMaximumMemory(atof(argv[++i]));
+    else if (strcmp(argv[i], "--poll") == 0 && i+1 < argc)
+      daemon->SetPollInterval(atof(argv[++i]));
+    else if (strcmp(argv[i], "--worker-id") == 0 && i+1 < argc)
+      daemon->SetWorkerID(argv[++i]);
+    else if (strcmp(argv[i], "--heartbeat-timeout") == 0 && i+1 < argc)
+      daemon->SetHeartbeatTimeout(atof(argv[++i]));
+    else if (strcmp(argv[i], "--per-job-outputs") == 0)
+      daemon->PerJobOutputsOn();
+    else if (strcmp(argv[i], "--exit-when-idle") == 0)
+      daemon->ExitWhenIdleOn();
+    else
+      validargs = false;
+  }
+
+  if (!validargs)
+  {
+    printUsage(argv[0]);
+    return -1;
+  }
+
+  itk::OutputWindow::SetInstance(itk::TextOutput::New());
+
+  try
+  {
+    daemon->SetSpoolDirectory(argv[1]);
+
+    // One log per worker
+    std::string logfn =
+      daemon->GetSpoolDirectory() + daemon->GetWorkerID() + ".log";
+    (mu::Log::GetInstance())->EchoOn();
+    (mu::Log::GetInstance())->SetOutputFileName(logfn);
+
+    daemon->Run();
+  }
+  catch (itk::ExceptionObject& e)
+  {
+    std::cerr << e << std::endl;
+    return -1;
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception: " << e.what() << std::endl;
+    return -1;
+  }
+  catch (...)
+  {
+    std::cerr << "Unknown exception" << std::endl;
+    return -1;
+  }
+
+  return 0;
+
+}
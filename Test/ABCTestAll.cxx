@@ -8,25 +8,99 @@
 #include "itkImageFileReader.h"
 #include "itkImageRegionIteratorWithIndex.h"
 
+#include "itksys/SystemTools.hxx"
+
 #include "EMSParameters.h"
 #include "runEMS.h"
 
+#include "ABCTests.h"
+
 #include <exception>
 #include <iostream>
 
 
+typedef int (*UnitTestFunction)(const std::string& outdir);
+
+struct UnitTestType
+{
+  const char* Name;
+  UnitTestFunction Function;
+};
+
+static UnitTestType _unitTests[] =
+{
+  {"BiasCorrector", testBiasCorrector},
+  {"MIGradient", testMIGradient},
+  {"BinIndexImageCache", testBinIndexImageCache},
+  {"RegistrationResultCache", testRegistrationResultCache},
+  {"AtlasCrop", testAtlasCrop},
+  {"MappedImageReader", testMappedImageReader},
+  {"SegmentationPipeline", testSegmentationPipeline},
+  {"CompiledAtlas", testCompiledAtlas},
+  {"HCMetric", testHCMetric},
+  {0, 0}
+};
+
 void
 printUsage(char* progname)
 {
   std::cerr << "Usage: " << progname << " <atlasdir> <datadir> <outdir>" << std::endl;
+  std::cerr << "       " << progname << " <test> <outdir>" << std::endl;
+  std::cerr << std::endl;
+  std::cerr << "Tests:";
+  for (unsigned int i = 0; _unitTests[i].Name != 0; i++)
+    std::cerr << " " << _unitTests[i].Name;
   std::cerr << std::endl;
 }
 
+static int
+runUnitTest(const std::string& name, const std::string& outdir)
+{
+  for (unsigned int i = 0; _unitTests[i].Name != 0; i++)
+  {
+    if (name.compare(_unitTests[i].Name) != 0)
+      continue;
+
+    std::cout << "Running test " << name << std::endl;
+
+    if (!itksys::SystemTools::MakeDirectory(outdir.c_str()))
+    {
+      std::cerr << "Failed creating " << outdir << std::endl;
+      return -1;
+    }
+
+    try
+    {
+      return (_unitTests[i].Function)(outdir);
+    }
+    catch (itk::ExceptionObject& e)
+    {
+      std::cerr << e << std::endl;
+    }
+    catch (std::exception& e)
+    {
+      std::cerr << "Exception: " << e.what() << std::endl;
+    }
+    catch (std::string& s)
+    {
+      std::cerr << "Exception: " << s << std::endl;
+    }
+    catch (...)
+    {
+      std::cerr << "Unknown exception" << std::endl;
+    }
+    return -1;
+  }
+
+  std::cerr << "Unknown test " << name << std::endl;
+  return -1;
+}
+
 int
 main(int argc, char** argv)
 {
 
-  if (argc != 4)
+  if (argc != 3 && argc != 4)
   {
     printUsage(argv[0]);
     return -1;
@@ -34,6 +108,9 @@ main(int argc, char** argv)
 
   itk::OutputWindow::SetInstance(itk::TextOutput::New());
 
+  if (argc == 3)
+    return runUnitTest(argv[1], argv[2]);
+
   std::string atlasdir = argv[1];
   std::string datadir = argv[2];
   std::string outdir = argv[3];
@@ -0,0 +1,134 @@
+
+#include "ABCTests.h"
+
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIteratorWithIndex.h"
+
+#include <math.h>
+
+static TestImageType::Pointer
+_allocateImage(unsigned int size)
+{
+  TestImageType::SizeType imgSize;
+  imgSize.Fill(size);
+
+  TestImageType::RegionType region;
+  region.SetSize(imgSize);
+
+  TestImageType::Pointer img = TestImageType::New();
+  img->SetRegions(region);
+  img->Allocate();
+  img->FillBuffer(0);
+
+  return img;
+}
+
+static double
+_clamp01(double x)
+{
+  if (x < 0.0)
+    return 0.0;
+  if (x > 1.0)
+    return 1.0;
+  return x;
+}
+
+// Class memberships at a voxel, in the order background, shell, sphere
+static void
+_phantomMemberships(unsigned int size, const TestImageType::IndexType& ind,
+  double* m)
+{
+  double halfSize = 0.5 * size;
+
+  double r1 = 0;
+  double r2 = 0;
+  for (unsigned int d = 0; d < 3; d++)
+  {
+    double x = (ind[d] - 0.5*(size-1)) / halfSize;
+    r1 += x*x;
+
+    // Inner sphere is off center, so the phantom has no symmetry
+    double y = x - (d == 0 ? 0.12 : (d == 1 ? -0.08 : 0.05));
+    r2 += y*y;
+  }
+  r1 = sqrt(r1);
+  r2 = sqrt(r2);
+
+  double w = 1.0 / halfSize;
+
+  m[2] = _clamp01((0.3 - r2) / w + 0.5);
+  m[1] = _clamp01((0.75 - r1) / w + 0.5) - m[2];
+  if (m[1] < 0)
+    m[1] = 0;
+  m[0] = 1.0 - m[1] - m[2];
+}
+
+TestImageType::Pointer
+createPhantomImage(unsigned int size, const double* means)
+{
+  TestImageType::Pointer img = _allocateImage(size);
+
+  double range = fabs(means[2] - means[0]);
+
+  itk::ImageRegionIteratorWithIndex<TestImageType> it(
+    img, img->GetLargestPossibleRegion());
+  for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+  {
+    TestImageType::IndexType ind = it.GetIndex();
+
+    double m[3];
+    _phantomMemberships(size, ind, m);
+
+    double v = 0;
+    for (unsigned int c = 0; c < 3; c++)
+      v += m[c] * means[c];
+
+    v += 0.02 * range * sin(1.3*ind[0]) * sin(0.7*ind[1] + 0.4)
+      * sin(1.1*ind[2] + 0.9);
+
+    it.Set(v);
+  }
+
+  return img;
+}
+
+TestImageType::Pointer
+createPhantomClass(unsigned int size, unsigned int c)
+{
+  TestImageType::Pointer img = _allocateImage(size);
+
+  itk::ImageRegionIteratorWithIndex<TestImageType> it(
+    img, img->GetLargestPossibleRegion());
+  for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+  {
+    double m[3];
+    _phantomMemberships(size, it.GetIndex(), m);
+    it.Set(m[c]);
+  }
+
+  return img;
+}
+
+double
+maxAbsDifference(const TestImageType* a, const TestImageType* b)
+{
+  if (a->GetLargestPossibleRegion().GetSize()
+      !=
+      b->GetLargestPossibleRegion().GetSize())
+    return HUGE_VAL;
+
+  itk::ImageRegionConstIterator<TestImageType> ita(
+    a, a->GetLargestPossibleRegion());
+  itk::ImageRegionConstIterator<TestImageType> itb(
+    b, b->GetLargestPossibleRegion());
+
+  double maxDiff = 0;
+  for (ita.GoToBegin(), itb.GoToBegin(); !ita.IsAtEnd(); ++ita, ++itb)
+  {
+    double d = fabs(ita.Get() - itb.Get());
+    if (d > maxDiff)
+      maxDiff = d;
+  }
+
+  return maxDiff;
+}
@@ -0,0 +1,40 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Unit tests run by ABCTestAll, selected by name on the command line
+//
+// Each test returns zero on success and prints what failed otherwise. The
+// images are small synthetic phantoms, so the tests need no data files.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _ABCTests_h
+#define _ABCTests_h
+
+#include "itkImage.h"
+
+#include <string>
+
+typedef itk::Image<float, 3> TestImageType;
+
+// Phantom of size^3 unit spaced voxels: an off center sphere (class 2) inside
+// a shell (class 1) surrounded by background (class 0), with a small smooth
+// texture added to the class means
+TestImageType::Pointer createPhantomImage(unsigned int size,
+  const double* means);
+
+// Membership of a phantom class, with a linear transition one voxel wide
+TestImageType::Pointer createPhantomClass(unsigned int size, unsigned int c);
+
+double maxAbsDifference(const TestImageType* a, const TestImageType* b);
+
+int testBiasCorrector(const std::string& outdir);
+int testMIGradient(const std::string& outdir);
+int testBinIndexImageCache(const std::string& outdir);
+int testRegistrationResultCache(const std::string& outdir);
+int testAtlasCrop(const std::string& outdir);
+int testMappedImageReader(const std::string& outdir);
+int testSegmentationPipeline(const std::string& outdir);
+int testCompiledAtlas(const std::string& outdir);
+int testHCMetric(const std::string& outdir);
+
+#endif
@@ -0,0 +1,148 @@
+
+// Multi-threaded diffusion bias correction against the single thread result,
+// and the corrected image against the unbiased phantom
+
+#include "ABCTests.h"
+
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIteratorWithIndex.h"
+
+#include "DiffusionBasedBiasCorrector.h"
+#include "DynArray.h"
+
+#include <iostream>
+
+#include <math.h>
+
+static const unsigned int _size = 32;
+
+// Smooth multiplicative bias varying along x and z
+static void
+_applyBias(TestImageType* img)
+{
+  itk::ImageRegionIteratorWithIndex<TestImageType> it(
+    img, img->GetLargestPossibleRegion());
+  for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+  {
+    TestImageType::IndexType ind = it.GetIndex();
+    double b = 1.0 + 0.2*sin(3.0*ind[0]/_size) - 0.15*cos(2.0*ind[2]/_size);
+    it.Set(it.Get() * b);
+  }
+}
+
+// Coefficient of variation over the voxels fully inside a phantom class,
+// does not depend on the overall scale of the corrected image
+static double
+_classVariation(const TestImageType* img, unsigned int c)
+{
+  TestImageType::Pointer member = createPhantomClass(_size, c);
+
+  itk::ImageRegionConstIterator<TestImageType> it(
+    img, img->GetLargestPossibleRegion());
+  itk::ImageRegionConstIterator<TestImageType> memberIt(
+    member, member->GetLargestPossibleRegion());
+
+  double sum = 0;
+  double sumSquares = 0;
+  double count = 0;
+  for (it.GoToBegin(), memberIt.GoToBegin(); !it.IsAtEnd(); ++it, ++memberIt)
+  {
+    if (memberIt.Get() < 0.99)
+      continue;
+    double v = it.Get();
+    sum += v;
+    sumSquares += v*v;
+    count += 1.0;
+  }
+
+  if (count < 2.0 || sum == 0)
+    return 0;
+
+  double mean = sum / count;
+  double var = sumSquares / count - mean*mean;
+  if (var < 0)
+    var = 0;
+
+  return sqrt(var) / fabs(mean);
+}
+
+static TestImageType::Pointer
+_correct(TestImageType* input, unsigned int numThreads)
+{
+  typedef DiffusionBasedBiasCorrector<TestImageType, TestImageType>
+    CorrectorType;
+
+  CorrectorType::Pointer corr = CorrectorType::New();
+  corr->SetMultiplicative();
+  corr->SetClampBias(true);
+  corr->SetMaximumBiasMagnitude(4.0);
+  corr->SetDiffusionIterations(10);
+  corr->SetNumberOfThreads(numThreads);
+
+  DynArray<TestImageType::Pointer> probs;
+  for (unsigned int c = 0; c < 3; c++)
+    probs.Append(createPhantomClass(_size, c));
+  corr->SetProbabilities(probs);
+
+  DynArray<TestImageType::Pointer> inputs;
+  inputs.Append(input);
+
+  DynArray<TestImageType::Pointer> outputs;
+  outputs.Append(TestImageType::New());
+
+  corr->CorrectImages(inputs, outputs);
+
+  return outputs[0];
+}
+
+int
+testBiasCorrector(const std::string&)
+{
+  double means[3] = {10.0, 100.0, 200.0};
+
+  TestImageType::Pointer phantom = createPhantomImage(_size, means);
+
+  TestImageType::Pointer img = createPhantomImage(_size, means);
+  _applyBias(img);
+
+  TestImageType::Pointer serial = _correct(img, 1);
+
+  // Slabs of uneven sizes, whatever the number of cores
+  TestImageType::Pointer parallel = _correct(img, 5);
+
+  double diff = maxAbsDifference(serial, parallel);
+  std::cout << "Max difference between 1 and 5 threads = " << diff
+    << std::endl;
+
+  // Only the order of the per-thread sums differs
+  if (diff > 1e-3)
+  {
+    std::cerr << "Multi-threaded correction differs from single thread"
+      << std::endl;
+    return -1;
+  }
+
+  // The unbiased phantom only varies by its texture within a class, the bias
+  // adds about ten percent. Background is left out, its values are too small
+  // for the relative variation to mean much.
+  bool ok = true;
+  for (unsigned int c = 1; c < 3; c++)
+  {
+    double truth = _classVariation(phantom, c);
+    double biased = _classVariation(img, c);
+    double corrected = _classVariation(serial, c);
+
+    std::cout << "Class " << c << " coefficient of variation: phantom "
+      << truth << ", biased " << biased << ", corrected " << corrected
+      << std::endl;
+
+    if (corrected > 0.5*biased)
+    {
+      std::cerr << "Bias field was not corrected in class " << c
+        << std::endl;
+      ok = false;
+    }
+  }
+
+  return ok ? 0 : -1;
+}
@@ -0,0 +1,147 @@
+
+// Bin index image cache: one global instance across threads, hits for the
+// same image and settings, misses after the image changes
+
+#include "ABCTests.h"
+
+#include "itkMultiThreader.h"
+
+#include "BinIndexImage.h"
+#include "NegativeMIImageMatchMetric.h"
+
+#include <iostream>
+
+static const unsigned int _size = 24;
+
+static BinIndexImageCache* _threadInstances[16];
+
+static ITK_THREAD_RETURN_TYPE
+_getInstanceThread(void* arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfoType;
+  ThreadInfoType* infoStruct = static_cast<ThreadInfoType*>(arg);
+
+  _threadInstances[infoStruct->ThreadID] =
+    BinIndexImageCache::GetGlobalInstance();
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+static bool
+_checkCounts(BinIndexImageCache* cache, const char* step,
+  unsigned long hits, unsigned long misses)
+{
+  std::cout << step << ": " << cache->GetNumberOfHits() << " hits, "
+    << cache->GetNumberOfMisses() << " misses" << std::endl;
+
+  if (cache->GetNumberOfHits() != hits || cache->GetNumberOfMisses() != misses)
+  {
+    std::cerr << step << ": expected " << hits << " hits and " << misses
+      << " misses" << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+static void
+_mapImages(TestImageType* fixedImg, TestImageType* movingImg,
+  unsigned int numBins)
+{
+  typedef NegativeMIImageMatchMetric<TestImageType, TestImageType> MetricType;
+
+  MetricType::Pointer metric = MetricType::New();
+  metric->SetNumberOfBins(numBins);
+  metric->SetFixedImage(fixedImg);
+  metric->SetMovingImage(movingImg);
+}
+
+int
+testBinIndexImageCache(const std::string&)
+{
+  // First use from many threads at once, every thread must get the same cache
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads(16);
+  unsigned int numThreads = threader->GetNumberOfThreads();
+  for (unsigned int t = 0; t < 16; t++)
+    _threadInstances[t] = 0;
+  threader->SetSingleMethod(_getInstanceThread, 0);
+  threader->SingleMethodExecute();
+
+  BinIndexImageCache* cache = BinIndexImageCache::GetGlobalInstance();
+  for (unsigned int t = 0; t < numThreads; t++)
+    if (_threadInstances[t] != cache)
+    {
+      std::cerr << "Thread " << t << " got a different cache instance"
+        << std::endl;
+      return -1;
+    }
+
+  double fixedMeans[3] = {10.0, 100.0, 200.0};
+  double movingMeans[3] = {50.0, 180.0, 90.0};
+
+  TestImageType::Pointer fixedImg = createPhantomImage(_size, fixedMeans);
+  TestImageType::Pointer movingImg = createPhantomImage(_size, movingMeans);
+
+  cache->Clear();
+  unsigned long hits = cache->GetNumberOfHits();
+  unsigned long misses = cache->GetNumberOfMisses();
+
+  // Both images are quantized the first time
+  _mapImages(fixedImg, movingImg, 32);
+  misses += 2;
+  if (!_checkCounts(cache, "First metric", hits, misses))
+    return -1;
+
+  // And reused by the next metric
+  _mapImages(fixedImg, movingImg, 32);
+  hits += 2;
+  if (!_checkCounts(cache, "Second metric", hits, misses))
+    return -1;
+
+  // Other settings do not match
+  _mapImages(fixedImg, movingImg, 64);
+  misses += 2;
+  if (!_checkCounts(cache, "Other number of bins", hits, misses))
+    return -1;
+
+  // Nor does a modified image
+  fixedImg->Modified();
+  _mapImages(fixedImg, movingImg, 32);
+  hits++;
+  misses++;
+  if (!_checkCounts(cache, "Modified fixed image", hits, misses))
+    return -1;
+
+  // Entries are shared, not copied
+  BinIndexImage::Pointer a = cache->Find(movingImg, 32, 4.0,
+    BinIndexImageCache::LinearMapping, false);
+  BinIndexImage::Pointer b = cache->Find(movingImg, 32, 4.0,
+    BinIndexImageCache::LinearMapping, false);
+  hits += 2;
+  if (!_checkCounts(cache, "Direct lookups", hits, misses))
+    return -1;
+  if (a.IsNull() || a.GetPointer() != b.GetPointer())
+  {
+    std::cerr << "Cached bins are not shared" << std::endl;
+    return -1;
+  }
+
+  // Least recently used entries go first
+  cache->SetMaximumNumberOfEntries(1);
+  BinIndexImage::Pointer c = cache->Find(fixedImg, 32, 4.0,
+    BinIndexImageCache::LinearMapping, false);
+  misses++;
+  if (!_checkCounts(cache, "After eviction", hits, misses))
+    return -1;
+  if (!c.IsNull())
+  {
+    std::cerr << "Evicted entry still found" << std::endl;
+    return -1;
+  }
+
+  cache->SetMaximumNumberOfEntries(16);
+  cache->Clear();
+
+  return 0;
+}
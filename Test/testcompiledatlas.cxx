@@ -0,0 +1,77 @@
+
+// Compiled atlas container: a written and mapped atlas gives back the
+// template, the normalized priors and the levels, and mapped images stay
+// valid after the atlas is closed and released
+
+#include "ABCTests.h"
+
+#include "CompiledAtlas.h"
+#include "DynArray.h"
+
+#include <iostream>
+
+static const unsigned int _size = 24;
+
+static bool
+_check(bool ok, const char* what)
+{
+  std::cout << what << ": " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+
+int
+testCompiledAtlas(const std::string& outdir)
+{
+  bool ok = true;
+
+  double means[3] = {10.0, 100.0, 200.0};
+
+  TestImageType::Pointer templateImg = createPhantomImage(_size, means);
+
+  DynArray<CompiledAtlas::FloatImagePointer> priors;
+  for (unsigned int c = 0; c < 3; c++)
+    priors.Append(createPhantomClass(_size, c));
+
+  DynArray<CompiledAtlas::ShrinkFactorsType> levelFactors;
+  CompiledAtlas::ShrinkFactorsType factors;
+  factors.Fill(2);
+  levelFactors.Append(factors);
+
+  CompiledAtlas::Pointer compiled =
+    CompiledAtlas::Compile(templateImg, priors, levelFactors);
+
+  std::string fn = outdir + "/" + MU_COMPILED_ATLAS_NAME;
+  compiled->Write(fn.c_str());
+
+  CompiledAtlas::Pointer mapped = CompiledAtlas::New();
+  mapped->Open(fn.c_str());
+
+  ok &= _check(mapped->IsMapped(), "Atlas is mapped");
+  ok &= _check(mapped->GetNumberOfPriors() == compiled->GetNumberOfPriors()
+    &&
+    mapped->GetNumberOfTemplateLevels() == 1,
+    "Same number of priors and levels");
+
+  ok &= _check(
+    maxAbsDifference(mapped->GetTemplate(), compiled->GetTemplate()) == 0,
+    "Mapped template");
+
+  // Images taken from the atlas outlive it
+  CompiledAtlas::FloatImagePointer mappedTemplate = mapped->GetTemplate();
+  CompiledAtlas::FloatImagePointer mappedPrior = mapped->GetPrior(1);
+  CompiledAtlas::FloatImagePointer mappedLevel = mapped->GetTemplateLevel(0);
+
+  mapped->Close();
+  ok &= _check(!mapped->IsMapped(), "Atlas closed");
+  mapped = 0;
+
+  ok &= _check(
+    maxAbsDifference(mappedTemplate, compiled->GetTemplate()) == 0
+    &&
+    maxAbsDifference(mappedPrior, compiled->GetPrior(1)) == 0
+    &&
+    maxAbsDifference(mappedLevel, compiled->GetTemplateLevel(0)) == 0,
+    "Images valid after the atlas is released");
+
+  return ok ? 0 : -1;
+}
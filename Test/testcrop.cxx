@@ -0,0 +1,240 @@
+
+// Atlas crop: the crop region is the padded bounding box of the priors,
+// cropping then restoring gives back the original voxels and geometry
+
+#include "ABCTests.h"
+
+#include "itkImageRegionConstIteratorWithIndex.h"
+
+#include "AtlasCropImageSource.h"
+#include "DynArray.h"
+
+#include <iostream>
+
+#include <math.h>
+
+static const unsigned int _size = 24;
+
+typedef itk::Image<unsigned char, 3> ByteImageType;
+
+typedef AtlasCropImageSource<TestImageType, TestImageType> CropperType;
+
+static bool
+_check(bool ok, const char* what)
+{
+  std::cout << what << ": " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+
+static void
+_setGeometry(itk::ImageBase<3>* img)
+{
+  TestImageType::SpacingType spacing;
+  spacing[0] = 1.0;
+  spacing[1] = 1.0;
+  spacing[2] = 1.5;
+  img->SetSpacing(spacing);
+
+  TestImageType::PointType origin;
+  origin[0] = -10.0;
+  origin[1] = 5.0;
+  origin[2] = 3.0;
+  img->SetOrigin(origin);
+}
+
+// Same region and physical geometry, the voxels are not compared
+template <class TImage>
+static bool
+_sameGeometry(const itk::ImageBase<3>* a, const TImage* b)
+{
+  if (a->GetLargestPossibleRegion() != b->GetLargestPossibleRegion())
+    return false;
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    if (fabs(a->GetOrigin()[i] - b->GetOrigin()[i]) > 1e-9)
+      return false;
+    if (fabs(a->GetSpacing()[i] - b->GetSpacing()[i]) > 1e-9)
+      return false;
+  }
+  return a->GetDirection() == b->GetDirection();
+}
+
+// Crop info against the bounding box of the nonzero voxels, padded and
+// clipped to the image
+static bool
+_checkCropInfo(CropperType* cropper, const TestImageType* prior,
+  const long* padding)
+{
+  TestImageType::IndexType lower;
+  TestImageType::IndexType upper;
+  lower.Fill(_size);
+  upper.Fill(-1);
+
+  itk::ImageRegionConstIteratorWithIndex<TestImageType> it(
+    prior, prior->GetLargestPossibleRegion());
+  for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+  {
+    if (it.Get() <= 0)
+      continue;
+    TestImageType::IndexType ind = it.GetIndex();
+    for (unsigned int i = 0; i < 3; i++)
+    {
+      if (ind[i] < lower[i])
+        lower[i] = ind[i];
+      if (ind[i] > upper[i])
+        upper[i] = ind[i];
+    }
+  }
+
+  const CropperType::CropInfoType& info = cropper->GetCropInfo();
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    long lo = lower[i] - padding[i];
+    if (lo < 0)
+      lo = 0;
+    long hi = upper[i] + padding[i];
+    if (hi > (long)_size-1)
+      hi = _size-1;
+
+    if (info.offset[i] != lo
+        ||
+        (long)info.cropped_size[i] != hi - lo + 1
+        ||
+        info.original_size[i] != _size)
+      return false;
+  }
+
+  return true;
+}
+
+int
+testAtlasCrop(const std::string&)
+{
+  bool ok = true;
+
+  double means[3] = {10.0, 100.0, 200.0};
+
+  TestImageType::Pointer img = createPhantomImage(_size, means);
+  _setGeometry(img);
+
+  // The inner sphere only, the other classes reach the image border
+  DynArray<TestImageType::Pointer> probs;
+  TestImageType::Pointer prior = createPhantomClass(_size, 2);
+  _setGeometry(prior);
+  probs.Append(prior);
+
+  // Padding in mm, 3 voxels along x and y and 2 along z
+  CropperType::Pointer cropper = CropperType::New();
+  cropper->SetPadding(3.0);
+  cropper->UseProbabilities(probs);
+
+  long padding[3] = {3, 3, 2};
+  ok &= _check(_checkCropInfo(cropper, prior, padding),
+    "Crop region is the padded bounding box");
+
+  // Padding beyond the image is clipped
+  CropperType::Pointer wideCropper = CropperType::New();
+  wideCropper->SetPadding(12.0);
+  wideCropper->UseProbabilities(probs);
+
+  long widePadding[3] = {12, 12, 8};
+  ok &= _check(_checkCropInfo(wideCropper, prior, widePadding),
+    "Crop region clipped to the image");
+
+  const CropperType::CropInfoType& info = cropper->GetCropInfo();
+
+  double fraction = cropper->GetCroppedFraction();
+  ok &= _check(fraction > 0.0 && fraction < 1.0, "Crop region is smaller");
+
+  // Cropping keeps the physical position of the voxels
+  TestImageType::Pointer cropped = cropper->Crop(img);
+
+  TestImageType::PointType croppedOrigin;
+  img->TransformIndexToPhysicalPoint(info.offset, croppedOrigin);
+  bool originOk = true;
+  for (unsigned int i = 0; i < 3; i++)
+    if (fabs(cropped->GetOrigin()[i] - croppedOrigin[i]) > 1e-9)
+      originOk = false;
+  ok &= _check(originOk, "Cropped origin at the crop offset");
+
+  // Restored without the original, zero outside the crop region
+  TestImageType::Pointer restored = cropper->Restore(cropped);
+  ok &= _check(_sameGeometry(img, restored.GetPointer()),
+    "Restored geometry matches the original");
+
+  TestImageType::RegionType cropRegion;
+  cropRegion.SetIndex(info.offset);
+  cropRegion.SetSize(info.cropped_size);
+
+  bool restoredOk = true;
+  itk::ImageRegionConstIteratorWithIndex<TestImageType> restIt(
+    restored, restored->GetLargestPossibleRegion());
+  for (restIt.GoToBegin(); !restIt.IsAtEnd(); ++restIt)
+  {
+    TestImageType::IndexType ind = restIt.GetIndex();
+    float expected = 0;
+    if (cropRegion.IsInside(ind))
+      expected = img->GetPixel(ind);
+    if (restIt.Get() != expected)
+      restoredOk = false;
+  }
+  ok &= _check(restoredOk, "Restored voxels, zero outside the crop region");
+
+  // Restored over the original, exact round trip
+  TestImageType::Pointer roundTrip =
+    cropper->RestoreImage<TestImageType>(cropped, img);
+  ok &= _check(maxAbsDifference(img, roundTrip) == 0,
+    "Restored over the original");
+
+  // Other pixel types with the same geometry, e.g. labels
+  ByteImageType::Pointer labels = ByteImageType::New();
+  labels->SetRegions(img->GetLargestPossibleRegion());
+  labels->CopyInformation(img);
+  labels->Allocate();
+  {
+    unsigned long n = labels->GetBufferedRegion().GetNumberOfPixels();
+    for (unsigned long i = 0; i < n; i++)
+      labels->GetBufferPointer()[i] = (unsigned char)(i % 251);
+  }
+
+  ByteImageType::Pointer croppedLabels =
+    cropper->CropImage<ByteImageType>(labels);
+  ByteImageType::Pointer restoredLabels =
+    cropper->RestoreImage<ByteImageType>(croppedLabels, labels);
+
+  bool labelsOk =
+    _sameGeometry(labels.GetPointer(), restoredLabels.GetPointer());
+  if (labelsOk)
+  {
+    unsigned long n = labels->GetBufferedRegion().GetNumberOfPixels();
+    for (unsigned long i = 0; i < n; i++)
+      if (labels->GetBufferPointer()[i]
+          != restoredLabels->GetBufferPointer()[i])
+        labelsOk = false;
+  }
+  ok &= _check(labelsOk, "Label image round trip");
+
+  // The crop info alone reproduces the crop
+  CropperType::Pointer other = CropperType::New();
+  other->SetCropInfo(info);
+  TestImageType::Pointer otherCropped = other->Crop(img);
+  ok &= _check(
+    _sameGeometry(cropped.GetPointer(), otherCropped.GetPointer())
+    &&
+    maxAbsDifference(cropped, otherCropped) == 0,
+    "Crop from saved crop info");
+
+  // Images of another size are rejected
+  bool thrown = false;
+  try
+  {
+    cropper->Restore(img);
+  }
+  catch (itk::ExceptionObject&)
+  {
+    thrown = true;
+  }
+  ok &= _check(thrown, "Size mismatch throws");
+
+  return ok ? 0 : -1;
+}
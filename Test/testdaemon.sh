@@ -0,0 +1,132 @@
+#!/bin/sh
+#
+# Segmentation workers sharing a spool directory: three workers run a batch
+# of jobs, one of them is killed in the middle of a job, every job has to end
+# up in done/ or failed/ exactly once
+#
+# Usage: testdaemon.sh <daemon> <atlasdir> <datadir> <outdir>
+
+if [ $# -ne 4 ]; then
+  echo "Usage: $0 <daemon> <atlasdir> <datadir> <outdir>" 1>&2
+  exit 1
+fi
+
+daemon=$1
+atlasdir=$2
+datadir=$3
+spool=$4/spool
+
+numjobs=6
+
+rm -rf "$spool"
+mkdir -p "$spool/incoming" || exit 1
+
+# Jobs are written elsewhere and moved in, as clients are expected to
+writejob()
+{
+  cat > "$spool/$1" << EOF
+<?xml version="1.0"?>
+<!DOCTYPE SEGMENTATION-PARAMETERS>
+<SEGMENTATION-PARAMETERS>
+<SUFFIX>seg</SUFFIX>
+<ATLAS-DIRECTORY>$atlasdir</ATLAS-DIRECTORY>
+<ATLAS-ORIENTATION>RAI</ATLAS-ORIENTATION>
+<OUTPUT-DIRECTORY>$spool/unused</OUTPUT-DIRECTORY>
+<OUTPUT-FORMAT>Meta</OUTPUT-FORMAT>
+<IMAGE>
+  <FILE>$2</FILE>
+  <ORIENTATION>RAI</ORIENTATION>
+</IMAGE>
+<FILTER-ITERATIONS>10</FILTER-ITERATIONS>
+<MAX-BIAS-DEGREE>2</MAX-BIAS-DEGREE>
+<PRIOR>1</PRIOR>
+<PRIOR>1</PRIOR>
+<PRIOR>1</PRIOR>
+<DO-ATLAS-WARP>0</DO-ATLAS-WARP>
+</SEGMENTATION-PARAMETERS>
+EOF
+  mv "$spool/$1" "$spool/incoming/$1"
+}
+
+jobs=""
+i=1
+while [ $i -le $numjobs ]; do
+  writejob "$i-job$i.xml" "$datadir/testimage_1.mha"
+  jobs="$jobs $i-job$i.xml"
+  i=`expr $i + 1`
+done
+
+# Fails when claimed, its image does not exist
+writejob "bad.xml" "$datadir/missing.mha"
+jobs="$jobs bad.xml"
+
+options="--poll 0.2 --heartbeat-timeout 3 --threads 1 --per-job-outputs --exit-when-idle --write-less"
+
+"$daemon" "$spool" --worker-id w1 $options > "$4/w1.out" 2>&1 &
+pid1=$!
+"$daemon" "$spool" --worker-id w2 $options > "$4/w2.out" 2>&1 &
+pid2=$!
+"$daemon" "$spool" --worker-id w3 $options > "$4/w3.out" 2>&1 &
+pid3=$!
+
+# Kill the first worker once it is running a job, give up after a minute
+killed=0
+t=0
+while [ $t -lt 600 ]; do
+  if ls "$spool/running/w1/"*.xml > /dev/null 2>&1; then
+    kill -9 $pid1
+    killed=1
+    break
+  fi
+  if ! kill -0 $pid1 2> /dev/null; then
+    break
+  fi
+  sleep 0.1 2> /dev/null || sleep 1
+  t=`expr $t + 1`
+done
+
+if [ $killed -eq 0 ]; then
+  echo "Worker w1 never ran a job" 1>&2
+  kill $pid1 $pid2 $pid3 2> /dev/null
+  exit 1
+fi
+wait $pid1 2> /dev/null
+
+# The others reclaim its job and stop when all jobs are finished
+wait $pid2
+wait $pid3
+
+status=0
+
+for job in $jobs; do
+  n=0
+  [ -f "$spool/done/$job" ] && n=`expr $n + 1`
+  [ -f "$spool/failed/$job" ] && n=`expr $n + 1`
+  [ -f "$spool/incoming/$job" ] && n=`expr $n + 1`
+  for dir in "$spool/running/"*; do
+    [ -f "$dir/$job" ] && n=`expr $n + 1`
+  done
+  if [ $n -ne 1 ]; then
+    echo "Job $job found $n times" 1>&2
+    status=1
+  elif [ ! -f "$spool/done/$job" ] && [ ! -f "$spool/failed/$job" ]; then
+    echo "Job $job did not finish" 1>&2
+    status=1
+  fi
+done
+
+if [ ! -f "$spool/failed/bad.xml" ]; then
+  echo "Invalid job did not fail" 1>&2
+  status=1
+fi
+
+if ! grep -q "reclaimed from w1" "$spool/status/"*.status; then
+  echo "No job was reclaimed from w1" 1>&2
+  status=1
+fi
+
+if [ $status -eq 0 ]; then
+  echo "All $numjobs jobs and the invalid one finished exactly once"
+fi
+
+exit $status
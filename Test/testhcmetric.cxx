@@ -0,0 +1,106 @@
+
+// Havrda-Charvat metric: the histogram and value filled by several threads
+// match a single thread run
+
+#include "ABCTests.h"
+
+#include "itkAffineTransform.h"
+
+#include "NegativeHCImageMatchMetric.h"
+
+#include <iostream>
+
+#include <math.h>
+
+static const unsigned int _size = 24;
+
+typedef NegativeHCImageMatchMetric<TestImageType, TestImageType> MetricType;
+
+static MetricType::Pointer
+_createMetric(const TestImageType* fixedImg, const TestImageType* movingImg,
+  MetricType::TransformType* transform, unsigned int numThreads)
+{
+  MetricType::Pointer metric = MetricType::New();
+  metric->SetNumberOfBins(32);
+  metric->SetNumberOfHistogramThreads(numThreads);
+  metric->SetSampleSpacing(2.0);
+
+  metric->SetFixedImage(fixedImg);
+  metric->SetMovingImage(movingImg);
+  metric->SetTransform(transform);
+
+  return metric;
+}
+
+int
+testHCMetric(const std::string&)
+{
+  typedef itk::AffineTransform<double, 3> TransformType;
+
+  double fixedMeans[3] = {10.0, 100.0, 200.0};
+  double movingMeans[3] = {50.0, 180.0, 90.0};
+
+  TestImageType::Pointer fixedImg = createPhantomImage(_size, fixedMeans);
+  TestImageType::Pointer movingImg = createPhantomImage(_size, movingMeans);
+
+  TransformType::Pointer affine = TransformType::New();
+
+  TransformType::InputPointType center;
+  center.Fill(0.5*(_size-1));
+  affine->SetCenter(center);
+
+  // Identity and a rotated, scaled and shifted transform
+  TransformType::ParametersType params[2];
+  params[0] = affine->GetParameters();
+  params[1] = params[0];
+  double a = 0.1;
+  params[1][0] = 1.05*cos(a);
+  params[1][1] = -sin(a);
+  params[1][3] = sin(a);
+  params[1][4] = 0.97*cos(a);
+  params[1][9] = 1.3;
+  params[1][10] = -0.8;
+  params[1][11] = 2.1;
+
+  MetricType::Pointer serial = _createMetric(fixedImg, movingImg, affine, 1);
+
+  // Also more threads than the 12 sample planes
+  unsigned int threadCounts[] = {2, 3, 5, 16};
+
+  bool ok = true;
+
+  for (unsigned int j = 0; j < 2; j++)
+  {
+    double v1 = serial->GetValue(params[j]);
+    MetricType::HistogramType H1 = serial->GetHistogram();
+
+    for (unsigned int k = 0; k < 4; k++)
+    {
+      MetricType::Pointer threaded =
+        _createMetric(fixedImg, movingImg, affine, threadCounts[k]);
+
+      double vt = threaded->GetValue(params[j]);
+      const MetricType::HistogramType& Ht = threaded->GetHistogram();
+
+      double maxDiff = 0;
+      for (unsigned int r = 0; r < H1.rows(); r++)
+        for (unsigned int c = 0; c < H1.cols(); c++)
+          if (fabs(H1(r, c) - Ht(r, c)) > maxDiff)
+            maxDiff = fabs(H1(r, c) - Ht(r, c));
+
+      std::cout << "Transform " << j << ", " << threadCounts[k]
+        << " threads: value " << vt << " (one thread " << v1
+        << "), max histogram difference " << maxDiff << std::endl;
+
+      // Partial sums are added in another order
+      if (maxDiff > 1e-12 || fabs(vt - v1) > 1e-9*fabs(v1))
+      {
+        std::cerr << "Threaded HC histogram differs from one thread"
+          << std::endl;
+        ok = false;
+      }
+    }
+  }
+
+  return ok ? 0 : -1;
+}
@@ -0,0 +1,164 @@
+
+// Mapped image reads against ImageFileReader for MetaImage and NRRD files,
+// files that can not be mapped are read the usual way
+
+#include "ABCTests.h"
+
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+
+#include "MappedImageReader.h"
+
+#include <iostream>
+
+#include <math.h>
+
+static const unsigned int _size = 20;
+
+typedef itk::Image<short, 3> ShortImageType;
+
+static bool
+_check(bool ok, const std::string& what)
+{
+  std::cout << what << ": " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+
+template <class TImage>
+static void
+_writeImage(const TImage* img, const std::string& fn, bool compress)
+{
+  typedef itk::ImageFileWriter<TImage> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetInput(img);
+  writer->SetFileName(fn.c_str());
+  writer->SetUseCompression(compress);
+  writer->Update();
+}
+
+static TestImageType::Pointer
+_readImage(const std::string& fn)
+{
+  typedef itk::ImageFileReader<TestImageType> ReaderType;
+  ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(fn.c_str());
+  reader->Update();
+  return reader->GetOutput();
+}
+
+// Same voxels and geometry, up to the precision of the header text
+static bool
+_sameImage(const TestImageType* a, const TestImageType* b)
+{
+  if (maxAbsDifference(a, b) != 0)
+    return false;
+
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    if (fabs(a->GetOrigin()[i] - b->GetOrigin()[i]) > 1e-5)
+      return false;
+    if (fabs(a->GetSpacing()[i] - b->GetSpacing()[i]) > 1e-5)
+      return false;
+    for (unsigned int j = 0; j < 3; j++)
+      if (fabs(a->GetDirection()[i][j] - b->GetDirection()[i][j]) > 1e-5)
+        return false;
+  }
+
+  return true;
+}
+
+int
+testMappedImageReader(const std::string& outdir)
+{
+  typedef MappedImageReader<TestImageType> MappedReaderType;
+
+  bool ok = true;
+
+  double means[3] = {10.0, 100.0, 200.0};
+
+  // Oblique, anisotropic and off the origin, to check the geometry
+  TestImageType::Pointer img = createPhantomImage(_size, means);
+  {
+    TestImageType::SpacingType spacing;
+    spacing[0] = 0.9;
+    spacing[1] = 1.1;
+    spacing[2] = 2.0;
+    img->SetSpacing(spacing);
+
+    TestImageType::PointType origin;
+    origin[0] = -12.5;
+    origin[1] = 30.25;
+    origin[2] = 4.0;
+    img->SetOrigin(origin);
+
+    double a = 0.3;
+    TestImageType::DirectionType direction;
+    direction.SetIdentity();
+    direction[0][0] = cos(a);
+    direction[0][1] = -sin(a);
+    direction[1][0] = sin(a);
+    direction[1][1] = cos(a);
+    img->SetDirection(direction);
+  }
+
+  // Uncompressed files are mapped and match what ITK reads
+  const char* extensions[] = {".mha", ".mhd", ".nrrd", 0};
+  for (unsigned int k = 0; extensions[k] != 0; k++)
+  {
+    std::string fn = outdir + "/mapped" + extensions[k];
+    _writeImage<TestImageType>(img, fn, false);
+
+    TestImageType::Pointer reference = _readImage(fn);
+    TestImageType::Pointer mapped = MappedReaderType::MapImage(fn);
+
+    ok &= _check(!mapped.IsNull(),
+      std::string("Mapped ") + extensions[k]);
+    if (mapped.IsNull())
+      continue;
+
+    ok &= _check(_sameImage(reference, mapped),
+      std::string("Mapped ") + extensions[k] + " matches ImageFileReader");
+
+    // Copy on write, changing the image leaves the file alone
+    mapped->FillBuffer(-1.0f);
+    ok &= _check(_sameImage(reference, _readImage(fn)),
+      std::string("Writing to mapped ") + extensions[k]
+      + " leaves the file unchanged");
+  }
+
+  // Compressed files are not mapped, but still read
+  {
+    std::string fn = outdir + "/compressed.mha";
+    _writeImage<TestImageType>(img, fn, true);
+
+    ok &= _check(MappedReaderType::MapImage(fn).IsNull(),
+      "Compressed file is not mapped");
+    ok &= _check(_sameImage(_readImage(fn), MappedReaderType::ReadImage(fn)),
+      "Compressed file read by ImageFileReader");
+  }
+
+  // Other voxel types are not mapped, but read and cast
+  {
+    ShortImageType::Pointer shortImg = ShortImageType::New();
+    shortImg->CopyInformation(img);
+    shortImg->SetRegions(img->GetLargestPossibleRegion());
+    shortImg->Allocate();
+
+    unsigned long n = img->GetBufferedRegion().GetNumberOfPixels();
+    for (unsigned long i = 0; i < n; i++)
+      shortImg->GetBufferPointer()[i] = (short)img->GetBufferPointer()[i];
+
+    std::string fn = outdir + "/short.mha";
+    _writeImage<ShortImageType>(shortImg, fn, false);
+
+    ok &= _check(MappedReaderType::MapImage(fn).IsNull(),
+      "Other voxel type is not mapped");
+    ok &= _check(_sameImage(_readImage(fn), MappedReaderType::ReadImage(fn)),
+      "Other voxel type read by ImageFileReader");
+
+    ok &= _check(!MappedImageReader<ShortImageType>::MapImage(fn).IsNull(),
+      "Mapped as its own voxel type");
+  }
+
+  return ok ? 0 : -1;
+}
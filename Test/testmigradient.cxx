@@ -0,0 +1,193 @@
+
+// Analytic MI gradient against central differences for affine and B-spline
+// transforms
+
+#include "ABCTests.h"
+
+#include "itkAffineTransform.h"
+#include "itkBSplineDeformableTransform.h"
+
+#include "NegativeMIImageMatchMetric.h"
+
+#include <iostream>
+
+#include <math.h>
+
+static const unsigned int _size = 32;
+
+typedef NegativeMIImageMatchMetric<TestImageType, TestImageType> MetricType;
+
+// Gradients with and without the analytic derivative, compared over one
+// step so that parameters of different units count alike
+static bool
+_checkGradient(const char* name,
+  const TestImageType* fixedImg, const TestImageType* movingImg,
+  MetricType::TransformType* transform,
+  const MetricType::ParametersType& p,
+  const MetricType::ParametersType& steps)
+{
+  std::cout << name << " transform" << std::endl;
+
+  MetricType::DerivativeType derivs[2];
+
+  for (unsigned int k = 0; k < 2; k++)
+  {
+    MetricType::Pointer metric = MetricType::New();
+    metric->SetNumberOfBins(32);
+    metric->SetNormalized(true);
+    metric->SetDerivativeStepLengths(steps);
+    metric->SetUseAnalyticDerivative(k == 0);
+    metric->SetUseBinIndexImageCache(false);
+    metric->SetSampleSpacing(1.0);
+
+    metric->SetFixedImage(fixedImg);
+    metric->SetMovingImage(movingImg);
+    metric->SetTransform(transform);
+
+    metric->GetDerivative(p, derivs[k]);
+  }
+
+  unsigned int numParams = p.GetSize();
+
+  double dot = 0;
+  double norm0 = 0;
+  double norm1 = 0;
+  for (unsigned int i = 0; i < numParams; i++)
+  {
+    double g0 = derivs[0][i] * steps[i];
+    double g1 = derivs[1][i] * steps[i];
+
+    if (numParams <= 12)
+      std::cout << "Parameter " << i << ": analytic " << derivs[0][i]
+        << ", finite differences " << derivs[1][i] << std::endl;
+
+    dot += g0*g1;
+    norm0 += g0*g0;
+    norm1 += g1*g1;
+  }
+  norm0 = sqrt(norm0);
+  norm1 = sqrt(norm1);
+
+  if (norm0 == 0 || norm1 == 0)
+  {
+    std::cerr << "Zero gradient" << std::endl;
+    return false;
+  }
+
+  double cosine = dot / (norm0*norm1);
+  double ratio = norm0 / norm1;
+
+  std::cout << "Cosine = " << cosine << ", norm ratio = " << ratio
+    << std::endl;
+
+  // Partial volume MI is only piecewise smooth, finite differences agree
+  // up to the kinks crossed within a step
+  if (cosine < 0.95 || ratio < 0.85 || ratio > 1.15)
+  {
+    std::cerr << name << " analytic gradient does not match finite differences"
+      << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+static bool
+_testAffine(const TestImageType* fixedImg, const TestImageType* movingImg)
+{
+  typedef itk::AffineTransform<double, 3> TransformType;
+
+  TransformType::Pointer affine = TransformType::New();
+
+  TransformType::InputPointType center;
+  center.Fill(0.5*(_size-1));
+  affine->SetCenter(center);
+
+  // Away from the optimum, rotated about z, scaled and shifted
+  TransformType::ParametersType p = affine->GetParameters();
+  double a = 0.05;
+  p[0] = 1.03*cos(a);
+  p[1] = -sin(a);
+  p[3] = sin(a);
+  p[4] = 0.98*cos(a);
+  p[8] = 1.02;
+  p[9] = 1.5;
+  p[10] = -1.0;
+  p[11] = 0.7;
+
+  // Steps small compared to a voxel at the image corners
+  TransformType::ParametersType steps(12);
+  for (unsigned int i = 0; i < 9; i++)
+    steps[i] = 0.01;
+  for (unsigned int i = 9; i < 12; i++)
+    steps[i] = 0.2;
+
+  return _checkGradient("Affine", fixedImg, movingImg, affine, p, steps);
+}
+
+static bool
+_testBSpline(const TestImageType* fixedImg, const TestImageType* movingImg)
+{
+  typedef itk::BSplineDeformableTransform<double, 3, 3> TransformType;
+
+  TransformType::Pointer bspline = TransformType::New();
+
+  // Grid over the fixed image as in PairRegistrationMethod::RegisterBSpline,
+  // two intervals along each axis padded for the spline order
+  const unsigned int gridSize = 2;
+
+  TransformType::SizeType totalGridSize;
+  totalGridSize.Fill(gridSize + 3);
+  TransformType::RegionType gridRegion;
+  gridRegion.SetSize(totalGridSize);
+
+  TransformType::SpacingType spacing = fixedImg->GetSpacing();
+  TransformType::SpacingType gridSpacing;
+  TransformType::SpacingType shift;
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    gridSpacing[i] = spacing[i] * (double)_size / (double)gridSize;
+    shift[i] = gridSpacing[i] + 0.5*spacing[i];
+  }
+
+  TransformType::DirectionType direction = fixedImg->GetDirection();
+  TransformType::OriginType gridOrigin =
+    fixedImg->GetOrigin() - direction*shift;
+
+  bspline->SetGridDirection(direction);
+  bspline->SetGridOrigin(gridOrigin);
+  bspline->SetGridSpacing(gridSpacing);
+  bspline->SetGridRegion(gridRegion);
+
+  unsigned int numParams = bspline->GetNumberOfParameters();
+
+  // Smooth displacements of up to a voxel and a half
+  TransformType::ParametersType p(numParams);
+  for (unsigned int i = 0; i < numParams; i++)
+    p[i] = 1.5 * sin(0.9*i + 0.3);
+
+  bspline->SetParametersByValue(p);
+
+  TransformType::ParametersType steps(numParams);
+  steps.Fill(0.2);
+
+  return _checkGradient("B-spline", fixedImg, movingImg, bspline, p, steps);
+}
+
+int
+testMIGradient(const std::string&)
+{
+  // Different contrasts, so the images only match through MI
+  double fixedMeans[3] = {10.0, 100.0, 200.0};
+  double movingMeans[3] = {50.0, 180.0, 90.0};
+
+  TestImageType::Pointer fixedImg = createPhantomImage(_size, fixedMeans);
+  TestImageType::Pointer movingImg = createPhantomImage(_size, movingMeans);
+
+  bool ok = true;
+
+  ok &= _testAffine(fixedImg, movingImg);
+  ok &= _testBSpline(fixedImg, movingImg);
+
+  return ok ? 0 : -1;
+}
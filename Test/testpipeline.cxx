@@ -0,0 +1,266 @@
+
+// Segmentation pipeline on images and an atlas in memory: labels, posteriors
+// and transforms are sensible, the inputs are left alone and nothing is
+// written without a transform or cache directory
+
+#include "ABCTests.h"
+
+#include "itkImageDuplicator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+
+#include "itksys/Directory.hxx"
+#include "itksys/SystemTools.hxx"
+
+#include "CompiledAtlas.h"
+#include "DynArray.h"
+#include "EMSParameters.h"
+#include "SegmentationPipeline.h"
+
+#include <iostream>
+
+#include <math.h>
+
+static const unsigned int _size = 32;
+
+static bool
+_check(bool ok, const char* what)
+{
+  std::cout << what << ": " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+
+static TestImageType::Pointer
+_copyImage(const TestImageType* img)
+{
+  typedef itk::ImageDuplicator<TestImageType> DuperType;
+  DuperType::Pointer dup = DuperType::New();
+  dup->SetInputImage(img);
+  dup->Update();
+  return dup->GetOutput();
+}
+
+// Entries of a directory besides . and ..
+static unsigned long
+_countFiles(const std::string& dir)
+{
+  itksys::Directory d;
+  if (!d.Load(dir.c_str()))
+    return 0;
+
+  unsigned long n = 0;
+  for (unsigned long i = 0; i < d.GetNumberOfFiles(); i++)
+  {
+    std::string name = d.GetFile(i);
+    if (name.compare(".") != 0 && name.compare("..") != 0)
+      n++;
+  }
+
+  return n;
+}
+
+// Largest displacement of points in the middle of the image
+static double
+_maxDisplacement(const SegmentationPipeline::AffineTransformType* t)
+{
+  double maxDisp = 0;
+  for (unsigned int k = 0; k < 8; k++)
+  {
+    SegmentationPipeline::AffineTransformType::InputPointType p;
+    for (unsigned int i = 0; i < 3; i++)
+      p[i] = 0.5*(_size-1) + ((k >> i) & 1 ? 6.0 : -6.0);
+
+    SegmentationPipeline::AffineTransformType::OutputPointType q =
+      t->TransformPoint(p);
+
+    double d = 0;
+    for (unsigned int i = 0; i < 3; i++)
+      d += (q[i]-p[i]) * (q[i]-p[i]);
+    d = sqrt(d);
+
+    if (d > maxDisp)
+      maxDisp = d;
+  }
+
+  return maxDisp;
+}
+
+int
+testSegmentationPipeline(const std::string& outdir)
+{
+  bool ok = true;
+
+  // Atlas: the T1 like phantom with the sphere, shell and background priors,
+  // the background last
+  double t1Means[3] = {10.0, 100.0, 200.0};
+  double t2Means[3] = {200.0, 120.0, 40.0};
+
+  TestImageType::Pointer templateImg = createPhantomImage(_size, t1Means);
+
+  DynArray<CompiledAtlas::FloatImagePointer> priors;
+  priors.Append(createPhantomClass(_size, 2));
+  priors.Append(createPhantomClass(_size, 1));
+  priors.Append(createPhantomClass(_size, 0));
+
+  DynArray<CompiledAtlas::ShrinkFactorsType> levelFactors;
+  CompiledAtlas::ShrinkFactorsType factors;
+  factors.Fill(2);
+  levelFactors.Append(factors);
+
+  CompiledAtlas::Pointer atlas =
+    CompiledAtlas::Compile(templateImg, priors, levelFactors);
+
+  // Subject with two contrasts
+  DynArray<SegmentationPipeline::FloatImagePointer> images;
+  images.Append(createPhantomImage(_size, t1Means));
+  images.Append(createPhantomImage(_size, t2Means));
+
+  DynArray<TestImageType::Pointer> originals;
+  for (unsigned int i = 0; i < images.GetSize(); i++)
+    originals.Append(_copyImage(images[i]));
+
+  EMSParameters::Pointer params = EMSParameters::New();
+  params->SetSuffix("seg");
+  params->SetAtlasOrientation("file");
+  params->SetFilterIterations(0);
+  params->SetMaxBiasDegree(1);
+  params->SetAtlasCropPadding(4.0);
+  for (unsigned int i = 0; i < priors.GetSize(); i++)
+    params->AppendPriorWeight(1.0);
+
+  // Run in an empty directory, to see whether anything is written
+  std::string rundir = outdir + "/run";
+  itksys::SystemTools::RemoveADirectory(rundir.c_str());
+  itksys::SystemTools::MakeDirectory(rundir.c_str());
+
+  std::string cwd = itksys::SystemTools::GetCurrentWorkingDirectory();
+  itksys::SystemTools::ChangeDirectory(rundir.c_str());
+
+  SegmentationPipeline::Pointer pipeline = SegmentationPipeline::New();
+  pipeline->SetParameters(params);
+  pipeline->SetInputImages(images);
+  pipeline->SetAtlas(atlas);
+
+  try
+  {
+    pipeline->Update();
+  }
+  catch (...)
+  {
+    itksys::SystemTools::ChangeDirectory(cwd.c_str());
+    throw;
+  }
+
+  itksys::SystemTools::ChangeDirectory(cwd.c_str());
+
+  ok &= _check(_countFiles(rundir) == 0 && _countFiles(outdir) == 1,
+    "Nothing written");
+
+  bool inputsOk = true;
+  for (unsigned int i = 0; i < images.GetSize(); i++)
+  {
+    if (maxAbsDifference(images[i], originals[i]) != 0
+        ||
+        images[i]->GetOrigin() != originals[i]->GetOrigin()
+        ||
+        images[i]->GetSpacing() != originals[i]->GetSpacing()
+        ||
+        images[i]->GetDirection() != originals[i]->GetDirection())
+      inputsOk = false;
+  }
+  ok &= _check(inputsOk, "Input images unmodified");
+
+  // Labels 1 and 2 for the sphere and shell priors, 0 for the background,
+  // compared away from the partial volume voxels
+  SegmentationPipeline::ShortImagePointer labels = pipeline->GetLabels();
+
+  TestImageType::Pointer truth[3];
+  for (unsigned int c = 0; c < 3; c++)
+    truth[c] = createPhantomClass(_size, c);
+
+  const short truthLabels[3] = {0, 2, 1};
+
+  unsigned long numCompared = 0;
+  unsigned long numAgree = 0;
+
+  itk::ImageRegionConstIteratorWithIndex<TestImageType> it(
+    truth[0], truth[0]->GetLargestPossibleRegion());
+  for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+  {
+    TestImageType::IndexType ind = it.GetIndex();
+    for (unsigned int c = 0; c < 3; c++)
+      if (truth[c]->GetPixel(ind) > 0.99)
+      {
+        numCompared++;
+        if (labels->GetPixel(ind) == truthLabels[c])
+          numAgree++;
+      }
+  }
+
+  ok &= _check(labels->GetLargestPossibleRegion()
+    == images[0]->GetLargestPossibleRegion(),
+    "Labels cover the input image");
+
+  double agreement = (double)numAgree / numCompared;
+  std::cout << "Label agreement = " << agreement << std::endl;
+  ok &= _check(agreement > 0.9, "Labels match the phantom");
+
+  // Posteriors of the sphere and shell, probabilities that are high where
+  // the class is
+  ok &= _check(pipeline->GetNumberOfPosteriors() == 2,
+    "Background posteriors left out");
+
+  bool postOk = true;
+  for (unsigned int p = 0; p < pipeline->GetNumberOfPosteriors() && p < 2;
+       p++)
+  {
+    SegmentationPipeline::FloatImagePointer post = pipeline->GetPosterior(p);
+    if (post->GetLargestPossibleRegion()
+        != images[0]->GetLargestPossibleRegion())
+    {
+      postOk = false;
+      continue;
+    }
+
+    unsigned int c = 2 - p;
+    double sumInside = 0;
+    double numInside = 0;
+    itk::ImageRegionConstIteratorWithIndex<TestImageType> postIt(
+      post, post->GetLargestPossibleRegion());
+    for (postIt.GoToBegin(); !postIt.IsAtEnd(); ++postIt)
+    {
+      float v = postIt.Get();
+      if (v < -1e-4 || v > 1.0 + 1e-4)
+        postOk = false;
+      if (truth[c]->GetPixel(postIt.GetIndex()) > 0.99)
+      {
+        sumInside += v;
+        numInside += 1.0;
+      }
+    }
+
+    if (numInside == 0 || sumInside / numInside < 0.8)
+      postOk = false;
+  }
+  ok &= _check(postOk, "Posteriors are probabilities of the classes");
+
+  // Nothing to register here, atlas and images are aligned
+  DynArray<SegmentationPipeline::AffineTransformPointer> transforms =
+    pipeline->GetAffineTransforms();
+
+  ok &= _check(transforms.GetSize() == 2, "One transform per image");
+  if (transforms.GetSize() == 2)
+  {
+    ok &= _check(_maxDisplacement(transforms[0]) < 1e-6,
+      "First image transform is the identity");
+    ok &= _check(_maxDisplacement(transforms[1]) < 1.0,
+      "Second image transform close to the identity");
+  }
+
+  SegmentationPipeline::AffineTransformPointer templateTransform =
+    pipeline->GetTemplateAffineTransform();
+  ok &= _check(!templateTransform.IsNull()
+    && _maxDisplacement(templateTransform) < 1.0,
+    "Template transform close to the identity");
+
+  return ok ? 0 : -1;
+}
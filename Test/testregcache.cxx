@@ -0,0 +1,157 @@
+
+// Registration result cache: keys follow the image contents and settings,
+// stored transforms round trip, failed stores throw
+
+#include "ABCTests.h"
+
+#include "itksys/Directory.hxx"
+#include "itksys/SystemTools.hxx"
+
+#include "RegistrationResultCache.h"
+
+#include <exception>
+#include <fstream>
+#include <iostream>
+
+#include <math.h>
+
+typedef RegistrationResultCache<TestImageType> CacheType;
+
+static bool
+_check(bool ok, const char* what)
+{
+  std::cout << what << ": " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+
+int
+testRegistrationResultCache(const std::string& outdir)
+{
+  bool ok = true;
+
+  double means[3] = {10.0, 100.0, 200.0};
+
+  TestImageType::Pointer fixedImg = createPhantomImage(16, means);
+  TestImageType::Pointer movingImg = createPhantomImage(16, means);
+
+  // Digests depend on the contents only
+  std::string fixedDigest = CacheType::ComputeImageDigest(fixedImg);
+  ok &= _check(
+    fixedDigest.compare(CacheType::ComputeImageDigest(movingImg)) == 0,
+    "Same contents, same digest");
+
+  TestImageType::IndexType ind;
+  ind.Fill(3);
+  movingImg->SetPixel(ind, movingImg->GetPixel(ind) + 1.0f);
+  std::string movingDigest = CacheType::ComputeImageDigest(movingImg);
+  ok &= _check(fixedDigest.compare(movingDigest) != 0,
+    "Changed voxel, new digest");
+
+  TestImageType::SpacingType spacing = fixedImg->GetSpacing();
+  spacing[2] = 1.5;
+  TestImageType::Pointer spacedImg = createPhantomImage(16, means);
+  spacedImg->SetSpacing(spacing);
+  ok &= _check(
+    fixedDigest.compare(CacheType::ComputeImageDigest(spacedImg)) != 0,
+    "Changed spacing, new digest");
+
+  std::string key =
+    CacheType::ComputeKey(fixedDigest, movingDigest, "affine");
+  ok &= _check(
+    key.compare(CacheType::ComputeKey(fixedDigest, movingDigest, "rigid"))
+      != 0,
+    "Changed settings, new key");
+  ok &= _check(
+    key.compare(CacheType::ComputeKey(movingDigest, fixedDigest, "affine"))
+      != 0,
+    "Swapped images, new key");
+
+  // Fresh directory for the stored results
+  std::string cachedir = outdir + "/cache";
+  itksys::SystemTools::RemoveADirectory(cachedir.c_str());
+
+  CacheType::Pointer cache = CacheType::New();
+  cache->SetDirectory(cachedir);
+
+  ok &= _check(cache->Find(key).IsNull(), "Miss before storing");
+
+  CacheType::AffineTransformPointer affine =
+    CacheType::AffineTransformType::New();
+  CacheType::AffineTransformType::ParametersType p = affine->GetParameters();
+  p[0] = 1.25;
+  p[1] = -2.5;
+  p[2] = 0.125;
+  p[4] = 0.05;
+  p[6] = 1.1;
+  p[10] = 0.01;
+  affine->SetAllParameters(p, 7.5, 7.5, 7.5, 8.0, 7.0, 7.5, true);
+
+  cache->Store(key, affine);
+
+  CacheType::AffineTransformPointer found = cache->Find(key);
+  ok &= _check(!found.IsNull(), "Hit after storing");
+  if (!found.IsNull())
+  {
+    double maxDiff = 0;
+    for (unsigned int i = 0; i < p.GetSize(); i++)
+    {
+      double d = fabs(found->GetParameters()[i] - p[i]);
+      if (d > maxDiff)
+        maxDiff = d;
+    }
+    for (unsigned int i = 0; i < 3; i++)
+    {
+      double ds = fabs(found->GetSourceCenter()[i]
+        - affine->GetSourceCenter()[i]);
+      double dt = fabs(found->GetTargetCenter()[i]
+        - affine->GetTargetCenter()[i]);
+      if (ds > maxDiff)
+        maxDiff = ds;
+      if (dt > maxDiff)
+        maxDiff = dt;
+    }
+    ok &= _check(maxDiff < 1e-9, "Stored transform round trips");
+  }
+
+  // Another key, e.g. after the voxels or settings changed
+  std::string otherKey =
+    CacheType::ComputeKey(fixedDigest, movingDigest, "affine fast");
+  ok &= _check(cache->Find(otherKey).IsNull(), "Miss for other settings");
+
+  // No temporary files are left behind
+  {
+    itksys::Directory d;
+    d.Load(cachedir.c_str());
+    unsigned int numTemp = 0;
+    for (unsigned long i = 0; i < d.GetNumberOfFiles(); i++)
+      if (itksys::SystemTools::GetFilenameLastExtension(d.GetFile(i))
+          .compare(".tmp") == 0)
+        numTemp++;
+    ok &= _check(numTemp == 0, "No temporary files left");
+  }
+
+  // Storing where no directory can be created fails with an exception that
+  // callers catching std::exception see
+  {
+    std::string blockfn = outdir + "/notadir";
+    std::ofstream outfile(blockfn.c_str());
+    outfile << "file" << std::endl;
+    outfile.close();
+
+    CacheType::Pointer badCache = CacheType::New();
+    badCache->SetDirectory(blockfn + "/cache");
+
+    bool thrown = false;
+    try
+    {
+      badCache->Store(key, affine);
+    }
+    catch (std::exception&)
+    {
+      thrown = true;
+    }
+    ok &= _check(thrown, "Failed store throws a std::exception");
+  }
+
+  return ok ? 0 : -1;
+}